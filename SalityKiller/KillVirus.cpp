@@ -3,13 +3,22 @@
 extern HMODULE g_hMod;
 const ULONGLONG g_maxInsCount = 1000 * 1000 * 1000;
 
+// "off" emulates every PE file; a number changes the triage threshold
+#define TRIAGE_THRESHOLD_ENV	L"TINYAV_TRIAGE_THRESHOLD"
+
+// raise it when the detection or the disinfection changes: the files stamped
+// clean by an older version are scanned again
+#define SALITY_MODULE_VERSION	1
+
 CKillVirus::CKillVirus()
 {
 	m_info.handle = g_hMod;
 	m_info.type = ScanModule;
 	wcscpy_s(m_info.name, MAX_NAME, L"W32.Sality.PE");
+	m_info.version = SALITY_MODULE_VERSION;
 	m_parser = NULL;
 	m_emul = NULL;
+	m_triage = NULL;
 	ZeroMemory(&m_scanResult, sizeof(m_scanResult));
 	m_InsCount = 0;
 	m_OepCode = NULL;
@@ -26,6 +35,12 @@ CKillVirus::~CKillVirus()
 		m_emul = NULL;
 	}
 
+	if (m_triage)
+	{
+		m_triage->Release();
+		m_triage = NULL;
+	}
+
 	if (m_parser)
 	{
 		m_parser->Release();
@@ -103,6 +118,18 @@ HRESULT WINAPI CKillVirus::OnScanInitialize(void)
 		m_emul = NULL;
 		return hr;
 	}
+
+	// The triage is an optimisation whose recall is not measured yet: it is
+	// only used when asked for, and scanning goes on without it if it is
+	// not available.
+	WCHAR szValue[64] = {};
+	DWORD length = GetEnvironmentVariableW(TRIAGE_THRESHOLD_ENV, szValue, _countof(szValue));
+	if (length > 0 && length < _countof(szValue) && _wcsicmp(szValue, L"off") != 0)
+	{
+		if (SUCCEEDED(CreateClassObject(CLSID_CPeTriage, 0, __uuidof(IPeTriage), (LPVOID*)&m_triage)) &&
+			_wcsicmp(szValue, L"on") != 0)
+			m_triage->SetThreshold(_wtof(szValue));
+	}
 	return S_OK;
 }
 
@@ -130,8 +157,17 @@ HRESULT WINAPI CKillVirus::Scan(__in IVirtualFs * file, __in IFsEnumContext * co
 	hr = m_parser->CheckType(file, &isMatched);
 	if (FAILED(hr) || isMatched == FALSE) return hr; // not PE file or malformed 
 
+	// skip the emulation of files whose code looks compiler-generated
+	PE_TRIAGE_RESULT triage;
+	if (m_triage && SUCCEEDED(m_triage->Classify(m_parser, &triage)) && !triage.suspicious)
+	{
+		hr = S_OK;
+		goto Exit;
+	}
+
 	m_emulErrCode = 0;
-	// emulate code from entry point to end of section
+	// emulate code from entry point to end of section, within the file's time budget
+	m_emul->SetDeadline(context->GetDeadline());
 	hr = m_emul->EmulatePeFile(m_parser, 0, IEmulator::FromEntryPoint, 0);
 
 	// emulator reports error
@@ -234,6 +270,12 @@ HRESULT WINAPI CKillVirus::OnScanShutdown(void)
 		m_emul = NULL;
 	}
 
+	if (m_triage)
+	{
+		m_triage->Release();
+		m_triage = NULL;
+	}
+
 	if (m_parser)
 	{
 		m_parser->Release();
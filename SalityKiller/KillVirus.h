@@ -21,6 +21,7 @@ protected:
 	MODULE_INFO m_info;
 	IPeFile *   m_parser;
 	IEmulator * m_emul;
+	IPeTriage * m_triage;	// NULL when the triage is turned off
 	DWORD		m_emulErrCode;
 	virtual ~CKillVirus();
 
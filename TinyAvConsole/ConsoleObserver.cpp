@@ -1,19 +1,44 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include "ConsoleObserver.h"
 
+// State of the file being scanned by the calling thread
+typedef struct CONSOLE_FILE_STATE
+{
+	BOOL virusDetected;
+	BOOL rescan;
+	BOOL error;
+	BOOL namePending;			// display name not printed yet
+	WCHAR displayName[70];
+}CONSOLE_FILE_STATE;
+
+static __declspec(thread) CONSOLE_FILE_STATE t_file;
+
 CConsoleObserver::CConsoleObserver()
 {
-	m_bRescan = FALSE;
-	m_bVirusDetected = FALSE;
+	InitializeCriticalSection(&m_lock);
 	m_TotalFileCnt = 0;
 	m_TotalObjectCnt = 0;
 	m_DetectedCnt = 0;
 	m_RemovedCnt = 0;
-	m_error = FALSE;
+	m_FailedCnt = 0;
+	m_DuplicateCnt = 0;
+	m_StampedCnt = 0;
+	m_DeferredCnt = 0;
+	m_TimedOutCnt = 0;
 }
 
 CConsoleObserver::~CConsoleObserver()
 {
+	DeleteCriticalSection(&m_lock);
+}
+
+void CConsoleObserver::FlushFileName(void)
+{
+	if (t_file.namePending)
+	{
+		wprintf(L"%-70s  ", t_file.displayName);
+		t_file.namePending = FALSE;
+	}
 }
 
 HRESULT WINAPI CConsoleObserver::QueryInterface(__in REFIID riid, __in void **ppvObject)
@@ -42,6 +67,10 @@ HRESULT WINAPI CConsoleObserver::OnScanStarted(__in IFsEnumContext * context)
 	m_DetectedCnt = 0;
 	m_RemovedCnt = 0;
 	m_FailedCnt = 0;
+	m_DuplicateCnt = 0;
+	m_StampedCnt = 0;
+	m_DeferredCnt = 0;
+	m_TimedOutCnt = 0;
 	return S_OK;
 }
 
@@ -64,14 +93,23 @@ HRESULT WINAPI CConsoleObserver::OnScanStopping(__in IFsEnumContext * context)
 	printf("Detected      : %lld file(s)\n", m_DetectedCnt);
 	printf("Removed       : %lld file(s)\n", m_RemovedCnt);
 	printf("Access denied : %lld file(s)\n", m_FailedCnt);
+	printf("Duplicates    : %lld file(s)\n", m_DuplicateCnt);
+	printf("Unchanged     : %lld file(s)\n", m_StampedCnt);
+	printf("Slow lane     : %lld file(s)\n", m_DeferredCnt);
+	printf("Timed out     : %lld file(s)\n", m_TimedOutCnt);
 	return S_OK;
 }
 
 HRESULT WINAPI CConsoleObserver::OnPreScan(__in IVirtualFs * file, __in IFsEnumContext * context)
 {
-	m_error = FALSE;
+	t_file.error = FALSE;
+	EnterCriticalSection(&m_lock);
 	m_TotalObjectCnt++;
-	if (m_bRescan) return S_OK;
+	if (t_file.rescan)
+	{
+		LeaveCriticalSection(&m_lock);
+		return S_OK;
+	}
 	BSTR fullPath = NULL;
 	ULONG fsType;
 	if (SUCCEEDED(file->GetFsType(&fsType)) &&
@@ -79,7 +117,10 @@ HRESULT WINAPI CConsoleObserver::OnPreScan(__in IVirtualFs * file, __in IFsEnumC
 	{
 		m_TotalFileCnt++;
 	}
+	LeaveCriticalSection(&m_lock);
 
+	// the name is printed with the result so that lines do not mix
+	t_file.namePending = FALSE;
 	file->GetFullPath(&fullPath);
 	if (fullPath)
 	{
@@ -95,7 +136,8 @@ HRESULT WINAPI CConsoleObserver::OnPreScan(__in IVirtualFs * file, __in IFsEnumC
 
 			wcscpy_s(&wzDisplay[wcslen(wzDisplay)], _countof(wzDisplay) - wcslen(wzDisplay), &fullPath[wcslen(fullPath) - (_countof(wzDisplay) - 1 - wcslen(wzDisplay))]);
 		}
-		wprintf(L"%-70s  ", wzDisplay);
+		wcscpy_s(t_file.displayName, _countof(t_file.displayName), wzDisplay);
+		t_file.namePending = TRUE;
 		SysFreeString(fullPath);
 	}
 	return S_OK;
@@ -103,22 +145,29 @@ HRESULT WINAPI CConsoleObserver::OnPreScan(__in IVirtualFs * file, __in IFsEnumC
 
 HRESULT WINAPI CConsoleObserver::OnAllScanFinished(__in IVirtualFs * file, __in IFsEnumContext * context)
 {
-	if (m_bVirusDetected == FALSE && !m_error)
+	if (t_file.virusDetected == FALSE && !t_file.error)
 	{
+		EnterCriticalSection(&m_lock);
+		FlushFileName();
 		printf("OK\n");
+		LeaveCriticalSection(&m_lock);
 	}
-	m_bVirusDetected = FALSE;
-	m_bRescan = FALSE;
-	m_error = FALSE;
+	t_file.virusDetected = FALSE;
+	t_file.rescan = FALSE;
+	t_file.error = FALSE;
+	t_file.namePending = FALSE;
 	return S_OK;
 }
 
 HRESULT WINAPI CConsoleObserver::OnPreClean(__in IVirtualFs * file, __in IFsEnumContext * context, __inout SCAN_RESULT * result)
 {
+	EnterCriticalSection(&m_lock);
+	FlushFileName();
 	wprintf(L"\n\t%s ", result->malwareName);
 	result->action = KillVirus;
-	m_bVirusDetected = TRUE;
+	t_file.virusDetected = TRUE;
 	m_DetectedCnt++;
+	LeaveCriticalSection(&m_lock);
 	return S_OK;
 }
 
@@ -126,11 +175,12 @@ HRESULT WINAPI CConsoleObserver::OnPostClean(__in IVirtualFs * file, __in IFsEnu
 {
 	if (result && result->scanResult == VirusDetected)
 	{
+		EnterCriticalSection(&m_lock);
 		switch (result->cleanResult)
 		{
 		case CleanVirusSucceeded:
 			printf("Disinfected \n");
-			m_bRescan = TRUE;
+			t_file.rescan = TRUE;
 			m_RemovedCnt++;
 			break;
 
@@ -149,6 +199,7 @@ HRESULT WINAPI CConsoleObserver::OnPostClean(__in IVirtualFs * file, __in IFsEnu
 			m_FailedCnt++;
 			break;
 		}
+		LeaveCriticalSection(&m_lock);
 	}
 
 	return S_OK;
@@ -156,7 +207,24 @@ HRESULT WINAPI CConsoleObserver::OnPostClean(__in IVirtualFs * file, __in IFsEnu
 
 void WINAPI CConsoleObserver::OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR lpMessage /*= NULL*/)
 {
-	m_error = TRUE;
+	EnterCriticalSection(&m_lock);
+	// hard links and directory loops skipped by the walker are only counted
+	if (dwErrorCode == IFsEnum::FsEnumDuplicate)
+	{
+		m_DuplicateCnt++;
+		LeaveCriticalSection(&m_lock);
+		return;
+	}
+	// and so are the files whose stamp shows they are clean
+	if (dwErrorCode == IFsEnum::FsEnumStamped)
+	{
+		m_StampedCnt++;
+		LeaveCriticalSection(&m_lock);
+		return;
+	}
+
+	t_file.error = TRUE;
+	FlushFileName();
 	printf("\n[!] ");
 	if (lpMessage)
 	{
@@ -173,6 +241,14 @@ void WINAPI CConsoleObserver::OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR l
 	case IFsEnum::FsEnumNotFound:
 		wprintf(L"Not found.");
 		break;
+	case IFsEnum::FsEnumDeferred:
+		wprintf(L"Out of time. Deferred to the slow lane.");
+		m_DeferredCnt++;
+		break;
+	case IFsEnum::FsEnumTimeout:
+		wprintf(L"Out of time. Skip this file.");
+		m_TimedOutCnt++;
+		break;
 
 	case IEmulObserver::EmulatorIsNotFound:
 		wprintf(L"unicorn.dll and its dependent dlls are needed.");
@@ -183,9 +259,14 @@ void WINAPI CConsoleObserver::OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR l
 	case IEmulObserver::EmulatorInternalError:
 		wprintf(L"Emulator has internal errors. Skip this file.");
 		break;
+	case IEmulObserver::EmulatorOutOfMemory:
+		wprintf(L"Out of memory. Not emulated, not fully scanned.");
+		m_FailedCnt++;
+		break;
 	default:
 		break;
 	}
 
 	printf("\n");
+	LeaveCriticalSection(&m_lock);
 }
@@ -6,17 +6,24 @@ class CConsoleObserver
 	, public IScanObserver
 {
 protected:
-	BOOL m_bVirusDetected;
-	BOOL m_bRescan;
-	BOOL m_error;
+	// The slow lane reports from its own thread while the scan goes on, so
+	// each report is printed as a whole under this lock.
+	CRITICAL_SECTION m_lock;
 	ULONGLONG m_TotalFileCnt;
 	ULONGLONG m_TotalObjectCnt;
 	ULONGLONG m_DetectedCnt;
 	ULONGLONG m_RemovedCnt;
 	ULONGLONG m_FailedCnt;
+	ULONGLONG m_DuplicateCnt;
+	ULONGLONG m_StampedCnt;
+	ULONGLONG m_DeferredCnt;
+	ULONGLONG m_TimedOutCnt;
 
 	virtual ~CConsoleObserver();
 
+	// print the name of the current file if it is not printed yet
+	virtual void FlushFileName(void);
+
 public:
 	CConsoleObserver();
 
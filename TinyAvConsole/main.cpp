@@ -1,5 +1,6 @@
 #include <windows.h>
 #include <stdio.h>
+#include <limits.h>
 #include <TinyAvCore.h>
 #include <Shlwapi.h>
 #pragma comment(lib, "Shlwapi.lib")
@@ -44,6 +45,99 @@ void PrintWelcome()
 	puts("--------------------------------------------------------------------------");
 }
 
+// Poll the scanner until the scan ends. The progress goes to the console
+// title so it does not mix with the per-file output.
+void ShowProgress(IScanner * scanner, IFsEnumContext * enumContext)
+{
+	WCHAR szTitle[MAX_PATH];
+	SCAN_PROGRESS progress;
+	while (SUCCEEDED(scanner->GetProgress(enumContext, &progress)))
+	{
+		if (progress.remainingMs == ULLONG_MAX)
+		{
+			swprintf_s(szTitle, L"TinyAntivirus - %llu/%llu%s file(s)",
+				progress.scannedFiles, progress.totalFiles, progress.censusDone ? L"" : L"+");
+		}
+		else
+		{
+			ULONGLONG seconds = progress.remainingMs / 1000;
+			swprintf_s(szTitle, L"TinyAntivirus - %.1f%% - %llu/%llu%s file(s) - ETA %llu:%02llu:%02llu",
+				progress.fraction * 100.0, progress.scannedFiles, progress.totalFiles,
+				progress.censusDone ? L"" : L"+",
+				seconds / 3600, (seconds / 60) % 60, seconds % 60);
+		}
+		SetConsoleTitleW(szTitle);
+		Sleep(1000);
+	}
+}
+
+// Print where the time of the scan went, stage by stage
+void PrintStageCounters(IScanner * scanner)
+{
+	static const char * stageNames[StageCount] = { "enumerate", "open", "parse", "module scan", "emulate" };
+	SCAN_STAGE_REPORT report;
+	if (FAILED(scanner->GetStageCounters(&report)))
+	{
+		puts("stage counters are not available");
+		return;
+	}
+
+	ULONGLONG totalUs = 0;
+	for (int i = 0; i < StageCount; i++)
+		totalUs += report.stages[i].wallUs;
+
+	puts("--------------------------------------------------------------------------");
+	printf("%-12s %12s %12s %7s %16s\n", "stage", "calls", "time (ms)", "share", "cycles (M)");
+	for (int i = 0; i < StageCount; i++)
+	{
+		const SCAN_STAGE_COUNTERS & stage = report.stages[i];
+		printf("%-12s %12llu %12.1f %6.1f%%", stageNames[i], stage.calls, stage.wallUs / 1000.0,
+			totalUs ? 100.0 * stage.wallUs / totalUs : 0.0);
+		if (report.cyclesAvailable)
+			printf(" %16.1f\n", stage.cycles / 1e6);
+		else
+			printf(" %16s\n", "n/a");
+	}
+}
+
+// Print the most expensive directory trees of the scan, or write them to a
+// tab-separated file
+void PrintDirectoryCosts(IScanner * scanner, ULONG count, LPCWSTR lpReport)
+{
+	SCAN_DIRECTORY_COST * costs = new SCAN_DIRECTORY_COST[count];
+	if (costs == NULL || FAILED(scanner->GetDirectoryCosts(costs, &count)))
+	{
+		puts("directory costs are not available");
+		delete[] costs;
+		return;
+	}
+
+	FILE * report = NULL;
+	if (lpReport && wcslen(lpReport) > 0 && _wfopen_s(&report, lpReport, L"w, ccs=UTF-8") != 0)
+	{
+		wprintf(L"Directory costs not written to %s\n", lpReport);
+		report = NULL;
+	}
+
+	if (report)
+	{
+		fwprintf(report, L"time (ms)\temulate (ms)\tfiles\tread (MB)\tdirectory\n");
+		for (ULONG i = 0; i < count; i++)
+			fwprintf(report, L"%.1f\t%.1f\t%llu\t%.1f\t%s\n", costs[i].wallUs / 1000.0, costs[i].emulateUs / 1000.0,
+				costs[i].files, costs[i].bytes / 1048576.0, costs[i].path);
+		fclose(report);
+	}
+	else
+	{
+		puts("--------------------------------------------------------------------------");
+		printf("%12s %12s %10s %10s  %s\n", "time (ms)", "emulate (ms)", "files", "read (MB)", "directory");
+		for (ULONG i = 0; i < count; i++)
+			wprintf(L"%12.1f %12.1f %10llu %10.1f  %s\n", costs[i].wallUs / 1000.0, costs[i].emulateUs / 1000.0,
+				costs[i].files, costs[i].bytes / 1048576.0, costs[i].path);
+	}
+	delete[] costs;
+}
+
 int wmain(int argc, wchar_t* argv[])
 {
 	PrintWelcome();
@@ -59,14 +153,23 @@ int wmain(int argc, wchar_t* argv[])
 	WCHAR szTargetDir[MAX_PATH + 1] = {};
 	WCHAR szPluginsSubDir[MAX_PATH + 1] = {};
 	WCHAR szPluginsDir[MAX_PATH + 1] = {};
+	WCHAR szImport[MAX_PATH + 1] = {};
+	WCHAR szExport[MAX_PATH + 1] = {};
+	WCHAR szCostReport[MAX_PATH + 1] = {};
 	int c;
 	int depth = -1;
 	int archiveDepth = -1;
 	ULARGE_INTEGER maxFileSize = {};
 	int mode = 2; //kill mode
+	ULONG scanFlags = 0;
+	ULONG fileBudget = 0;
+	ULONG slowLaneBudget = 0;
+	ULONG workers = 0;
+	BOOL stageCounters = FALSE;
+	ULONG costTrees = 0;
 	maxFileSize.QuadPart = 10 * 1024 * 1024;
 	// -p
-	while ((c = getopt_w(argc, argv, L"e:A:D:d:p:s:m:h")) != -1)
+	while ((c = getopt_w(argc, argv, L"e:A:D:d:l:p:s:m:P:t:j:M:I:X:R:cwLECNVh")) != -1)
 	{
 		switch (c)
 		{
@@ -86,6 +189,11 @@ int wmain(int argc, wchar_t* argv[])
 			wcscpy_s((wchar_t*)szTargetDir, MAX_PATH, optarg_w);
 			break;
 
+		case L'l': // scan the files named in a list ("-" for stdin)
+			wcscpy_s((wchar_t*)szTargetDir, MAX_PATH, optarg_w);
+			scanFlags |= IFsEnumContext::ScanFileList;
+			break;
+
 		case L'p':
 			wcscpy_s((wchar_t*)szPattern, MAX_PATH, optarg_w);
 			break;
@@ -101,6 +209,83 @@ int wmain(int argc, wchar_t* argv[])
 				mode = 1;
 			break;
 
+		case L'c': // carve executables from raw images and dumps
+			scanFlags |= IFsEnumContext::CarveImages;
+			break;
+
+		case L'w': // watch the target directory and scan changed files
+			scanFlags |= IFsEnumContext::WatchChanges;
+			break;
+
+		case L'L': // follow directory symbolic links and junctions
+			scanFlags |= IFsEnumContext::FollowLinks;
+			break;
+
+		case L'P': // profile emulations and report those taking at least <ms>
+			// plug-ins read the setting when they load
+			SetEnvironmentVariableW(L"TINYAV_EMUL_PROFILE", optarg_w);
+			break;
+
+		case L'C': // count the time and cycles of each scan stage
+			// plug-ins read the setting when they load
+			SetEnvironmentVariableW(L"TINYAV_STAGE_COUNTERS", L"1");
+			stageCounters = TRUE;
+			break;
+
+		case L'N': // read the files past the system file cache
+			scanFlags |= IFsEnumContext::NoCache;
+			break;
+
+		case L'V': // stamp the files found clean and skip them while unchanged
+			scanFlags |= IFsEnumContext::VerdictStamps;
+			break;
+
+		case L'I': // merge the verdicts exported by another host before the scan
+			wcscpy_s((wchar_t*)szImport, MAX_PATH, optarg_w);
+			scanFlags |= IFsEnumContext::VerdictStamps;
+			break;
+
+		case L'X': // export the verdicts by content when the scan ends
+			wcscpy_s((wchar_t*)szExport, MAX_PATH, optarg_w);
+			scanFlags |= IFsEnumContext::VerdictStamps;
+			break;
+
+		case L'R': // report the most expensive directory trees, to the console or to a file
+		{
+			costTrees = (ULONG)_wtoi(optarg_w);
+			if (costTrees == 0) costTrees = 20;
+			const wchar_t * file = wcschr(optarg_w, L',');
+			if (file) wcscpy_s((wchar_t*)szCostReport, MAX_PATH, file + 1);
+			scanFlags |= IFsEnumContext::DirectoryCosts;
+			break;
+		}
+
+		case L'E': // count the files first and show progress and ETA in the title bar
+			scanFlags |= IFsEnumContext::Census;
+			break;
+
+		case L't': // time budget of a file in ms, and of a file in the slow lane
+		{
+			fileBudget = (ULONG)_wtoi(optarg_w);
+			const wchar_t * slow = wcschr(optarg_w, L',');
+			slowLaneBudget = slow ? (ULONG)_wtoi(slow + 1) : fileBudget * 10;
+			break;
+		}
+
+		case L'j': // number of scan workers, 0 for one per processor
+		{
+			SYSTEM_INFO si;
+			GetSystemInfo(&si);
+			workers = (ULONG)_wtoi(optarg_w);
+			if (workers == 0) workers = si.dwNumberOfProcessors;
+			break;
+		}
+
+		case L'M': // memory limit of the scan in MB
+			// plug-ins read the setting when they load
+			SetEnvironmentVariableW(L"TINYAV_MEMORY_LIMIT", optarg_w);
+			break;
+
 		case L'h':
 			Usage();
 			break;
@@ -157,17 +342,30 @@ int wmain(int argc, wchar_t* argv[])
 
 		if (
 			SUCCEEDED(hr = scanner->AddScanObserver(consoleObserver)) &&
+			SUCCEEDED(hr = scanner->SetTimeBudget(fileBudget, slowLaneBudget)) &&
+			SUCCEEDED(hr = scanner->SetWorkerCount(workers)) &&
 			SUCCEEDED(hr = enumContext->SetSearchPattern(szPattern)) &&
 			SUCCEEDED(hr = enumContext->SetMaxDepth(depth)) &&
 			SUCCEEDED(hr = enumContext->SetMaxDepthInArchive(archiveDepth)) &&
 			SUCCEEDED(hr = enumContext->SetMaxFileSize(maxFileSize)) &&
-			SUCCEEDED(hr = enumContext->SetFlags((mode == 1) ? IFsEnumContext::DetectOnly : IFsEnumContext::Disinfect)) &&
+			SUCCEEDED(hr = enumContext->SetFlags(scanFlags | ((mode == 1) ? IFsEnumContext::DetectOnly : IFsEnumContext::Disinfect))) &&
 			SUCCEEDED(hr = container->Create(szTargetDir, 0)) &&
 			SUCCEEDED(hr = enumContext->SetSearchContainer(container))
 			)
 		{
+			// a host without a cache yet scans everything
+			if (wcslen(szImport) > 0 && FAILED(hr = scanner->ImportVerdicts(szImport)))
+				wprintf(L"Verdicts not imported from %s: 0x%08X\n", szImport, hr);
 			hr = scanner->Start(enumContext);
+			if (SUCCEEDED(hr) && TEST_FLAG(scanFlags, IFsEnumContext::Census))
+				ShowProgress(scanner, enumContext);
 			scanner->Forever();
+			if (stageCounters)
+				PrintStageCounters(scanner);
+			if (costTrees)
+				PrintDirectoryCosts(scanner, costTrees, szCostReport);
+			if (wcslen(szExport) > 0 && FAILED(hr = scanner->ExportVerdicts(szExport)))
+				wprintf(L"Verdicts not exported to %s: 0x%08X\n", szExport, hr);
 		}
 	}
 	consoleObserver->Release();
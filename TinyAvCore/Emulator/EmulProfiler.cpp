@@ -0,0 +1,240 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "EmulProfiler.h"
+#include "PeEmulator.h"
+#include "..\Utils.h"
+#include <algorithm>
+#include <stdio.h>
+
+#define EMUL_PROFILE_ENV			L"TINYAV_EMUL_PROFILE"
+#define EMUL_PROFILE_LOG_ENV		L"TINYAV_EMUL_PROFILE_LOG"
+#define EMUL_PROFILE_TOP_BLOCKS		(20)
+#define EMUL_PROFILE_CORPUS_BLOCKS	(64)	// hot blocks of a run merged into the corpus
+#define EMUL_PROFILE_MAX_BLOCK		(4096)
+
+void CEmulProfile::AddRegion(__in LPCSTR name, __in ULONGLONG begin, __in ULONGLONG size)
+{
+	EMUL_REGION region = {};
+	strncpy_s(region.name, name, IMAGE_SIZEOF_SHORT_NAME);
+	region.begin = begin;
+	region.end = begin + size;
+	regions.push_back(region);
+}
+
+LPCSTR CEmulProfile::FindRegion(__in ULONGLONG address, __out ULONGLONG * offset)
+{
+	for (size_t i = 0; i < regions.size(); i++)
+	{
+		if (address >= regions[i].begin && address < regions[i].end)
+		{
+			*offset = address - regions[i].begin;
+			return regions[i].name;
+		}
+	}
+	*offset = address;
+	return "?";
+}
+
+CEmulProfiler::CEmulProfiler()
+{
+	m_enabled = FALSE;
+	m_thresholdMs = 0;
+	m_topBlocks = EMUL_PROFILE_TOP_BLOCKS;
+	m_hReport = INVALID_HANDLE_VALUE;
+	m_closeReport = FALSE;
+	m_runCount = 0;
+	m_reportedCount = 0;
+	m_totalMs = 0;
+	InitializeSRWLock(&m_lock);
+
+	WCHAR szValue[MAX_PATH + 1] = {};
+	if (GetEnvironmentVariableW(EMUL_PROFILE_ENV, szValue, MAX_PATH) == 0)
+		return;
+
+	UINT topBlocks = 0;
+	m_thresholdMs = (DWORD)_wtoi(szValue);
+	LPCWSTR comma = wcschr(szValue, L',');
+	if (comma && (topBlocks = (UINT)_wtoi(comma + 1)) > 0)
+		m_topBlocks = topBlocks;
+
+	if (GetEnvironmentVariableW(EMUL_PROFILE_LOG_ENV, szValue, MAX_PATH) != 0)
+	{
+		m_hReport = CreateFileW(szValue, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		m_closeReport = (m_hReport != INVALID_HANDLE_VALUE);
+	}
+	if (m_hReport == INVALID_HANDLE_VALUE)
+		m_hReport = GetStdHandle(STD_OUTPUT_HANDLE);
+	m_enabled = TRUE;
+}
+
+CEmulProfiler::~CEmulProfiler()
+{
+	if (m_enabled && m_runCount)
+		WriteCorpusReport();
+
+	if (m_closeReport)
+		CloseHandle(m_hReport);
+	m_hReport = INVALID_HANDLE_VALUE;
+}
+
+CEmulProfiler * CEmulProfiler::GetInstance(void)
+{
+	static CEmulProfiler s_profiler;
+	return &s_profiler;
+}
+
+void CEmulProfiler::Write(__in LPCSTR format, ...)
+{
+	CHAR szLine[1024];
+	va_list args;
+	va_start(args, format);
+	int len = _vsnprintf_s(szLine, _TRUNCATE, format, args);
+	va_end(args);
+	if (len < 0) len = (int)strlen(szLine);
+
+	DWORD written;
+	WriteFile(m_hReport, szLine, (DWORD)len, &written, NULL);
+}
+
+CEmulProfile * CEmulProfiler::Begin(__in_opt LPCWSTR fileName)
+{
+	if (!m_enabled) return NULL;
+
+	CEmulProfile * profile = new CEmulProfile;
+	if (profile == NULL) return NULL;
+	if (fileName) profile->fileName = fileName;
+	profile->blocks.reserve(1024);
+	profile->startTime = GetTickCount64();
+	return profile;
+}
+
+void CEmulProfiler::End(__in CEmulProfile * profile, __in uc_engine * engine)
+{
+	if (profile == NULL) return;
+
+	ULONGLONG elapsedMs = GetTickCount64() - profile->startTime;
+	ULONGLONG totalBytes = 0;
+
+	// rank blocks by the bytes of code they executed
+	std::vector<std::pair<ULONGLONG, EMUL_BLOCK> > ranked(profile->blocks.begin(), profile->blocks.end());
+	for (size_t i = 0; i < ranked.size(); i++)
+		totalBytes += ranked[i].second.hits * ranked[i].second.size;
+
+	size_t keep = min(ranked.size(), (size_t)max(m_topBlocks, (UINT)EMUL_PROFILE_CORPUS_BLOCKS));
+	std::partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(),
+		[](const std::pair<ULONGLONG, EMUL_BLOCK> & a, const std::pair<ULONGLONG, EMUL_BLOCK> & b)
+	{
+		return a.second.hits * a.second.size > b.second.hits * b.second.size;
+	});
+	ranked.resize(keep);
+
+	AcquireSRWLockExclusive(&m_lock);
+	m_runCount++;
+	m_totalMs += elapsedMs;
+	Merge(profile, ranked, engine);
+	if (elapsedMs >= m_thresholdMs)
+	{
+		m_reportedCount++;
+		Report(profile, ranked, elapsedMs, totalBytes);
+	}
+	ReleaseSRWLockExclusive(&m_lock);
+
+	delete profile;
+}
+
+void CEmulProfiler::Merge(__in CEmulProfile * profile, __in std::vector<std::pair<ULONGLONG, EMUL_BLOCK> > & ranked, __in uc_engine * engine)
+{
+	BYTE code[EMUL_PROFILE_MAX_BLOCK];
+	size_t n = min(ranked.size(), (size_t)EMUL_PROFILE_CORPUS_BLOCKS);
+	for (size_t i = 0; i < n; i++)
+	{
+		ULONGLONG address = ranked[i].first;
+		EMUL_BLOCK & block = ranked[i].second;
+		ULONG size = min(block.size, (ULONG)EMUL_PROFILE_MAX_BLOCK);
+
+		// FNV-1a of the code; the address is used when the code is gone
+		ULONG hash = 2166136261UL;
+		if (engine && size && uc_mem_read(engine, address, code, size) == UC_ERR_OK)
+		{
+			for (ULONG k = 0; k < size; k++)
+				hash = (hash ^ code[k]) * 16777619UL;
+		}
+		else
+		{
+			for (ULONG k = 0; k < sizeof(address); k++)
+				hash = (hash ^ (BYTE)(address >> (k * 8))) * 16777619UL;
+		}
+
+		EMUL_CORPUS_BLOCK & merged = m_corpus[hash];
+		if (merged.files == 0)
+		{
+			merged.size = block.size;
+			merged.sampleAddress = address;
+			merged.sampleFile = profile->fileName;
+		}
+		merged.hits += block.hits;
+		merged.bytes += block.hits * block.size;
+		merged.files++;
+	}
+}
+
+void CEmulProfiler::Report(__in CEmulProfile * profile, __in std::vector<std::pair<ULONGLONG, EMUL_BLOCK> > & ranked, __in ULONGLONG elapsedMs, __in ULONGLONG totalBytes)
+{
+	StringA fileName = UnicodeToAnsi(profile->fileName);
+	Write("\n[profile] %s: %llu ms, %zu unique block(s), %llu byte(s) of code executed\n",
+		fileName.c_str(), elapsedMs, profile->blocks.size(), totalBytes);
+	if (totalBytes == 0) return;
+
+	// bytes executed per region
+	std::vector<ULONGLONG> regionBytes(profile->regions.size() + 1, 0);
+	for (std::unordered_map<ULONGLONG, EMUL_BLOCK>::iterator it = profile->blocks.begin(); it != profile->blocks.end(); ++it)
+	{
+		size_t r = 0;
+		while (r < profile->regions.size() &&
+			(it->first < profile->regions[r].begin || it->first >= profile->regions[r].end))
+			r++;
+		regionBytes[r] += it->second.hits * it->second.size;
+	}
+	for (size_t r = 0; r < regionBytes.size(); r++)
+	{
+		if (regionBytes[r] == 0) continue;
+		Write("  region %-8s %16llu byte(s) %6.2f%%\n",
+			(r < profile->regions.size()) ? profile->regions[r].name : "?",
+			regionBytes[r], regionBytes[r] * 100.0 / totalBytes);
+	}
+
+	size_t n = min(ranked.size(), (size_t)m_topBlocks);
+	for (size_t i = 0; i < n; i++)
+	{
+		ULONGLONG offset;
+		LPCSTR region = profile->FindRegion(ranked[i].first, &offset);
+		ULONGLONG bytes = ranked[i].second.hits * ranked[i].second.size;
+		Write("  #%-3zu 0x%08llX %-8s+0x%06llX size %4lu hits %12llu %6.2f%%\n",
+			i + 1, ranked[i].first, region, offset, ranked[i].second.size,
+			ranked[i].second.hits, bytes * 100.0 / totalBytes);
+	}
+}
+
+void CEmulProfiler::WriteCorpusReport(void)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	Write("\n[profile] corpus: %llu emulation(s), %llu over %lu ms, %llu ms in total\n",
+		m_runCount, m_reportedCount, m_thresholdMs, m_totalMs);
+
+	std::vector<EMUL_CORPUS_BLOCK *> ranked;
+	ranked.reserve(m_corpus.size());
+	for (std::unordered_map<ULONG, EMUL_CORPUS_BLOCK>::iterator it = m_corpus.begin(); it != m_corpus.end(); ++it)
+		ranked.push_back(&it->second);
+
+	size_t n = min(ranked.size(), (size_t)m_topBlocks);
+	std::partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(),
+		[](const EMUL_CORPUS_BLOCK * a, const EMUL_CORPUS_BLOCK * b) { return a->bytes > b->bytes; });
+	for (size_t i = 0; i < n; i++)
+	{
+		StringA sampleFile = UnicodeToAnsi(ranked[i]->sampleFile);
+		Write("  #%-3zu size %4lu hits %12llu in %lu file(s), e.g. 0x%08llX in %s\n",
+			i + 1, ranked[i]->size, ranked[i]->hits, ranked[i]->files,
+			ranked[i]->sampleAddress, sampleFile.c_str());
+	}
+	ReleaseSRWLockExclusive(&m_lock);
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <TinyAvCore.h>
+#include <unordered_map>
+
+// Execution count of one translated block
+typedef struct EMUL_BLOCK
+{
+	ULONGLONG	hits;
+	ULONG		size;		// bytes of machine code in the block
+}EMUL_BLOCK;
+
+// Named address range of the emulated image (usually a PE section)
+typedef struct EMUL_REGION
+{
+	CHAR		name[IMAGE_SIZEOF_SHORT_NAME + 1];
+	ULONGLONG	begin;
+	ULONGLONG	end;
+}EMUL_REGION;
+
+// Statistics of a block merged from several files. Blocks are matched by
+// the hash of their code, so a decryptor shared by a family adds up even
+// when it is loaded at different addresses.
+typedef struct EMUL_CORPUS_BLOCK
+{
+	ULONGLONG	hits;
+	ULONGLONG	bytes;
+	ULONG		size;
+	ULONG		files;
+	ULONGLONG	sampleAddress;
+	StringW		sampleFile;
+}EMUL_CORPUS_BLOCK;
+
+// Profile of one emulation run. It is only touched by the thread running
+// the emulator, so the block hook does not take any lock.
+class CEmulProfile
+{
+public:
+	StringW		fileName;
+	ULONGLONG	startTime;
+	std::vector<EMUL_REGION> regions;
+	std::unordered_map<ULONGLONG, EMUL_BLOCK> blocks;
+
+	CEmulProfile() : startTime(0), m_lastAddress(0), m_last(NULL) {}
+
+	void AddRegion(__in LPCSTR name, __in ULONGLONG begin, __in ULONGLONG size);
+
+	// Called from the block hook. Tight loops hit the same block again and
+	// again, so the previous entry is kept at hand.
+	inline void OnBlock(__in ULONGLONG address, __in ULONG size)
+	{
+		if (m_last == NULL || m_lastAddress != address)
+		{
+			m_last = &blocks[address];
+			m_lastAddress = address;
+		}
+		m_last->hits++;
+		m_last->size = size;
+	}
+
+	LPCSTR FindRegion(__in ULONGLONG address, __out ULONGLONG * offset);
+
+protected:
+	ULONGLONG	m_lastAddress;
+	EMUL_BLOCK*	m_last;
+};
+
+// Opt-in hot-spot profiler for the emulator.
+// TinyAvCore is a static library, so every plug-in has its own instance. All
+// of them read their settings from the environment:
+//	TINYAV_EMUL_PROFILE=<threshold ms>[,<blocks per report>]
+//	TINYAV_EMUL_PROFILE_LOG=<report file> (default: standard output)
+// Runs that take at least the threshold are reported one by one; the corpus
+// report is written when the instance is destroyed.
+class CEmulProfiler
+{
+protected:
+	BOOL		m_enabled;
+	DWORD		m_thresholdMs;
+	UINT		m_topBlocks;
+	HANDLE		m_hReport;
+	BOOL		m_closeReport;
+	SRWLOCK		m_lock;
+
+	ULONGLONG	m_runCount;
+	ULONGLONG	m_reportedCount;
+	ULONGLONG	m_totalMs;
+	std::unordered_map<ULONG, EMUL_CORPUS_BLOCK> m_corpus;
+
+	CEmulProfiler();
+	virtual ~CEmulProfiler();
+
+	void Write(__in LPCSTR format, ...);
+	void Report(__in CEmulProfile * profile, __in std::vector<std::pair<ULONGLONG, EMUL_BLOCK> > & ranked, __in ULONGLONG elapsedMs, __in ULONGLONG totalBytes);
+	void Merge(__in CEmulProfile * profile, __in std::vector<std::pair<ULONGLONG, EMUL_BLOCK> > & ranked, __in uc_engine * engine);
+
+public:
+	static CEmulProfiler * GetInstance(void);
+
+	BOOL IsEnabled(void) { return m_enabled; }
+
+	/* Start profiling an emulation run
+	@fileName: name of the emulated file, used in the reports
+	@return: a new profile, or NULL when profiling is disabled.
+	*/
+	CEmulProfile * Begin(__in_opt LPCWSTR fileName);
+
+	/* Finish an emulation run. The engine must still be open because the
+	hot blocks are read back to match them across files.
+	@profile: object returned by Begin(). It is deleted.
+	@engine: the engine that ran the emulation
+	*/
+	void End(__in CEmulProfile * profile, __in uc_engine * engine);
+
+	// Write the hot blocks of all profiled runs
+	void WriteCorpusReport(void);
+};
@@ -0,0 +1,97 @@
+#include "EmulRuntime.h"
+
+CEmulRuntime::CEmulRuntime()
+{
+	InitializeSRWLock(&m_lock);
+	m_users = 0;
+	m_loadResult = E_PENDING;
+}
+
+CEmulRuntime::~CEmulRuntime()
+{
+	// the library is left to the process: it may be going away with the
+	// loader lock held, when freeing libraries is not safe
+}
+
+CEmulRuntime * CEmulRuntime::GetInstance(void)
+{
+	static CEmulRuntime s_runtime;
+	return &s_runtime;
+}
+
+HRESULT CEmulRuntime::Load(void)
+{
+#ifdef DYNLOAD
+	if (!uc_dyn_load(NULL, 0))
+		return HRESULT_FROM_WIN32(ERROR_MOD_NOT_FOUND);
+#endif // DYNLOAD
+	return S_OK;
+}
+
+HRESULT CEmulRuntime::Acquire(void)
+{
+	HRESULT hr;
+
+	// once loaded, emulators only share the lock
+	AcquireSRWLockShared(&m_lock);
+	hr = m_loadResult;
+	if (SUCCEEDED(hr))
+		InterlockedIncrement(&m_users);
+	ReleaseSRWLockShared(&m_lock);
+	if (hr != E_PENDING) return hr;
+
+	AcquireSRWLockExclusive(&m_lock);
+	if (m_loadResult == E_PENDING)
+		m_loadResult = Load();
+	hr = m_loadResult;
+	if (SUCCEEDED(hr))
+		InterlockedIncrement(&m_users);
+	ReleaseSRWLockExclusive(&m_lock);
+	return hr;
+}
+
+void CEmulRuntime::Release(void)
+{
+	InterlockedDecrement(&m_users);
+}
+
+HRESULT CEmulRuntime::Unload(void)
+{
+	HRESULT hr = S_OK;
+	AcquireSRWLockExclusive(&m_lock);
+	if (m_users)
+	{
+		hr = E_NOT_VALID_STATE;
+	}
+	else if (m_loadResult != E_PENDING)
+	{
+#ifdef DYNLOAD
+		if (SUCCEEDED(m_loadResult))
+			uc_dyn_free();
+#endif // DYNLOAD
+		m_loadResult = E_PENDING;
+	}
+	ReleaseSRWLockExclusive(&m_lock);
+	return hr;
+}
+
+BOOL CEmulRuntime::IsLoaded(void)
+{
+	AcquireSRWLockShared(&m_lock);
+	BOOL loaded = SUCCEEDED(m_loadResult);
+	ReleaseSRWLockShared(&m_lock);
+	return loaded;
+}
+
+BOOL CEmulRuntime::TimeoutFromDeadline(__in ULONGLONG deadline, __in ULONGLONG now, __out uint64_t * timeout)
+{
+	*timeout = 0;
+	if (deadline == 0) return TRUE;
+	if (now >= deadline) return FALSE;
+
+	// a deadline too far to count in microseconds is no limit
+	ULONGLONG remainingMs = deadline - now;
+	if (remainingMs <= (ULONGLONG)-1 / 1000)
+		*timeout = remainingMs * 1000;
+	return TRUE;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <TinyAvCore.h>
+
+// windows specific
+#ifdef _MSC_VER
+#include <io.h>
+#include <windows.h>
+#define PRIx64 "llx"
+
+// posix specific
+#else // _MSC_VER
+#include <unistd.h>
+#include <inttypes.h>
+#endif // _MSC_VER
+
+// DYNLOAD loads the engine library at run time; without it the engine is
+// linked in, statically or through its import library
+#ifdef DYNLOAD
+#include "unicorn_dynload.h"
+#else // DYNLOAD
+#include <unicorn/unicorn.h>
+#ifdef _MSC_VER
+#ifdef _WIN64
+#pragma comment(lib, "unicorn_staload64.lib")
+#else // _WIN64
+#pragma comment(lib, "unicorn_staload.lib")
+#endif // _WIN64
+#endif // _MSC_VER
+#endif // DYNLOAD
+
+// The emulation engine, shared by all the emulators of a TinyAvCore copy.
+// The engine library is loaded by the first emulation, not when an emulator
+// is created, and stays loaded while an emulator holds a reference. Creating
+// and destroying emulators from several threads is safe: only this object
+// touches the entry points of the library.
+class CEmulRuntime
+{
+protected:
+	SRWLOCK			m_lock;
+	volatile LONG	m_users;
+	HRESULT			m_loadResult;	// of loading the library, E_PENDING until tried
+
+	CEmulRuntime();
+	virtual ~CEmulRuntime();
+
+	HRESULT Load(void);
+
+public:
+	static CEmulRuntime * GetInstance(void);
+
+	/* Take a reference on the engine, loading it on the first call
+	@return: S_OK, or the error of loading the library. A failure is kept, so
+	emulations without the library do not try again.
+	*/
+	HRESULT Acquire(void);
+
+	// Return a reference taken by Acquire()
+	void Release(void);
+
+	/* Unload the engine library
+	@return: S_OK, or E_NOT_VALID_STATE while an emulator holds a reference.
+	The next Acquire() loads the library again.
+	*/
+	HRESULT Unload(void);
+
+	BOOL IsLoaded(void);
+
+	/* Convert a deadline to the timeout of uc_emu_start(), which takes microseconds
+	@deadline: GetTickCount64() value to stop at, 0 for no limit
+	@now: GetTickCount64() value to count from
+	@timeout: a pointer to a variable storing the timeout, 0 for no limit
+	@return: FALSE if the deadline has passed.
+	*/
+	static BOOL TimeoutFromDeadline(__in ULONGLONG deadline, __in ULONGLONG now, __out uint64_t * timeout);
+};
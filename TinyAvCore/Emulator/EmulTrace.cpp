@@ -0,0 +1,383 @@
+#include "EmulTrace.h"
+#include "PeEmulator.h"
+#include <stdio.h>
+
+#define EMUL_TRACE_ENV	L"TINYAV_EMUL_TRACE"
+
+static const int s_traceRegisters[] = {
+	UC_X86_REG_EAX, UC_X86_REG_EBX, UC_X86_REG_ECX, UC_X86_REG_EDX,
+	UC_X86_REG_ESI, UC_X86_REG_EDI, UC_X86_REG_EBP, UC_X86_REG_ESP,
+	UC_X86_REG_EIP, UC_X86_REG_EFLAGS
+};
+
+static BOOL WriteAll(__in HANDLE hFile, __in_bcount(size) const void * data, __in size_t size)
+{
+	DWORD written = 0;
+	if (size == 0) return TRUE;
+	return WriteFile(hFile, data, (DWORD)size, &written, NULL) && written == size;
+}
+
+static BOOL ReadAll(__in HANDLE hFile, __out_bcount(size) void * data, __in size_t size)
+{
+	DWORD read = 0;
+	if (size == 0) return TRUE;
+	return ReadFile(hFile, data, (DWORD)size, &read, NULL) && read == size;
+}
+
+// Take count items of itemSize bytes from what is left of a file. Counts come
+// from the file: they are checked before anything is allocated for them.
+static BOOL TakeItems(__inout ULONGLONG * remaining, __in ULONGLONG count, __in ULONGLONG itemSize)
+{
+	if (count > *remaining / itemSize) return FALSE;
+	*remaining -= count * itemSize;
+	return TRUE;
+}
+
+/* Read a mapped region into a content buffer, without its trailing zero bytes
+@engine: engine that maps the region
+@region: the region, its dataSize is set
+@content: the bytes read are added to it
+*/
+static void ReadRegion(__in uc_engine * engine, __inout EMUL_TRACE_REGION & region, __inout std::vector<BYTE> & content)
+{
+	std::vector<BYTE> page(EMUL_TRACE_PAGE_SIZE);
+	size_t base = content.size();
+	size_t lastNonZero = base;
+	for (ULONGLONG offset = 0; offset < region.size; offset += page.size())
+	{
+		size_t n = (size_t)min((ULONGLONG)page.size(), region.size - offset);
+		if (uc_mem_read(engine, region.address + offset, &page[0], n) != UC_ERR_OK)
+			ZeroMemory(&page[0], n);
+		content.insert(content.end(), page.begin(), page.begin() + n);
+		for (size_t k = n; k > 0; k--)
+		{
+			if (page[k - 1] != 0)
+			{
+				lastNonZero = content.size() - n + k;
+				break;
+			}
+		}
+	}
+	content.resize(lastNonZero);
+	region.dataSize = (DWORD)(lastNonZero - base);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CEmulTraceRecorder
+
+CEmulTraceRecorder::CEmulTraceRecorder()
+{
+	ZeroMemory(&m_header, sizeof(m_header));
+	m_header.magic = EMUL_TRACE_MAGIC;
+	m_header.version = EMUL_TRACE_VERSION;
+	m_header.arch = UC_ARCH_X86;
+	m_header.mode = UC_MODE_32;
+	m_unserved = 0;
+	m_hookCode = 0;
+	m_hookMem = 0;
+	m_started = FALSE;
+}
+
+CEmulTraceRecorder::~CEmulTraceRecorder()
+{
+}
+
+CEmulTraceRecorder * CEmulTraceRecorder::Create(void)
+{
+	WCHAR szDir[MAX_PATH + 1];
+	if (GetEnvironmentVariableW(EMUL_TRACE_ENV, szDir, MAX_PATH) == 0)
+		return NULL;
+	return new CEmulTraceRecorder;
+}
+
+void CEmulTraceRecorder::OnMap(__in ULONGLONG address, __in ULONGLONG size, __in DWORD perms)
+{
+	EMUL_TRACE_REGION region = { address, size, perms, 0 };
+	m_regions.push_back(region);
+}
+
+void CEmulTraceRecorder::OnProtect(__in ULONGLONG address, __in ULONGLONG size, __in DWORD perms)
+{
+	EMUL_TRACE_REGION region = { address, size, perms, 0 };
+	m_protects.push_back(region);
+}
+
+HRESULT CEmulTraceRecorder::Start(__in uc_engine * engine, __in ULONGLONG begin, __in ULONGLONG until)
+{
+	if (engine == NULL) return E_INVALIDARG;
+	m_header.begin = begin;
+	m_header.until = until;
+
+	for (size_t i = 0; i < _countof(s_traceRegisters); i++)
+	{
+		EMUL_TRACE_REGISTER reg = { s_traceRegisters[i], 0, 0 };
+		if (uc_reg_read(engine, s_traceRegisters[i], &reg.value) == UC_ERR_OK)
+			m_registers.push_back(reg);
+	}
+
+	// The regions are read back as they are now. Protections were applied
+	// after the content was written, so reads are not affected by them.
+	for (size_t i = 0; i < m_regions.size(); i++)
+		ReadRegion(engine, m_regions[i], m_content);
+
+	uc_hook_add(engine, &m_hookCode, UC_HOOK_CODE, (void*)&CEmulTraceRecorder::HookCode, this, (uint64_t)1, (uint64_t)0);
+	uc_hook_add(engine, &m_hookMem, UC_HOOK_MEM_READ_UNMAPPED | UC_HOOK_MEM_WRITE_UNMAPPED | UC_HOOK_MEM_FETCH_UNMAPPED,
+		(void*)&CEmulTraceRecorder::HookMemUnmapped, this);
+	m_started = TRUE;
+	return S_OK;
+}
+
+void CEmulTraceRecorder::CaptureServed(__in uc_engine * engine)
+{
+	// The run went on past the access, so a hook mapped the page: it is
+	// read as it is now, after the access was made.
+	BYTE probe;
+	for (; m_unserved < m_events.size(); m_unserved++)
+	{
+		ULONGLONG page = m_events[m_unserved].address & ~(ULONGLONG)(EMUL_TRACE_PAGE_SIZE - 1);
+		if (uc_mem_read(engine, page, &probe, 1) != UC_ERR_OK)
+			continue;
+
+		EMUL_TRACE_REGION & region = m_served[m_unserved];
+		region.address = page;
+		region.size = EMUL_TRACE_PAGE_SIZE;
+		region.perms = UC_PROT_ALL;
+		ReadRegion(engine, region, m_servedContent);
+	}
+}
+
+void CEmulTraceRecorder::HookCode(uc_engine *uc, uint64_t address, uint32_t size, void *user_data)
+{
+	UNREFERENCED_PARAMETER(address);
+	UNREFERENCED_PARAMETER(size);
+	CEmulTraceRecorder * t = (CEmulTraceRecorder *)user_data;
+	t->m_header.instructions++;
+	if (t->m_unserved < t->m_events.size())
+		t->CaptureServed(uc);
+}
+
+bool CEmulTraceRecorder::HookMemUnmapped(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data)
+{
+	UNREFERENCED_PARAMETER(uc);
+	CEmulTraceRecorder * t = (CEmulTraceRecorder *)user_data;
+	EMUL_TRACE_EVENT e = { address, value, (DWORD)size, (DWORD)type };
+	EMUL_TRACE_REGION none = {};
+	t->m_events.push_back(e);
+	t->m_served.push_back(none);
+	return false;	// leave the decision to the other hooks
+}
+
+HRESULT CEmulTraceRecorder::Finish(__in uc_engine * engine)
+{
+	if (!m_started) return S_FALSE;
+	if (engine)
+	{
+		uc_hook_del(engine, m_hookCode);
+		uc_hook_del(engine, m_hookMem);
+		CaptureServed(engine);
+	}
+	m_started = FALSE;
+
+	static volatile LONG s_traceId = 0;
+	WCHAR szDir[MAX_PATH + 1], szFileName[MAX_PATH + 1];
+	if (GetEnvironmentVariableW(EMUL_TRACE_ENV, szDir, MAX_PATH) == 0)
+		return E_NOT_SET;
+	swprintf_s(szFileName, L"%s\\%08lX-%05lu%s", szDir, GetCurrentProcessId(),
+		(ULONG)InterlockedIncrement(&s_traceId), EMUL_TRACE_EXTENSION);
+
+	HANDLE hFile = CreateFileW(szFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	m_header.registerCount = (DWORD)m_registers.size();
+	m_header.regionCount = (DWORD)m_regions.size();
+	m_header.protectCount = (DWORD)m_protects.size();
+	m_header.eventCount = (DWORD)m_events.size();
+
+	BOOL ok = WriteAll(hFile, &m_header, sizeof(m_header)) &&
+		WriteAll(hFile, m_registers.data(), m_registers.size() * sizeof(EMUL_TRACE_REGISTER));
+	size_t offset = 0;
+	for (size_t i = 0; ok && i < m_regions.size(); i++)
+	{
+		ok = WriteAll(hFile, &m_regions[i], sizeof(EMUL_TRACE_REGION)) &&
+			WriteAll(hFile, m_content.data() + offset, m_regions[i].dataSize);
+		offset += m_regions[i].dataSize;
+	}
+	ok = ok && WriteAll(hFile, m_protects.data(), m_protects.size() * sizeof(EMUL_TRACE_REGION));
+	offset = 0;
+	for (size_t i = 0; ok && i < m_events.size(); i++)
+	{
+		ok = WriteAll(hFile, &m_events[i], sizeof(EMUL_TRACE_EVENT)) &&
+			WriteAll(hFile, &m_served[i], sizeof(EMUL_TRACE_REGION)) &&
+			WriteAll(hFile, m_servedContent.data() + offset, m_served[i].dataSize);
+		offset += m_served[i].dataSize;
+	}
+	CloseHandle(hFile);
+
+	if (!ok)
+	{
+		DeleteFileW(szFileName);
+		return E_FAIL;
+	}
+	return S_OK;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CEmulTrace
+
+CEmulTrace::CEmulTrace()
+{
+	ZeroMemory(&m_header, sizeof(m_header));
+	m_nextEvent = 0;
+	m_recordedStop = FALSE;
+	m_hookMem = 0;
+}
+
+CEmulTrace::~CEmulTrace()
+{
+}
+
+HRESULT CEmulTrace::Load(__in LPCWSTR lpFileName)
+{
+	if (lpFileName == NULL) return E_INVALIDARG;
+
+	HANDLE hFile = CreateFileW(lpFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	HRESULT hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+	LARGE_INTEGER fileSize = {};
+	ULONGLONG remaining = 0;
+	if (!GetFileSizeEx(hFile, &fileSize))
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		goto Exit;
+	}
+	remaining = (ULONGLONG)fileSize.QuadPart;
+	m_content.clear();
+	m_servedContent.clear();
+
+	if (!TakeItems(&remaining, 1, sizeof(m_header)) ||
+		!ReadAll(hFile, &m_header, sizeof(m_header)) ||
+		m_header.magic != EMUL_TRACE_MAGIC ||
+		m_header.version != EMUL_TRACE_VERSION)
+		goto Exit;
+
+	if (!TakeItems(&remaining, m_header.registerCount, sizeof(EMUL_TRACE_REGISTER)))
+		goto Exit;
+	m_registers.resize(m_header.registerCount);
+	if (!ReadAll(hFile, m_registers.data(), m_registers.size() * sizeof(EMUL_TRACE_REGISTER)))
+		goto Exit;
+
+	if (!TakeItems(&remaining, m_header.regionCount, sizeof(EMUL_TRACE_REGION)))
+		goto Exit;
+	m_regions.resize(m_header.regionCount);
+	for (size_t i = 0; i < m_regions.size(); i++)
+	{
+		if (!ReadAll(hFile, &m_regions[i], sizeof(EMUL_TRACE_REGION)) ||
+			m_regions[i].dataSize > m_regions[i].size ||
+			!TakeItems(&remaining, m_regions[i].dataSize, 1))
+			goto Exit;
+
+		size_t offset = m_content.size();
+		m_content.resize(offset + m_regions[i].dataSize);
+		if (!ReadAll(hFile, m_content.data() + offset, m_regions[i].dataSize))
+			goto Exit;
+	}
+
+	if (!TakeItems(&remaining, m_header.protectCount, sizeof(EMUL_TRACE_REGION)))
+		goto Exit;
+	m_protects.resize(m_header.protectCount);
+	if (!ReadAll(hFile, m_protects.data(), m_protects.size() * sizeof(EMUL_TRACE_REGION)))
+		goto Exit;
+
+	if (!TakeItems(&remaining, m_header.eventCount, sizeof(EMUL_TRACE_EVENT) + sizeof(EMUL_TRACE_REGION)))
+		goto Exit;
+	m_events.resize(m_header.eventCount);
+	m_served.resize(m_header.eventCount);
+	m_servedOffsets.resize(m_header.eventCount);
+	for (size_t i = 0; i < m_events.size(); i++)
+	{
+		if (!ReadAll(hFile, &m_events[i], sizeof(EMUL_TRACE_EVENT)) ||
+			!ReadAll(hFile, &m_served[i], sizeof(EMUL_TRACE_REGION)) ||
+			m_served[i].dataSize > m_served[i].size ||
+			!TakeItems(&remaining, m_served[i].dataSize, 1))
+			goto Exit;
+
+		m_servedOffsets[i] = m_servedContent.size();
+		m_servedContent.resize(m_servedOffsets[i] + m_served[i].dataSize);
+		if (!ReadAll(hFile, m_servedContent.data() + m_servedOffsets[i], m_served[i].dataSize))
+			goto Exit;
+	}
+	hr = S_OK;
+
+Exit:
+	CloseHandle(hFile);
+	return hr;
+}
+
+HRESULT CEmulTrace::Apply(__in uc_engine * engine)
+{
+	if (engine == NULL) return E_INVALIDARG;
+
+	size_t offset = 0;
+	for (size_t i = 0; i < m_regions.size(); i++)
+	{
+		if (uc_mem_map(engine, m_regions[i].address, (size_t)m_regions[i].size, m_regions[i].perms) != UC_ERR_OK)
+			return E_FAIL;
+		if (m_regions[i].dataSize &&
+			uc_mem_write(engine, m_regions[i].address, m_content.data() + offset, m_regions[i].dataSize) != UC_ERR_OK)
+			return E_FAIL;
+		offset += m_regions[i].dataSize;
+	}
+
+	for (size_t i = 0; i < m_protects.size(); i++)
+	{
+		if (uc_mem_protect(engine, m_protects[i].address, (size_t)m_protects[i].size, m_protects[i].perms) != UC_ERR_OK)
+			return E_FAIL;
+	}
+
+	for (size_t i = 0; i < m_registers.size(); i++)
+	{
+		if (uc_reg_write(engine, m_registers[i].id, &m_registers[i].value) != UC_ERR_OK)
+			return E_FAIL;
+	}
+
+	m_nextEvent = 0;
+	m_recordedStop = FALSE;
+	if (m_events.size() &&
+		uc_hook_add(engine, &m_hookMem, UC_HOOK_MEM_READ_UNMAPPED | UC_HOOK_MEM_WRITE_UNMAPPED | UC_HOOK_MEM_FETCH_UNMAPPED,
+		(void*)&CEmulTrace::HookMemUnmapped, this) != UC_ERR_OK)
+		return E_FAIL;
+	return S_OK;
+}
+
+bool CEmulTrace::HookMemUnmapped(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data)
+{
+	UNREFERENCED_PARAMETER(size);
+	UNREFERENCED_PARAMETER(value);
+	CEmulTrace * t = (CEmulTrace *)user_data;
+
+	// The events come in the order of the recorded run. An access the run
+	// did not make means the replay diverged: it stops with an error.
+	size_t i = t->m_nextEvent;
+	while (i < t->m_events.size() &&
+		(t->m_events[i].address != address || t->m_events[i].type != (DWORD)type))
+		i++;
+	if (i == t->m_events.size()) return false;
+	t->m_nextEvent = i + 1;
+
+	const EMUL_TRACE_REGION & region = t->m_served[i];
+	if (region.size == 0)
+	{
+		// the recorded run ended here too
+		t->m_recordedStop = TRUE;
+		return false;
+	}
+	if (uc_mem_map(uc, region.address, (size_t)region.size, region.perms) != UC_ERR_OK)
+		return false;
+	if (region.dataSize &&
+		uc_mem_write(uc, region.address, t->m_servedContent.data() + t->m_servedOffsets[i], region.dataSize) != UC_ERR_OK)
+		return false;
+	return true;
+}
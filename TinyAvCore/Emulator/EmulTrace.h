@@ -0,0 +1,155 @@
+#pragma once
+#include <TinyAvCore.h>
+#include <vector>
+
+// Trace file layout (little-endian):
+//	EMUL_TRACE_HEADER
+//	EMUL_TRACE_REGISTER	[registerCount]
+//	EMUL_TRACE_REGION	[regionCount], each followed by dataSize bytes of content
+//	EMUL_TRACE_REGION	[protectCount], protections applied after the content is written
+//	EMUL_TRACE_EVENT	[eventCount], each followed by an EMUL_TRACE_REGION and its dataSize bytes
+#define EMUL_TRACE_MAGIC		(0x54564154)	// "TAVT"
+#define EMUL_TRACE_VERSION		(2)
+#define EMUL_TRACE_PAGE_SIZE	(0x1000)
+#define EMUL_TRACE_EXTENSION	L".tavt"
+
+typedef struct EMUL_TRACE_HEADER
+{
+	DWORD		magic;
+	DWORD		version;
+	DWORD		arch;			// uc_arch
+	DWORD		mode;			// uc_mode
+	ULONGLONG	begin;			// address where emulation starts
+	ULONGLONG	until;			// address where emulation stops
+	ULONGLONG	instructions;	// instructions executed by the recorded run
+	DWORD		registerCount;
+	DWORD		regionCount;
+	DWORD		protectCount;
+	DWORD		eventCount;
+}EMUL_TRACE_HEADER;
+
+typedef struct EMUL_TRACE_REGISTER
+{
+	LONG		id;				// uc_x86_reg
+	DWORD		reserved;
+	ULONGLONG	value;
+}EMUL_TRACE_REGISTER;
+
+// A mapped range. Trailing zero bytes are not stored, so stacks and
+// uninitialized data cost nothing.
+typedef struct EMUL_TRACE_REGION
+{
+	ULONGLONG	address;
+	ULONGLONG	size;
+	DWORD		perms;
+	DWORD		dataSize;
+}EMUL_TRACE_REGION;
+
+// An access to unmapped memory made by the recorded run. The region that
+// follows it is the page a hook mapped to serve the access, with its content
+// once the access was made; its size is 0 when the access ended the run.
+typedef struct EMUL_TRACE_EVENT
+{
+	ULONGLONG	address;
+	LONGLONG	value;
+	DWORD		size;
+	DWORD		type;			// uc_mem_type
+}EMUL_TRACE_EVENT;
+
+// Records the initial state of an emulation run into a trace file.
+// Recording is enabled by naming a directory in TINYAV_EMUL_TRACE.
+class CEmulTraceRecorder
+{
+protected:
+	EMUL_TRACE_HEADER	m_header;
+	std::vector<EMUL_TRACE_REGION>	m_regions;
+	std::vector<EMUL_TRACE_REGION>	m_protects;
+	std::vector<EMUL_TRACE_REGISTER> m_registers;
+	std::vector<EMUL_TRACE_EVENT>	m_events;
+	std::vector<EMUL_TRACE_REGION>	m_served;	// one for each of m_events
+	std::vector<BYTE>	m_content;	// contents of m_regions, one after another
+	std::vector<BYTE>	m_servedContent;	// contents of m_served
+	size_t		m_unserved;		// first event whose page is not read yet
+	uc_hook		m_hookCode;
+	uc_hook		m_hookMem;
+	BOOL		m_started;
+
+	CEmulTraceRecorder();
+
+	// Read the pages mapped by hooks for the last events
+	void CaptureServed(__in uc_engine * engine);
+
+	static void HookCode(uc_engine *uc, uint64_t address, uint32_t size, void *user_data);
+	static bool HookMemUnmapped(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data);
+
+public:
+	virtual ~CEmulTraceRecorder();
+
+	// @return: a new recorder, or NULL when recording is disabled.
+	static CEmulTraceRecorder * Create(void);
+
+	void OnMap(__in ULONGLONG address, __in ULONGLONG size, __in DWORD perms);
+	void OnProtect(__in ULONGLONG address, __in ULONGLONG size, __in DWORD perms);
+
+	/* Capture registers and memory right before uc_emu_start()
+	@engine: engine that is about to run
+	@begin, @until: arguments of uc_emu_start()
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT Start(__in uc_engine * engine, __in ULONGLONG begin, __in ULONGLONG until);
+
+	/* Remove the hooks and write the trace file. Nothing is written if
+	Start() was not called.
+	@engine: engine that ran the emulation
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT Finish(__in uc_engine * engine);
+};
+
+// A trace loaded from a file, ready to be replayed
+class CEmulTrace
+{
+protected:
+	EMUL_TRACE_HEADER	m_header;
+	std::vector<EMUL_TRACE_REGISTER> m_registers;
+	std::vector<EMUL_TRACE_REGION>	m_regions;
+	std::vector<EMUL_TRACE_REGION>	m_protects;
+	std::vector<EMUL_TRACE_EVENT>	m_events;
+	std::vector<EMUL_TRACE_REGION>	m_served;
+	std::vector<size_t>	m_servedOffsets;	// of each of m_served in m_servedContent
+	std::vector<BYTE>	m_content;
+	std::vector<BYTE>	m_servedContent;
+	size_t		m_nextEvent;
+	BOOL		m_recordedStop;
+	uc_hook		m_hookMem;
+
+	// Serve an access to unmapped memory the way the recorded run did
+	static bool HookMemUnmapped(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data);
+
+public:
+	CEmulTrace();
+	virtual ~CEmulTrace();
+
+	/* Read a trace file
+	@lpFileName: path of the trace file
+	@return: HRESULT on success, HRESULT_FROM_WIN32(ERROR_BAD_FORMAT) if the
+	file is not a trace or holds fewer items than its header counts.
+	*/
+	HRESULT Load(__in LPCWSTR lpFileName);
+
+	/* Map memory, set registers and hook the accesses to unmapped memory of an opened engine
+	@engine: engine opened with GetArch() and GetMode()
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT Apply(__in uc_engine * engine);
+
+	// TRUE when the replay stopped on the access to unmapped memory that ended the recorded run
+	BOOL IsRecordedStop(void) { return m_recordedStop; }
+
+	uc_arch GetArch(void) { return (uc_arch)m_header.arch; }
+	uc_mode GetMode(void) { return (uc_mode)m_header.mode; }
+	ULONGLONG GetBegin(void) { return m_header.begin; }
+	ULONGLONG GetUntil(void) { return m_header.until; }
+	ULONGLONG GetInstructionCount(void) { return m_header.instructions; }
+	DWORD GetEventCount(void) { return m_header.eventCount; }
+};
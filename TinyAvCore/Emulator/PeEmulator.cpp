@@ -1,11 +1,49 @@
 #include "PeEmulator.h"
 #include "..\FileType\PeFileParser.h"
+#include "EmulProfiler.h"
+#include "EmulTrace.h"
+#include "..\Scanner\StageCounters.h"
+#include "..\Scanner\EmulationClock.h"
+#include "..\Scanner\MemoryGovernor.h"
+
+// A run of the engine, from the moment the observers are told it starts. It
+// ends the profile and the trace, tells the observers the run stopped and
+// closes the engine, whichever way the run leaves.
+class CEmulRunScope
+{
+protected:
+	CPeEmulator *	m_emulator;
+
+public:
+	CEmulRunScope(__in CPeEmulator * emulator, __in_opt LPCWSTR fileName, __in BOOL record)
+	{
+		m_emulator = emulator;
+		m_emulator->BeginProfile(fileName);
+		if (record) m_emulator->m_recorder = CEmulTraceRecorder::Create();
+	}
+
+	~CEmulRunScope()
+	{
+		m_emulator->EndProfile();
+		m_emulator->EndTrace();
+		m_emulator->OnStopped();
+		if (m_emulator->m_engine)
+		{
+			uc_close(m_emulator->m_engine);
+			m_emulator->m_engine = NULL;
+		}
+	}
+};
 
 CPeEmulator::CPeEmulator()
 {
 	m_engine = NULL;
-	m_bEmulatorEngineReady = uc_dyn_load(NULL, 0);
+	m_runtimeHeld = false;
 	m_starting = false;
+	m_profile = NULL;
+	m_profileHook = 0;
+	m_recorder = NULL;
+	m_deadline = 0;
 }
 
 CPeEmulator::~CPeEmulator()
@@ -17,7 +55,8 @@ CPeEmulator::~CPeEmulator()
 		m_Observers[i]->Release();
 	}
 
-	uc_dyn_free();
+	if (m_runtimeHeld)
+		CEmulRuntime::GetInstance()->Release();
 }
 
 HRESULT WINAPI CPeEmulator::OnStarting(void)
@@ -59,6 +98,63 @@ HRESULT WINAPI CPeEmulator::OnStopped(void)
 	return S_OK;
 }
 
+void WINAPI CPeEmulator::BeginProfile(__in_opt LPCWSTR fileName)
+{
+	m_profile = CEmulProfiler::GetInstance()->Begin(fileName);
+	if (m_profile == NULL) return;
+
+	// begin > end: every block of the emulated code
+	if (uc_hook_add(m_engine, &m_profileHook, UC_HOOK_BLOCK, (void*)&CPeEmulator::HookBlock, this, (uint64_t)1, (uint64_t)0) != UC_ERR_OK)
+	{
+		CEmulProfiler::GetInstance()->End(m_profile, NULL);
+		m_profile = NULL;
+	}
+}
+
+void WINAPI CPeEmulator::EndProfile(void)
+{
+	if (m_profile == NULL) return;
+
+	uc_hook_del(m_engine, m_profileHook);
+	m_profileHook = 0;
+	CEmulProfiler::GetInstance()->End(m_profile, m_engine);
+	m_profile = NULL;
+}
+
+void CPeEmulator::HookBlock(uc_engine *uc, uint64_t address, uint32_t size, void *user_data)
+{
+	UNREFERENCED_PARAMETER(uc);
+	CPeEmulator * t = (CPeEmulator *)user_data;
+	t->m_profile->OnBlock(address, size);
+}
+
+void WINAPI CPeEmulator::EndTrace(void)
+{
+	if (m_recorder == NULL) return;
+	m_recorder->Finish(m_engine);
+	delete m_recorder;
+	m_recorder = NULL;
+}
+
+HRESULT WINAPI CPeEmulator::AcquireRuntime(void)
+{
+	if (m_runtimeHeld) return S_OK;
+
+	// the engine is loaded by the first emulation of the process
+	if (FAILED(CEmulRuntime::GetInstance()->Acquire()))
+	{
+		OnError(IEmulObserver::EmulatorIsNotFound);
+		return E_NOT_VALID_STATE;
+	}
+	m_runtimeHeld = true;
+	return S_OK;
+}
+
+BOOL WINAPI CPeEmulator::GetTimeout(__out uint64_t * timeout)
+{
+	return CEmulRuntime::TimeoutFromDeadline(m_deadline, GetTickCount64(), timeout);
+}
+
 HRESULT WINAPI CPeEmulator::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
 {
 	if (ppvObject == NULL) return E_INVALIDARG;
@@ -108,10 +204,18 @@ HRESULT WINAPI CPeEmulator::EmulateCode(
 	uc_err err;
 	HRESULT hr;
 
-	if (m_bEmulatorEngineReady == false)
+	if (FAILED(hr = AcquireRuntime()))
+		return hr;
+
+	uint64_t timeout;
+	if (!GetTimeout(&timeout)) return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+
+	// wait for the memory of the guest before opening the engine
+	CMemoryCharge guestMemory(MemoryEmulator);
+	if (FAILED(hr = guestMemory.Reserve((ULONGLONG)CPeFileParser::SectionAlign(nSizeOfCode, 0x1000) + nSizeOfStackReserve, m_deadline)))
 	{
-		OnError(IEmulObserver::EmulatorIsNotFound);
-		return E_NOT_VALID_STATE;
+		OnError(IEmulObserver::EmulatorOutOfMemory);
+		return hr;
 	}
 
 	try
@@ -128,82 +232,57 @@ HRESULT WINAPI CPeEmulator::EmulateCode(
 			m_engine = NULL;
 			return hr;
 		}
+		CEmulRunScope run(this, NULL, TRUE);
 
 		// map memory for this emulation
 		nSizeOfCode = CPeFileParser::SectionAlign(nSizeOfCode, 0x1000);
 		err = uc_mem_map(m_engine, memoryMappedAddr, nSizeOfCode, UC_PROT_ALL);
-		if (err != UC_ERR_OK)
-		{
-			OnStopped();
-			uc_close(m_engine);
-			m_engine = NULL;
-			return E_FAIL;
-		}
+		if (err != UC_ERR_OK) return E_FAIL;
+		if (m_profile) m_profile->AddRegion("code", memoryMappedAddr, nSizeOfCode);
+		if (m_recorder) m_recorder->OnMap(memoryMappedAddr, nSizeOfCode, UC_PROT_ALL);
 
 		err = uc_mem_map(m_engine, memoryMappedAddr + nSizeOfCode, nSizeOfStackReserve, UC_PROT_READ | UC_PROT_WRITE);
-		if (err != UC_ERR_OK)
-		{
-			OnStopped();
-			uc_close(m_engine);
-			m_engine = NULL;
-			return E_FAIL;
-		}
+		if (err != UC_ERR_OK) return E_FAIL;
+		if (m_recorder) m_recorder->OnMap(memoryMappedAddr + nSizeOfCode, nSizeOfStackReserve, UC_PROT_READ | UC_PROT_WRITE);
 
 		DWORD r_esp = (DWORD)memoryMappedAddr + nSizeOfCode + nSizeOfStackCommit;
 		err = uc_reg_write(m_engine, UC_X86_REG_ESP, &r_esp);
-		if (err != UC_ERR_OK)
-		{
-			OnStopped();
-			uc_close(m_engine);
-			m_engine = NULL;
-			return E_FAIL;
-		}
+		if (err != UC_ERR_OK) return E_FAIL;
 
 		err = uc_mem_write(m_engine, memoryMappedAddr, lpCodeBuffer, nSizeOfCode);
-		if (err != UC_ERR_OK)
-		{
-			OnStopped();
-			uc_close(m_engine);
-			m_engine = NULL;
-			return E_FAIL;
-		}
+		if (err != UC_ERR_OK) return E_FAIL;
 
-		// emulate machine code in infinite time
+		if (m_recorder)
+			m_recorder->Start(m_engine, addressToStart, (nNumberOfBytesToEmulate == 0) ? 0 : addressToStart + nNumberOfBytesToEmulate - 1);
+
+		// emulate machine code until it ends or the deadline is reached
+		GetTimeout(&timeout);
 		if (nNumberOfBytesToEmulate == 0)
-			err = uc_emu_start(m_engine, addressToStart, 0, 0, 0);
+			err = uc_emu_start(m_engine, addressToStart, 0, timeout, 0);
 		else
-			err = uc_emu_start(m_engine, addressToStart, addressToStart + nNumberOfBytesToEmulate - 1, 0, 0);
-
-		OnStopped();
-		uc_close(m_engine);
-		m_engine = NULL;
+			err = uc_emu_start(m_engine, addressToStart, addressToStart + nNumberOfBytesToEmulate - 1, timeout, 0);
 
-		return (err == UC_ERR_OK) ? S_OK : E_FAIL;
+		if (err != UC_ERR_OK) return E_FAIL;
+		return GetTimeout(&timeout) ? S_OK : HRESULT_FROM_WIN32(ERROR_TIMEOUT);
 	}
 	catch (...)
 	{
-		if (m_starting)
+		// a run that started is ended by its scope
+		OnError(IEmulObserver::EmulatorInternalError);
+		if (m_starting) OnStopped();
+		if (m_engine)
 		{
-			OnError(IEmulObserver::EmulatorInternalError);
-			OnStopped();
-			if (m_engine)
-			{
-				uc_close(m_engine);
-				m_engine = NULL;
-			}
-		}
-		else
-		{
-			OnError(IEmulObserver::EmulatorInternalError);
+			uc_close(m_engine);
 			m_engine = NULL;
 		}
-
 		return E_FAIL;
 	}
 }
 
 HRESULT WINAPI CPeEmulator::EmulatePeFile(__in IPeFile *peFile, __in DWORD_PTR rvaToStart, __in int origin, __in DWORD nNumberOfBytesToEmulate /*= 0*/)
 {
+	CStageScope stage(StageEmulate);
+	CEmulationScope emulation;
 	IMAGE_SECTION_HEADER section;
 	IMAGE_NT_HEADERS32 ntHeader;
 	IFsStream * fileStream = NULL;
@@ -213,13 +292,15 @@ HRESULT WINAPI CPeEmulator::EmulatePeFile(__in IPeFile *peFile, __in DWORD_PTR r
 	HRESULT hr;
 	IVirtualFs *fs;
 	IFsAttribute * attrib;
+	BSTR fileName = NULL;
 	if (peFile == NULL) return E_INVALIDARG;
 
-	if (m_bEmulatorEngineReady == false)
-	{
-		OnError(IEmulObserver::EmulatorIsNotFound);
-		return E_NOT_VALID_STATE;
-	}
+	if (FAILED(hr = AcquireRuntime()))
+		return hr;
+
+	uint64_t timeout;
+	if (!GetTimeout(&timeout)) return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+
 	try
 	{
 		hr = peFile->QueryInterface(__uuidof(IVirtualFs), (LPVOID*)&fs);
@@ -232,12 +313,23 @@ HRESULT WINAPI CPeEmulator::EmulatePeFile(__in IPeFile *peFile, __in DWORD_PTR r
 		}
 		hr = attrib->Size(&fileSize);
 		attrib->Release();
+		if (CEmulProfiler::GetInstance()->IsEnabled())
+			fs->GetFullPath(&fileName);
 		fs->Release();
 		if (FAILED(hr)) return hr;
 
 		hr = peFile->GetPEHeader(&ntHeader);
 		if (FAILED(hr)) return hr;
 
+		// the guest memory is sized by the headers; wait for it before opening the engine
+		CMemoryCharge guestMemory(MemoryEmulator);
+		hr = guestMemory.Reserve((ULONGLONG)ntHeader.OptionalHeader.SizeOfImage + ntHeader.OptionalHeader.SizeOfStackReserve, m_deadline);
+		if (FAILED(hr))
+		{
+			OnError(IEmulObserver::EmulatorOutOfMemory);
+			return hr;
+		}
+
 		hr = peFile->QueryInterface(__uuidof(IFsStream), (LPVOID*)&fileStream);
 		if (FAILED(hr)) return hr;
 
@@ -245,6 +337,7 @@ HRESULT WINAPI CPeEmulator::EmulatePeFile(__in IPeFile *peFile, __in DWORD_PTR r
 		if (err != UC_ERR_OK) {
 			OnError(IEmulObserver::EmulatorIsNotRunable);
 			fileStream->Release();
+			if (fileName) SysFreeString(fileName);
 			return E_FAIL;
 		}
 
@@ -253,8 +346,13 @@ HRESULT WINAPI CPeEmulator::EmulatePeFile(__in IPeFile *peFile, __in DWORD_PTR r
 			uc_close(m_engine);
 			m_engine = NULL;
 			fileStream->Release();
+			if (fileName) SysFreeString(fileName);
 			return hr;
 		}
+		CEmulRunScope run(this, fileName, TRUE);
+		if (fileName) SysFreeString(fileName);
+		fileName = NULL;
+		if (m_profile) m_profile->AddRegion("header", ntHeader.OptionalHeader.ImageBase, ntHeader.OptionalHeader.SizeOfHeaders);
 
 		// map memory for this emulation
 		err = uc_mem_map(m_engine, ntHeader.OptionalHeader.ImageBase, ntHeader.OptionalHeader.SizeOfImage, UC_PROT_ALL);
@@ -263,6 +361,7 @@ HRESULT WINAPI CPeEmulator::EmulatePeFile(__in IPeFile *peFile, __in DWORD_PTR r
 			hr = E_FAIL;
 			goto Exit;
 		}
+		if (m_recorder) m_recorder->OnMap(ntHeader.OptionalHeader.ImageBase, ntHeader.OptionalHeader.SizeOfImage, UC_PROT_ALL);
 		DWORD SizeOfImage = CPeFileParser::SectionAlign(ntHeader.OptionalHeader.SizeOfImage, ntHeader.OptionalHeader.SectionAlignment);
 		err = uc_mem_map(m_engine, ntHeader.OptionalHeader.ImageBase + SizeOfImage, ntHeader.OptionalHeader.SizeOfStackReserve, UC_PROT_READ | UC_PROT_WRITE);
 		if (err != UC_ERR_OK)
@@ -270,6 +369,7 @@ HRESULT WINAPI CPeEmulator::EmulatePeFile(__in IPeFile *peFile, __in DWORD_PTR r
 			hr = E_FAIL;
 			goto Exit;
 		}
+		if (m_recorder) m_recorder->OnMap(ntHeader.OptionalHeader.ImageBase + SizeOfImage, ntHeader.OptionalHeader.SizeOfStackReserve, UC_PROT_READ | UC_PROT_WRITE);
 
 		DWORD r_esp = (DWORD)ntHeader.OptionalHeader.ImageBase + SizeOfImage + ntHeader.OptionalHeader.SizeOfStackCommit;
 		err = uc_reg_write(m_engine, UC_X86_REG_ESP, &r_esp);
@@ -353,6 +453,14 @@ HRESULT WINAPI CPeEmulator::EmulatePeFile(__in IPeFile *peFile, __in DWORD_PTR r
 			delete[] tmp;
 			tmp = NULL;
 
+			if (m_profile)
+			{
+				CHAR name[IMAGE_SIZEOF_SHORT_NAME + 1] = {};
+				memcpy(name, section.Name, IMAGE_SIZEOF_SHORT_NAME);
+				m_profile->AddRegion(name, ntHeader.OptionalHeader.ImageBase + section.VirtualAddress,
+					CPeFileParser::SectionAlign(section.Misc.VirtualSize, ntHeader.OptionalHeader.SectionAlignment));
+			}
+
 			uint32_t perms = 0;
 			perms |= TEST_FLAG(section.Characteristics, IMAGE_SCN_MEM_EXECUTE) ? UC_PROT_EXEC  : 0;
 			perms |= TEST_FLAG(section.Characteristics, IMAGE_SCN_MEM_READ)    ? UC_PROT_READ  : 0;
@@ -363,6 +471,7 @@ HRESULT WINAPI CPeEmulator::EmulatePeFile(__in IPeFile *peFile, __in DWORD_PTR r
 				hr = E_FAIL;
 				goto Exit;
 			}
+			if (m_recorder) m_recorder->OnProtect(ntHeader.OptionalHeader.ImageBase + section.VirtualAddress, CPeFileParser::SectionAlign(section.Misc.VirtualSize, ntHeader.OptionalHeader.SectionAlignment), perms);
 		}
 
 		uint64_t begin = 0;
@@ -391,36 +500,30 @@ HRESULT WINAPI CPeEmulator::EmulatePeFile(__in IPeFile *peFile, __in DWORD_PTR r
 			}
 		}
 
-		// emulate machine code in infinite time
-		err = uc_emu_start(m_engine, begin, begin + nNumberOfBytesToEmulate - 1, 0, 0);
+		if (m_recorder) m_recorder->Start(m_engine, begin, begin + nNumberOfBytesToEmulate - 1);
+
+		// emulate machine code until it ends or the deadline is reached
+		GetTimeout(&timeout);
+		err = uc_emu_start(m_engine, begin, begin + nNumberOfBytesToEmulate - 1, timeout, 0);
 			
 		hr = (err == UC_ERR_OK) ? S_OK : E_FAIL;
+		if (err == UC_ERR_OK && !GetTimeout(&timeout))
+			hr = HRESULT_FROM_WIN32(ERROR_TIMEOUT);
 
 	Exit:
-		OnStopped();
-		uc_close(m_engine);
-		m_engine = NULL;
 		fileStream->Release();
 		return hr;
 	}
 	catch (...)
 	{
-		if (m_starting)
+		// a run that started is ended by its scope
+		OnError(IEmulObserver::EmulatorInternalError);
+		if (m_starting) OnStopped();
+		if (m_engine)
 		{
-			OnError(IEmulObserver::EmulatorInternalError);
-			OnStopped();
-			if (m_engine)
-			{
-				uc_close(m_engine);
-				m_engine = NULL;
-			}
-		}
-		else
-		{
-			OnError(IEmulObserver::EmulatorInternalError);
+			uc_close(m_engine);
 			m_engine = NULL;
 		}
-
 		return E_FAIL;
 	}
 }
@@ -512,4 +615,63 @@ HRESULT WINAPI CPeEmulator::StopEmulator(void)
 {
 	if (m_engine == NULL) return E_NOT_VALID_STATE;
 	return (UC_ERR_OK == uc_emu_stop(m_engine)) ? S_OK : E_FAIL;
+}
+
+HRESULT WINAPI CPeEmulator::EmulateTrace(__in LPCWSTR lpTraceFile)
+{
+	HRESULT hr;
+	if (lpTraceFile == NULL) return E_INVALIDARG;
+
+	if (FAILED(hr = AcquireRuntime()))
+		return hr;
+
+	CEmulTrace trace;
+	if (FAILED(hr = trace.Load(lpTraceFile)))
+		return hr;
+
+	try
+	{
+		uc_err err = uc_open(trace.GetArch(), trace.GetMode(), &m_engine);
+		if (err != UC_ERR_OK) {
+			OnError(IEmulObserver::EmulatorIsNotRunable);
+			return E_FAIL;
+		}
+
+		if (FAILED(hr = OnStarting()))
+		{
+			uc_close(m_engine);
+			m_engine = NULL;
+			return hr;
+		}
+		// a replay is not recorded again
+		CEmulRunScope run(this, lpTraceFile, FALSE);
+
+		// the recorded run is replayed for exactly as many instructions
+		hr = trace.Apply(m_engine);
+		if (SUCCEEDED(hr))
+		{
+			// a run that ended on an access to unmapped memory ends there again
+			err = uc_emu_start(m_engine, trace.GetBegin(), trace.GetUntil(), 0, (size_t)trace.GetInstructionCount());
+			hr = (err == UC_ERR_OK || trace.IsRecordedStop()) ? S_OK : E_FAIL;
+		}
+		return hr;
+	}
+	catch (...)
+	{
+		// a run that started is ended by its scope
+		OnError(IEmulObserver::EmulatorInternalError);
+		if (m_starting) OnStopped();
+		if (m_engine)
+		{
+			uc_close(m_engine);
+			m_engine = NULL;
+		}
+		return E_FAIL;
+	}
+}
+
+HRESULT WINAPI CPeEmulator::SetDeadline(__in ULONGLONG deadline)
+{
+	m_deadline = deadline;
+	return S_OK;
 }
\ No newline at end of file
@@ -1,48 +1,44 @@
 #pragma once
 #include <TinyAvCore.h>
-
-#ifndef DYNLOAD
-#define DYNLOAD
-#endif
-
-// windows specific
-#ifdef _MSC_VER
-#include <io.h>
-#include <windows.h>
-#define PRIx64 "llx"
-#ifdef DYNLOAD
-#include "unicorn_dynload.h"
-#else // DYNLOAD
-#include <unicorn/unicorn.h>
-#ifdef _WIN64
-#pragma comment(lib, "unicorn_staload64.lib")
-#else // _WIN64
-#pragma comment(lib, "unicorn_staload.lib")
-#endif // _WIN64
-#endif // DYNLOAD
-
-// posix specific
-#else // _MSC_VER
-#include <unistd.h>
-#include <inttypes.h>
-#include <unicorn/unicorn.h>
-#endif // _MSC_VER
+#include "EmulRuntime.h"
 #include <vector>
 
+class CEmulProfile;
+class CEmulTraceRecorder;
+class CEmulRunScope;
+
 class CPeEmulator 
 	: public CRefCount
 	, public IEmulator
 {
 protected:
 	bool		m_starting;
-	bool        m_bEmulatorEngineReady;
+	bool        m_runtimeHeld;	// a reference on CEmulRuntime is taken
 	uc_engine * m_engine;
 	std::vector<IEmulObserver * > m_Observers;
 
+	// hot-spot profile of the current run, NULL unless profiling is enabled
+	CEmulProfile * m_profile;
+	uc_hook		m_profileHook;
+
+	// trace of the current run, NULL unless recording is enabled
+	CEmulTraceRecorder * m_recorder;
+
+	// GetTickCount64() value to stop the runs at, 0 for no limit
+	ULONGLONG	m_deadline;
+
 private:
 	HRESULT WINAPI OnStarting(void);
 	void WINAPI    OnError(__in DWORD const dwErrorCode);
 	HRESULT WINAPI OnStopped(void);
+	void WINAPI    BeginProfile(__in_opt LPCWSTR fileName);
+	void WINAPI    EndProfile(void);
+	static void    HookBlock(uc_engine *uc, uint64_t address, uint32_t size, void *user_data);
+	void WINAPI    EndTrace(void);
+	BOOL WINAPI    GetTimeout(__out uint64_t * timeout);
+	HRESULT WINAPI AcquireRuntime(void);
+
+	friend class CEmulRunScope;
 
 protected:
 	virtual ~CPeEmulator();
@@ -78,4 +74,8 @@ public:
 
 	virtual HRESULT WINAPI StopEmulator(void) override;
 
+	virtual HRESULT WINAPI EmulateTrace(__in LPCWSTR lpTraceFile) override;
+
+	virtual HRESULT WINAPI SetDeadline(__in ULONGLONG deadline) override;
+
 };
\ No newline at end of file
@@ -1,13 +1,153 @@
 #include "BufferedStream.h"
+#include "..\Scanner\MemoryGovernor.h"
 
 CBufferedStream::CBufferedStream(void) :
 	m_FileSize(0),
-	m_CurrPos(0)
+	m_CurrPos(0),
+	m_firstSize(0),
+	m_charged(0),
+	m_hSpill(INVALID_HANDLE_VALUE)
 {
 }
 
 CBufferedStream::~CBufferedStream(void)
 {
+	FreeChunks(0);
+	if (m_hSpill != INVALID_HANDLE_VALUE)
+		CloseHandle(m_hSpill);
+}
+
+// Charge the governor with the bytes of the chunks
+void CBufferedStream::Recharge(void)
+{
+	size_t capacity = (size_t)GetCapacity();
+	CMemoryGovernor::GetInstance()->Charge(MemoryArchive, (LONG64)capacity - (LONG64)m_charged);
+	m_charged = capacity;
+}
+
+ULONGLONG CBufferedStream::GetCapacity(void)
+{
+	if (m_chunks.empty()) return 0;
+	return (ULONGLONG)m_firstSize + (ULONGLONG)(m_chunks.size() - 1) * BUFFERED_CHUNK_SIZE;
+}
+
+// Address of the byte at pos, which must be under the capacity, and the
+// number of bytes from it to the end of its chunk
+BYTE * CBufferedStream::Locate(__in ULONGLONG pos, __out size_t * available)
+{
+	if (pos < m_firstSize)
+	{
+		*available = m_firstSize - (size_t)pos;
+		return m_chunks[0] + (size_t)pos;
+	}
+
+	pos -= m_firstSize;
+	size_t offset = (size_t)(pos % BUFFERED_CHUNK_SIZE);
+	*available = BUFFERED_CHUNK_SIZE - offset;
+	return m_chunks[1 + (size_t)(pos / BUFFERED_CHUNK_SIZE)] + offset;
+}
+
+void CBufferedStream::FreeChunks(__in size_t keep)
+{
+	for (size_t i = keep; i < m_chunks.size(); i++)
+		delete[] m_chunks[i];
+	if (keep < m_chunks.size())
+		m_chunks.resize(keep);
+	if (keep == 0)
+		m_firstSize = 0;
+	Recharge();
+}
+
+HRESULT CBufferedStream::Reserve(__in ULONGLONG size)
+{
+	if (size == 0 || size > BUFFERED_RESERVE_MAX) return S_FALSE;
+	if (!m_chunks.empty() || m_hSpill != INVALID_HANDLE_VALUE) return S_FALSE;
+
+	// the size is only declared: it must not make the stream spill before
+	// anything is written, the writes decide that
+	CMemoryGovernor * governor = CMemoryGovernor::GetInstance();
+	if (governor->IsEnabled() && (governor->IsUnderPressure() || !governor->Fits(size)))
+		return S_FALSE;
+
+	BYTE * chunk = new BYTE[(size_t)size];
+	if (chunk == NULL) return E_OUTOFMEMORY;
+	m_chunks.push_back(chunk);
+	m_firstSize = (size_t)size;
+	Recharge();
+	return S_OK;
+}
+
+// Make room for size bytes, in memory or, near the memory limit, in a temporary file
+HRESULT CBufferedStream::Grow(__in ULONGLONG size)
+{
+	CMemoryGovernor * governor = CMemoryGovernor::GetInstance();
+	if (governor->IsEnabled() && size >= GOVERNOR_SPILL_MIN_SIZE && size > m_charged &&
+		(governor->IsUnderPressure() || !governor->Fits(size - m_charged)) &&
+		SUCCEEDED(Spill()))
+		return S_OK;
+
+	HRESULT hr = S_OK;
+	if (m_chunks.empty())
+	{
+		// without a reservation the first chunk holds the first write
+		size_t firstSize = (size_t)((size + BUFFERED_MIN_CHUNK - 1) / BUFFERED_MIN_CHUNK * BUFFERED_MIN_CHUNK);
+		BYTE * chunk = new BYTE[firstSize];
+		if (chunk == NULL) return E_OUTOFMEMORY;
+		m_chunks.push_back(chunk);
+		m_firstSize = firstSize;
+	}
+	while (GetCapacity() < size)
+	{
+		BYTE * chunk = new BYTE[BUFFERED_CHUNK_SIZE];
+		if (chunk == NULL)
+		{
+			hr = E_OUTOFMEMORY;
+			break;
+		}
+		m_chunks.push_back(chunk);
+	}
+	Recharge();
+	return hr;
+}
+
+// Move the data to a temporary file and free the memory
+HRESULT CBufferedStream::Spill(void)
+{
+	if (m_hSpill != INVALID_HANDLE_VALUE) return S_OK;
+
+	WCHAR szTempDir[MAX_PATH], szTempFile[MAX_PATH];
+	if (GetTempPathW(MAX_PATH, szTempDir) == 0 ||
+		GetTempFileNameW(szTempDir, L"tav", 0, szTempFile) == 0)
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	HANDLE hSpill = CreateFileW(szTempFile, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if (hSpill == INVALID_HANDLE_VALUE)
+	{
+		HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		DeleteFileW(szTempFile);
+		return hr;
+	}
+
+	ULONGLONG done = 0;
+	while (done < m_FileSize)
+	{
+		DWORD written = 0;
+		size_t available = 0;
+		const BYTE * data = Locate(done, &available);
+		DWORD chunk = (DWORD)min((ULONGLONG)available, m_FileSize - done);
+		if (!WriteFile(hSpill, data, chunk, &written, NULL) || written != chunk)
+		{
+			HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+			CloseHandle(hSpill);
+			return FAILED(hr) ? hr : E_FAIL;
+		}
+		done += written;
+	}
+
+	FreeChunks(0);
+	m_hSpill = hSpill;
+	return S_OK;
 }
 
 HRESULT WINAPI CBufferedStream::QueryInterface(
@@ -39,7 +179,34 @@ HRESULT WINAPI CBufferedStream::Read(__out_bcount(bufferSize) LPVOID buffer, __i
 	if (readSize) *readSize = (ULONG)copySize;
 	if (copySize == 0) return E_NOT_VALID_STATE;
 
-	memcpy(buffer, &m_DataStream[(size_t)m_CurrPos], (size_t)copySize);
+	if (m_hSpill != INVALID_HANDLE_VALUE)
+	{
+		LARGE_INTEGER pos;
+		DWORD bytesRead = 0;
+		pos.QuadPart = (LONGLONG)m_CurrPos;
+		if (!SetFilePointerEx(m_hSpill, pos, NULL, FILE_BEGIN) ||
+			!ReadFile(m_hSpill, buffer, (DWORD)copySize, &bytesRead, NULL) || bytesRead != copySize)
+		{
+			if (readSize) *readSize = 0;
+			return E_FAIL;
+		}
+	}
+	else
+	{
+		BYTE * out = (BYTE *)buffer;
+		ULONGLONG pos = m_CurrPos;
+		size_t left = (size_t)copySize;
+		while (left)
+		{
+			size_t available = 0;
+			const BYTE * data = Locate(pos, &available);
+			size_t count = min(available, left);
+			memcpy(out, data, count);
+			out += count;
+			pos += count;
+			left -= count;
+		}
+	}
 	m_CurrPos += copySize;
 
 	return S_OK;
@@ -57,35 +224,46 @@ HRESULT WINAPI CBufferedStream::ReadAt(
 HRESULT WINAPI CBufferedStream::Write(__in_bcount(bufferSize) LPCVOID buffer, __in ULONG bufferSize, __out_opt ULONG * writtenSize)
 {
 	if (buffer == NULL || bufferSize == 0) return E_INVALIDARG;
+	if (writtenSize) *writtenSize = 0;
+	if (m_CurrPos > m_FileSize) return E_NOT_VALID_STATE;
 
-	if (m_CurrPos == m_FileSize)
+	ULONGLONG endPos = m_CurrPos + (ULONGLONG)bufferSize;
+	if (m_hSpill == INVALID_HANDLE_VALUE && endPos > GetCapacity())
 	{
-		m_DataStream.insert(m_DataStream.end(), bufferSize, 0);
-		memcpy(&m_DataStream[(size_t)m_CurrPos], buffer, bufferSize);
-		m_FileSize = m_CurrPos = m_CurrPos + (ULONGLONG)bufferSize;
-		if (*writtenSize) *writtenSize = bufferSize;
-		return S_OK;
+		HRESULT hr = Grow(endPos);
+		if (FAILED(hr)) return hr;
 	}
-	else if (m_CurrPos < m_FileSize)
+
+	if (m_hSpill != INVALID_HANDLE_VALUE)
 	{
-		if ((m_CurrPos + (ULONGLONG)bufferSize) <= m_FileSize)
-		{
-			memcpy(&m_DataStream[(size_t)m_CurrPos], buffer, bufferSize);
-			m_CurrPos += (ULONGLONG)bufferSize;
-			if (*writtenSize) *writtenSize = bufferSize;
-			return S_OK;
-		}
-		else
+		LARGE_INTEGER pos;
+		DWORD written = 0;
+		pos.QuadPart = (LONGLONG)m_CurrPos;
+		if (!SetFilePointerEx(m_hSpill, pos, NULL, FILE_BEGIN) ||
+			!WriteFile(m_hSpill, buffer, bufferSize, &written, NULL) || written != bufferSize)
+			return E_FAIL;
+	}
+	else
+	{
+		const BYTE * in = (const BYTE *)buffer;
+		ULONGLONG pos = m_CurrPos;
+		size_t left = bufferSize;
+		while (left)
 		{
-			m_DataStream.insert(m_DataStream.end(), (size_t)(m_CurrPos + (ULONGLONG)bufferSize - m_FileSize), 0);
-			memcpy(&m_DataStream[(size_t)m_CurrPos], buffer, bufferSize);
-			m_FileSize = m_CurrPos = m_CurrPos + (ULONGLONG)bufferSize;
-			if (*writtenSize) *writtenSize = bufferSize;
-			return S_OK;
+			size_t available = 0;
+			BYTE * data = Locate(pos, &available);
+			size_t count = min(available, left);
+			memcpy(data, in, count);
+			in += count;
+			pos += count;
+			left -= count;
 		}
 	}
 
-	return E_NOT_VALID_STATE;
+	m_CurrPos = endPos;
+	if (endPos > m_FileSize) m_FileSize = endPos;
+	if (writtenSize) *writtenSize = bufferSize;
+	return S_OK;
 }
 
 HRESULT WINAPI CBufferedStream::WriteAt(
@@ -138,15 +316,36 @@ void WINAPI CBufferedStream::SetFileHandle(__in void* const handle)
 {
 	if ((HANDLE)handle == INVALID_HANDLE_VALUE || handle == NULL)
 	{
-		m_DataStream.clear();
+		FreeChunks(0);
+		if (m_hSpill != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(m_hSpill);
+			m_hSpill = INVALID_HANDLE_VALUE;
+		}
 		m_FileSize = m_CurrPos = 0;
 	}
 }
 
 HRESULT WINAPI CBufferedStream::Shrink(void)
 {
-	m_DataStream.resize((size_t)m_CurrPos);
-	m_FileSize = m_DataStream.size();
+	if (m_hSpill != INVALID_HANDLE_VALUE)
+	{
+		LARGE_INTEGER pos;
+		pos.QuadPart = (LONGLONG)m_CurrPos;
+		if (!SetFilePointerEx(m_hSpill, pos, NULL, FILE_BEGIN) || !SetEndOfFile(m_hSpill))
+			return HRESULT_FROM_WIN32(GetLastError());
+	}
+	else
+	{
+		// keep the chunks up to the new end
+		size_t keep = 0;
+		if (m_CurrPos > m_firstSize)
+			keep = 1 + (size_t)((m_CurrPos - m_firstSize + BUFFERED_CHUNK_SIZE - 1) / BUFFERED_CHUNK_SIZE);
+		else if (m_CurrPos)
+			keep = 1;
+		FreeChunks(keep);
+	}
+	m_FileSize = m_CurrPos;
 	m_CurrPos--;
 	return S_OK;
 }
@@ -2,6 +2,16 @@
 #include <TinyAvCore.h>
 #include <vector>
 
+#define BUFFERED_CHUNK_SIZE		(64 * 1024)			// size of the chunks after the first one
+#define BUFFERED_MIN_CHUNK		(4 * 1024)			// the first chunk is a multiple of it
+#define BUFFERED_RESERVE_MAX	(64 * 1024 * 1024)	// larger declared sizes grow by chunks
+
+// Stream held in memory, such as an inflated archive member. Near the memory
+// limit, streams from GOVERNOR_SPILL_MIN_SIZE move to a temporary file that
+// is deleted when the stream is released.
+// The data is kept in chunks that are never moved: the first one is sized by
+// Reserve() or by the first write, the next ones are BUFFERED_CHUNK_SIZE.
+// A stream that grows allocates a chunk instead of copying what it holds.
 class CBufferedStream :
 	public CRefCount,
 	public IFsStream
@@ -9,11 +19,32 @@ class CBufferedStream :
 protected:
 	ULONGLONG			m_FileSize;
 	ULONGLONG			m_CurrPos;
-	std::vector<BYTE>	m_DataStream;
+	std::vector<BYTE*>	m_chunks;
+	size_t				m_firstSize;	// size of m_chunks[0]
+	size_t				m_charged;	// bytes charged to the memory governor
+	HANDLE				m_hSpill;	// temporary file holding the data once spilled
 	virtual ~CBufferedStream(void);
+
+	HRESULT Grow(__in ULONGLONG size);
+	HRESULT Spill(void);
+	void Recharge(void);
+
+	ULONGLONG GetCapacity(void);
+	BYTE * Locate(__in ULONGLONG pos, __out size_t * available);
+
+	// Free the chunks from the index keep
+	void FreeChunks(__in size_t keep);
 public:
 	CBufferedStream(void);
 
+	/* Allocate the whole stream at once when its size is known, such as the
+	declared size of an archive member. Sizes past BUFFERED_RESERVE_MAX or the
+	memory limit are not reserved; the stream then grows as it is written.
+	@size: expected size of the stream in bytes
+	@return: S_OK if reserved, S_FALSE if not, or other value on failure.
+	*/
+	HRESULT Reserve(__in ULONGLONG size);
+
 	// implement IUnknown Interface 
 	DECLARE_REF_COUNT();
 	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
@@ -35,4 +66,7 @@ public:
 
 	virtual HRESULT WINAPI Shrink(void) override;
 
+	BOOL IsSpilled(void) { return m_hSpill != INVALID_HANDLE_VALUE; }
+
+	size_t GetChunkCount(void) { return m_chunks.size(); }
 };
@@ -0,0 +1,77 @@
+#include "ByteName.h"
+
+CByteName::CByteName()
+{
+	m_inline[0] = '\0';
+	m_data = m_inline;
+	m_length = 0;
+	m_capacity = BYTE_NAME_INLINE_SIZE;
+}
+
+CByteName::~CByteName()
+{
+	if (m_data != m_inline)
+		delete[] m_data;
+}
+
+HRESULT CByteName::Reserve(__in ULONG length)
+{
+	if (length >= MAXLONG) return E_INVALIDARG;
+	if (length < m_capacity) return S_OK;
+
+	CHAR * data = new CHAR[length + 1];
+	if (data == NULL) return E_OUTOFMEMORY;
+	if (m_data != m_inline)
+		delete[] m_data;
+	m_data = data;
+	m_capacity = length + 1;
+	m_length = 0;
+	m_data[0] = '\0';
+	return S_OK;
+}
+
+HRESULT CByteName::Assign(__in const BYTE_NAME_VIEW & view)
+{
+	if (view.data == NULL && view.length) return E_INVALIDARG;
+
+	HRESULT hr = Reserve(view.length);
+	if (FAILED(hr)) return hr;
+	if (view.length)
+		memcpy(m_data, view.data, view.length);
+	SetLength(view.length);
+	return S_OK;
+}
+
+void CByteName::SetLength(__in ULONG length)
+{
+	m_length = min(length, m_capacity - 1);
+	m_data[m_length] = '\0';
+}
+
+void CByteName::Clear(void)
+{
+	SetLength(0);
+}
+
+HRESULT CByteName::ToUnicode(__in const BYTE_NAME_VIEW & view, __in UINT codePage, __out StringW * str, __in BOOL strict)
+{
+	if (str == NULL) return E_INVALIDARG;
+	str->clear();
+	if (view.length == 0) return S_OK;
+	if (view.data == NULL || view.length >= MAXLONG) return E_INVALIDARG;
+
+	DWORD dwFlags = (codePage == CP_UTF8 && strict) ? MB_ERR_INVALID_CHARS : 0;
+	int nRequired = MultiByteToWideChar(codePage, dwFlags, view.data, (int)view.length, NULL, 0);
+	if (nRequired == 0) return HRESULT_FROM_WIN32(GetLastError());
+
+	// convert in place: the string owns the only buffer
+	str->resize(nRequired);
+	nRequired = MultiByteToWideChar(codePage, dwFlags, view.data, (int)view.length, &(*str)[0], nRequired);
+	if (nRequired == 0)
+	{
+		str->clear();
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	str->resize(nRequired);
+	return S_OK;
+}
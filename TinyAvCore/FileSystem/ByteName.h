@@ -0,0 +1,57 @@
+#pragma once
+#include <TinyAvCore.h>
+
+#define BYTE_NAME_INLINE_SIZE	(128)	// names shorter than this need no allocation
+
+// Bytes of a name owned by someone else, not terminated
+typedef struct BYTE_NAME_VIEW
+{
+	LPCSTR	data;
+	ULONG	length;
+}BYTE_NAME_VIEW;
+
+// Name of an archive member as the archive stores it. The bytes are only
+// converted when a wide name is needed for the scan observers, and short
+// names live inside the object.
+class CByteName
+{
+protected:
+	CHAR	m_inline[BYTE_NAME_INLINE_SIZE];
+	CHAR *	m_data;			// m_inline, or a heap buffer of m_capacity bytes
+	ULONG	m_length;
+	ULONG	m_capacity;
+
+public:
+	CByteName();
+	virtual ~CByteName();
+
+	// Make room for a name of length bytes and its terminator; the content is lost
+	HRESULT Reserve(__in ULONG length);
+
+	HRESULT Assign(__in const BYTE_NAME_VIEW & view);
+
+	// Set the length after the bytes were written to Buffer()
+	void SetLength(__in ULONG length);
+
+	void Clear(void);
+
+	CHAR * Buffer(void) { return m_data; }
+	ULONG Capacity(void) const { return m_capacity; }
+	LPCSTR c_str(void) const { return m_data; }
+	ULONG length(void) const { return m_length; }
+	BOOL empty(void) const { return m_length == 0; }
+	BYTE_NAME_VIEW View(void) const { BYTE_NAME_VIEW view = { m_data, m_length }; return view; }
+
+	/* Convert bytes into a wide string, in a single allocation of the result
+	@view: bytes to convert
+	@codePage: code page of the bytes
+	@str: a pointer to a variable storing the wide string
+	@strict: fail on bytes that are not UTF-8 when codePage is CP_UTF8, instead of replacing them with U+FFFD
+	@return: HRESULT on success, or other value on failure.
+	*/
+	static HRESULT ToUnicode(__in const BYTE_NAME_VIEW & view, __in UINT codePage, __out StringW * str, __in BOOL strict = TRUE);
+
+private:
+	CByteName(const CByteName &);
+	CByteName & operator=(const CByteName &);
+};
@@ -1,6 +1,7 @@
 #include "FileFs.h"
 #include "FileFsAttribute.h"
 #include "FileFsStream.h"
+#include "..\Scanner\StageCounters.h"
 
 CFileFs::CFileFs()
 {
@@ -10,6 +11,7 @@ CFileFs::CFileFs()
 	m_error = 0;
 	m_attribute = static_cast<IFsAttribute*> (new CFileFsAttribute());
 	m_stream = static_cast<IFsStream*> (new CFileFsStream());
+	m_attached = NULL;
 	m_delimiter = StringW(L"\\");
 	m_fsType = IFsType::basic;
 }
@@ -36,6 +38,12 @@ CFileFs::~CFileFs()
 		m_stream = NULL;
 	}
 
+	if (m_attached)
+	{
+		m_attached->Release();
+		m_attached = NULL;
+	}
+
 	if (m_container)
 	{
 		m_container->Release();
@@ -68,6 +76,12 @@ HRESULT WINAPI CFileFs::QueryInterface(
 
 	else if (IsEqualIID(riid, __uuidof(IFsStream)))
 	{
+		if (m_attached)
+		{
+			m_attached->AddRef();
+			*ppvObject = static_cast<IFsStream*>(m_attached);
+			return S_OK;
+		}
 		if (m_stream == NULL) return E_NOT_SET;
 		m_stream->AddRef();
 		*ppvObject = static_cast<IFsStream*>(m_stream);
@@ -89,6 +103,7 @@ HRESULT WINAPI CFileFs::Create(__in LPCWSTR lpFileName, __in ULONG const flags)
 {
 	if (!m_FileName.empty()) return E_NOT_VALID_STATE;
 	if (lpFileName == NULL || _tcslen(lpFileName) == 0) return E_INVALIDARG;
+	CStageScope stage(StageOpen);
 	m_FileName = lpFileName;
 	BSTR fullPath;
 	HRESULT hr = GetFullPath(&fullPath);
@@ -148,7 +163,12 @@ HRESULT WINAPI CFileFs::Create(__in LPCWSTR lpFileName, __in ULONG const flags)
 			BOOL deferredCreation = TEST_FLAG(m_flags, fsDeferredCreation);
 			if (!deferredCreation)
 			{
-				dwFlagsAndAttributes |= FILE_FLAG_SEQUENTIAL_SCAN;
+				// without the cache, this handle only serves the small reads
+				// at random offsets; the large ones have a handle of their own
+				if (TEST_FLAG(m_flags, fsRandomAccess) || TEST_FLAG(m_flags, fsNoCache))
+					dwFlagsAndAttributes |= FILE_FLAG_RANDOM_ACCESS;
+				else
+					dwFlagsAndAttributes |= FILE_FLAG_SEQUENTIAL_SCAN;
 
 				m_handle = CreateFileW(fullPath, dwDesiredAccess, dwShareMode,
 					NULL, dwCreationDisposition, dwFlagsAndAttributes, NULL);
@@ -157,7 +177,11 @@ HRESULT WINAPI CFileFs::Create(__in LPCWSTR lpFileName, __in ULONG const flags)
 					hr = HRESULT_FROM_WIN32(GetLastError());
 
 				if (SUCCEEDED(hr))
+				{
 					m_stream->SetFileHandle((void*)m_handle);
+					if (TEST_FLAG(m_flags, fsNoCache))
+						static_cast<CFileFsStream*>(m_stream)->OpenDirect(fullPath);
+				}
 			}
 			else
 			{
@@ -371,4 +395,12 @@ HRESULT WINAPI CFileFs::DeferredDelete(void)
 {
 	m_flags |= fsDeferredDeletion;
 	return S_OK;
+}
+
+HRESULT WINAPI CFileFs::AttachStream(__in_opt IFsStream * stream)
+{
+	if (stream) stream->AddRef();
+	if (m_attached) m_attached->Release();
+	m_attached = stream;
+	return S_OK;
 }
\ No newline at end of file
@@ -14,6 +14,7 @@ protected:
 	ULONG			m_fsType;
 	IFsAttribute *	m_attribute;
 	IFsStream *		m_stream;
+	IFsStream *		m_attached;	// read through instead of m_stream, see AttachStream()
 	IVirtualFs *		m_container;
 
 	virtual ~CFileFs();
@@ -56,4 +57,6 @@ public:
 
 	virtual HRESULT WINAPI DeferredDelete(void) override;
 
+	virtual HRESULT WINAPI AttachStream(__in_opt IFsStream * stream) override;
+
 };
\ No newline at end of file
@@ -2,16 +2,34 @@
 #include  <algorithm>
 #include "FileFs.h"
 #include "FileFsEnumContext.h"
+#include "..\Scanner\StageCounters.h"
+#include "..\Scanner\VerdictStamps.h"
+#include "..\Scanner\DirectoryCosts.h"
+#include "carve\CarveFsEnum.h"
 
 CFileFsEnum::CFileFsEnum()
 {
 	m_findHandle = INVALID_HANDLE_VALUE;
 	ZeroMemory(&m_wfd, sizeof(m_wfd));
 	m_hStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_trackVisited = FALSE;
+	m_stamps = NULL;
+	m_costs = NULL;
 }
 
 CFileFsEnum::~CFileFsEnum()
 {
+	if (m_stamps)
+	{
+		m_stamps->Release();
+		m_stamps = NULL;
+	}
+	if (m_costs)
+	{
+		m_costs->Release();
+		m_costs = NULL;
+	}
+
 	size_t i, n;
 	n = m_Observers.size();
 	for (i = 0; i < n; i++)
@@ -118,6 +136,9 @@ HRESULT WINAPI CFileFsEnum::Enum(__in IFsEnumContext *context)
 {
 	if (context == NULL) return E_INVALIDARG;
 
+	// the walk itself; the files it finds are charged to their own stages
+	CStageScope stage(StageEnumerate);
+
 	// Use linked-list to store stack of found directories
 	std::stack<DIRPATH> dirStack;
 
@@ -160,6 +181,8 @@ HRESULT WINAPI CFileFsEnum::Enum(__in IFsEnumContext *context)
 	SysFreeString(searchContainerPath);
 	searchContainerPath = NULL;
 
+	m_visited.Clear();
+	m_trackVisited = TRUE;
 	InitArchiveObservers();
 	if (EnumInit())
 	{
@@ -191,6 +214,14 @@ HRESULT WINAPI CFileFsEnum::Enum(__in IFsEnumContext *context)
 				continue;
 			}
 
+			// The same directory can be reached again through a junction, a
+			// symbolic link or a mounted folder; walk it only once.
+			if (IsDirectoryVisited(currentDirInfo.path.c_str()))
+			{
+				OnError(FsEnumDuplicate, currentDirInfo.path.c_str());
+				continue;
+			}
+
 			// Start enumerate files and sub-directories of the current search directory
 			fullPath = MakePath(currentDirInfo.path.c_str(), searchPattern);
 			if (!EnumFirstFile(fullPath.c_str()))
@@ -216,6 +247,14 @@ HRESULT WINAPI CFileFsEnum::Enum(__in IFsEnumContext *context)
 					continue;	// Skip parent dir and current dir
 				fullPath = MakePath(currentDirInfo.path.c_str(), m_wfd.cFileName);
 
+				// Skip directory links and junctions unless asked to follow them.
+				// A file link is scanned: its target is opened like any file.
+				if (TEST_FLAG(m_wfd.dwFileAttributes, FILE_ATTRIBUTE_DIRECTORY) &&
+					TEST_FLAG(m_wfd.dwFileAttributes, FILE_ATTRIBUTE_REPARSE_POINT) &&
+					(m_wfd.dwReserved0 == IO_REPARSE_TAG_SYMLINK || m_wfd.dwReserved0 == IO_REPARSE_TAG_MOUNT_POINT) &&
+					!TEST_FLAG(context->GetFlags(), IFsEnumContext::FollowLinks))
+					continue;
+
 				if (TEST_FLAG(m_wfd.dwFileAttributes, FILE_ATTRIBUTE_DIRECTORY))
 				{
 					// Add sub-directory to search stack
@@ -252,6 +291,8 @@ HRESULT WINAPI CFileFsEnum::Enum(__in IFsEnumContext *context)
 		}
 	}
 
+	m_trackVisited = FALSE;
+	if (m_costs) m_costs->Flush();
 	SysFreeString(searchPattern);
 	CleanupArchiveObservers();
 	if (searchContainer) searchContainer->Release();
@@ -265,6 +306,10 @@ HRESULT WINAPI CFileFsEnum::OnFileFound(__in IVirtualFs *file, __in IFsEnumConte
 	HRESULT	hr = S_OK;
 	BOOL bOver = FALSE;
 
+	// the file that contains this one is out of time
+	if (IsPastDeadline(context))
+		return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+
 	if (SUCCEEDED(IsFileTooLarge(file, context, &bOver)) && bOver)
 		return E_OUTOFMEMORY;
 
@@ -293,7 +338,7 @@ HRESULT WINAPI CFileFsEnum::OnFileFound(__in IVirtualFs *file, __in IFsEnumConte
 	if (FAILED(hr)) return hr;
 
 	// Enum by archivers
-	EnumByArchivers(file, context, currentDepth, context->GetDepthInArchive());
+	EnumByArchivers(file, context, currentDepth, context->GetDepthInArchive(), FALSE);
 	return S_OK;
 }
 
@@ -360,7 +405,24 @@ HRESULT WINAPI CFileFsEnum::OnEnumEntryFound(__in IVirtualFs * container, __in L
 	HRESULT	hr = S_OK;
 	BOOL bOver = FALSE;
 
-	if (SUCCEEDED(IsFileTooLarge(container, fileName, context, &bOver)) && bOver)
+	// A deadline covers one file. The observer that scans it sets a new one.
+	context->SetDeadline(0);
+	CDirectoryCostScope cost(m_costs, container, fileName);
+
+	// The modules a file was stamped clean by skip it if it was not changed
+	// since. The file is still read: the stamp only counts once the content
+	// matches it, see CVerdictStamps::VerifyContent().
+	if (m_stamps)
+	{
+		VERDICT_STAMP stamp;
+		ReadStamp(container, fileName, context, &stamp);
+		CVerdictStamps::BeginFile(&stamp);
+	}
+
+	// Files over the size limit are still carved for embedded images, but
+	// they are not handed to the scan modules as a whole.
+	if (SUCCEEDED(IsFileTooLarge(container, fileName, context, &bOver)) && bOver &&
+		!TEST_FLAG(context->GetFlags(), IFsEnumContext::CarveImages))
 		return E_OUTOFMEMORY;
 
 	// Initialize file object
@@ -368,26 +430,36 @@ HRESULT WINAPI CFileFsEnum::OnEnumEntryFound(__in IVirtualFs * container, __in L
 	if (fsFile == NULL) return E_OUTOFMEMORY;
 	ULONG creationFlags = 0;
 
-	switch (context->GetFlags())
+	if (TEST_FLAG(context->GetFlags(), IFsEnumContext::Disinfect) && !bOver)
 	{
-	case IFsEnumContext::DetectOnly:
-		creationFlags = IVirtualFs::fsRead | IVirtualFs::fsSharedRead | IVirtualFs::fsSharedDelete | IVirtualFs::fsOpenExisting | IVirtualFs::fsAttrNormal;
-		break;
-
-	case IFsEnumContext::Disinfect:
 		creationFlags = IVirtualFs::fsRead | IVirtualFs::fsWrite | IVirtualFs::fsSharedRead | IVirtualFs::fsSharedDelete | IVirtualFs::fsOpenExisting | IVirtualFs::fsAttrNormal;
-		break;
-
-	default:
-		creationFlags = 0;
-		break;
 	}
+	else if (TEST_FLAG(context->GetFlags(), IFsEnumContext::DetectOnly) ||
+		TEST_FLAG(context->GetFlags(), IFsEnumContext::Disinfect))
+	{
+		creationFlags = IVirtualFs::fsRead | IVirtualFs::fsSharedRead | IVirtualFs::fsSharedDelete | IVirtualFs::fsOpenExisting | IVirtualFs::fsAttrNormal;
+	}
+	if (creationFlags && TEST_FLAG(context->GetFlags(), IFsEnumContext::NoCache))
+		creationFlags |= IVirtualFs::fsNoCache;
 
 	if (SUCCEEDED(hr = fsFile->SetContainer(container)) &&
 		SUCCEEDED(hr = fsFile->Create(fileName, creationFlags)))
 	{
+		// Another hard link to this file was already scanned
+		if (IsFileVisited(fsFile))
+		{
+			BSTR fullPath = NULL;
+			if (SUCCEEDED(fsFile->GetFullPath(&fullPath)))
+			{
+				OnError(FsEnumDuplicate, fullPath);
+				SysFreeString(fullPath);
+			}
+			fsFile->Release();
+			return S_OK;
+		}
+
 		// Now scan file user file scanner modules
-		n = (int)m_Observers.size();
+		n = bOver ? 0 : (int)m_Observers.size();
 		for (i = 0; i < n; i++)
 		{
 			hr = m_Observers[i]->OnFileFound(fsFile, context, currentDepth);
@@ -407,8 +479,9 @@ HRESULT WINAPI CFileFsEnum::OnEnumEntryFound(__in IVirtualFs * container, __in L
 
 		if ((hr != E_ABORT) && (WaitForSingleObject(m_hStop, 0) == WAIT_TIMEOUT))
 		{
-			// Enum by archivers
-			EnumByArchivers(fsFile, context, currentDepth, 0);
+			// Enum by archivers. A file over the size limit is only carved:
+			// the other archivers would read it as a whole.
+			EnumByArchivers(fsFile, context, currentDepth, 0, bOver);
 			hr = CheckDeferredDeletion(container, fsFile);
 			if (hr == S_OK)
 			{
@@ -417,6 +490,23 @@ HRESULT WINAPI CFileFsEnum::OnEnumEntryFound(__in IVirtualFs * container, __in L
 				fsFile = NULL;
 			}
 		}
+
+		// The scan of this file was cut short. Whoever set the deadline
+		// decides what to do with it; the walk goes on.
+		if (fsFile && (hr != E_ABORT) && IsPastDeadline(context))
+		{
+			BSTR fullPath = NULL;
+			if (SUCCEEDED(fsFile->GetFullPath(&fullPath)))
+			{
+				OnError(FsEnumTimeout, fullPath);
+				SysFreeString(fullPath);
+			}
+			hr = S_OK;
+		}
+		else if (fsFile && m_stamps && (hr != E_ABORT) && (WaitForSingleObject(m_hStop, 0) == WAIT_TIMEOUT))
+		{
+			m_stamps->EndFile(fsFile, context);
+		}
 	}
 
 	// Release the file object
@@ -476,7 +566,7 @@ void WINAPI CFileFsEnum::InitArchiveObservers(void)
 	}
 }
 
-void WINAPI CFileFsEnum::EnumByArchivers(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int depth, __in const int depthInArchive)
+void WINAPI CFileFsEnum::EnumByArchivers(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int depth, __in const int depthInArchive, __in BOOL carveOnly)
 {
 	if (context->GetMaxDepthInArchive() != -1 &&
 		depthInArchive + 1 > context->GetMaxDepthInArchive()
@@ -494,6 +584,7 @@ void WINAPI CFileFsEnum::EnumByArchivers(__in IVirtualFs *file, __in IFsEnumCont
 	archiveEnum->SetDepth(depth);
 	archiveEnum->SetMaxDepthInArchive(context->GetMaxDepthInArchive());
 	archiveEnum->SetDepthInArchive(depthInArchive);
+	archiveEnum->SetDeadline(context->GetDeadline());
 
 	BSTR s = NULL;
 	if (SUCCEEDED(context->GetSearchPattern(&s)))
@@ -504,8 +595,12 @@ void WINAPI CFileFsEnum::EnumByArchivers(__in IVirtualFs *file, __in IFsEnumCont
 
 	for (std::vector<IFsEnum *>::iterator it = m_Archivers.begin(); it != m_Archivers.end(); ++it)
 	{
+		if (carveOnly && dynamic_cast<CCarveFsEnum*>(*it) == NULL)
+			continue;
+
 		(*it)->Enum(archiveEnum);
-		if (WaitForSingleObject(m_hStop, 0) == WAIT_OBJECT_0)
+		if (WaitForSingleObject(m_hStop, 0) == WAIT_OBJECT_0 ||
+			IsPastDeadline(archiveEnum))
 			break;
 		
 		ULONG flags;
@@ -551,6 +646,73 @@ BOOL WINAPI CFileFsEnum::TestFilePath(__in LPCWSTR lpFileName)
 	return isFile;
 }
 
+BOOL WINAPI CFileFsEnum::IsDirectoryVisited(__in LPCWSTR lpPath)
+{
+	if (!m_trackVisited) return FALSE;
+
+	FILE_ID id;
+	if (FAILED(CFileIdSet::QueryFileId(lpPath, &id)))
+		return FALSE;
+	return (m_visited.Insert(id) == S_FALSE);
+}
+
+BOOL WINAPI CFileFsEnum::IsFileVisited(__in IVirtualFs * file)
+{
+	if (!m_trackVisited) return FALSE;
+
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	FILE_ID id;
+	DWORD links = 0;
+	if (FAILED(file->GetHandle((LPVOID*)&hFile)) ||
+		FAILED(CFileIdSet::QueryFileId(hFile, &id, &links)))
+		return FALSE;
+
+	// Only files with several names can be reached twice, so the set stays
+	// small on ordinary trees.
+	if (links < 2) return FALSE;
+	return (m_visited.Insert(id) == S_FALSE);
+}
+
+BOOL WINAPI CFileFsEnum::ReadStamp(__in_opt IVirtualFs * container, __in LPCWSTR fileName, __in IFsEnumContext *context, __out VERDICT_STAMP * stamp)
+{
+	ZeroMemory(stamp, sizeof(*stamp));
+	StringW fullPath = fileName;
+	BSTR containerPath = NULL;
+	if (container)
+	{
+		if (FAILED(container->GetFullPath(&containerPath))) return FALSE;
+		fullPath = MakePath(containerPath, fileName);
+		SysFreeString(containerPath);
+	}
+
+	// the walk of a directory has the entry of the file at hand
+	const WIN32_FIND_DATAW * findData = NULL;
+	if (container && m_findHandle != INVALID_HANDLE_VALUE && 0 == wcscmp(m_wfd.cFileName, fileName))
+		findData = &m_wfd;
+
+	return m_stamps->IsCurrent(fullPath.c_str(), findData, context, stamp);
+}
+
+void CFileFsEnum::SetVerdictStamps(__in_opt CVerdictStamps * stamps)
+{
+	if (stamps) stamps->AddRef();
+	if (m_stamps) m_stamps->Release();
+	m_stamps = stamps;
+}
+
+void CFileFsEnum::SetDirectoryCosts(__in_opt CDirectoryCosts * costs)
+{
+	if (costs) costs->AddRef();
+	if (m_costs) m_costs->Release();
+	m_costs = costs;
+}
+
+BOOL CFileFsEnum::IsPastDeadline(__in IFsEnumContext *context)
+{
+	ULONGLONG deadline = context->GetDeadline();
+	return (deadline != 0 && GetTickCount64() >= deadline);
+}
+
 BOOL WINAPI CFileFsEnum::EnumInit(void)
 {
 	return TRUE;
@@ -1,5 +1,10 @@
 #pragma once
 #include <TinyAvCore.h>
+#include "FileIdSet.h"
+
+class CVerdictStamps;
+struct VERDICT_STAMP;
+class CDirectoryCosts;
 
 class CFileFsEnum :
 	public CRefCount,
@@ -11,8 +16,15 @@ protected:
 
 	std::vector<IFsEnumObserver*> m_Observers;
 	std::vector<IFsEnum* >		  m_Archivers;
-private:
 	HANDLE m_hStop;
+
+	// Identities of visited files and directories. Used by enumerators that
+	// walk the real file system to skip hard links and directory loops.
+	CFileIdSet	m_visited;
+	BOOL		m_trackVisited;
+
+	CVerdictStamps *	m_stamps;	// NULL unless the files are stamped
+	CDirectoryCosts *	m_costs;	// NULL unless the files are charged to their directory
 public:
 	CFileFsEnum();
 
@@ -31,18 +43,31 @@ public:
 	virtual HRESULT WINAPI OnFileFound(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int currentDepth) override;
 	virtual void WINAPI OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR lpMessage = NULL) override;
 
+	// TRUE when the deadline of the context has passed
+	static BOOL IsPastDeadline(__in IFsEnumContext *context);
+
+	// Skip the files stamped clean, and stamp the files found clean
+	void SetVerdictStamps(__in_opt CVerdictStamps * stamps);
+
+	// Charge each file found by the walk, with the files inside it, to its directory
+	void SetDirectoryCosts(__in_opt CDirectoryCosts * costs);
+
 private:
 	virtual HRESULT WINAPI IsFileTooLarge(__in IVirtualFs * container, __in LPCWSTR fileName, __in IFsEnumContext *context, __out BOOL* over);
 	virtual HRESULT WINAPI IsFileTooLarge(__in IVirtualFs * file, __in IFsEnumContext *context, __out BOOL* over);
-	virtual HRESULT WINAPI OnEnumEntryFound(__in IVirtualFs * container, __in LPCWSTR fileName, __in IFsEnumContext *context, __in int currentDepth);
-	virtual StringW MakePath(__in LPCWSTR str1, __in  LPCWSTR str2);
 	HRESULT CheckDeferredDeletion(__in IVirtualFs * container, __in IVirtualFs * file);
 
 protected:
+	virtual HRESULT WINAPI OnEnumEntryFound(__in IVirtualFs * container, __in LPCWSTR fileName, __in IFsEnumContext *context, __in int currentDepth);
+	virtual StringW MakePath(__in LPCWSTR str1, __in  LPCWSTR str2);
 	virtual void WINAPI InitArchiveObservers(void);
-	virtual void WINAPI EnumByArchivers(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int depth, __in const int depthInArchive);
+	// carveOnly: run CCarveFsEnum only, for files over the size limit
+	virtual void WINAPI EnumByArchivers(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int depth, __in const int depthInArchive, __in BOOL carveOnly);
 	virtual void WINAPI CleanupArchiveObservers(void);
 	virtual BOOL WINAPI TestFilePath(__in LPCWSTR lpFileName);
+	virtual BOOL WINAPI IsDirectoryVisited(__in LPCWSTR lpPath);
+	virtual BOOL WINAPI IsFileVisited(__in IVirtualFs * file);
+	virtual BOOL WINAPI ReadStamp(__in_opt IVirtualFs * container, __in LPCWSTR fileName, __in IFsEnumContext *context, __out VERDICT_STAMP * stamp);
 
 	HANDLE	m_findHandle;
 	WIN32_FIND_DATAW m_wfd;
@@ -7,6 +7,7 @@ CFileFsEnumContext::CFileFsEnumContext()
 	m_ArchiveDepth = 0;
 	m_maxArchiveDepth = -1;
 	m_flags = 0;
+	m_deadline = 0;
 	m_container = NULL;
 	m_maxSize.QuadPart = MAX_FILE_SIZE;
 }
@@ -216,3 +217,14 @@ ULONG WINAPI CFileFsEnumContext::GetFlags(void)
 	return m_flags;
 }
 
+HRESULT WINAPI CFileFsEnumContext::SetDeadline(__in const ULONGLONG deadline)
+{
+	m_deadline = deadline;
+	return S_OK;
+}
+
+ULONGLONG WINAPI CFileFsEnumContext::GetDeadline(void)
+{
+	return m_deadline;
+}
+
@@ -19,6 +19,7 @@ protected:
 	int		m_maxArchiveDepth;
 	int		m_ArchiveDepth;
 	ULONG   m_flags;
+	ULONGLONG m_deadline;
 
 public:
 	CFileFsEnumContext();
@@ -39,6 +40,10 @@ public:
 
 	virtual ULONG WINAPI GetFlags(void) override;
 
+	virtual HRESULT WINAPI SetDeadline(__in const ULONGLONG deadline) override;
+
+	virtual ULONGLONG WINAPI GetDeadline(void) override;
+
 	virtual  HRESULT WINAPI SetMaxDepth(__in const int maxDepth) override;
 	virtual HRESULT WINAPI SetDepth(__in const int depth) override;
 
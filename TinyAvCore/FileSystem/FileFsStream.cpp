@@ -1,8 +1,13 @@
 #include "FileFsStream.h"
+#include "..\Scanner\DirectoryCosts.h"
 
 CFileFsStream::CFileFsStream()
 {
 	m_hFile = INVALID_HANDLE_VALUE;
+	m_hDirect = INVALID_HANDLE_VALUE;
+	m_direct = NULL;
+	m_rangesSize = 0;
+	m_rangesKnown = FALSE;
 	ZeroMemory(&m_currentPos, sizeof(m_currentPos));
 	m_cacheSize = 0;
 	m_cache = new char[DEFAULT_MAX_CACHE_SIZE];
@@ -16,6 +21,86 @@ CFileFsStream::~CFileFsStream()
 		delete[] m_cache;
 		m_cache = NULL;
 	}
+	CloseDirect();
+	if (m_direct)
+	{
+		VirtualFree(m_direct, 0, MEM_RELEASE);
+		m_direct = NULL;
+	}
+}
+
+HRESULT CFileFsStream::OpenDirect(__in LPCWSTR path)
+{
+	if (path == NULL) return E_INVALIDARG;
+	if (m_hFile == INVALID_HANDLE_VALUE || m_hFile == NULL) return E_NOT_VALID_STATE;
+	CloseDirect();
+
+	// the share mode lets in the access of the handle already open
+	m_hDirect = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (m_hDirect == INVALID_HANDLE_VALUE)
+		return HRESULT_FROM_WIN32(GetLastError());
+	return S_OK;
+}
+
+void CFileFsStream::CloseDirect(void)
+{
+	if (m_hDirect != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hDirect);
+		m_hDirect = INVALID_HANDLE_VALUE;
+	}
+}
+
+// Read at the current position through the unbuffered handle: the aligned
+// blocks around the range are read into m_direct and copied out
+HRESULT CFileFsStream::ReadDirect(__out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out ULONG * readSize)
+{
+	*readSize = 0;
+	if (m_direct == NULL)
+	{
+		// VirtualAlloc() memory is aligned on pages
+		m_direct = (BYTE *)VirtualAlloc(NULL, DIRECT_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (m_direct == NULL) return E_OUTOFMEMORY;
+	}
+
+	BYTE * out = (BYTE *)buffer;
+	ULONGLONG start = m_currentPos.QuadPart & ~(ULONGLONG)(DIRECT_ALIGN - 1);
+	ULONG skip = (ULONG)(m_currentPos.QuadPart - start);
+	ULONG done = 0;
+	while (done < bufferSize)
+	{
+		ULONGLONG span = ((ULONGLONG)skip + (bufferSize - done) + DIRECT_ALIGN - 1) & ~(ULONGLONG)(DIRECT_ALIGN - 1);
+		DWORD want = (DWORD)min(span, (ULONGLONG)DIRECT_BUFFER_SIZE);
+		DWORD got = 0;
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = (DWORD)start;
+		overlapped.OffsetHigh = (DWORD)(start >> 32);
+		if (!ReadFile(m_hDirect, m_direct, want, &got, &overlapped))
+		{
+			DWORD error = GetLastError();
+			if (error != ERROR_HANDLE_EOF) return HRESULT_FROM_WIN32(error);
+			got = 0;
+		}
+		CDirectoryCosts::CountBytes(got);
+		if (got <= skip) break;
+
+		ULONG count = min((ULONG)(got - skip), bufferSize - done);
+		memcpy(out + done, m_direct + skip, count);
+		done += count;
+		start += got;
+		skip = 0;
+		if (got < want) break;	// end of file
+	}
+
+	// the cached handle follows, as after any other read
+	m_currentPos.QuadPart += done;
+	*readSize = done;
+	LARGE_INTEGER distanceToMove;
+	distanceToMove.QuadPart = m_currentPos.QuadPart;
+	if (FALSE == SetFilePointerEx(m_hFile, distanceToMove, (PLARGE_INTEGER)NULL, FILE_BEGIN))
+		return HRESULT_FROM_WIN32(GetLastError());
+	return S_OK;
 }
 
 HRESULT WINAPI CFileFsStream::QueryInterface(
@@ -31,6 +116,13 @@ HRESULT WINAPI CFileFsStream::QueryInterface(
 		return S_OK;
 	}
 
+	if (IsEqualIID(riid, __uuidof(IFsSparseStream)))
+	{
+		*ppvObject = static_cast<IFsSparseStream*>(this);
+		AddRef();
+		return S_OK;
+	}
+
 	return E_NOINTERFACE;
 }
 
@@ -43,6 +135,17 @@ HRESULT WINAPI CFileFsStream::Read(
 	if (m_hFile == INVALID_HANDLE_VALUE) return E_NOT_SET;
 	if (buffer == NULL || bufferSize == 0) return E_INVALIDARG;
 
+	if (m_hDirect != INVALID_HANDLE_VALUE && bufferSize >= DIRECT_READ_MIN)
+	{
+		if (SUCCEEDED(ReadDirect(buffer, bufferSize, &r)))
+		{
+			if (readSize) *readSize = r;
+			return S_OK;
+		}
+		// the volume refuses unbuffered reads: the cached handle does them all
+		CloseDirect();
+	}
+
 	if ((m_cachePos.QuadPart <= m_currentPos.QuadPart) &&
 		(m_currentPos.QuadPart + bufferSize < m_cachePos.QuadPart + m_cacheSize))
 	{
@@ -63,6 +166,7 @@ HRESULT WINAPI CFileFsStream::Read(
 		{
 			return HRESULT_FROM_WIN32(GetLastError());
 		}
+		CDirectoryCosts::CountBytes(r);
 
 		if (r)
 		{
@@ -97,6 +201,9 @@ HRESULT WINAPI CFileFsStream::Write(
 	if (m_hFile == INVALID_HANDLE_VALUE) return E_NOT_SET;
 	if (buffer == NULL || bufferSize == 0) return E_INVALIDARG;
 
+	// a write may fill a hole
+	m_rangesKnown = FALSE;
+
 	// write to disk
 	if (!WriteFile(m_hFile, buffer, bufferSize, &w, NULL))
 	{
@@ -183,6 +290,8 @@ HRESULT WINAPI CFileFsStream::Seek(
 
 void WINAPI CFileFsStream::SetFileHandle(__in void* const handle)
 {
+	CloseDirect();
+	m_rangesKnown = FALSE;
 	m_hFile = (HANDLE)handle;
 	if (m_hFile != NULL && m_hFile != INVALID_HANDLE_VALUE)
 	{
@@ -191,6 +300,7 @@ void WINAPI CFileFsStream::SetFileHandle(__in void* const handle)
 		DWORD r;
 		if (ReadFile(m_hFile, m_cache, DEFAULT_MAX_CACHE_SIZE, &r, NULL) && r > 0)
 		{
+			CDirectoryCosts::CountBytes(r);
 			m_cacheSize = (size_t)r;
 		}
 		ZeroMemory(&m_cachePos, sizeof(m_cachePos));
@@ -203,6 +313,7 @@ HRESULT WINAPI CFileFsStream::Shrink(void)
 	if (m_hFile == NULL || m_hFile == INVALID_HANDLE_VALUE) return E_NOT_VALID_STATE;
 	if (!SetEndOfFile(m_hFile))
 		return HRESULT_FROM_WIN32(GetLastError());
+	m_rangesKnown = FALSE;
 
 	if ((m_cachePos.QuadPart <= m_currentPos.QuadPart) &&
 		(m_currentPos.QuadPart < m_cachePos.QuadPart + m_cacheSize))
@@ -211,3 +322,84 @@ HRESULT WINAPI CFileFsStream::Shrink(void)
 		m_cacheSize = 0;
 	return S_OK;
 }
+
+// Read the allocated ranges of the file; a file that is not sparse is one range
+HRESULT CFileFsStream::LoadRanges(void)
+{
+	if (m_rangesKnown) return S_OK;
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(m_hFile, &info))
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	m_ranges.clear();
+	m_rangesSize = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	if (!(info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE))
+	{
+		FILE_ALLOCATED_RANGE_BUFFER all;
+		all.FileOffset.QuadPart = 0;
+		all.Length.QuadPart = (LONGLONG)m_rangesSize;
+		if (m_rangesSize) m_ranges.push_back(all);
+		m_rangesKnown = TRUE;
+		return S_OK;
+	}
+
+	FILE_ALLOCATED_RANGE_BUFFER query, ranges[64];
+	query.FileOffset.QuadPart = 0;
+	query.Length.QuadPart = (LONGLONG)m_rangesSize;
+	while (query.Length.QuadPart > 0)
+	{
+		DWORD returned = 0;
+		BOOL done = DeviceIoControl(m_hFile, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+			ranges, sizeof(ranges), &returned, NULL);
+		DWORD error = done ? ERROR_SUCCESS : GetLastError();
+		if (!done && error != ERROR_MORE_DATA)
+		{
+			m_ranges.clear();
+			return HRESULT_FROM_WIN32(error);
+		}
+
+		DWORD count = returned / sizeof(ranges[0]);
+		m_ranges.insert(m_ranges.end(), ranges, ranges + count);
+		if (done || count == 0) break;
+
+		// more ranges after the last one returned
+		LONGLONG next = ranges[count - 1].FileOffset.QuadPart + ranges[count - 1].Length.QuadPart;
+		query.Length.QuadPart -= next - query.FileOffset.QuadPart;
+		query.FileOffset.QuadPart = next;
+	}
+	m_rangesKnown = TRUE;
+	return S_OK;
+}
+
+HRESULT WINAPI CFileFsStream::GetDataRange(__in ULONGLONG offset, __out ULONGLONG * dataStart, __out ULONGLONG * dataEnd)
+{
+	if (m_hFile == INVALID_HANDLE_VALUE || m_hFile == NULL) return E_NOT_SET;
+	if (dataStart == NULL || dataEnd == NULL) return E_INVALIDARG;
+
+	HRESULT hr = LoadRanges();
+	if (FAILED(hr)) return hr;
+
+	// the first range ending past offset
+	size_t low = 0, high = m_ranges.size();
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2;
+		const FILE_ALLOCATED_RANGE_BUFFER & range = m_ranges[middle];
+		if ((ULONGLONG)(range.FileOffset.QuadPart + range.Length.QuadPart) <= offset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (low == m_ranges.size())
+	{
+		*dataStart = *dataEnd = m_rangesSize;
+		return S_FALSE;
+	}
+
+	const FILE_ALLOCATED_RANGE_BUFFER & range = m_ranges[low];
+	*dataStart = max(offset, (ULONGLONG)range.FileOffset.QuadPart);
+	*dataEnd = min((ULONGLONG)(range.FileOffset.QuadPart + range.Length.QuadPart), m_rangesSize);
+	return S_OK;
+}
@@ -1,13 +1,27 @@
 #pragma once
 #include <TinyAvCore.h>
+#include <winioctl.h>
+#include <vector>
 
 #ifndef DEFAULT_MAX_CACHE_SIZE
 #define DEFAULT_MAX_CACHE_SIZE (16 * 1024)
 #endif
 
+#define DIRECT_READ_MIN		(64 * 1024)		// smaller reads go through the system cache
+#define DIRECT_ALIGN		(4096)			// a multiple of the sector size of the disks
+#define DIRECT_BUFFER_SIZE	(1024 * 1024)
+
+// Stream of a file on disk. Opened with IVirtualFs::fsNoCache, the stream
+// reads blocks of DIRECT_READ_MIN and more through a second, unbuffered
+// handle, so a full scan does not fill the system cache with files read
+// once. The unbuffered reads are aligned on DIRECT_ALIGN and go through a
+// buffer allocated with that alignment.
+// For sparse files, the stream also tells the data ranges from the holes,
+// from the allocated ranges of the file system.
 class CFileFsStream :
 	public CRefCount,
-	public IFsStream
+	public IFsStream,
+	public IFsSparseStream
 {
 protected:
 	char *m_cache;
@@ -15,9 +29,18 @@ protected:
 	ULARGE_INTEGER m_cachePos;
 	ULARGE_INTEGER m_currentPos;
 	HANDLE m_hFile;
+	HANDLE m_hDirect;		// unbuffered handle, or INVALID_HANDLE_VALUE
+	BYTE * m_direct;		// aligned buffer of the unbuffered reads
+	std::vector<FILE_ALLOCATED_RANGE_BUFFER> m_ranges;	// data of the file, sorted by offset
+	ULONGLONG m_rangesSize;	// size of the file when m_ranges was loaded
+	BOOL m_rangesKnown;		// FALSE until loaded, and after any write
 
 	virtual ~CFileFsStream();
 
+	HRESULT ReadDirect(__out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out ULONG * readSize);
+	void CloseDirect(void);
+	HRESULT LoadRanges(void);
+
 public:
 	CFileFsStream();
 
@@ -47,4 +70,15 @@ public:
 
 	virtual HRESULT WINAPI Shrink(void) override;
 
+	// implement IFsSparseStream interface
+	virtual HRESULT WINAPI GetDataRange(__in ULONGLONG offset, __out ULONGLONG * dataStart, __out ULONGLONG * dataEnd) override;
+
+	/* Open the unbuffered handle of the large reads, after SetFileHandle()
+	@path: full path of the file
+	@return: HRESULT on success, or other value on failure. The stream then
+	reads through the system cache only.
+	*/
+	HRESULT OpenDirect(__in LPCWSTR path);
+
+	BOOL IsDirect(void) { return m_hDirect != INVALID_HANDLE_VALUE; }
 };
@@ -0,0 +1,127 @@
+#include "FileIdSet.h"
+
+#define FILE_ID_INITIAL_CAPACITY	(4096)
+#define FILE_ID_USED				(0x8000000000000000ULL)	// marks an occupied slot
+
+CFileIdSet::CFileIdSet()
+{
+	m_table = NULL;
+	m_capacity = 0;
+	m_count = 0;
+	InitializeSRWLock(&m_lock);
+}
+
+CFileIdSet::~CFileIdSet()
+{
+	if (m_table)
+	{
+		delete[] m_table;
+		m_table = NULL;
+	}
+}
+
+size_t CFileIdSet::Hash(__in const FILE_ID & id)
+{
+	// 64-bit mix (splitmix64 finalizer)
+	ULONGLONG h = id.index ^ (id.volume * 0x9E3779B97F4A7C15ULL);
+	h ^= h >> 30;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 27;
+	h *= 0x94D049BB133111EBULL;
+	h ^= h >> 31;
+	return (size_t)h;
+}
+
+BOOL CFileIdSet::Grow(void)
+{
+	size_t newCapacity = m_capacity ? m_capacity * 2 : FILE_ID_INITIAL_CAPACITY;
+	FILE_ID * newTable = new FILE_ID[newCapacity];
+	if (newTable == NULL) return FALSE;
+	ZeroMemory(newTable, newCapacity * sizeof(FILE_ID));
+
+	for (size_t i = 0; i < m_capacity; i++)
+	{
+		if ((m_table[i].volume & FILE_ID_USED) == 0) continue;
+		size_t slot = Hash(m_table[i]) & (newCapacity - 1);
+		while (newTable[slot].volume & FILE_ID_USED)
+			slot = (slot + 1) & (newCapacity - 1);
+		newTable[slot] = m_table[i];
+	}
+
+	if (m_table) delete[] m_table;
+	m_table = newTable;
+	m_capacity = newCapacity;
+	return TRUE;
+}
+
+HRESULT CFileIdSet::Insert(__in const FILE_ID & id)
+{
+	FILE_ID key = id;
+	key.volume |= FILE_ID_USED;
+	HRESULT hr = S_OK;
+
+	AcquireSRWLockExclusive(&m_lock);
+	// keep the load factor under 1/2 so probe sequences stay short
+	if ((m_count + 1) * 2 > m_capacity && !Grow())
+	{
+		ReleaseSRWLockExclusive(&m_lock);
+		return E_OUTOFMEMORY;
+	}
+
+	size_t slot = Hash(key) & (m_capacity - 1);
+	while (m_table[slot].volume & FILE_ID_USED)
+	{
+		if (m_table[slot].volume == key.volume && m_table[slot].index == key.index)
+		{
+			hr = S_FALSE;
+			break;
+		}
+		slot = (slot + 1) & (m_capacity - 1);
+	}
+
+	if (hr == S_OK)
+	{
+		m_table[slot] = key;
+		m_count++;
+	}
+	ReleaseSRWLockExclusive(&m_lock);
+	return hr;
+}
+
+void CFileIdSet::Clear(void)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	if (m_table)
+		ZeroMemory(m_table, m_capacity * sizeof(FILE_ID));
+	m_count = 0;
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+HRESULT CFileIdSet::QueryFileId(__in HANDLE hFile, __out FILE_ID * id, __out_opt DWORD * links)
+{
+	if (id == NULL || hFile == NULL || hFile == INVALID_HANDLE_VALUE) return E_INVALIDARG;
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(hFile, &info))
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	id->volume = info.dwVolumeSerialNumber;
+	id->index = ((ULONGLONG)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	if (links) *links = info.nNumberOfLinks;
+	return S_OK;
+}
+
+HRESULT CFileIdSet::QueryFileId(__in LPCWSTR lpPath, __out FILE_ID * id)
+{
+	if (lpPath == NULL || id == NULL) return E_INVALIDARG;
+
+	HANDLE hFile = CreateFileW(lpPath, FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	HRESULT hr = QueryFileId(hFile, id, NULL);
+	CloseHandle(hFile);
+	return hr;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <TinyAvCore.h>
+
+// Identity of a file system object: volume serial number and file index,
+// the Windows counterpart of (device, inode).
+typedef struct FILE_ID
+{
+	ULONGLONG volume;
+	ULONGLONG index;
+}FILE_ID;
+
+// Thread-safe set of file identities. Entries live in a flat open-addressing
+// table (16 bytes each) so millions of files fit in a few tens of megabytes.
+class CFileIdSet
+{
+protected:
+	FILE_ID *	m_table;
+	size_t		m_capacity;	// always a power of two
+	size_t		m_count;
+	SRWLOCK		m_lock;
+
+	BOOL Grow(void);
+	static size_t Hash(__in const FILE_ID & id);
+
+public:
+	CFileIdSet();
+	virtual ~CFileIdSet();
+
+	/* Add an identity to the set
+	@id: identity of the file or directory
+	@return: S_OK if the identity is new, S_FALSE if it was already in the set,
+	or other value on failure.
+	*/
+	HRESULT Insert(__in const FILE_ID & id);
+
+	// Remove all identities
+	void Clear(void);
+
+	/* Retrieve the identity of an opened file or directory
+	@hFile: handle opened with at least FILE_READ_ATTRIBUTES access
+	@id: a pointer to a variable storing result.
+	@links: a pointer to a variable storing the number of hard links.
+	@return: HRESULT on success, or other value on failure.
+	*/
+	static HRESULT QueryFileId(__in HANDLE hFile, __out FILE_ID * id, __out_opt DWORD * links);
+
+	/* Retrieve the identity of a file or directory by its path
+	@lpPath: path of the object. Reparse points are followed, so a
+	link reports the identity of its target.
+	@id: a pointer to a variable storing result.
+	@return: HRESULT on success, or other value on failure.
+	*/
+	static HRESULT QueryFileId(__in LPCWSTR lpPath, __out FILE_ID * id);
+};
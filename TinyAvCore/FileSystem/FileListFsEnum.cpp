@@ -0,0 +1,165 @@
+#include "FileListFsEnum.h"
+#include <Shlwapi.h>
+#pragma comment(lib, "Shlwapi.lib")
+#include "..\Scanner\StageCounters.h"
+#include "..\Scanner\DirectoryCosts.h"
+
+CFileListFsEnum::CFileListFsEnum(void)
+{
+}
+
+CFileListFsEnum::~CFileListFsEnum(void)
+{
+}
+
+HRESULT WINAPI CFileListFsEnum::Enum(__in IFsEnumContext *context)
+{
+	if (context == NULL) return E_INVALIDARG;
+
+	CStageScope stage(StageEnumerate);
+	HRESULT hr = S_OK;
+	IVirtualFs * listFile = NULL;
+	BSTR listName = NULL;
+	BSTR listPath = NULL;
+	BSTR searchPattern = NULL;
+	HANDLE hList = INVALID_HANDLE_VALUE;
+	BOOL bStdin = FALSE;
+
+	if (FAILED(hr = context->GetSearchContainer(&listFile)) ||
+		FAILED(hr = context->GetSearchPattern(&searchPattern)) ||
+		FAILED(hr = listFile->GetFileName(&listName)))
+	{
+		if (listFile) listFile->Release();
+		if (searchPattern) SysFreeString(searchPattern);
+		return hr;
+	}
+
+	bStdin = (wcscmp(listName, L"-") == 0);
+	SysFreeString(listName);
+	if (bStdin)
+	{
+		hList = GetStdHandle(STD_INPUT_HANDLE);
+	}
+	else if (SUCCEEDED(hr = listFile->GetFullPath(&listPath)))
+	{
+		hList = CreateFileW(listPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		SysFreeString(listPath);
+	}
+	listFile->Release();
+
+	if (hList == INVALID_HANDLE_VALUE || hList == NULL)
+	{
+		SysFreeString(searchPattern);
+		return FAILED(hr) ? hr : HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	// The list is consumed in fixed-size batches. Only the entry that
+	// straddles two batches is carried over, so memory use does not depend
+	// on the length of the list.
+	char * batch = new char[LIST_BATCH_SIZE];
+	if (batch == NULL)
+	{
+		if (!bStdin) CloseHandle(hList);
+		SysFreeString(searchPattern);
+		return E_OUTOFMEMORY;
+	}
+
+	m_visited.Clear();
+	m_trackVisited = TRUE;
+	InitArchiveObservers();
+	size_t carried = 0;
+	BOOL bSkipEntry = FALSE;
+	HRESULT hrRead = S_OK;
+	hr = S_OK;
+	for (;;)
+	{
+		DWORD dwRead = 0;
+		if (!ReadFile(hList, batch + carried, (DWORD)(LIST_BATCH_SIZE - carried), &dwRead, NULL))
+		{
+			// the writer of a pipe closed its end: the list ends there. Any other
+			// error cuts the list short, and the bytes carried are not an entry.
+			if (GetLastError() != ERROR_BROKEN_PIPE)
+			{
+				hrRead = HRESULT_FROM_WIN32(GetLastError());
+				break;
+			}
+			dwRead = 0;
+		}
+
+		size_t size = carried + dwRead;
+		if (dwRead == 0)
+		{
+			// last entry without a terminator
+			if (size && !bSkipEntry)
+				hr = OnListEntry(batch, size, searchPattern, context);
+			break;
+		}
+
+		size_t start = 0;
+		for (size_t i = carried; i < size; i++)
+		{
+			if (batch[i] != '\0' && batch[i] != '\n') continue;
+
+			if (!bSkipEntry)
+			{
+				hr = OnListEntry(batch + start, i - start, searchPattern, context);
+				if (hr == E_ABORT || WaitForSingleObject(m_hStop, 0) == WAIT_OBJECT_0)
+					goto Exit;
+			}
+			bSkipEntry = FALSE;
+			start = i + 1;
+		}
+
+		carried = size - start;
+		if (carried >= LIST_MAX_ENTRY_SIZE)
+		{
+			// not a path; drop it up to the next terminator
+			bSkipEntry = TRUE;
+			carried = 0;
+		}
+		else if (carried)
+		{
+			memmove(batch, batch + start, carried);
+		}
+	}
+
+Exit:
+	m_trackVisited = FALSE;
+	if (m_costs) m_costs->Flush();
+	CleanupArchiveObservers();
+	delete[] batch;
+	if (!bStdin) CloseHandle(hList);
+	SysFreeString(searchPattern);
+	// the entries report their own errors; the list fails only if it cannot be read
+	return (hr == E_ABORT) ? hr : hrRead;
+}
+
+HRESULT WINAPI CFileListFsEnum::OnListEntry(__in_bcount(size) const char * entry, __in size_t size, __in LPCWSTR searchPattern, __in IFsEnumContext *context)
+{
+	// strip CR of CR-LF lists
+	while (size && (entry[size - 1] == '\r')) size--;
+	if (size == 0) return S_OK;
+
+	int cch = MultiByteToWideChar(CP_UTF8, 0, entry, (int)size, NULL, 0);
+	if (cch <= 0) return S_OK;
+	if (m_path.size() < (size_t)cch + 1)
+		m_path.resize((size_t)cch + 1);
+	MultiByteToWideChar(CP_UTF8, 0, entry, (int)size, &m_path[0], cch);
+	m_path[cch] = L'\0';
+
+	LPCWSTR lpPath = &m_path[0];
+	if (searchPattern && !PathMatchSpecW(PathFindFileNameW(lpPath), searchPattern))
+		return S_OK;
+
+	HRESULT hr = OnEnumEntryFound(NULL, lpPath, context, 0);
+	if (FAILED(hr) && hr != E_ABORT)
+	{
+		if (hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) ||
+			hr == HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND))
+			OnError(FsEnumNotFound, lpPath);
+		else
+			OnError(FsEnumAccessDenied, lpPath);
+	}
+	return hr;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "FileFsEnum.h"
+
+#define LIST_BATCH_SIZE		(1024 * 1024)
+#define LIST_MAX_ENTRY_SIZE	(32 * 1024 * 3)	// longest UTF-8 encoded path
+
+// Scans the files named in a list instead of walking directories. The search
+// container is the list file; a container named "-" reads the list from stdin.
+// Entries are UTF-8 paths separated by NUL or new-line characters.
+class CFileListFsEnum :
+	public CFileFsEnum
+{
+protected:
+	virtual ~CFileListFsEnum(void);
+
+	virtual HRESULT WINAPI OnListEntry(__in_bcount(size) const char * entry, __in size_t size, __in LPCWSTR searchPattern, __in IFsEnumContext *context);
+
+	std::vector<WCHAR> m_path;
+
+public:
+	CFileListFsEnum(void);
+
+	virtual HRESULT WINAPI Enum(__in IFsEnumContext *context) override;
+};
@@ -0,0 +1,518 @@
+#include "TeeStream.h"
+#include "..\Scanner\MemoryGovernor.h"
+
+#define STREAM_CACHE_ENV	L"TINYAV_STREAM_CACHE"
+
+// what the consumers without IFsSparseConsumer are given for the holes
+static const BYTE s_zeros[TEE_BLOCK_SIZE] = {};
+
+CTeeStream::CTeeStream()
+{
+	m_source = NULL;
+	m_sparse = NULL;
+	m_size = 0;
+	m_pos = 0;
+	m_cacheLimit = 0;
+	m_cached = 0;
+	m_sourceBytes = 0;
+	m_holeBytes = 0;
+}
+
+CTeeStream::~CTeeStream()
+{
+	size_t i, n;
+	Invalidate();
+
+	n = m_consumers.size();
+	for (i = 0; i < n; i++)
+	{
+		m_consumers[i]->Release();
+	}
+
+	if (m_sparse)
+	{
+		m_sparse->Release();
+		m_sparse = NULL;
+	}
+
+	if (m_source)
+	{
+		m_source->Release();
+		m_source = NULL;
+	}
+}
+
+HRESULT WINAPI CTeeStream::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown) || IsEqualIID(riid, __uuidof(IFsStream)))
+	{
+		*ppvObject = static_cast<IFsStream*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+HRESULT CTeeStream::Initialize(__in IFsStream * source, __in ULONGLONG size, __in ULONGLONG cacheLimit)
+{
+	if (source == NULL) return E_INVALIDARG;
+	if (m_source) return E_NOT_VALID_STATE;
+
+	source->AddRef();
+	m_source = source;
+	if (FAILED(source->QueryInterface(__uuidof(IFsSparseStream), (LPVOID*)&m_sparse)))
+		m_sparse = NULL;
+	m_size = size;
+	m_pos = 0;
+	m_cacheLimit = cacheLimit;
+
+	// only the blocks that fit in the cache are tracked
+	ULONGLONG cacheable = min(size, cacheLimit);
+	m_blocks.resize((size_t)((cacheable + TEE_BLOCK_SIZE - 1) / TEE_BLOCK_SIZE));
+	for (size_t i = 0; i < m_blocks.size(); i++)
+	{
+		m_blocks[i].data = NULL;
+		m_blocks[i].length = 0;
+		m_blocks[i].hole = FALSE;
+	}
+	return S_OK;
+}
+
+HRESULT CTeeStream::AddConsumer(__in IFsStreamConsumer * consumer)
+{
+	if (consumer == NULL) return E_INVALIDARG;
+	consumer->AddRef();
+	m_consumers.push_back(consumer);
+	return S_OK;
+}
+
+HRESULT CTeeStream::ReadSource(__in ULONGLONG offset, __out_bcount(size) LPVOID buffer, __in ULONG size, __out ULONG * readSize)
+{
+	LARGE_INTEGER position;
+	position.QuadPart = (LONGLONG)offset;
+	*readSize = 0;
+	if (size == 0) return S_OK;
+
+	HRESULT hr = m_source->ReadAt(position, IFsStream::FsStreamBegin, buffer, size, readSize);
+	if (SUCCEEDED(hr))
+		m_sourceBytes += *readSize;
+	return hr;
+}
+
+BOOL CTeeStream::CanCache(void)
+{
+	CMemoryGovernor * governor = CMemoryGovernor::GetInstance();
+	return m_cached + TEE_BLOCK_SIZE <= m_cacheLimit &&
+		!governor->IsUnderPressure() && governor->Fits(TEE_BLOCK_SIZE);
+}
+
+HRESULT CTeeStream::LoadBlock(__in size_t index)
+{
+	if (index >= m_blocks.size()) return E_BOUNDS;
+	if (m_blocks[index].data || m_blocks[index].hole) return S_OK;
+	if (!CanCache()) return E_OUTOFMEMORY;
+
+	ULONGLONG offset = (ULONGLONG)index * TEE_BLOCK_SIZE;
+	ULONG length = (ULONG)min((ULONGLONG)TEE_BLOCK_SIZE, m_size - offset);
+	BYTE * data = new BYTE[TEE_BLOCK_SIZE];
+	if (data == NULL) return E_OUTOFMEMORY;
+
+	HRESULT hr = ReadSource(offset, data, length, &length);
+	if (FAILED(hr))
+	{
+		delete[] data;
+		return hr;
+	}
+
+	m_blocks[index].data = data;
+	m_blocks[index].length = length;
+	m_cached += TEE_BLOCK_SIZE;
+	CMemoryGovernor::GetInstance()->Charge(MemoryStreamCache, TEE_BLOCK_SIZE);
+	return S_OK;
+}
+
+void CTeeStream::DropBlocks(__in ULONGLONG offset, __in ULONGLONG size)
+{
+	if (size == 0 || m_blocks.empty()) return;
+
+	size_t first = (size_t)(offset / TEE_BLOCK_SIZE);
+	size_t last = (size_t)min((offset + size - 1) / TEE_BLOCK_SIZE, (ULONGLONG)m_blocks.size() - 1);
+	for (size_t i = first; i <= last; i++)
+	{
+		if (m_blocks[i].hole)
+		{
+			m_blocks[i].hole = FALSE;
+			m_blocks[i].length = 0;
+		}
+		if (m_blocks[i].data == NULL) continue;
+		delete[] m_blocks[i].data;
+		m_blocks[i].data = NULL;
+		m_blocks[i].length = 0;
+		m_cached -= TEE_BLOCK_SIZE;
+		CMemoryGovernor::GetInstance()->Charge(MemoryStreamCache, -(LONG64)TEE_BLOCK_SIZE);
+	}
+}
+
+void CTeeStream::Invalidate(void)
+{
+	DropBlocks(0, (ULONGLONG)m_blocks.size() * TEE_BLOCK_SIZE);
+}
+
+ULONGLONG CTeeStream::GetHoleEnd(__in ULONGLONG offset, __inout ULONGLONG * dataStart, __inout ULONGLONG * dataEnd)
+{
+	if (m_sparse == NULL) return offset;
+
+	// the data range found last is still ahead
+	if (offset >= *dataEnd &&
+		FAILED(m_sparse->GetDataRange(offset, dataStart, dataEnd)))
+	{
+		// read everything
+		*dataStart = 0;
+		*dataEnd = m_size;
+		return offset;
+	}
+	if (*dataStart <= offset) return offset;
+
+	// the block where the data starts is read whole
+	ULONGLONG end = (*dataStart >= m_size) ? m_size : *dataStart - *dataStart % TEE_BLOCK_SIZE;
+	return max(end, offset);
+}
+
+void CTeeStream::Deliver(__inout std::vector<TEE_CONSUMER> & active, __in ULONGLONG offset, __in_opt const BYTE * data, __in ULONGLONG size)
+{
+	for (size_t i = 0; i < active.size(); )
+	{
+		HRESULT hrBlock = S_OK;
+		if (data)
+			hrBlock = active[i].consumer->OnStreamBlock(offset, data, (ULONG)size);
+		else if (active[i].sparse)
+			hrBlock = active[i].sparse->OnStreamHole(offset, size);
+		else
+		{
+			for (ULONGLONG done = 0; done < size && SUCCEEDED(hrBlock); done += TEE_BLOCK_SIZE)
+				hrBlock = active[i].consumer->OnStreamBlock(offset + done, s_zeros, (ULONG)min(size - done, (ULONGLONG)TEE_BLOCK_SIZE));
+		}
+
+		if (FAILED(hrBlock))
+		{
+			// this consumer has seen enough of the file
+			active[i].consumer->OnStreamEnd(hrBlock);
+			if (active[i].sparse) active[i].sparse->Release();
+			active.erase(active.begin() + i);
+			continue;
+		}
+		i++;
+	}
+}
+
+HRESULT CTeeStream::Pump(__in_opt IVirtualFs * file)
+{
+	std::vector<TEE_CONSUMER> active;
+	size_t i;
+	if (m_source == NULL) return E_NOT_VALID_STATE;
+
+	for (i = 0; i < m_consumers.size(); i++)
+	{
+		if (m_consumers[i]->OnStreamBegin(file, m_size) == S_OK)
+		{
+			TEE_CONSUMER entry = { m_consumers[i], NULL };
+			if (FAILED(m_consumers[i]->QueryInterface(__uuidof(IFsSparseConsumer), (LPVOID*)&entry.sparse)))
+				entry.sparse = NULL;
+			active.push_back(entry);
+		}
+	}
+	if (active.empty()) return S_OK;
+
+	HRESULT hr = S_OK;
+	BYTE * scratch = NULL;	// for the blocks past the cache
+	ULONGLONG offset = 0;
+	ULONGLONG dataStart = 0, dataEnd = 0;
+	while (offset < m_size && !active.empty())
+	{
+		// whole blocks in a hole are neither read nor cached
+		ULONGLONG holeEnd = GetHoleEnd(offset, &dataStart, &dataEnd);
+		if (holeEnd > offset)
+		{
+			for (size_t index = (size_t)(offset / TEE_BLOCK_SIZE); index < m_blocks.size() && (ULONGLONG)index * TEE_BLOCK_SIZE < holeEnd; index++)
+			{
+				if (m_blocks[index].data) continue;
+				m_blocks[index].hole = TRUE;
+				m_blocks[index].length = (ULONG)min((ULONGLONG)TEE_BLOCK_SIZE, m_size - (ULONGLONG)index * TEE_BLOCK_SIZE);
+			}
+			Deliver(active, offset, NULL, holeEnd - offset);
+			m_holeBytes += holeEnd - offset;
+			offset = holeEnd;
+			continue;
+		}
+
+		size_t index = (size_t)(offset / TEE_BLOCK_SIZE);
+		ULONG expected = (ULONG)min((ULONGLONG)TEE_BLOCK_SIZE, m_size - offset);
+		const BYTE * data;
+		ULONG length;
+
+		if (index < m_blocks.size() && SUCCEEDED(LoadBlock(index)))
+		{
+			data = m_blocks[index].hole ? s_zeros : m_blocks[index].data;
+			length = m_blocks[index].length;
+		}
+		else
+		{
+			if (scratch == NULL && (scratch = new BYTE[TEE_BLOCK_SIZE]) == NULL)
+			{
+				hr = E_OUTOFMEMORY;
+				break;
+			}
+			if (FAILED(hr = ReadSource(offset, scratch, expected, &length)))
+				break;
+			data = scratch;
+		}
+		if (length == 0) break;
+
+		Deliver(active, offset, data, length);
+		offset += length;
+		if (length < expected) break;	// the file is shorter than its size
+	}
+
+	if (scratch) delete[] scratch;
+	for (i = 0; i < active.size(); i++)
+	{
+		active[i].consumer->OnStreamEnd(hr);
+		if (active[i].sparse) active[i].sparse->Release();
+	}
+	return hr;
+}
+
+ULONGLONG CTeeStream::GetCacheLimit(void)
+{
+	static LONG64 s_limit = -1;
+	if (s_limit < 0)
+	{
+		WCHAR szValue[32];
+		LONG64 limit = TEE_DEFAULT_CACHE_MB;
+		DWORD length = GetEnvironmentVariableW(STREAM_CACHE_ENV, szValue, _countof(szValue));
+		if (length > 0 && length < _countof(szValue))
+			limit = max(_wtoi64(szValue), 0);
+		InterlockedExchange64(&s_limit, limit * 1024 * 1024);
+	}
+	return (ULONGLONG)s_limit;
+}
+
+HRESULT CTeeStream::Attach(__in IVirtualFs * file, __in const std::vector<IScanModule *> & modules, __in_opt IFsStreamConsumer * extra, __out CTeeStream ** tee)
+{
+	if (file == NULL || tee == NULL) return E_INVALIDARG;
+	*tee = NULL;
+
+	// members of archives are already in memory, or read from their container
+	ULONGLONG cacheLimit = GetCacheLimit();
+	IVirtualFs * container = NULL;
+	if (SUCCEEDED(file->GetContainer(&container)))
+	{
+		container->Release();
+		cacheLimit = 0;
+	}
+
+	std::vector<IFsStreamConsumer *> consumers;
+	size_t i, n;
+	n = modules.size();
+	for (i = 0; i < n; i++)
+	{
+		IFsStreamConsumer * consumer = NULL;
+		if (SUCCEEDED(modules[i]->QueryInterface(__uuidof(IFsStreamConsumer), (LPVOID*)&consumer)))
+			consumers.push_back(consumer);
+	}
+	if (extra)
+	{
+		extra->AddRef();
+		consumers.push_back(extra);
+	}
+
+	HRESULT hr = S_FALSE;
+	if (!consumers.empty() || cacheLimit)
+	{
+		IFsStream * source = NULL;
+		IFsAttribute * attribute = NULL;
+		ULARGE_INTEGER size = {};
+		if (SUCCEEDED(hr = file->QueryInterface(__uuidof(IFsAttribute), (LPVOID*)&attribute)))
+		{
+			hr = attribute->Size(&size);
+			attribute->Release();
+		}
+		if (SUCCEEDED(hr))
+			hr = file->QueryInterface(__uuidof(IFsStream), (LPVOID*)&source);
+
+		if (SUCCEEDED(hr))
+		{
+			CTeeStream * stream = new CTeeStream();
+			if (stream == NULL)
+				hr = E_OUTOFMEMORY;
+			else if (FAILED(hr = stream->Initialize(source, size.QuadPart, cacheLimit)) ||
+				FAILED(hr = file->AttachStream(stream)))
+				stream->Release();
+			else
+			{
+				for (i = 0; i < consumers.size(); i++)
+					stream->AddConsumer(consumers[i]);
+				*tee = stream;
+			}
+			source->Release();
+		}
+	}
+
+	for (i = 0; i < consumers.size(); i++)
+	{
+		consumers[i]->Release();
+	}
+	return hr;
+}
+
+HRESULT CTeeStream::Detach(__in IVirtualFs * file)
+{
+	if (file == NULL) return E_INVALIDARG;
+	Invalidate();
+	return file->AttachStream(NULL);
+}
+
+HRESULT WINAPI CTeeStream::Read(__out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out_opt ULONG * readSize)
+{
+	if (m_source == NULL) return E_NOT_SET;
+	if (buffer == NULL || bufferSize == 0) return E_INVALIDARG;
+
+	HRESULT hr = S_OK;
+	ULONG done = 0;
+	while (done < bufferSize && m_pos < m_size)
+	{
+		size_t index = (size_t)(m_pos / TEE_BLOCK_SIZE);
+		ULONG inBlock = (ULONG)(m_pos % TEE_BLOCK_SIZE);
+		ULONG chunk = min(bufferSize - done, TEE_BLOCK_SIZE - inBlock);
+
+		if (index < m_blocks.size() && SUCCEEDED(LoadBlock(index)))
+		{
+			const TEE_BLOCK & block = m_blocks[index];
+			if (inBlock >= block.length) break;
+			chunk = min(chunk, block.length - inBlock);
+			if (block.hole)
+				ZeroMemory((BYTE*)buffer + done, chunk);
+			else
+				memcpy((BYTE*)buffer + done, block.data + inBlock, chunk);
+		}
+		else
+		{
+			// past the cache: straight from the file
+			if (FAILED(hr = ReadSource(m_pos, (BYTE*)buffer + done, chunk, &chunk)) || chunk == 0)
+				break;
+		}
+		done += chunk;
+		m_pos += chunk;
+	}
+
+	if (readSize) *readSize = done;
+	return (FAILED(hr) && done == 0) ? hr : S_OK;
+}
+
+HRESULT WINAPI CTeeStream::ReadAt(__in LARGE_INTEGER const offset, __in const FsStreamSeek moveMethod,
+	__out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out_opt ULONG * readSize)
+{
+	HRESULT hr = Seek(NULL, offset, moveMethod);
+	if (FAILED(hr)) return hr;
+	return Read(buffer, bufferSize, readSize);
+}
+
+HRESULT WINAPI CTeeStream::Write(__in_bcount(bufferSize) LPCVOID buffer, __in ULONG bufferSize, __out_opt ULONG * writtenSize)
+{
+	if (m_source == NULL) return E_NOT_SET;
+	if (buffer == NULL || bufferSize == 0) return E_INVALIDARG;
+
+	LARGE_INTEGER position;
+	position.QuadPart = (LONGLONG)m_pos;
+	ULONG written = 0;
+	HRESULT hr = m_source->WriteAt(position, IFsStream::FsStreamBegin, buffer, bufferSize, &written);
+
+	// part of the bytes may be written even on failure
+	DropBlocks(m_pos, bufferSize);
+	if (FAILED(hr)) return hr;
+
+	m_pos += written;
+	if (m_pos > m_size)
+	{
+		// the last block no longer ends the file
+		if (m_size) DropBlocks(m_size - 1, 1);
+		m_size = m_pos;
+	}
+	if (writtenSize) *writtenSize = written;
+	return S_OK;
+}
+
+HRESULT WINAPI CTeeStream::WriteAt(__in LARGE_INTEGER const offset, __in const FsStreamSeek moveMethod,
+	__in_bcount(bufferSize) LPCVOID buffer, __in ULONG bufferSize, __out_opt ULONG * writtenSize)
+{
+	HRESULT hr = Seek(NULL, offset, moveMethod);
+	if (FAILED(hr)) return hr;
+	return Write(buffer, bufferSize, writtenSize);
+}
+
+HRESULT WINAPI CTeeStream::Tell(__out ULARGE_INTEGER * pos)
+{
+	if (m_source == NULL) return E_NOT_SET;
+	if (pos == NULL) return E_INVALIDARG;
+	pos->QuadPart = m_pos;
+	return S_OK;
+}
+
+HRESULT WINAPI CTeeStream::Seek(__out_opt ULARGE_INTEGER * pos, __in LARGE_INTEGER const distanceToMove, __in const FsStreamSeek MoveMethod)
+{
+	if (m_source == NULL) return E_NOT_SET;
+
+	LONGLONG base;
+	switch (MoveMethod)
+	{
+	case IFsStream::FsStreamBegin:
+		base = 0;
+		break;
+
+	case IFsStream::FsStreamCurrent:
+		base = (LONGLONG)m_pos;
+		break;
+
+	case IFsStream::FsStreamEnd:
+		base = (LONGLONG)m_size;
+		break;
+
+	default:
+		return E_INVALIDARG;
+	}
+
+	if (base + distanceToMove.QuadPart < 0)
+		return HRESULT_FROM_WIN32(ERROR_NEGATIVE_SEEK);
+
+	m_pos = (ULONGLONG)(base + distanceToMove.QuadPart);
+	if (pos) pos->QuadPart = m_pos;
+	return S_OK;
+}
+
+void WINAPI CTeeStream::SetFileHandle(__in void* const handle)
+{
+	if (m_source == NULL) return;
+	m_source->SetFileHandle(handle);
+	Invalidate();
+}
+
+HRESULT WINAPI CTeeStream::Shrink(void)
+{
+	if (m_source == NULL) return E_NOT_SET;
+
+	LARGE_INTEGER position;
+	position.QuadPart = (LONGLONG)m_pos;
+	HRESULT hr = m_source->Seek(NULL, position, IFsStream::FsStreamBegin);
+	if (FAILED(hr)) return hr;
+	if (FAILED(hr = m_source->Shrink())) return hr;
+
+	if (m_pos < m_size)
+	{
+		DropBlocks(m_pos, m_size - m_pos);
+		m_size = m_pos;
+	}
+	return S_OK;
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <TinyAvCore.h>
+#include <vector>
+
+#define TEE_BLOCK_SIZE			(256 * 1024)
+#define TEE_DEFAULT_CACHE_MB	(64)	// bytes of a file kept, see GetCacheLimit()
+
+typedef struct TEE_BLOCK
+{
+	BYTE *	data;		// NULL until the block is read
+	ULONG	length;		// less than TEE_BLOCK_SIZE for the last block
+	BOOL	hole;		// the block is in a hole of a sparse file: zeros, never read
+}TEE_BLOCK;
+
+// A consumer being given the file by Pump()
+typedef struct TEE_CONSUMER
+{
+	IFsStreamConsumer *	consumer;
+	IFsSparseConsumer *	sparse;		// NULL when the consumer wants the zeros of the holes
+}TEE_CONSUMER;
+
+// Stream a file is read through while the scan modules run. The file is read
+// once, in blocks of TEE_BLOCK_SIZE: Pump() hands every block to the stream
+// consumers in order, and the blocks are kept so the modules reading at random
+// offsets afterwards are served from memory. Bytes past the cache limit, or
+// when the memory governor is under pressure, are read from the file as
+// before. Writes go to the file and drop the blocks they touch.
+// When the file is sparse, the blocks inside its holes are not read: they are
+// given as holes to the consumers that take them, and as zeros to the others.
+class CTeeStream :
+	public CRefCount,
+	public IFsStream
+{
+protected:
+	IFsStream *			m_source;
+	IFsSparseStream *	m_sparse;		// holes of m_source, NULL when it has none
+	ULONGLONG			m_size;
+	ULONGLONG			m_pos;
+	ULONGLONG			m_cacheLimit;
+	ULONGLONG			m_cached;		// bytes held by m_blocks, charged to the governor
+	ULONGLONG			m_sourceBytes;	// bytes read from m_source
+	ULONGLONG			m_holeBytes;	// bytes of holes given without reads
+	std::vector<TEE_BLOCK>				m_blocks;
+	std::vector<IFsStreamConsumer *>	m_consumers;
+
+	virtual ~CTeeStream();
+
+	HRESULT ReadSource(__in ULONGLONG offset, __out_bcount(size) LPVOID buffer, __in ULONG size, __out ULONG * readSize);
+	BOOL CanCache(void);
+	HRESULT LoadBlock(__in size_t index);
+	void DropBlocks(__in ULONGLONG offset, __in ULONGLONG size);
+
+	// End of the whole blocks of a hole starting at offset, offset if none
+	ULONGLONG GetHoleEnd(__in ULONGLONG offset, __inout ULONGLONG * dataStart, __inout ULONGLONG * dataEnd);
+
+	/* Give a block, or a hole when data is NULL, to the consumers; those
+	failing it are ended and removed
+	*/
+	void Deliver(__inout std::vector<TEE_CONSUMER> & active, __in ULONGLONG offset, __in_opt const BYTE * data, __in ULONGLONG size);
+
+public:
+	CTeeStream();
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	/* Read a stream through the tee
+	@source: stream of the file
+	@size: size of the file in bytes
+	@cacheLimit: bytes of the file to keep in memory, 0 to keep none
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT Initialize(__in IFsStream * source, __in ULONGLONG size, __in ULONGLONG cacheLimit);
+
+	HRESULT AddConsumer(__in IFsStreamConsumer * consumer);
+
+	size_t GetConsumerCount(void) { return m_consumers.size(); }
+
+	/* Read the file from its start and give every block to the consumers
+	@file: the file, passed to IFsStreamConsumer::OnStreamBegin()
+	@return: S_OK, or the error that stopped the reads.
+	*/
+	HRESULT Pump(__in_opt IVirtualFs * file);
+
+	// Forget the blocks read so far, after the file was changed behind the tee
+	void Invalidate(void);
+
+	ULONGLONG GetSourceBytes(void) { return m_sourceBytes; }
+
+	ULONGLONG GetHoleBytes(void) { return m_holeBytes; }
+
+	// Cache limit per file, from TINYAV_STREAM_CACHE in megabytes (0 disables it)
+	static ULONGLONG GetCacheLimit(void);
+
+	/* Read a file through a new tee while modules scan it
+	@file: file to scan
+	@modules: scan modules; those exposing IFsStreamConsumer are registered
+	@extra: another consumer of the file, NULL for none
+	@tee: a pointer to a variable storing the tee, NULL when it has no use
+	for this file. Pass it to Detach() after the scan.
+	@return: HRESULT on success, or other value on failure.
+	*/
+	static HRESULT Attach(__in IVirtualFs * file, __in const std::vector<IScanModule *> & modules, __in_opt IFsStreamConsumer * extra, __out CTeeStream ** tee);
+
+	HRESULT Detach(__in IVirtualFs * file);
+
+	// implement IFsStream interface
+	virtual HRESULT WINAPI Read(__out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out_opt ULONG * readSize) override;
+
+	virtual HRESULT WINAPI ReadAt(__in LARGE_INTEGER const offset, __in const FsStreamSeek moveMethod,
+		__out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out_opt ULONG * readSize) override;
+
+	virtual HRESULT WINAPI Write(__in_bcount(bufferSize) LPCVOID buffer, __in ULONG bufferSize, __out_opt ULONG * writtenSize) override;
+
+	virtual HRESULT WINAPI WriteAt(__in LARGE_INTEGER const offset, __in const FsStreamSeek moveMethod,
+		__in_bcount(bufferSize) LPCVOID buffer, __in ULONG bufferSize, __out_opt ULONG * writtenSize) override;
+
+	virtual HRESULT WINAPI Tell(__out ULARGE_INTEGER * pos) override;
+
+	virtual HRESULT WINAPI Seek(__out_opt ULARGE_INTEGER * pos, __in LARGE_INTEGER const distanceToMove, __in const FsStreamSeek MoveMethod) override;
+
+	virtual void WINAPI SetFileHandle(__in void* const handle) override;
+
+	virtual HRESULT WINAPI Shrink(void) override;
+};
@@ -0,0 +1,232 @@
+#include "WatchFsEnum.h"
+#include <algorithm>
+#include <Shlwapi.h>
+#pragma comment(lib, "Shlwapi.lib")
+#include "..\Scanner\DirectoryCosts.h"
+
+CWatchFsEnum::CWatchFsEnum(void)
+{
+}
+
+CWatchFsEnum::~CWatchFsEnum(void)
+{
+}
+
+HRESULT WINAPI CWatchFsEnum::Enum(__in IFsEnumContext *context)
+{
+	if (context == NULL) return E_INVALIDARG;
+
+	HRESULT hr = S_OK;
+	IVirtualFs * searchContainer = NULL;
+	BSTR searchContainerPath = NULL;
+
+	if (FAILED(hr = context->GetSearchContainer(&searchContainer)) ||
+		FAILED(hr = searchContainer->GetFullPath(&searchContainerPath)))
+	{
+		if (searchContainer) searchContainer->Release();
+		return hr;
+	}
+	StringW root = searchContainerPath;
+	SysFreeString(searchContainerPath);
+	searchContainer->Release();
+
+	// a single file can not be watched; scan it once
+	if (TestFilePath(root.c_str()))
+		return CFileFsEnum::Enum(context);
+
+	HANDLE hDir = CreateFileW(root.c_str(), FILE_LIST_DIRECTORY,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if (hDir == INVALID_HANDLE_VALUE)
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	// ReadDirectoryChangesW requires a DWORD-aligned buffer
+	DWORD * buffer = new DWORD[WATCH_BUFFER_SIZE / sizeof(DWORD)];
+	OVERLAPPED ov = {};
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (buffer == NULL || ov.hEvent == NULL)
+	{
+		if (buffer) delete[] buffer;
+		if (ov.hEvent) CloseHandle(ov.hEvent);
+		CloseHandle(hDir);
+		return E_OUTOFMEMORY;
+	}
+
+	const DWORD notifyFilter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+		FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+	HANDLE waitTable[2] = { ov.hEvent, m_hStop };
+
+	InitArchiveObservers();
+	for (;;)
+	{
+		ResetEvent(ov.hEvent);
+		if (!ReadDirectoryChangesW(hDir, buffer, WATCH_BUFFER_SIZE, TRUE, notifyFilter, NULL, &ov, NULL))
+		{
+			hr = HRESULT_FROM_WIN32(GetLastError());
+			break;
+		}
+
+		// Block until something changes. While files are waiting to settle,
+		// wake up periodically to scan the ones that went quiet.
+		DWORD dwWait;
+		for (;;)
+		{
+			dwWait = WaitForMultipleObjects(2, waitTable, FALSE, m_pending.empty() ? INFINITE : WATCH_POLL_TIME);
+			if (dwWait != WAIT_TIMEOUT) break;
+			hr = ScanSettledFiles(context, FALSE);
+			if (hr == E_ABORT) break;
+		}
+
+		if (dwWait != WAIT_OBJECT_0 || hr == E_ABORT)
+		{
+			DWORD dwBytes = 0;
+			CancelIo(hDir);
+			GetOverlappedResult(hDir, &ov, &dwBytes, TRUE);
+			hr = S_OK;
+			break;
+		}
+
+		DWORD dwBytes = 0;
+		if (!GetOverlappedResult(hDir, &ov, &dwBytes, FALSE))
+		{
+			hr = HRESULT_FROM_WIN32(GetLastError());
+			break;
+		}
+
+		if (dwBytes == 0)
+		{
+			// The notification buffer overflowed and the changes were lost.
+			// Fall back to a full walk so no modified file goes unchecked.
+			m_pending.clear();
+			CleanupArchiveObservers();
+			hr = CFileFsEnum::Enum(context);
+			InitArchiveObservers();
+			if (hr == E_ABORT) break;
+			continue;
+		}
+
+		OnChanges(root.c_str(), (const BYTE*)buffer, dwBytes, context);
+	}
+
+	// scan what is still pending before leaving
+	if (WaitForSingleObject(m_hStop, 0) != WAIT_OBJECT_0)
+		ScanSettledFiles(context, TRUE);
+	if (m_costs) m_costs->Flush();
+	CleanupArchiveObservers();
+
+	CloseHandle(ov.hEvent);
+	CloseHandle(hDir);
+	delete[] buffer;
+	return hr;
+}
+
+void WINAPI CWatchFsEnum::OnChanges(__in LPCWSTR lpRoot, __in_bcount(size) const BYTE * buffer, __in DWORD size, __in IFsEnumContext *context)
+{
+	BSTR searchPattern = NULL;
+	context->GetSearchPattern(&searchPattern);
+	int maxDepth = context->GetMaxDepth();
+	ULONGLONG now = GetTickCount64();
+	DWORD offset = 0;
+
+	for (;;)
+	{
+		if (offset + sizeof(FILE_NOTIFY_INFORMATION) > size) break;
+		const FILE_NOTIFY_INFORMATION * info = (const FILE_NOTIFY_INFORMATION *)(buffer + offset);
+		StringW relativePath(info->FileName, info->FileNameLength / sizeof(WCHAR));
+		StringW fullPath = MakePath(lpRoot, relativePath.c_str());
+
+		switch (info->Action)
+		{
+		case FILE_ACTION_ADDED:
+		case FILE_ACTION_MODIFIED:
+		case FILE_ACTION_RENAMED_NEW_NAME:
+		{
+			// apply the same filters as a full walk
+			int depth = 1 + (int)std::count(relativePath.begin(), relativePath.end(), L'\\');
+			if (maxDepth != -1 && depth > maxDepth) break;
+
+			size_t pos = relativePath.rfind(L'\\');
+			LPCWSTR fileName = relativePath.c_str() + ((pos == StringW::npos) ? 0 : pos + 1);
+			if (searchPattern && !PathMatchSpecW(fileName, searchPattern)) break;
+
+			// bursts of events for the same file collapse into one entry
+			m_pending[fullPath] = { now, depth };
+			break;
+		}
+
+		case FILE_ACTION_REMOVED:
+		case FILE_ACTION_RENAMED_OLD_NAME:
+			m_pending.erase(fullPath);
+			break;
+
+		default:
+			break;
+		}
+
+		if (info->NextEntryOffset == 0) break;
+		offset += info->NextEntryOffset;
+	}
+
+	if (searchPattern) SysFreeString(searchPattern);
+}
+
+HRESULT WINAPI CWatchFsEnum::ScanSettledFiles(__in IFsEnumContext *context, __in BOOL flushAll)
+{
+	HRESULT hr = S_OK;
+	ULONGLONG now = GetTickCount64();
+
+	PENDING_MAP::iterator it = m_pending.begin();
+	while (it != m_pending.end())
+	{
+		if (!flushAll && now - it->second.lastChange < WATCH_SETTLE_TIME)
+		{
+			++it;
+			continue;
+		}
+
+		if (!TestFilePath(it->first.c_str()))
+		{
+			// removed since, or a directory
+			it = m_pending.erase(it);
+			continue;
+		}
+
+		if (!flushAll && IsFileBeingWritten(it->first.c_str()))
+		{
+			// debounce: check again on the next round
+			it->second.lastChange = now;
+			++it;
+			continue;
+		}
+
+		StringW path = it->first;
+		int depth = it->second.depth;
+		it = m_pending.erase(it);
+
+		hr = OnEnumEntryFound(NULL, path.c_str(), context, depth);
+		if (hr == E_ABORT || WaitForSingleObject(m_hStop, 0) == WAIT_OBJECT_0)
+			return E_ABORT;
+
+		if (FAILED(hr))
+		{
+			if (hr == E_NOT_SET)
+				OnError(FsEnumNotFound, path.c_str());
+
+			OnError(FsEnumAccessDenied, path.c_str());
+		}
+	}
+
+	return S_OK;
+}
+
+BOOL WINAPI CWatchFsEnum::IsFileBeingWritten(__in LPCWSTR lpFileName)
+{
+	// A writer still holding the file open makes a deny-write open fail.
+	HANDLE hFile = CreateFileW(lpFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return GetLastError() == ERROR_SHARING_VIOLATION;
+
+	CloseHandle(hFile);
+	return FALSE;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "FileFsEnum.h"
+#include <map>
+
+#define WATCH_BUFFER_SIZE	(64 * 1024)
+#define WATCH_SETTLE_TIME	(250)	// ms without change events before a file is scanned
+#define WATCH_POLL_TIME		(100)	// ms between checks of pending files
+
+// Watches the search container for changes and scans only the files that were
+// created, modified or renamed into it. The enumeration runs until Stop().
+class CWatchFsEnum :
+	public CFileFsEnum
+{
+protected:
+	typedef struct WATCH_ENTRY
+	{
+		ULONGLONG lastChange;	// tick count of the last change event
+		int depth;
+	}WATCH_ENTRY;
+
+	// full path -> pending change
+	typedef std::map<StringW, WATCH_ENTRY> PENDING_MAP;
+
+	PENDING_MAP m_pending;
+
+	virtual ~CWatchFsEnum(void);
+
+	virtual void WINAPI OnChanges(__in LPCWSTR lpRoot, __in_bcount(size) const BYTE * buffer, __in DWORD size, __in IFsEnumContext *context);
+	virtual HRESULT WINAPI ScanSettledFiles(__in IFsEnumContext *context, __in BOOL flushAll);
+	virtual BOOL WINAPI IsFileBeingWritten(__in LPCWSTR lpFileName);
+
+public:
+	CWatchFsEnum(void);
+
+	virtual HRESULT WINAPI Enum(__in IFsEnumContext *context) override;
+};
@@ -0,0 +1,77 @@
+#include "CarveFs.h"
+#include "CarveFsStream.h"
+#include "CarveFsAttribute.h"
+
+CCarveFs::CCarveFs()
+{
+	m_fsType = IVirtualFs::archive;
+	if (m_attribute)m_attribute->Release();
+	m_attribute = static_cast<IFsAttribute*> (new CCarveFsAttribute());
+	if (m_stream)m_stream->Release();
+	m_stream = static_cast<IFsStream *> (new CCarveFsStream());
+	m_delimiter = StringW(L">");
+}
+
+CCarveFs::~CCarveFs()
+{
+	Close();
+}
+
+HRESULT WINAPI CCarveFs::Create(__in LPCWSTR lpFileName, __in ULONG const flags)
+{
+	if (m_container == NULL)
+		return E_NOT_SET;
+	if (lpFileName == NULL) return E_INVALIDARG;
+	m_FileName = lpFileName;
+	m_flags = flags;
+
+	if (m_attribute == NULL || m_stream == NULL)
+	{
+		Close();
+		return E_OUTOFMEMORY;
+	}
+	m_attribute->SetFilePath(m_FileName.c_str());
+	return S_OK;
+}
+
+HRESULT WINAPI CCarveFs::SetWindow(__in IFsStream * parent, __in ULONGLONG offset, __in ULONGLONG size)
+{
+	if (parent == NULL) return E_INVALIDARG;
+	if (m_container == NULL || m_stream == NULL) return E_NOT_SET;
+
+	HRESULT hr = static_cast<CCarveFsStream*>(m_stream)->SetWindow(parent, offset, size);
+	if (FAILED(hr)) return hr;
+
+	IFsAttribute * parentAttribute = NULL;
+	m_container->QueryInterface(__uuidof(IFsAttribute), (LPVOID*)&parentAttribute);
+	hr = static_cast<CCarveFsAttribute*>(m_attribute)->SetWindow(size, parentAttribute);
+	if (parentAttribute) parentAttribute->Release();
+
+	// the parent stream serves as the handle of the carved image
+	m_handle = (HANDLE)parent;
+	return hr;
+}
+
+HRESULT WINAPI CCarveFs::Close(void)
+{
+	m_handle = INVALID_HANDLE_VALUE;
+	if (m_stream)
+		m_stream->SetFileHandle(m_handle);
+	return S_OK;
+}
+
+HRESULT WINAPI CCarveFs::ReCreate(__in_opt void* handle, __in_opt ULONG const flags /*= 0*/)
+{
+	UNREFERENCED_PARAMETER(handle);
+	if (flags)
+		m_flags = flags;
+
+	// a window can not be reopened once it was closed
+	return (m_handle != INVALID_HANDLE_VALUE) ? S_OK : E_NOT_VALID_STATE;
+}
+
+HRESULT WINAPI CCarveFs::DeferredDelete(void)
+{
+	// carved images are read-only views; never delete the whole image or dump
+	return E_ACCESSDENIED;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <TinyAvCore.h>
+#include "../FileFs.h"
+
+// Executable image carved out of a container (disk image, memory dump...).
+// The object is a read-only window over the container stream.
+class CCarveFs : public CFileFs
+{
+protected:
+	virtual ~CCarveFs();
+public:
+	CCarveFs();
+
+	/* Map the carved image onto the container stream
+	@parent: stream of the container.
+	@offset: offset of the image in the container.
+	@size: size of the image.
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT WINAPI SetWindow(__in IFsStream * parent, __in ULONGLONG offset, __in ULONGLONG size);
+
+	virtual HRESULT WINAPI Create(__in LPCWSTR path, __in ULONG const flags) override;
+
+	virtual HRESULT WINAPI Close(void) override;
+
+	virtual HRESULT WINAPI ReCreate(__in_opt void* handle, __in_opt ULONG const flags /*= 0*/) override;
+
+	virtual HRESULT WINAPI DeferredDelete(void) override;
+};
@@ -0,0 +1,51 @@
+#include "CarveFsAttribute.h"
+
+CCarveFsAttribute::CCarveFsAttribute(void)
+{
+}
+
+CCarveFsAttribute::~CCarveFsAttribute(void)
+{
+}
+
+HRESULT WINAPI CCarveFsAttribute::SetWindow(__in ULONGLONG size, __in_opt IFsAttribute * parent)
+{
+	m_wfd.nFileSizeHigh = (DWORD)(size >> 32);
+	m_wfd.nFileSizeLow = (DWORD)(size & 0xFFFFFFFF);
+	m_wfd.dwFileAttributes = FILE_ATTRIBUTE_READONLY;
+
+	if (parent)
+	{
+		parent->Time(&m_wfd.ftCreationTime, &m_wfd.ftLastAccessTime, &m_wfd.ftLastWriteTime);
+	}
+	m_bInited = TRUE;
+	return S_OK;
+}
+
+HRESULT WINAPI CCarveFsAttribute::QueryAttributes(void)
+{
+	// all attributes are set by SetWindow; nothing to query from the file system
+	return m_bInited ? S_OK : E_NOT_SET;
+}
+
+HRESULT WINAPI CCarveFsAttribute::SetAttributes(__in DWORD attribs)
+{
+	UNREFERENCED_PARAMETER(attribs);
+	return E_NOTIMPL;
+}
+
+HRESULT WINAPI CCarveFsAttribute::SetTime(__in_opt FILETIME *lpCreationTime, __in_opt FILETIME *lpLastAccessTime, __in_opt FILETIME *lpLastWriteTime)
+{
+	UNREFERENCED_PARAMETER(lpCreationTime);
+	UNREFERENCED_PARAMETER(lpLastWriteTime);
+	UNREFERENCED_PARAMETER(lpLastAccessTime);
+
+	return E_NOTIMPL;
+}
+
+HRESULT WINAPI CCarveFsAttribute::SetFilePath(__in LPCWSTR lpFilePath, __in_opt void* handle /*= NULL*/)
+{
+	m_handle = (HANDLE)handle;
+	m_fileName = lpFilePath;
+	return S_OK;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "../FileFsAttribute.h"
+
+class CCarveFsAttribute :
+	public CFileFsAttribute
+{
+protected:
+	virtual ~CCarveFsAttribute(void);
+
+public:
+	CCarveFsAttribute(void);
+
+	/* Describe the carved image
+	@size: size of the carved image.
+	@parent: attribute of the carved container. Its times are inherited.
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT WINAPI SetWindow(__in ULONGLONG size, __in_opt IFsAttribute * parent);
+
+	virtual HRESULT WINAPI QueryAttributes(void);
+
+	virtual HRESULT WINAPI SetAttributes(__in DWORD attribs) override;
+
+	virtual HRESULT WINAPI SetTime(__in_opt FILETIME *lpCreationTime, __in_opt FILETIME *lpLastAccessTime, __in_opt FILETIME *lpLastWriteTime) override;
+
+	virtual HRESULT WINAPI SetFilePath(__in LPCWSTR lpFilePath, __in_opt void* handle /*= NULL*/) override;
+};
@@ -0,0 +1,198 @@
+#include "CarveFsEnum.h"
+#include "CarveFs.h"
+#include "../../FileType/PeFileParser.h"
+
+CCarveFsEnum::CCarveFsEnum(void)
+{
+}
+
+CCarveFsEnum::~CCarveFsEnum(void)
+{
+}
+
+HRESULT WINAPI CCarveFsEnum::Enum(__in IFsEnumContext *context)
+{
+	HRESULT hr;
+	IVirtualFs * container = NULL;
+	IFsStream * stream = NULL;
+	IFsAttribute * attribute = NULL;
+	ULARGE_INTEGER containerSize = {};
+
+	if (context == NULL) return E_INVALIDARG;
+	if (!TEST_FLAG(context->GetFlags(), IFsEnumContext::CarveImages)) return S_FALSE;
+
+	hr = context->GetSearchContainer(&container);
+	if (FAILED(hr)) return hr;
+
+	// images found inside a carved image are already reported by its parent
+	if (dynamic_cast<CCarveFs*>(container) != NULL)
+	{
+		container->Release();
+		return S_FALSE;
+	}
+
+	if (SUCCEEDED(hr = container->QueryInterface(__uuidof(IFsStream), (LPVOID*)&stream)) &&
+		SUCCEEDED(hr = container->QueryInterface(__uuidof(IFsAttribute), (LPVOID*)&attribute)) &&
+		SUCCEEDED(hr = attribute->Size(&containerSize)))
+	{
+		hr = CarveImages(container, stream, containerSize.QuadPart, context);
+	}
+
+	if (attribute) attribute->Release();
+	if (stream) stream->Release();
+	container->Release();
+	return hr;
+}
+
+HRESULT WINAPI CCarveFsEnum::CarveImages(__in IVirtualFs * container, __in IFsStream * stream, __in ULONGLONG containerSize, __in IFsEnumContext * context)
+{
+	HRESULT hr = S_OK;
+	ULONGLONG pos = 0;
+	BYTE * block = new BYTE[CARVE_BLOCK_SIZE];
+	if (block == NULL) return E_OUTOFMEMORY;
+
+	IPeFile * parser = static_cast<IPeFile*>(new CPeFileParser());
+	if (parser == NULL)
+	{
+		delete[] block;
+		return E_OUTOFMEMORY;
+	}
+
+	while (pos + 1 < containerSize)
+	{
+		if (IsPastDeadline(context))
+		{
+			hr = HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+			goto Exit;
+		}
+
+		LARGE_INTEGER offset;
+		ULONG readSize = 0;
+		offset.QuadPart = (LONGLONG)pos;
+		if (FAILED(stream->ReadAt(offset, IFsStream::FsStreamBegin, block, CARVE_BLOCK_SIZE, &readSize)) || readSize < 2)
+			break;
+
+		// Candidates are "MZ" pairs that start inside this block. memchr is
+		// vectorized by the CRT, so the search runs close to memory bandwidth;
+		// the expensive checks only run on the rare hits.
+		const BYTE * p = block;
+		const BYTE * end = block + readSize - 1;
+		while (p < end && (p = (const BYTE*)memchr(p, 'M', end - p)) != NULL)
+		{
+			if (p[1] == 'Z')
+			{
+				ULONGLONG candidate = pos + (ULONGLONG)(p - block);
+				// the image at offset 0 is the container itself
+				if (candidate != 0)
+				{
+					hr = ProbeImage(container, stream, candidate, containerSize - candidate,
+						p, (ULONG)(block + readSize - p), parser, context);
+					if (hr == E_ABORT || hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT))
+						goto Exit;
+				}
+			}
+			p++;
+		}
+
+		// the last byte may be the 'M' of a pair split across blocks
+		pos += readSize - 1;
+	}
+	hr = S_OK;
+
+Exit:
+	parser->Release();
+	delete[] block;
+	return hr;
+}
+
+HRESULT WINAPI CCarveFsEnum::ProbeImage(__in IVirtualFs * container, __in IFsStream * stream, __in ULONGLONG offset, __in ULONGLONG maxSize,
+	__in_bcount(bufferSize) const BYTE * buffer, __in ULONG bufferSize, __in IPeFile * parser, __in IFsEnumContext * context)
+{
+	LONG lfanew = 0;
+	DWORD signature = 0;
+	LARGE_INTEGER readOffset;
+	ULONG readSize = 0;
+
+	if (maxSize < sizeof(IMAGE_DOS_HEADER) + sizeof(IMAGE_NT_HEADERS32)) return S_FALSE;
+
+	// cheap structural checks on the bytes already in memory
+	if (bufferSize >= sizeof(IMAGE_DOS_HEADER))
+	{
+		lfanew = ((const IMAGE_DOS_HEADER*)buffer)->e_lfanew;
+	}
+	else
+	{
+		readOffset.QuadPart = (LONGLONG)(offset + FIELD_OFFSET(IMAGE_DOS_HEADER, e_lfanew));
+		if (FAILED(stream->ReadAt(readOffset, IFsStream::FsStreamBegin, &lfanew, sizeof(lfanew), &readSize)) || readSize != sizeof(lfanew))
+			return S_FALSE;
+	}
+
+	if (lfanew <= 0 ||
+		lfanew > MAX_PE_HEADER_SIZE - (LONG)sizeof(IMAGE_NT_HEADERS32) ||
+		(ULONGLONG)lfanew + sizeof(IMAGE_NT_HEADERS32) >= maxSize)
+		return S_FALSE;
+
+	if ((ULONG)lfanew + sizeof(signature) <= bufferSize)
+	{
+		signature = *(const DWORD*)(buffer + lfanew);
+	}
+	else
+	{
+		readOffset.QuadPart = (LONGLONG)(offset + lfanew);
+		if (FAILED(stream->ReadAt(readOffset, IFsStream::FsStreamBegin, &signature, sizeof(signature), &readSize)) || readSize != sizeof(signature))
+			return S_FALSE;
+	}
+
+	if (signature != IMAGE_NT_SIGNATURE) return S_FALSE;
+
+	// full header validation
+	WCHAR szName[32];
+	swprintf_s(szName, _countof(szName), L"@0x%I64X", offset);
+
+	CCarveFs * carved = new CCarveFs();
+	if (carved == NULL) return E_OUTOFMEMORY;
+	IVirtualFs * carvedFile = static_cast<IVirtualFs*>(carved);
+
+	HRESULT hr = S_FALSE;
+	BOOL isPe = FALSE;
+	if (SUCCEEDED(carvedFile->SetContainer(container)) &&
+		SUCCEEDED(carvedFile->Create(szName, IVirtualFs::fsRead)) &&
+		SUCCEEDED(carved->SetWindow(stream, offset, maxSize)) &&
+		SUCCEEDED(parser->CheckType(carvedFile, &isPe)) && isPe)
+	{
+		// the image ends with the raw data of its last section
+		IMAGE_NT_HEADERS32 peHeader;
+		IMAGE_SECTION_HEADER section;
+		ULONGLONG imageSize = 0;
+		if (SUCCEEDED(parser->GetPEHeader(&peHeader)))
+			imageSize = peHeader.OptionalHeader.SizeOfHeaders;
+		for (UINT i = 0; i < parser->GetSectionCount(); ++i)
+		{
+			if (SUCCEEDED(parser->GetSectionHeader(i, &section)) &&
+				(ULONGLONG)section.PointerToRawData + section.SizeOfRawData > imageSize)
+			{
+				imageSize = (ULONGLONG)section.PointerToRawData + section.SizeOfRawData;
+			}
+		}
+		parser->ReleaseCurrentFile();
+
+		if (imageSize > maxSize || imageSize == 0)
+			imageSize = maxSize;
+
+		if (SUCCEEDED(carved->SetWindow(stream, offset, imageSize)))
+		{
+			int currentDepthInArchive = context->GetDepthInArchive();
+			context->SetDepthInArchive(currentDepthInArchive + 1);
+			hr = OnFileFound(carvedFile, context, context->GetDepth() + 1);
+			context->SetDepthInArchive(currentDepthInArchive);
+		}
+	}
+	else
+	{
+		parser->ReleaseCurrentFile();
+	}
+
+	carvedFile->Close();
+	carvedFile->Release();
+	return hr;
+}
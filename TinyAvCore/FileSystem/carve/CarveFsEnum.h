@@ -0,0 +1,22 @@
+#pragma once
+#include "../FileFsEnum.h"
+
+#define CARVE_BLOCK_SIZE	(1024 * 1024)
+
+// Locates PE images embedded at arbitrary offsets of a container (raw disk
+// images, memory dumps...) and reports each of them as a virtual child file.
+class CCarveFsEnum :
+	public CFileFsEnum
+{
+protected:
+	virtual ~CCarveFsEnum(void);
+
+	virtual HRESULT WINAPI CarveImages(__in IVirtualFs * container, __in IFsStream * stream, __in ULONGLONG containerSize, __in IFsEnumContext * context);
+	virtual HRESULT WINAPI ProbeImage(__in IVirtualFs * container, __in IFsStream * stream, __in ULONGLONG offset, __in ULONGLONG maxSize,
+		__in_bcount(bufferSize) const BYTE * buffer, __in ULONG bufferSize, __in IPeFile * parser, __in IFsEnumContext * context);
+
+public:
+	CCarveFsEnum(void);
+
+	virtual HRESULT WINAPI Enum(__in IFsEnumContext *context) override;
+};
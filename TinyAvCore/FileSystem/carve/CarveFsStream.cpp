@@ -0,0 +1,146 @@
+#include "CarveFsStream.h"
+
+CCarveFsStream::CCarveFsStream(void) :
+	m_parent(NULL),
+	m_base(0),
+	m_size(0),
+	m_CurrPos(0)
+{
+}
+
+CCarveFsStream::~CCarveFsStream(void)
+{
+	SetFileHandle(INVALID_HANDLE_VALUE);
+}
+
+HRESULT WINAPI CCarveFsStream::QueryInterface(
+	__in REFIID riid,
+	__out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown) ||
+		IsEqualIID(riid, __uuidof(IFsStream)))
+	{
+		*ppvObject = static_cast<IFsStream*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	return E_NOINTERFACE;
+}
+
+HRESULT WINAPI CCarveFsStream::SetWindow(__in IFsStream * parent, __in ULONGLONG base, __in ULONGLONG size)
+{
+	if (parent == NULL) return E_INVALIDARG;
+	parent->AddRef();
+	if (m_parent) m_parent->Release();
+	m_parent = parent;
+	m_base = base;
+	m_size = size;
+	m_CurrPos = 0;
+	return S_OK;
+}
+
+HRESULT WINAPI CCarveFsStream::Read(__out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out_opt ULONG * readSize)
+{
+	if (m_parent == NULL) return E_NOT_SET;
+	if (buffer == NULL || bufferSize == 0) return E_INVALIDARG;
+
+	ULONG copySize = bufferSize;
+	if (m_CurrPos + bufferSize > m_size)
+		copySize = (ULONG)(m_size - m_CurrPos);
+
+	if (readSize) *readSize = 0;
+	if (copySize == 0) return S_OK;
+
+	LARGE_INTEGER offset;
+	ULONG r = 0;
+	offset.QuadPart = (LONGLONG)(m_base + m_CurrPos);
+	HRESULT hr = m_parent->ReadAt(offset, IFsStream::FsStreamBegin, buffer, copySize, &r);
+	if (FAILED(hr)) return hr;
+
+	m_CurrPos += r;
+	if (readSize) *readSize = r;
+	return S_OK;
+}
+
+HRESULT WINAPI CCarveFsStream::ReadAt(
+	__in LARGE_INTEGER const offset, __in const FsStreamSeek moveMethod,
+	__out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out_opt ULONG * readSize)
+{
+	HRESULT hr = Seek(NULL, offset, moveMethod);
+	if (FAILED(hr)) return hr;
+	return Read(buffer, bufferSize, readSize);
+}
+
+HRESULT WINAPI CCarveFsStream::Write(__in_bcount(bufferSize) LPCVOID buffer, __in ULONG bufferSize, __out_opt ULONG * writtenSize)
+{
+	UNREFERENCED_PARAMETER(buffer);
+	UNREFERENCED_PARAMETER(bufferSize);
+	if (writtenSize) *writtenSize = 0;
+	return E_ACCESSDENIED;
+}
+
+HRESULT WINAPI CCarveFsStream::WriteAt(
+	__in LARGE_INTEGER const offset, __in const FsStreamSeek moveMethod,
+	__in_bcount(bufferSize) LPCVOID buffer, __in ULONG bufferSize, __out_opt ULONG * writtenSize)
+{
+	UNREFERENCED_PARAMETER(offset);
+	UNREFERENCED_PARAMETER(moveMethod);
+	return Write(buffer, bufferSize, writtenSize);
+}
+
+HRESULT WINAPI CCarveFsStream::Tell(__out ULARGE_INTEGER * pos)
+{
+	if (pos == NULL) return E_INVALIDARG;
+
+	pos->QuadPart = m_CurrPos;
+	return S_OK;
+}
+
+HRESULT WINAPI CCarveFsStream::Seek(__out_opt ULARGE_INTEGER * pos, __in LARGE_INTEGER const distanceToMove, __in const FsStreamSeek MoveMethod)
+{
+	ULONGLONG newPos;
+
+	switch (MoveMethod)
+	{
+	case FsStreamBegin:
+		newPos = distanceToMove.QuadPart;
+		break;
+
+	case FsStreamCurrent:
+		newPos = m_CurrPos + distanceToMove.QuadPart;
+		break;
+
+	case FsStreamEnd:
+		newPos = m_size + distanceToMove.QuadPart;
+		break;
+
+	default:
+		return E_INVALIDARG;
+	}
+
+	if (newPos > m_size) return E_INVALIDARG;
+	m_CurrPos = newPos;
+	if (pos)
+		pos->QuadPart = m_CurrPos;
+	return S_OK;
+}
+
+void WINAPI CCarveFsStream::SetFileHandle(__in void* const handle)
+{
+	if ((HANDLE)handle == INVALID_HANDLE_VALUE || handle == NULL)
+	{
+		if (m_parent)
+		{
+			m_parent->Release();
+			m_parent = NULL;
+		}
+		m_base = m_size = m_CurrPos = 0;
+	}
+}
+
+HRESULT WINAPI CCarveFsStream::Shrink(void)
+{
+	return E_ACCESSDENIED;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <TinyAvCore.h>
+
+// Read-only window over a range of a parent stream. No data is copied: every
+// read is forwarded to the parent stream at (base + position).
+class CCarveFsStream :
+	public CRefCount,
+	public IFsStream
+{
+protected:
+	IFsStream *	m_parent;
+	ULONGLONG	m_base;
+	ULONGLONG	m_size;
+	ULONGLONG	m_CurrPos;
+	virtual ~CCarveFsStream(void);
+public:
+	CCarveFsStream(void);
+
+	// implement IUnknown Interface 
+	DECLARE_REF_COUNT();
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	/* Attach the window to a parent stream
+	@parent: stream of the carved container.
+	@base: offset of the first byte of the window in the parent stream.
+	@size: number of bytes visible through the window.
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT WINAPI SetWindow(__in IFsStream * parent, __in ULONGLONG base, __in ULONGLONG size);
+
+	// implement IFsStream Interface 
+	virtual HRESULT WINAPI Read(__out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out_opt ULONG * readSize) override;
+
+	virtual HRESULT WINAPI ReadAt(__in LARGE_INTEGER const offset, __in const FsStreamSeek moveMethod, __out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out_opt ULONG * readSize) override;
+
+	virtual HRESULT WINAPI Write(__in_bcount(bufferSize) LPCVOID buffer, __in ULONG bufferSize, __out_opt ULONG * writtenSize) override;
+
+	virtual HRESULT WINAPI WriteAt(__in LARGE_INTEGER const offset, __in const FsStreamSeek moveMethod, __in_bcount(bufferSize) LPCVOID buffer, __in ULONG bufferSize, __out_opt ULONG * writtenSize) override;
+
+	virtual HRESULT WINAPI Tell(__out ULARGE_INTEGER * pos) override;
+
+	virtual HRESULT WINAPI Seek(__out_opt ULARGE_INTEGER * pos, __in LARGE_INTEGER const distanceToMove, __in const FsStreamSeek MoveMethod) override;
+
+	virtual void WINAPI SetFileHandle(__in void* const handle) override;
+
+	virtual HRESULT WINAPI Shrink(void) override;
+};
@@ -7,6 +7,9 @@ CZipFs::CZipFs()
 {
 	m_fsType = IVirtualFs::archive;
 	ZeroMemory(&m_currentFilePos, sizeof(m_currentFilePos));
+	m_hasEntry = FALSE;
+	ZeroMemory(&m_entryPos, sizeof(m_entryPos));
+	ZeroMemory(&m_entryInfo, sizeof(m_entryInfo));
 	if (m_attribute)m_attribute->Release();
 	m_attribute = static_cast<IFsAttribute*> (new CZipFsAttribute());
 	if (m_stream)m_stream->Release();
@@ -35,6 +38,14 @@ HRESULT WINAPI CZipFs::Create(__in LPCWSTR lpFileName, __in ULONG const flags)
 	return S_OK;
 }
 
+HRESULT CZipFs::SetEntry(__in const unz64_file_pos & pos, __in const unz_file_info64 & info)
+{
+	m_entryPos = pos;
+	m_entryInfo = info;
+	m_hasEntry = TRUE;
+	return S_OK;
+}
+
 HRESULT WINAPI CZipFs::Close(void)
 {
 	HRESULT hr = S_OK;
@@ -64,13 +75,23 @@ HRESULT WINAPI CZipFs::ReCreate(__in_opt void* handle, __in_opt ULONG const flag
 
 	m_handle = (HANDLE)handle;
 
-	StringA strNameA = UnicodeToAnsi(m_FileName);
-
 	if (UNZ_OK != unzGetFilePos64((unzFile)m_handle, &m_currentFilePos))
 		return E_NOT_SET;
 
-	if (unzLocateFile((unzFile)m_handle, strNameA.c_str(), 0) != UNZ_OK)
-		return E_FAIL;
+	if (m_hasEntry)
+	{
+		// usually the archive is still on the entry
+		if (m_currentFilePos.pos_in_zip_directory != m_entryPos.pos_in_zip_directory &&
+			unzGoToFilePos64((unzFile)m_handle, &m_entryPos) != UNZ_OK)
+			return E_FAIL;
+	}
+	else
+	{
+		// unzLocateFile() reads the whole central directory up to the name
+		StringA strNameA = UnicodeToAnsi(m_FileName);
+		if (unzLocateFile((unzFile)m_handle, strNameA.c_str(), 0) != UNZ_OK)
+			return E_FAIL;
+	}
 
 	HRESULT hr = (unzOpenCurrentFile((unzFile)m_handle) == UNZ_OK) ? S_OK : E_FAIL;
 	if (FAILED(hr))
@@ -84,12 +105,20 @@ HRESULT WINAPI CZipFs::ReCreate(__in_opt void* handle, __in_opt ULONG const flag
 		m_stream->Release();
 		m_stream = NULL;
 	}
-	m_stream = new CBufferedStream();
-	if (m_stream == NULL)
+	CBufferedStream * stream = new CBufferedStream();
+	if (stream == NULL)
 	{
 		Close();
 		return E_OUTOFMEMORY;
 	}
+	m_stream = stream;
+
+	// the member is inflated into a buffer of its declared size, without
+	// copies as it grows
+	unz_file_info64 info = m_entryInfo;
+	if (m_hasEntry ||
+		unzGetCurrentFileInfo64((unzFile)m_handle, &info, NULL, 0, NULL, 0, NULL, 0) == UNZ_OK)
+		stream->Reserve(info.uncompressed_size);
 
 	int err = 0;
 	unsigned char *pTemp = new unsigned char[WRITEBUFFERSIZE];
@@ -118,6 +147,9 @@ HRESULT WINAPI CZipFs::ReCreate(__in_opt void* handle, __in_opt ULONG const flag
 	ULARGE_INTEGER pos = {};
 	LARGE_INTEGER distanceToMove = {};
 	m_stream->Seek(&pos, distanceToMove, IFsStream::FsStreamBegin);
-	m_attribute->SetFilePath(m_FileName.c_str(), handle);
+	if (m_hasEntry)
+		static_cast<CZipFsAttribute*>(m_attribute)->SetEntry(m_FileName.c_str(), handle, m_entryInfo);
+	else
+		m_attribute->SetFilePath(m_FileName.c_str(), handle);
 	return S_OK;
 }
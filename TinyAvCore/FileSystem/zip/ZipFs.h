@@ -1,5 +1,6 @@
 #include <TinyAvCore.h>
 #include "../FileFs.h"
+#include "../ByteName.h"
 #ifdef __cplusplus
 extern "C"
 {
@@ -11,14 +12,27 @@ extern "C"
 #endif // __cplusplus
 
 #define  WRITEBUFFERSIZE  ( 16 * 1024)
+#define  ZIP_FLAG_UTF8    (1 << 11)	// general purpose bit 11: name and comment are UTF-8
 class CZipFs : public CFileFs
 {
 protected:
 	unz64_file_pos m_currentFilePos;
+	// set by the enumerator, which has already read the entry from the central directory
+	BOOL m_hasEntry;
+	unz64_file_pos m_entryPos;
+	unz_file_info64 m_entryInfo;
 	virtual ~CZipFs();
 public:
 	CZipFs();
 
+	/* Remember where the enumerator found the entry, so that ReCreate() goes
+	back to it instead of looking its name up in the central directory
+	@pos: position of the entry, from unzGetFilePos64()
+	@info: information of the entry, from unzGetCurrentFileInfo64()
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT SetEntry(__in const unz64_file_pos & pos, __in const unz_file_info64 & info);
+
 	virtual HRESULT WINAPI Create(__in LPCWSTR path, __in ULONG const flags) override;
 
 	virtual HRESULT WINAPI Close(void) override;
@@ -21,6 +21,14 @@ HRESULT WINAPI CZipFsAttribute::QueryAttributes(void)
 	if (err != UNZ_OK)
 		return E_FAIL;
 
+	StringA strNameA = filename_inzip;
+	StringW strNameW = AnsiToUnicode(&strNameA);
+	SetInfo(file_info, strNameW.c_str());
+	return S_OK;
+}
+
+void CZipFsAttribute::SetInfo(__in const unz_file_info64 & file_info, __in LPCWSTR lpName)
+{
 	// file size
 	m_wfd.nFileSizeHigh = file_info.uncompressed_size >> 32;
 	m_wfd.nFileSizeLow = file_info.uncompressed_size & 0xFFFFFFFF;
@@ -33,12 +41,9 @@ HRESULT WINAPI CZipFsAttribute::QueryAttributes(void)
 	m_wfd.ftCreationTime = m_wfd.ftLastWriteTime;
 	m_wfd.ftLastAccessTime = m_wfd.ftLastWriteTime;
 
-	// file name
-	StringA strNameA = filename_inzip;
-	StringW strNameW = AnsiToUnicode(&strNameA);
-	wcscpy_s(m_wfd.cFileName, MAX_PATH, strNameW.c_str());
+	// file name, cut at MAX_PATH
+	wcsncpy_s(m_wfd.cFileName, MAX_PATH, lpName, _TRUNCATE);
 	m_bInited = TRUE;
-	return S_OK;
 }
 
 HRESULT WINAPI CZipFsAttribute::SetTime(__in_opt FILETIME *lpCreationTime, __in_opt FILETIME *lpLastAccessTime, __in_opt FILETIME *lpLastWriteTime)
@@ -57,3 +62,12 @@ HRESULT WINAPI CZipFsAttribute::SetFilePath(__in LPCWSTR lpFilePath, __in_opt vo
 	return QueryAttributes();
 }
 
+HRESULT CZipFsAttribute::SetEntry(__in LPCWSTR lpFilePath, __in_opt void* handle, __in const unz_file_info64 & info)
+{
+	if (lpFilePath == NULL) return E_INVALIDARG;
+	m_handle = (HANDLE)handle;
+	m_fileName = lpFilePath;
+	SetInfo(info, lpFilePath);
+	return S_OK;
+}
+
@@ -17,4 +17,10 @@ public:
 
 	virtual HRESULT WINAPI SetFilePath(__in LPCWSTR lpFilePath, __in_opt void* handle /*= NULL*/) override;
 
+	// Same as SetFilePath(), with the information the enumerator has already read
+	HRESULT SetEntry(__in LPCWSTR lpFilePath, __in_opt void* handle, __in const unz_file_info64 & info);
+
+protected:
+	void SetInfo(__in const unz_file_info64 & info, __in LPCWSTR lpName);
+
 };
\ No newline at end of file
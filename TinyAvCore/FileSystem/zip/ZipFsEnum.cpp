@@ -50,8 +50,11 @@ HRESULT WINAPI CZipFsEnum::Enum(__in IFsEnumContext *context)
 
 HRESULT WINAPI CZipFsEnum::ReadArchiver(__in_opt IVirtualFs * container, __in IFsEnumContext * context, __in void * stream)
 {
-	char filename_inzip[256] = {};
+	CByteName filename_inzip;	// reused: most names fit in it without an allocation
+	StringW wstrName;
 	unz_file_info64 file_info;
+	unz64_file_pos file_pos;
+	CZipFs * zipFile;
 	unz_global_info64 gi;
 	int err;
 	bool	stopSearch = false;
@@ -67,20 +70,43 @@ HRESULT WINAPI CZipFsEnum::ReadArchiver(__in_opt IVirtualFs * container, __in IF
 
 	for (ZPOS64_T i = 0; (i < gi.number_entry) && (!stopSearch); i++)
 	{
-		err = unzGetCurrentFileInfo64(uf, &file_info, filename_inzip, sizeof(filename_inzip), NULL, 0, NULL, 0);
+		err = unzGetCurrentFileInfo64(uf, &file_info, filename_inzip.Buffer(), filename_inzip.Capacity(), NULL, 0, NULL, 0);
 		if (err != UNZ_OK) break;
+		if (file_info.size_filename >= filename_inzip.Capacity())
+		{
+			// a long name: read it again in full
+			if (FAILED(filename_inzip.Reserve(file_info.size_filename))) break;
+			err = unzGetCurrentFileInfo64(uf, &file_info, filename_inzip.Buffer(), filename_inzip.Capacity(), NULL, 0, NULL, 0);
+			if (err != UNZ_OK) break;
+		}
+		filename_inzip.SetLength(file_info.size_filename);
 
 		if (file_info.uncompressed_size > (ZPOS64_T)maxFileSize.QuadPart) // skip big-file
-			continue;
-		
-		StringA strName = filename_inzip;
-		StringW wstrName = AnsiToUnicode(&strName);
-
-		IVirtualFs * zipFile = static_cast<IVirtualFs*>(new CZipFs());
+			goto NextFile;
+
+		// directories hold no data
+		if (TEST_FLAG(file_info.external_fa, FILE_ATTRIBUTE_DIRECTORY) ||
+			(file_info.size_filename && filename_inzip.c_str()[file_info.size_filename - 1] == '/'))
+			goto NextFile;
+
+		if (UNZ_OK != unzGetFilePos64(uf, &file_pos)) break;
+
+		// the name is UTF-8 when bit 11 is set; older archivers wrote it in
+		// the OEM code page, which is only used when the bytes are not UTF-8.
+		// A member is scanned whatever its name: a bad name is decoded with
+		// U+FFFD in place of the invalid bytes.
+		if (FAILED(CByteName::ToUnicode(filename_inzip.View(), CP_UTF8, &wstrName)) &&
+			(TEST_FLAG(file_info.flag, ZIP_FLAG_UTF8) ||
+			FAILED(CByteName::ToUnicode(filename_inzip.View(), CP_OEMCP, &wstrName))) &&
+			FAILED(CByteName::ToUnicode(filename_inzip.View(), CP_UTF8, &wstrName, FALSE)))
+			wstrName = L"\xFFFD";
+
+		zipFile = new CZipFs();
 		if (zipFile)
 		{
 			if (SUCCEEDED(zipFile->SetContainer(container)) &&
 				SUCCEEDED(zipFile->Create(wstrName.c_str(), 0)) &&
+				SUCCEEDED(zipFile->SetEntry(file_pos, file_info)) &&
 				SUCCEEDED(zipFile->ReCreate((void*)uf)))
 			{
 				IFsAttribute * fsAttrib = NULL;
@@ -94,7 +120,7 @@ HRESULT WINAPI CZipFsEnum::ReadArchiver(__in_opt IVirtualFs * container, __in IF
 						int currentDepthInArchive = context->GetDepthInArchive();
 						context->SetDepthInArchive(currentDepthInArchive + 1);
 						hr = OnFileFound(zipFile, context, context->GetDepth() + 1);
-						if (hr == E_ABORT)
+						if (hr == E_ABORT || hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT))
 						{
 							stopSearch = true;
 						}
@@ -117,6 +143,7 @@ HRESULT WINAPI CZipFsEnum::ReadArchiver(__in_opt IVirtualFs * container, __in IF
 			zipFile->Release();
 		}
 
+	NextFile:
 		err = unzGoToNextFile(uf);
 		if (err != UNZ_OK) break;
 	}
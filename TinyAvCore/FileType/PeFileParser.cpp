@@ -1,4 +1,5 @@
 #include "PeFileParser.h"
+#include "..\Scanner\StageCounters.h"
 
 CPeFileParser::CPeFileParser()
 {
@@ -217,6 +218,7 @@ HRESULT WINAPI CPeFileParser::CheckType(__in IVirtualFs* fsFile, __out BOOL *typ
 {
 	if (fsFile == NULL || typeMatched == NULL) return E_INVALIDARG;
 
+	CStageScope stage(StageParse);
 	HRESULT hr;
 	BOOL    fileOpened = FALSE;
 
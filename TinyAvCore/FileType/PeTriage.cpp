@@ -0,0 +1,407 @@
+#include "PeTriage.h"
+
+// Operand bytes following the opcode
+#define N	0x00
+#define M	0x01	// ModR/M byte, with SIB and displacement
+#define I8	0x02
+#define I16	0x04
+#define IZ	0x08	// 16 or 32 bits, by operand size
+#define MO	0x10	// 16 or 32-bit memory offset, by address size
+#define P	0x20	// prefix
+#define X	0x40	// not a valid instruction in 32-bit code
+#define G3	0x80	// group 3: immediate operand with test only
+
+// Instruction classes
+#define MV	TriageOpMove
+#define AR	TriageOpArith
+#define LG	TriageOpLogic
+#define ST	TriageOpStack
+#define BR	TriageOpBranch
+#define CL	TriageOpCall
+#define SG	TriageOpString
+#define RR	TriageOpRare
+#define FP	TriageOpFloat
+#define OT	TriageOpOther
+
+static const BYTE s_oneByte[256] = {
+	/* 00 */ M, M, M, M, I8, IZ, N, N, M, M, M, M, I8, IZ, N, N,
+	/* 10 */ M, M, M, M, I8, IZ, N, N, M, M, M, M, I8, IZ, N, N,
+	/* 20 */ M, M, M, M, I8, IZ, P, N, M, M, M, M, I8, IZ, P, N,
+	/* 30 */ M, M, M, M, I8, IZ, P, N, M, M, M, M, I8, IZ, P, N,
+	/* 40 */ N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* 50 */ N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* 60 */ N, N, M, M, P, P, P, P, IZ, M|IZ, I8, M|I8, N, N, N, N,
+	/* 70 */ I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8,
+	/* 80 */ M|I8, M|IZ, M|I8, M|I8, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 90 */ N, N, N, N, N, N, N, N, N, N, I16|IZ, N, N, N, N, N,
+	/* A0 */ MO, MO, MO, MO, N, N, N, N, I8, IZ, N, N, N, N, N, N,
+	/* B0 */ I8, I8, I8, I8, I8, I8, I8, I8, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ,
+	/* C0 */ M|I8, M|I8, I16, N, M, M, M|I8, M|IZ, I8|I16, N, I16, N, N, I8, N, N,
+	/* D0 */ M, M, M, M, I8, I8, N, N, M, M, M, M, M, M, M, M,
+	/* E0 */ I8, I8, I8, I8, I8, I8, I8, I8, IZ, IZ, I16|IZ, I8, N, N, N, N,
+	/* F0 */ P, N, P, P, N, N, M|G3, M|G3, N, N, N, N, N, N, M, M,
+};
+static const BYTE s_twoByte[256] = {
+	/* 00 */ M, M, M, M, X, N, N, N, N, N, X, N, X, M, N, M|I8,
+	/* 10 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 20 */ M, M, M, M, X, X, X, X, M, M, M, M, M, M, M, M,
+	/* 30 */ N, N, N, N, N, N, X, N, M, X, M|I8, X, X, X, X, X,
+	/* 40 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 50 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 60 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 70 */ M|I8, M|I8, M|I8, M|I8, M, M, M, N, M, M, M, M, M, M, M, M,
+	/* 80 */ IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ,
+	/* 90 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* A0 */ N, N, N, M, M|I8, M, M, M, N, N, N, M, M|I8, M, M, M,
+	/* B0 */ M, M, M, M, M, M, M, M, M, M, M|I8, M, M, M, M, M,
+	/* C0 */ M, M, M|I8, M, M|I8, M|I8, M|I8, M, N, N, N, N, N, N, N, N,
+	/* D0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* E0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* F0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+};
+static const BYTE s_oneByteClass[256] = {
+	/* 00 */ AR, AR, AR, AR, AR, AR, RR, RR, LG, LG, LG, LG, LG, LG, RR, OT,
+	/* 10 */ AR, AR, AR, AR, AR, AR, RR, RR, AR, AR, AR, AR, AR, AR, RR, RR,
+	/* 20 */ LG, LG, LG, LG, LG, LG, OT, RR, AR, AR, AR, AR, AR, AR, OT, RR,
+	/* 30 */ LG, LG, LG, LG, LG, LG, OT, RR, AR, AR, AR, AR, AR, AR, OT, RR,
+	/* 40 */ AR, AR, AR, AR, AR, AR, AR, AR, AR, AR, AR, AR, AR, AR, AR, AR,
+	/* 50 */ ST, ST, ST, ST, ST, ST, ST, ST, ST, ST, ST, ST, ST, ST, ST, ST,
+	/* 60 */ ST, ST, RR, RR, OT, OT, OT, OT, ST, AR, ST, AR, RR, RR, RR, RR,
+	/* 70 */ BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR,
+	/* 80 */ AR, AR, AR, AR, LG, LG, MV, MV, MV, MV, MV, MV, MV, MV, MV, ST,
+	/* 90 */ OT, MV, MV, MV, MV, MV, MV, MV, AR, AR, RR, FP, ST, ST, RR, RR,
+	/* A0 */ MV, MV, MV, MV, SG, SG, SG, SG, LG, LG, SG, SG, SG, SG, SG, SG,
+	/* B0 */ MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV,
+	/* C0 */ LG, LG, CL, CL, RR, RR, MV, MV, ST, ST, RR, RR, RR, RR, RR, RR,
+	/* D0 */ LG, LG, LG, LG, RR, RR, RR, MV, FP, FP, FP, FP, FP, FP, FP, FP,
+	/* E0 */ BR, BR, BR, BR, RR, RR, RR, RR, CL, BR, RR, BR, RR, RR, RR, RR,
+	/* F0 */ OT, RR, OT, OT, RR, OT, LG, LG, OT, OT, RR, RR, OT, OT, AR, AR,
+};
+static const BYTE s_twoByteClass[256] = {
+	/* 00 */ RR, RR, RR, RR, FP, RR, RR, RR, RR, RR, FP, RR, FP, OT, OT, FP,
+	/* 10 */ FP, FP, FP, FP, FP, FP, FP, FP, OT, OT, OT, OT, OT, OT, OT, OT,
+	/* 20 */ RR, RR, RR, RR, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP,
+	/* 30 */ RR, RR, RR, RR, RR, RR, FP, RR, FP, FP, FP, FP, FP, FP, FP, FP,
+	/* 40 */ MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV,
+	/* 50 */ FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP,
+	/* 60 */ FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP,
+	/* 70 */ FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP,
+	/* 80 */ BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR, BR,
+	/* 90 */ MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV, MV,
+	/* A0 */ RR, RR, RR, LG, LG, LG, FP, FP, RR, RR, RR, LG, LG, LG, OT, AR,
+	/* B0 */ MV, MV, RR, LG, RR, RR, MV, MV, LG, RR, LG, LG, LG, LG, MV, MV,
+	/* C0 */ MV, MV, FP, FP, FP, FP, FP, OT, MV, MV, MV, MV, MV, MV, MV, MV,
+	/* D0 */ FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP,
+	/* E0 */ FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP,
+	/* F0 */ FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, FP, RR,
+};
+
+// Weights of the linear model, one per instruction class. The class counts
+// are divided by the number of decoded instructions.
+static const DOUBLE s_classWeight[TriageOpClassCount] = {
+	-1.5,	// move: compiled code mostly moves data around
+	1.0,	// arith
+	3.0,	// logic: the xor, add and rotate of a decryptor
+	-0.5,	// stack: function prologues
+	0.5,	// branch
+	-1.0,	// call
+	2.0,	// string
+	4.0,	// rare: junk instructions of polymorphic engines
+	0.5,	// float
+	0.0,	// other
+};
+
+#define TRIAGE_BIAS					(-2.0)
+#define TRIAGE_WEIGHT_INVALID		(2.0)	// by byte of the windows
+#define TRIAGE_WEIGHT_EP_LAST		(2.5)
+#define TRIAGE_WEIGHT_EP_WRITABLE	(1.5)
+#define TRIAGE_WEIGHT_JUMP_LAST		(2.5)
+#define TRIAGE_WEIGHT_GETPC			(2.0)
+#define TRIAGE_WEIGHT_LOOP			(0.75)
+
+CPeTriage::CPeTriage()
+{
+	m_threshold = PE_TRIAGE_DEFAULT_THRESHOLD;
+}
+
+CPeTriage::~CPeTriage()
+{
+}
+
+HRESULT WINAPI CPeTriage::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown) ||
+		IsEqualIID(riid, __uuidof(IPeTriage)))
+	{
+		*ppvObject = static_cast<IPeTriage*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+UINT CPeTriage::DecodeLength(__in_bcount(size) const BYTE * code, __in ULONG size, __out PeTriageOpClass * opClass)
+{
+	if (code == NULL || opClass == NULL) return 0;
+	*opClass = TriageOpOther;
+
+	ULONG i = 0;
+	BOOL operand16 = FALSE, address16 = FALSE, twoByte = FALSE;
+	while (i < size && i < TRIAGE_MAX_INSN_SIZE && (s_oneByte[code[i]] & P))
+	{
+		if (code[i] == 0x66) operand16 = TRUE;
+		if (code[i] == 0x67) address16 = TRUE;
+		i++;
+	}
+	if (i >= size || i >= TRIAGE_MAX_INSN_SIZE) return 0;
+
+	BYTE opcode = code[i++];
+	BYTE flags, cls;
+	if (opcode == 0x0F)
+	{
+		if (i >= size) return 0;
+		twoByte = TRUE;
+		opcode = code[i++];
+		flags = s_twoByte[opcode];
+		cls = s_twoByteClass[opcode];
+		// 0F 38 and 0F 3A: the third byte only selects the operation
+		if (opcode == 0x38 || opcode == 0x3A) i++;
+	}
+	else
+	{
+		flags = s_oneByte[opcode];
+		cls = s_oneByteClass[opcode];
+	}
+	if (flags & X) return 0;
+
+	if (flags & M)
+	{
+		if (i >= size) return 0;
+		BYTE modrm = code[i++];
+		BYTE mod = modrm >> 6, reg = (modrm >> 3) & 7, rm = modrm & 7;
+		if (mod != 3)
+		{
+			if (address16)
+			{
+				if (mod == 0 && rm == 6) i += 2;
+				else if (mod == 1) i += 1;
+				else if (mod == 2) i += 2;
+			}
+			else
+			{
+				if (rm == 4)
+				{
+					if (i >= size) return 0;
+					BYTE sib = code[i++];
+					if (mod == 0 && (sib & 7) == 5) i += 4;
+				}
+				if (mod == 0 && rm == 5) i += 4;
+				else if (mod == 1) i += 1;
+				else if (mod == 2) i += 4;
+			}
+		}
+
+		// the reg field selects the operation of the group opcodes
+		if (!twoByte)
+		{
+			switch (opcode)
+			{
+			case 0x80: case 0x81: case 0x82: case 0x83:
+				cls = (reg == 1 || reg == 4 || reg == 6) ? TriageOpLogic : TriageOpArith;
+				break;
+			case 0xF6: case 0xF7:
+				if (reg <= 1) flags |= (opcode == 0xF6) ? I8 : IZ;
+				cls = (reg <= 2) ? TriageOpLogic : TriageOpArith;
+				break;
+			case 0xFE:
+				if (reg > 1) return 0;
+				break;
+			case 0xFF:
+				if (reg == 7) return 0;
+				cls = (reg <= 1) ? TriageOpArith : (reg <= 3) ? TriageOpCall : (reg <= 5) ? TriageOpBranch : TriageOpStack;
+				break;
+			case 0x8F: case 0xC6: case 0xC7:
+				if (reg != 0) return 0;
+				break;
+			case 0x62: case 0xC4: case 0xC5:
+				// EVEX and VEX prefixes in 32-bit code
+				if (mod == 3) return 0;
+				break;
+			}
+		}
+	}
+
+	if (flags & I8) i += 1;
+	if (flags & I16) i += 2;
+	if (flags & IZ) i += operand16 ? 2 : 4;
+	if (flags & MO) i += address16 ? 2 : 4;
+	if (i > size || i > TRIAGE_MAX_INSN_SIZE) return 0;
+
+	*opClass = (PeTriageOpClass)cls;
+	return i;
+}
+
+void CPeTriage::Sweep(__in_bcount(size) const BYTE * code, __in ULONG size, __out TRIAGE_SWEEP * sweep)
+{
+	if (sweep == NULL) return;
+	ZeroMemory(sweep, sizeof(TRIAGE_SWEEP));
+	if (code == NULL) return;
+
+	ULONG offset = 0;
+	BOOL afterFloat = FALSE;
+	while (offset < size)
+	{
+		PeTriageOpClass opClass;
+		UINT length = DecodeLength(code + offset, size - offset, &opClass);
+		if (length == 0)
+		{
+			sweep->invalidBytes++;
+			offset++;
+			afterFloat = FALSE;
+			continue;
+		}
+
+		const BYTE * insn = code + offset;
+		sweep->instructions++;
+		sweep->histogram[opClass]++;
+
+		if (insn[0] == 0xE8 || insn[0] == 0xE9)
+		{
+			if (length == 5)
+			{
+				LONG rel = *(const LONG UNALIGNED *)(insn + 1);
+				if (insn[0] == 0xE8 && rel == 0) sweep->getPc = TRUE;
+				if (sweep->nearTargetCount < _countof(sweep->nearTargets))
+					sweep->nearTargets[sweep->nearTargetCount++] = (LONG)offset + 5 + rel;
+			}
+		}
+		else if (length == 2 && ((insn[0] >= 0x70 && insn[0] <= 0x7F) || (insn[0] >= 0xE0 && insn[0] <= 0xE3) || insn[0] == 0xEB))
+		{
+			LONG target = (LONG)offset + 2 + (CHAR)insn[1];
+			if (target >= 0 && target < (LONG)offset) sweep->backwardLoop = TRUE;
+		}
+		// fnstenv [mem] stores the address of the last x87 instruction
+		else if (insn[0] == 0xD9 && length > 1 && ((insn[1] >> 3) & 7) == 6 && (insn[1] >> 6) != 3 && afterFloat)
+		{
+			sweep->getPc = TRUE;
+		}
+
+		afterFloat = (opClass == TriageOpFloat);
+		offset += length;
+	}
+}
+
+DOUBLE CPeTriage::Score(__in const PE_TRIAGE_RESULT * result)
+{
+	if (result == NULL) return 0;
+	DOUBLE score = TRIAGE_BIAS;
+	DOUBLE instructions = result->instructions ? (DOUBLE)result->instructions : 1.0;
+	DOUBLE bytes = instructions + result->invalidBytes;
+
+	for (int i = 0; i < TriageOpClassCount; i++)
+		score += s_classWeight[i] * result->histogram[i] / instructions;
+	score += TRIAGE_WEIGHT_INVALID * result->invalidBytes / bytes;
+	if (result->epInLastSection) score += TRIAGE_WEIGHT_EP_LAST;
+	if (result->epWritable) score += TRIAGE_WEIGHT_EP_WRITABLE;
+	if (result->jumpsToLastSection) score += TRIAGE_WEIGHT_JUMP_LAST;
+	if (result->getPc) score += TRIAGE_WEIGHT_GETPC;
+	if (result->backwardLoop) score += TRIAGE_WEIGHT_LOOP;
+	return score;
+}
+
+static void AddSweep(__inout PE_TRIAGE_RESULT * result, __in const TRIAGE_SWEEP & sweep)
+{
+	result->instructions += sweep.instructions;
+	result->invalidBytes += sweep.invalidBytes;
+	for (int i = 0; i < TriageOpClassCount; i++)
+		result->histogram[i] += sweep.histogram[i];
+	result->getPc |= sweep.getPc;
+	result->backwardLoop |= sweep.backwardLoop;
+}
+
+HRESULT WINAPI CPeTriage::Classify(__in IPeFile * parser, __out PE_TRIAGE_RESULT * result)
+{
+	if (parser == NULL || result == NULL) return E_INVALIDARG;
+	ZeroMemory(result, sizeof(PE_TRIAGE_RESULT));
+
+	HRESULT hr;
+	IMAGE_NT_HEADERS32 peHeader;
+	IMAGE_SECTION_HEADER epSection, lastSection;
+	UINT sectionCount = parser->GetSectionCount();
+	UINT epIndex = 0;
+	if (sectionCount == 0) return E_NOT_SET;
+	if (FAILED(hr = parser->GetPEHeader(&peHeader)) ||
+		FAILED(hr = parser->GetSectionHeader(sectionCount - 1, &lastSection)))
+		return hr;
+
+	UINT epRva = peHeader.OptionalHeader.AddressOfEntryPoint;
+	BOOL epInSection = SUCCEEDED(parser->FindSectionByRva(epRva, &epIndex)) &&
+		SUCCEEDED(parser->GetSectionHeader(epIndex, &epSection));
+	if (epInSection)
+	{
+		result->epInLastSection = (epIndex == sectionCount - 1);
+		result->epWritable = TEST_FLAG(epSection.Characteristics, IMAGE_SCN_MEM_WRITE);
+	}
+
+	// where appended code runs from, and where an obscured entry point jumps
+	// to: the start of the entry point may not show anything. Linkers leave
+	// writable data or executable code last, rarely a section that is both.
+	result->lastSectionOpen = TEST_FLAG(lastSection.Characteristics, IMAGE_SCN_MEM_WRITE | IMAGE_SCN_MEM_EXECUTE);
+	result->epOutsideCode = TRUE;
+	for (UINT i = 0; i < sectionCount; i++)
+	{
+		IMAGE_SECTION_HEADER section;
+		if (FAILED(parser->GetSectionHeader(i, &section))) break;
+		if ((section.Characteristics & (IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE)) == 0) continue;
+		result->epOutsideCode = !(epInSection && epIndex == i);
+		break;
+	}
+
+	BYTE window[TRIAGE_WINDOW_SIZE];
+	ULONG bytesRead = 0;
+	TRIAGE_SWEEP sweep;
+	if (SUCCEEDED(parser->ReadEntryPointData(window, sizeof(window), &bytesRead)) && bytesRead)
+	{
+		Sweep(window, bytesRead, &sweep);
+		AddSweep(result, sweep);
+
+		ULONG lastEnd = lastSection.VirtualAddress + max(lastSection.Misc.VirtualSize, lastSection.SizeOfRawData);
+		for (UINT i = 0; i < sweep.nearTargetCount; i++)
+		{
+			ULONG target = epRva + (ULONG)sweep.nearTargets[i];
+			if (target >= lastSection.VirtualAddress && target < lastEnd)
+				result->jumpsToLastSection = TRUE;
+		}
+	}
+
+	// appended code starts at the end of the original last section, which
+	// is not known, so the start of the section is the best guess
+	if (!result->epInLastSection &&
+		SUCCEEDED(parser->ReadSectionData(sectionCount - 1, window, sizeof(window), &bytesRead)) && bytesRead)
+	{
+		Sweep(window, bytesRead, &sweep);
+		AddSweep(result, sweep);
+	}
+
+	result->score = Score(result);
+	result->suspicious = (result->score >= m_threshold);
+	// the model has not seen entry points outside the sections, and is not
+	// trusted with the layouts of entry-point-obscuring infectors
+	if (!epInSection || result->lastSectionOpen || result->epOutsideCode)
+		result->suspicious = TRUE;
+	return S_OK;
+}
+
+HRESULT WINAPI CPeTriage::SetThreshold(__in DOUBLE threshold)
+{
+	m_threshold = threshold;
+	return S_OK;
+}
+
+DOUBLE WINAPI CPeTriage::GetThreshold(void)
+{
+	return m_threshold;
+}
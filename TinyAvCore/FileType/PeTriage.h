@@ -0,0 +1,53 @@
+#pragma once
+#include <TinyAvCore.h>
+
+#define TRIAGE_WINDOW_SIZE		(384)	// bytes decoded at each place
+#define TRIAGE_MAX_INSN_SIZE	(15)
+
+// Counts of one linear sweep over a window of code
+typedef struct TRIAGE_SWEEP
+{
+	UINT	instructions;
+	UINT	invalidBytes;
+	UINT	histogram[TriageOpClassCount];
+	BOOL	getPc;
+	BOOL	backwardLoop;
+	LONG	nearTargets[8];		// offsets from the window of the first rel32 calls and jumps
+	UINT	nearTargetCount;
+}TRIAGE_SWEEP;
+
+class CPeTriage :
+	public CRefCount,
+	public IPeTriage
+{
+protected:
+	DOUBLE m_threshold;
+	virtual ~CPeTriage();
+
+public:
+	CPeTriage();
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	virtual HRESULT WINAPI Classify(__in IPeFile * parser, __out PE_TRIAGE_RESULT * result) override;
+
+	virtual HRESULT WINAPI SetThreshold(__in DOUBLE threshold) override;
+
+	virtual DOUBLE WINAPI GetThreshold(void) override;
+
+	/* Length of the 32-bit x86 instruction at code
+	@code: instruction bytes
+	@size: bytes available
+	@opClass: a pointer to a variable storing the class of the instruction
+	@return: length in bytes, or 0 if the bytes are not a valid instruction
+	*/
+	static UINT DecodeLength(__in_bcount(size) const BYTE * code, __in ULONG size, __out PeTriageOpClass * opClass);
+
+	// Decode a window from its first byte, skipping the bytes that do not decode
+	static void Sweep(__in_bcount(size) const BYTE * code, __in ULONG size, __out TRIAGE_SWEEP * sweep);
+
+	// Apply the linear model to the features of a result
+	static DOUBLE Score(__in const PE_TRIAGE_RESULT * result);
+};
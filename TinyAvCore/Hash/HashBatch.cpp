@@ -0,0 +1,167 @@
+#include "HashBatch.h"
+
+CHashBatch::CHashBatch()
+{
+	// the SHA extensions beat eight lanes of general-purpose vector code
+	if (CSha256::HasShaNi())
+		m_engine = HashEngineShaNi;
+	else if (CSha256::HasAvx2())
+		m_engine = HashEngineAvx2;
+	else
+		m_engine = HashEngineScalar;
+}
+
+CHashBatch::~CHashBatch()
+{
+}
+
+HRESULT WINAPI CHashBatch::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown) || IsEqualIID(riid, __uuidof(IHashBatch)))
+	{
+		*ppvObject = static_cast<IHashBatch*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+HRESULT WINAPI CHashBatch::Add(__in_bcount(size) const BYTE * data, __in SIZE_T size, __out_bcount(SHA256_DIGEST_SIZE) BYTE * digest)
+{
+	if ((data == NULL && size) || digest == NULL) return E_INVALIDARG;
+
+	HASH_JOB job = { data, size, digest };
+	m_jobs.push_back(job);
+	return S_OK;
+}
+
+HRESULT WINAPI CHashBatch::Flush(void)
+{
+	switch (m_engine)
+	{
+	case HashEngineAvx2:
+		FlushLanes();
+		break;
+
+	case HashEngineShaNi:
+		FlushSerial(&CSha256::CompressShaNi);
+		break;
+
+	default:
+		FlushSerial(&CSha256::CompressScalar);
+		break;
+	}
+	m_jobs.clear();
+	return S_OK;
+}
+
+void CHashBatch::FlushSerial(__in SHA256_COMPRESS compress)
+{
+	size_t i, n;
+	n = m_jobs.size();
+	for (i = 0; i < n; i++)
+	{
+		const HASH_JOB & job = m_jobs[i];
+		UINT32 state[8];
+		BYTE tail[2 * SHA256_BLOCK_SIZE];
+		SIZE_T blocks = job.size / SHA256_BLOCK_SIZE;
+
+		memcpy(state, CSha256::H0, sizeof(state));
+		if (blocks) compress(state, job.data, blocks);
+		ULONG tailBlocks = CSha256::Pad(job.size, job.data + blocks * SHA256_BLOCK_SIZE, tail);
+		compress(state, tail, tailBlocks);
+		CSha256::Store(state, job.digest);
+	}
+}
+
+void CHashBatch::FlushLanes(void)
+{
+	static const BYTE s_idle[SHA256_BLOCK_SIZE] = {};
+	__declspec(align(32)) UINT32 state[8][SHA256_LANES];
+	HASH_LANE lanes[SHA256_LANES];
+	const BYTE * blocks[SHA256_LANES];
+	size_t nextJob = 0;
+	int l, w;
+
+	for (l = 0; l < SHA256_LANES; l++)
+		lanes[l].job = NULL;
+
+	for (;;)
+	{
+		// a lane whose message is done takes the next one
+		int active = 0;
+		for (l = 0; l < SHA256_LANES; l++)
+		{
+			HASH_LANE & lane = lanes[l];
+			if (lane.job == NULL && nextJob < m_jobs.size())
+			{
+				lane.job = &m_jobs[nextJob++];
+				lane.next = 0;
+				lane.blocks = lane.job->size / SHA256_BLOCK_SIZE;
+				lane.tailBlocks = CSha256::Pad(lane.job->size, lane.job->data + lane.blocks * SHA256_BLOCK_SIZE, lane.tail);
+				for (w = 0; w < 8; w++)
+					state[w][l] = CSha256::H0[w];
+			}
+
+			if (lane.job == NULL)
+			{
+				blocks[l] = s_idle;
+				continue;
+			}
+			blocks[l] = (lane.next < lane.blocks) ?
+				lane.job->data + lane.next * SHA256_BLOCK_SIZE :
+				lane.tail + (lane.next - lane.blocks) * SHA256_BLOCK_SIZE;
+			active++;
+		}
+		if (active == 0) break;
+
+		CSha256::CompressX8(state, blocks);
+
+		for (l = 0; l < SHA256_LANES; l++)
+		{
+			HASH_LANE & lane = lanes[l];
+			if (lane.job == NULL) continue;
+			if (++lane.next < lane.blocks + lane.tailBlocks) continue;
+
+			UINT32 digest[8];
+			for (w = 0; w < 8; w++)
+				digest[w] = state[w][l];
+			CSha256::Store(digest, lane.job->digest);
+			lane.job = NULL;
+		}
+	}
+}
+
+HRESULT WINAPI CHashBatch::SetEngine(__in HashEngine engine)
+{
+	if (engine < 0 || engine >= HashEngineCount) return E_INVALIDARG;
+	if (!IsEngineSupported(engine)) return E_NOTIMPL;
+	m_engine = engine;
+	return S_OK;
+}
+
+HashEngine WINAPI CHashBatch::GetEngine(void)
+{
+	return m_engine;
+}
+
+BOOL CHashBatch::IsEngineSupported(__in HashEngine engine)
+{
+	switch (engine)
+	{
+	case HashEngineScalar:
+		return TRUE;
+
+	case HashEngineShaNi:
+		return CSha256::HasShaNi();
+
+	case HashEngineAvx2:
+		return CSha256::HasAvx2();
+
+	default:
+		return FALSE;
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <TinyAvCore.h>
+#include <vector>
+#include "Sha256.h"
+
+typedef struct HASH_JOB
+{
+	const BYTE *	data;
+	SIZE_T			size;
+	BYTE *			digest;
+}HASH_JOB;
+
+// A message in an AVX2 lane: its whole blocks are read in place, the last
+// one or two are built with the padding
+typedef struct HASH_LANE
+{
+	const HASH_JOB *	job;		// NULL for an idle lane
+	SIZE_T				next;		// next block to compress
+	SIZE_T				blocks;		// whole blocks of the message
+	ULONG				tailBlocks;
+	BYTE				tail[2 * SHA256_BLOCK_SIZE];
+}HASH_LANE;
+
+class CHashBatch :
+	public CRefCount,
+	public IHashBatch
+{
+protected:
+	std::vector<HASH_JOB>	m_jobs;
+	HashEngine				m_engine;
+
+	virtual ~CHashBatch();
+
+	void FlushSerial(__in SHA256_COMPRESS compress);
+	void FlushLanes(void);
+
+public:
+	CHashBatch();
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	virtual HRESULT WINAPI Add(__in_bcount(size) const BYTE * data, __in SIZE_T size, __out_bcount(SHA256_DIGEST_SIZE) BYTE * digest) override;
+
+	virtual HRESULT WINAPI Flush(void) override;
+
+	virtual HRESULT WINAPI SetEngine(__in HashEngine engine) override;
+
+	virtual HashEngine WINAPI GetEngine(void) override;
+
+	static BOOL IsEngineSupported(__in HashEngine engine);
+};
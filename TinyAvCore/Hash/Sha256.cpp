@@ -0,0 +1,344 @@
+#include "Sha256.h"
+#include <intrin.h>
+#include <immintrin.h>
+
+const UINT32 CSha256::K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+const UINT32 CSha256::H0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define ROTR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define ZERO_BLOCKS		(64)
+
+static const BYTE s_zeros[ZERO_BLOCKS * SHA256_BLOCK_SIZE] = {};
+
+static inline UINT32 LoadBigEndian32(__in const BYTE * p)
+{
+	return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | ((UINT32)p[2] << 8) | (UINT32)p[3];
+}
+
+CSha256::CSha256()
+{
+	m_compress = HasShaNi() ? &CSha256::CompressShaNi : &CSha256::CompressScalar;
+	Init();
+}
+
+void CSha256::Init(void)
+{
+	memcpy(m_state, H0, sizeof(m_state));
+	m_length = 0;
+}
+
+void CSha256::Update(__in_bcount(size) const void * data, __in SIZE_T size)
+{
+	const BYTE * bytes = (const BYTE *)data;
+	ULONG used = (ULONG)(m_length % SHA256_BLOCK_SIZE);
+	m_length += size;
+
+	if (used)
+	{
+		ULONG fill = (ULONG)min((SIZE_T)(SHA256_BLOCK_SIZE - used), size);
+		memcpy(m_buffer + used, bytes, fill);
+		bytes += fill;
+		size -= fill;
+		if (used + fill < SHA256_BLOCK_SIZE) return;
+		m_compress(m_state, m_buffer, 1);
+	}
+
+	// whole blocks straight from the caller's buffer
+	if (size >= SHA256_BLOCK_SIZE)
+	{
+		SIZE_T count = size / SHA256_BLOCK_SIZE;
+		m_compress(m_state, bytes, count);
+		bytes += count * SHA256_BLOCK_SIZE;
+		size -= count * SHA256_BLOCK_SIZE;
+	}
+	if (size) memcpy(m_buffer, bytes, size);
+}
+
+void CSha256::UpdateZeros(__in ULONGLONG size)
+{
+	// complete the block in progress
+	ULONG used = (ULONG)(m_length % SHA256_BLOCK_SIZE);
+	if (used)
+	{
+		ULONG fill = (ULONG)min((ULONGLONG)(SHA256_BLOCK_SIZE - used), size);
+		Update(s_zeros, fill);
+		size -= fill;
+	}
+
+	ULONGLONG blocks = size / SHA256_BLOCK_SIZE;
+	m_length += blocks * SHA256_BLOCK_SIZE;
+	if (m_compress == &CSha256::CompressScalar)
+		CompressZeros(m_state, blocks);
+	else
+	{
+		// the SHA extensions are faster than skipping the schedule
+		while (blocks)
+		{
+			SIZE_T count = (SIZE_T)min(blocks, (ULONGLONG)ZERO_BLOCKS);
+			m_compress(m_state, s_zeros, count);
+			blocks -= count;
+		}
+	}
+
+	if (size % SHA256_BLOCK_SIZE)
+		Update(s_zeros, (SIZE_T)(size % SHA256_BLOCK_SIZE));
+}
+
+void CSha256::Final(__out_bcount(SHA256_DIGEST_SIZE) BYTE * digest)
+{
+	BYTE blocks[2 * SHA256_BLOCK_SIZE];
+	ULONG count = Pad(m_length, m_buffer, blocks);
+	m_compress(m_state, blocks, count);
+	Store(m_state, digest);
+	Init();
+}
+
+void CSha256::Hash(__in_bcount(size) const void * data, __in SIZE_T size, __out_bcount(SHA256_DIGEST_SIZE) BYTE * digest)
+{
+	CSha256 sha;
+	sha.Update(data, size);
+	sha.Final(digest);
+}
+
+CHmacSha256::CHmacSha256()
+{
+	ZeroMemory(m_pad, sizeof(m_pad));
+}
+
+CHmacSha256::~CHmacSha256()
+{
+	SecureZeroMemory(m_pad, sizeof(m_pad));
+}
+
+void CHmacSha256::Init(__in_bcount(keySize) const void * key, __in SIZE_T keySize)
+{
+	ZeroMemory(m_pad, sizeof(m_pad));
+	if (keySize > SHA256_BLOCK_SIZE)
+		CSha256::Hash(key, keySize, m_pad);
+	else if (keySize)
+		memcpy(m_pad, key, keySize);
+
+	BYTE inner[SHA256_BLOCK_SIZE];
+	for (int i = 0; i < SHA256_BLOCK_SIZE; i++)
+	{
+		inner[i] = m_pad[i] ^ 0x36;
+		m_pad[i] ^= 0x5c;
+	}
+	m_sha.Init();
+	m_sha.Update(inner, sizeof(inner));
+	SecureZeroMemory(inner, sizeof(inner));
+}
+
+void CHmacSha256::Update(__in_bcount(size) const void * data, __in SIZE_T size)
+{
+	m_sha.Update(data, size);
+}
+
+void CHmacSha256::Final(__out_bcount(SHA256_DIGEST_SIZE) BYTE * mac)
+{
+	BYTE digest[SHA256_DIGEST_SIZE];
+	m_sha.Final(digest);
+	m_sha.Update(m_pad, sizeof(m_pad));
+	m_sha.Update(digest, sizeof(digest));
+	m_sha.Final(mac);
+}
+
+ULONG CSha256::Pad(__in ULONGLONG length, __in_opt const BYTE * tail, __out_bcount(2 * SHA256_BLOCK_SIZE) BYTE * blocks)
+{
+	ULONG used = (ULONG)(length % SHA256_BLOCK_SIZE);
+	ULONG count = (used + 9 <= SHA256_BLOCK_SIZE) ? 1 : 2;
+	ULONG size = count * SHA256_BLOCK_SIZE;
+
+	memset(blocks, 0, size);
+	if (used) memcpy(blocks, tail, used);
+	blocks[used] = 0x80;
+
+	ULONGLONG bits = length * 8;
+	for (int i = 0; i < 8; i++)
+		blocks[size - 1 - i] = (BYTE)(bits >> (8 * i));
+	return count;
+}
+
+void CSha256::Store(__in const UINT32 state[8], __out_bcount(SHA256_DIGEST_SIZE) BYTE * digest)
+{
+	for (int i = 0; i < 8; i++)
+	{
+		digest[4 * i] = (BYTE)(state[i] >> 24);
+		digest[4 * i + 1] = (BYTE)(state[i] >> 16);
+		digest[4 * i + 2] = (BYTE)(state[i] >> 8);
+		digest[4 * i + 3] = (BYTE)state[i];
+	}
+}
+
+BOOL CSha256::HasShaNi(void)
+{
+	static LONG s_shaNi = -1;
+	if (s_shaNi < 0)
+	{
+		int info[4];
+		BOOL found = FALSE;
+		__cpuid(info, 0);
+		if (info[0] >= 7)
+		{
+			int features[4];
+			__cpuid(features, 1);
+			__cpuidex(info, 7, 0);
+			// SHA, with the SSSE3 and SSE4.1 shuffles and blends it is used with
+			found = (info[1] & (1 << 29)) && (features[2] & (1 << 9)) && (features[2] & (1 << 19));
+		}
+		InterlockedExchange(&s_shaNi, found ? 1 : 0);
+	}
+	return s_shaNi == 1;
+}
+
+BOOL CSha256::HasAvx2(void)
+{
+	static LONG s_avx2 = -1;
+	if (s_avx2 < 0)
+	{
+		int info[4];
+		BOOL found = FALSE;
+		__cpuid(info, 0);
+		if (info[0] >= 7)
+		{
+			int features[4];
+			__cpuid(features, 1);
+			__cpuidex(info, 7, 0);
+			// the OS must save the YMM registers as well
+			found = (features[2] & (1 << 27)) && (features[2] & (1 << 28)) &&
+				((_xgetbv(0) & 6) == 6) && (info[1] & (1 << 5));
+		}
+		InterlockedExchange(&s_avx2, found ? 1 : 0);
+	}
+	return s_avx2 == 1;
+}
+
+void CSha256::CompressScalar(__inout UINT32 state[8], __in_bcount(count * SHA256_BLOCK_SIZE) const BYTE * blocks, __in SIZE_T count)
+{
+	UINT32 w[64];
+	for (SIZE_T n = 0; n < count; n++, blocks += SHA256_BLOCK_SIZE)
+	{
+		int t;
+		for (t = 0; t < 16; t++)
+			w[t] = LoadBigEndian32(blocks + 4 * t);
+		for (t = 16; t < 64; t++)
+		{
+			UINT32 s0 = ROTR32(w[t - 15], 7) ^ ROTR32(w[t - 15], 18) ^ (w[t - 15] >> 3);
+			UINT32 s1 = ROTR32(w[t - 2], 17) ^ ROTR32(w[t - 2], 19) ^ (w[t - 2] >> 10);
+			w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+		}
+
+		UINT32 a = state[0], b = state[1], c = state[2], d = state[3];
+		UINT32 e = state[4], f = state[5], g = state[6], h = state[7];
+		for (t = 0; t < 64; t++)
+		{
+			UINT32 t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + K[t] + w[t];
+			UINT32 t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+void CSha256::CompressZeros(__inout UINT32 state[8], __in ULONGLONG count)
+{
+	for (ULONGLONG n = 0; n < count; n++)
+	{
+		UINT32 a = state[0], b = state[1], c = state[2], d = state[3];
+		UINT32 e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int t = 0; t < 64; t++)
+		{
+			UINT32 t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + K[t];
+			UINT32 t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+void CSha256::CompressShaNi(__inout UINT32 state[8], __in_bcount(count * SHA256_BLOCK_SIZE) const BYTE * blocks, __in SIZE_T count)
+{
+	const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, msg, tmp;
+	__m128i w[4];
+
+	// the instructions work on the state as ABEF and CDGH
+	tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);				// CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B);		// EFGH
+	state0 = _mm_alignr_epi8(tmp, state1, 8);		// ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	// CDGH
+
+	for (SIZE_T n = 0; n < count; n++, blocks += SHA256_BLOCK_SIZE)
+	{
+		__m128i abefSave = state0;
+		__m128i cdghSave = state1;
+
+		// four rounds per step; the schedule of later words is computed
+		// while the current ones are used
+		for (int i = 0; i < 16; i++)
+		{
+			__m128i & cur = w[i & 3];
+			if (i < 4)
+				cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + 16 * i)), swap);
+
+			msg = _mm_add_epi32(cur, _mm_loadu_si128((const __m128i*)&K[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			if (i >= 3 && i <= 14)
+			{
+				__m128i & next = w[(i + 1) & 3];
+				tmp = _mm_alignr_epi8(cur, w[(i + 3) & 3], 4);
+				next = _mm_add_epi32(next, tmp);
+				next = _mm_sha256msg2_epu32(next, cur);
+			}
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+			if (i >= 1 && i <= 12)
+			{
+				__m128i & prev = w[(i + 3) & 3];
+				prev = _mm_sha256msg1_epu32(prev, cur);
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, abefSave);
+		state1 = _mm_add_epi32(state1, cdghSave);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);			// FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);		// DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);	// DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);		// HGFE
+	_mm_storeu_si128((__m128i*)&state[0], state0);
+	_mm_storeu_si128((__m128i*)&state[4], state1);
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <TinyAvCore.h>
+
+#define SHA256_BLOCK_SIZE	(64)
+#define SHA256_LANES		(8)		// messages hashed together by CompressX8()
+
+// Compress whole blocks of one message into its state
+typedef void (*SHA256_COMPRESS)(__inout UINT32 state[8], __in_bcount(count * SHA256_BLOCK_SIZE) const BYTE * blocks, __in SIZE_T count);
+
+// SHA-256 of one message fed in pieces, with the fastest single-message
+// engine of the CPU. Also holds the engines used by CHashBatch.
+class CSha256
+{
+protected:
+	UINT32			m_state[8];
+	BYTE			m_buffer[SHA256_BLOCK_SIZE];
+	ULONGLONG		m_length;
+	SHA256_COMPRESS	m_compress;
+
+public:
+	CSha256();
+
+	void Init(void);
+	void Update(__in_bcount(size) const void * data, __in SIZE_T size);
+
+	// Same as Update() with size zero bytes, such as a hole of a sparse file,
+	// without a buffer of zeros
+	void UpdateZeros(__in ULONGLONG size);
+	void Final(__out_bcount(SHA256_DIGEST_SIZE) BYTE * digest);
+
+	static void Hash(__in_bcount(size) const void * data, __in SIZE_T size, __out_bcount(SHA256_DIGEST_SIZE) BYTE * digest);
+
+	static const UINT32 K[64];
+	static const UINT32 H0[8];
+
+	/* Build the last blocks of a message: its tail, the padding and the length
+	@length: length of the whole message in bytes
+	@tail: the bytes after the last whole block, length % SHA256_BLOCK_SIZE of them
+	@blocks: a buffer of 2 blocks receiving the last blocks
+	@return: number of blocks written, 1 or 2.
+	*/
+	static ULONG Pad(__in ULONGLONG length, __in_opt const BYTE * tail, __out_bcount(2 * SHA256_BLOCK_SIZE) BYTE * blocks);
+
+	// Write a state as a digest, in big-endian order
+	static void Store(__in const UINT32 state[8], __out_bcount(SHA256_DIGEST_SIZE) BYTE * digest);
+
+	static BOOL HasShaNi(void);
+	static BOOL HasAvx2(void);
+
+	static void CompressScalar(__inout UINT32 state[8], __in_bcount(count * SHA256_BLOCK_SIZE) const BYTE * blocks, __in SIZE_T count);
+	static void CompressShaNi(__inout UINT32 state[8], __in_bcount(count * SHA256_BLOCK_SIZE) const BYTE * blocks, __in SIZE_T count);
+
+	// CompressScalar() of count blocks of zeros, whose message schedule is all zeros
+	static void CompressZeros(__inout UINT32 state[8], __in ULONGLONG count);
+
+	/* Compress one block of each of SHA256_LANES messages, with AVX2
+	@state: states of the messages, word by word: state[w][lane]
+	@blocks: the next block of each message
+	*/
+	static void CompressX8(__inout UINT32 state[8][SHA256_LANES], __in const BYTE * blocks[SHA256_LANES]);
+};
+
+// HMAC-SHA256 (RFC 2104) of one message fed in pieces
+class CHmacSha256
+{
+protected:
+	CSha256		m_sha;
+	BYTE		m_pad[SHA256_BLOCK_SIZE];	// the key padded to a block, XOR 0x5c
+
+public:
+	CHmacSha256();
+	~CHmacSha256();
+
+	// Start a message; keys longer than a block are hashed first
+	void Init(__in_bcount(keySize) const void * key, __in SIZE_T keySize);
+	void Update(__in_bcount(size) const void * data, __in SIZE_T size);
+
+	// End the message; Init() again before the next one
+	void Final(__out_bcount(SHA256_DIGEST_SIZE) BYTE * mac);
+};
@@ -0,0 +1,76 @@
+#include "Sha256.h"
+#include <immintrin.h>
+
+// Eight messages in the eight 32-bit lanes of the AVX2 registers: the
+// rounds are the ones of CompressScalar(), one message per lane.
+
+#define ROTR8(x, n)		_mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define XOR3(x, y, z)	_mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define ADD(x, y)		_mm256_add_epi32(x, y)
+
+#define BSIG0(x)		XOR3(ROTR8(x, 2), ROTR8(x, 13), ROTR8(x, 22))
+#define BSIG1(x)		XOR3(ROTR8(x, 6), ROTR8(x, 11), ROTR8(x, 25))
+#define SSIG0(x)		XOR3(ROTR8(x, 7), ROTR8(x, 18), _mm256_srli_epi32(x, 3))
+#define SSIG1(x)		XOR3(ROTR8(x, 17), ROTR8(x, 19), _mm256_srli_epi32(x, 10))
+#define CH(e, f, g)		_mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g))
+#define MAJ(a, b, c)	XOR3(_mm256_and_si256(a, b), _mm256_and_si256(a, c), _mm256_and_si256(b, c))
+
+static inline int Load32(__in const BYTE * p)
+{
+	int value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+void CSha256::CompressX8(__inout UINT32 state[8][SHA256_LANES], __in const BYTE * blocks[SHA256_LANES])
+{
+	// the words of the blocks are big-endian
+	const __m256i swap = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i w[16];
+	int t;
+
+	for (t = 0; t < 16; t++)
+	{
+		w[t] = _mm256_shuffle_epi8(_mm256_setr_epi32(
+			Load32(blocks[0] + 4 * t), Load32(blocks[1] + 4 * t), Load32(blocks[2] + 4 * t), Load32(blocks[3] + 4 * t),
+			Load32(blocks[4] + 4 * t), Load32(blocks[5] + 4 * t), Load32(blocks[6] + 4 * t), Load32(blocks[7] + 4 * t)), swap);
+	}
+
+	__m256i a = _mm256_loadu_si256((const __m256i*)state[0]);
+	__m256i b = _mm256_loadu_si256((const __m256i*)state[1]);
+	__m256i c = _mm256_loadu_si256((const __m256i*)state[2]);
+	__m256i d = _mm256_loadu_si256((const __m256i*)state[3]);
+	__m256i e = _mm256_loadu_si256((const __m256i*)state[4]);
+	__m256i f = _mm256_loadu_si256((const __m256i*)state[5]);
+	__m256i g = _mm256_loadu_si256((const __m256i*)state[6]);
+	__m256i h = _mm256_loadu_si256((const __m256i*)state[7]);
+
+	for (t = 0; t < 64; t++)
+	{
+		// the schedule keeps the last 16 words only
+		if (t >= 16)
+			w[t & 15] = ADD(ADD(w[t & 15], SSIG0(w[(t - 15) & 15])), ADD(w[(t - 7) & 15], SSIG1(w[(t - 2) & 15])));
+
+		__m256i t1 = ADD(ADD(ADD(h, BSIG1(e)), ADD(CH(e, f, g), _mm256_set1_epi32((int)K[t]))), w[t & 15]);
+		__m256i t2 = ADD(BSIG0(a), MAJ(a, b, c));
+		h = g;
+		g = f;
+		f = e;
+		e = ADD(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = ADD(t1, t2);
+	}
+
+	_mm256_storeu_si256((__m256i*)state[0], ADD(a, _mm256_loadu_si256((const __m256i*)state[0])));
+	_mm256_storeu_si256((__m256i*)state[1], ADD(b, _mm256_loadu_si256((const __m256i*)state[1])));
+	_mm256_storeu_si256((__m256i*)state[2], ADD(c, _mm256_loadu_si256((const __m256i*)state[2])));
+	_mm256_storeu_si256((__m256i*)state[3], ADD(d, _mm256_loadu_si256((const __m256i*)state[3])));
+	_mm256_storeu_si256((__m256i*)state[4], ADD(e, _mm256_loadu_si256((const __m256i*)state[4])));
+	_mm256_storeu_si256((__m256i*)state[5], ADD(f, _mm256_loadu_si256((const __m256i*)state[5])));
+	_mm256_storeu_si256((__m256i*)state[6], ADD(g, _mm256_loadu_si256((const __m256i*)state[6])));
+	_mm256_storeu_si256((__m256i*)state[7], ADD(h, _mm256_loadu_si256((const __m256i*)state[7])));
+}
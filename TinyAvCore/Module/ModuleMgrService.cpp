@@ -1,5 +1,24 @@
 #include "ModuleMgrService.h"
 #include <TinyAvCore.h>
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#endif
+
+#ifndef _WIN32
+// Convert a wide path into the multibyte encoding of the file system
+static BOOL ToNativePath(__in LPCWSTR lpPath, __out StringA * path)
+{
+	size_t length = wcstombs(NULL, lpPath, 0);
+	if (length == (size_t)-1) return FALSE;
+	std::vector<char> buffer(length + 1);
+	wcstombs(&buffer[0], lpPath, buffer.size());
+	path->assign(&buffer[0], length);
+	return TRUE;
+}
+#endif
 
 CModuleMgrService::CModuleMgrService()
 {
@@ -23,70 +42,142 @@ HRESULT WINAPI CModuleMgrService::QueryInterface(__in REFIID riid, _COM_Outptr_
 	return E_NOINTERFACE;
 }
 
-HRESULT WINAPI CModuleMgrService::Load(__in LPCWSTR lpModuleDirectory /*= NULL*/, __in LPCWSTR lpModuleName /*= NULL*/, __in DWORD flags /*= 0*/)
+// A plug-in found by Load(), loaded on the thread pool
+typedef struct MODULE_LOAD_ITEM
 {
-	StringW searchStr, searchPath;
+	StringW		path;
+	DWORD		flags;
+	HMODULE		handle;
+	IModule *	module;
+}MODULE_LOAD_ITEM;
 
-	if (lpModuleDirectory)
-		searchPath = lpModuleDirectory;
-	else
-	{
-		WCHAR currentFileName[MAX_PATH + 1] = {};
-		GetModuleFileNameW(NULL, currentFileName, MAX_PATH);
-		searchPath = currentFileName;
-	}
+static VOID CALLBACK LoadModuleWork(__inout PTP_CALLBACK_INSTANCE instance, __inout_opt PVOID context, __inout PTP_WORK work)
+{
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(work);
+	MODULE_LOAD_ITEM * item = (MODULE_LOAD_ITEM*)context;
+	CModuleMgrService::LoadPlugin(item->path.c_str(), item->flags, &item->handle, &item->module);
+}
 
-	if (lpModuleName == NULL)
-	{
-		searchStr = searchPath + L"\\*.";
-		searchStr += MODULE_EXTENSION;
-	}
+HRESULT CModuleMgrService::LoadPlugin(__in LPCWSTR lpModulePath, __in DWORD flags, __out HMODULE * handle, __out IModule ** module)
+{
+	*handle = NULL;
+	*module = NULL;
+
+	HRESULT hr;
+#ifdef _WIN32
+	HMODULE library = LoadLibraryExW(lpModulePath, NULL, flags);
+	if (library == NULL) return HRESULT_FROM_WIN32(GetLastError());
+#else
+	// the flags of LoadLibraryExW() have no counterpart: a plug-in is bound
+	// when it is loaded and keeps its symbols to itself
+	UNREFERENCED_PARAMETER(flags);
+	StringA path;
+	if (!ToNativePath(lpModulePath, &path)) return HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION);
+
+	HMODULE library = (HMODULE)dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (library == NULL) return HRESULT_FROM_WIN32(ERROR_MOD_NOT_FOUND);
+#endif
+
+	CREATEMODULEOBJECT createModuleObj = (CREATEMODULEOBJECT)FindPluginSymbol(library, MODULE_EP);
+	if (createModuleObj == NULL)
+		hr = HRESULT_FROM_WIN32(ERROR_PROC_NOT_FOUND);
 	else
+		hr = createModuleObj(CLSID_NULL, 0, __uuidof(IModule), (LPVOID*)module);
+
+	if (FAILED(hr))
 	{
-		searchStr = searchPath + L"\\";
-		searchStr += lpModuleName;
+		*module = NULL;
+		FreePlugin(library);
+		return hr;
 	}
+	*handle = library;
+	return S_OK;
+}
+
+void CModuleMgrService::FreePlugin(__in HMODULE handle)
+{
+	if (handle == NULL) return;
+#ifdef _WIN32
+	FreeLibrary(handle);
+#else
+	dlclose(handle);
+#endif
+}
+
+FARPROC CModuleMgrService::FindPluginSymbol(__in HMODULE handle, __in LPCSTR name)
+{
+	if (handle == NULL || name == NULL) return NULL;
+#ifdef _WIN32
+	return GetProcAddress(handle, name);
+#else
+	return (FARPROC)dlsym(handle, name);
+#endif
+}
 
+HRESULT CModuleMgrService::PinPlugin(__in HMODULE handle, __out HMODULE * pinned)
+{
+	if (handle == NULL || pinned == NULL) return E_INVALIDARG;
+	*pinned = NULL;
+#ifdef _WIN32
+	// the handle is the base address of the library
+	if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)handle, pinned))
+		return HRESULT_FROM_WIN32(GetLastError());
+#else
+	// dlopen() of a library already loaded returns it with one more reference
+	Dl_info info;
+	void * entry = dlsym(handle, MODULE_EP);
+	if (entry == NULL || dladdr(entry, &info) == 0 || info.dli_fname == NULL)
+		return HRESULT_FROM_WIN32(ERROR_MOD_NOT_FOUND);
+	*pinned = (HMODULE)dlopen(info.dli_fname, RTLD_NOW | RTLD_LOCAL | RTLD_NOLOAD);
+	if (*pinned == NULL)
+		return HRESULT_FROM_WIN32(ERROR_MOD_NOT_FOUND);
+#endif
+	return S_OK;
+}
+
+HRESULT CModuleMgrService::FindPlugins(__in LPCWSTR lpDirectory, __in LPCWSTR lpPattern, __inout std::vector<StringW> & paths)
+{
+	if (lpDirectory == NULL || lpPattern == NULL) return E_INVALIDARG;
+#ifdef _WIN32
+	StringW searchStr = StringW(lpDirectory) + L"\\" + lpPattern;
 	WIN32_FIND_DATAW wfd = {};
 	HANDLE hFind = FindFirstFileW(searchStr.c_str(), &wfd);
 	if (hFind == INVALID_HANDLE_VALUE)
-	{
 		return HRESULT_FROM_WIN32(GetLastError());
-	}
-
 	do
 	{
-		StringW modulePath = searchPath + L"\\" + wfd.cFileName;
-		HMODULE handle = LoadLibraryExW(modulePath.c_str(), NULL, flags);
-		if (handle)
-		{
-			CREATEMODULEOBJECT createModuleObj = (CREATEMODULEOBJECT)GetProcAddress(handle, MODULE_EP);
-			IModule * module = NULL;
-			if (SUCCEEDED(createModuleObj(CLSID_NULL, 0, __uuidof(IModule), (LPVOID*)&module)))
-			{
-				if (m_modules.end() == std::find(m_modules.begin(), m_modules.end(), module))
-				{
-					m_modules.push_back(module);
-					handle = NULL;
-					module = NULL;
-				}
-			}
-
-			if (module) module->Release();
-		}
-
-		if (handle) FreeLibrary(handle);
-
+		paths.push_back(StringW(lpDirectory) + L"\\" + wfd.cFileName);
 	} while (FindNextFileW(hFind, &wfd));
-
 	FindClose(hFind);
-
-	return (m_modules.size()) ? S_OK : E_FAIL;
+#else
+	StringA directory, pattern;
+	if (!ToNativePath(lpDirectory, &directory) || !ToNativePath(lpPattern, &pattern))
+		return HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION);
+	DIR * dir = opendir(directory.c_str());
+	if (dir == NULL)
+		return HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND);
+	size_t found = paths.size();
+	for (struct dirent * entry = readdir(dir); entry; entry = readdir(dir))
+	{
+		if (fnmatch(pattern.c_str(), entry->d_name, 0) != 0)
+			continue;
+		StringA path = directory + "/" + entry->d_name;
+		std::vector<WCHAR> wide(path.size() + 1);
+		if (mbstowcs(&wide[0], path.c_str(), wide.size()) != (size_t)-1)
+			paths.push_back(&wide[0]);
+	}
+	closedir(dir);
+	if (paths.size() == found)
+		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+#endif
+	return S_OK;
 }
 
-HRESULT WINAPI CModuleMgrService::Load(__in LPCWSTR lpModuleDirectory /*= NULL*/, __in ModuleType moduleType /*= 0*/, __in DWORD flags /*= 0*/)
+HRESULT CModuleMgrService::LoadModules(__in_opt LPCWSTR lpModuleDirectory, __in_opt LPCWSTR lpModuleName,
+	__in BOOL anyType, __in ModuleType moduleType, __in DWORD flags)
 {
-	StringW searchStr, searchPath;
+	StringW searchPattern, searchPath;
 
 	if (lpModuleDirectory)
 		searchPath = lpModuleDirectory;
@@ -97,48 +188,87 @@ HRESULT WINAPI CModuleMgrService::Load(__in LPCWSTR lpModuleDirectory /*= NULL*/
 		searchPath = currentFileName;
 	}
 
-	searchStr = searchPath + L"\\*.";
-	searchStr += MODULE_EXTENSION;
+	if (lpModuleName == NULL)
+	{
+		searchPattern = L"*.";
+		searchPattern += MODULE_EXTENSION;
+	}
+	else
+	{
+		searchPattern = lpModuleName;
+	}
 
-	WIN32_FIND_DATAW wfd = {};
-	HANDLE hFind = FindFirstFileW(searchStr.c_str(), &wfd);
-	if (hFind == INVALID_HANDLE_VALUE)
+	std::vector<StringW> paths;
+	HRESULT hr = FindPlugins(searchPath.c_str(), searchPattern.c_str(), paths);
+	if (FAILED(hr)) return hr;
+
+	std::vector<MODULE_LOAD_ITEM> items;
+	for (size_t k = 0; k < paths.size(); k++)
 	{
-		return HRESULT_FROM_WIN32(GetLastError());
+		MODULE_LOAD_ITEM item;
+		item.path = paths[k];
+		item.flags = flags;
+		item.handle = NULL;
+		item.module = NULL;
+		items.push_back(item);
 	}
 
-	do
+	// The plug-ins do not depend on each other: load them at the same time,
+	// so that starting takes about as long as the slowest one.
+	std::vector<PTP_WORK> works(items.size(), (PTP_WORK)NULL);
+	size_t i, n;
+	n = items.size();
+	for (i = 0; i + 1 < n; i++)
+	{
+		works[i] = CreateThreadpoolWork(&LoadModuleWork, &items[i], NULL);
+		if (works[i])
+			SubmitThreadpoolWork(works[i]);
+	}
+	for (i = 0; i < n; i++)
 	{
-		StringW modulePath = searchPath + L"\\" + wfd.cFileName;
-		HMODULE handle = LoadLibraryExW(modulePath.c_str(), NULL, flags);
-		if (handle)
+		if (works[i])
 		{
-			CREATEMODULEOBJECT createclsObj = (CREATEMODULEOBJECT)GetProcAddress(handle, MODULE_EP);
-			IModule * module = NULL;
-			if (SUCCEEDED(createclsObj(CLSID_NULL, 0, __uuidof(IModule), (LPVOID*)&module)))
+			WaitForThreadpoolWorkCallbacks(works[i], FALSE);
+			CloseThreadpoolWork(works[i]);
+		}
+		else
+		{
+			LoadPlugin(items[i].path.c_str(), items[i].flags, &items[i].handle, &items[i].module);
+		}
+	}
+
+	// in the order of the directory
+	for (i = 0; i < n; i++)
+	{
+		IModule * module = items[i].module;
+		HMODULE handle = items[i].handle;
+		if (module && (anyType || module->GetType() == moduleType))
+		{
+			if (m_modules.end() == std::find(m_modules.begin(), m_modules.end(), module))
 			{
-				if (module->GetType() == moduleType)
-				{
-					if (m_modules.end() == std::find(m_modules.begin(), m_modules.end(), module))
-					{
-						m_modules.push_back(module);
-						handle = NULL;
-						module = NULL;
-					}
-				}
+				m_modules.push_back(module);
+				handle = NULL;
+				module = NULL;
 			}
-
-			if (module) module->Release();
 		}
 
-		if (handle) FreeLibrary(handle);
-
-	} while (FindNextFileW(hFind, &wfd));
+		if (module) module->Release();
+		if (handle) FreePlugin(handle);
+	}
 
-	FindClose(hFind);
 	return (m_modules.size()) ? S_OK : E_FAIL;
 }
 
+HRESULT WINAPI CModuleMgrService::Load(__in LPCWSTR lpModuleDirectory /*= NULL*/, __in LPCWSTR lpModuleName /*= NULL*/, __in DWORD flags /*= 0*/)
+{
+	return LoadModules(lpModuleDirectory, lpModuleName, TRUE, DefaultModuleType, flags);
+}
+
+HRESULT WINAPI CModuleMgrService::Load(__in LPCWSTR lpModuleDirectory /*= NULL*/, __in ModuleType moduleType /*= 0*/, __in DWORD flags /*= 0*/)
+{
+	return LoadModules(lpModuleDirectory, NULL, FALSE, moduleType, flags);
+}
+
 HRESULT WINAPI CModuleMgrService::Unload(__in LPCWSTR lpModuleName /*= NULL*/)
 {
 	if (lpModuleName == NULL)
@@ -149,9 +279,13 @@ HRESULT WINAPI CModuleMgrService::Unload(__in LPCWSTR lpModuleName /*= NULL*/)
 			if (SUCCEEDED((*it)->GetModuleInfo(&info)))
 			{
 				(*it)->Release();
-				FreeLibrary(info.handle);
+				FreePlugin(info.handle);
 				it = m_modules.erase(it);
 			}
+			else
+			{
+				++it;
+			}
 		}
 		return S_OK;
 	}
@@ -169,7 +303,7 @@ HRESULT WINAPI CModuleMgrService::Unload(__in LPCWSTR lpModuleName /*= NULL*/)
 					if (SUCCEEDED((*it)->GetModuleInfo(&info)))
 					{
 						(*it)->Release();
-						FreeLibrary(info.handle);
+						FreePlugin(info.handle);
 						m_modules.erase(it);
 						SysFreeString(name);
 						return S_OK;
@@ -194,7 +328,7 @@ HRESULT WINAPI CModuleMgrService::Unload(__in ModuleType moduleType /*= DefaultM
 			if (SUCCEEDED((*it)->GetModuleInfo(&info)))
 			{
 				(*it)->Release();
-				FreeLibrary(info.handle);
+				FreePlugin(info.handle);
 				it = m_modules.erase(it);
 				bFound = TRUE;
 			}
@@ -203,6 +337,10 @@ HRESULT WINAPI CModuleMgrService::Unload(__in ModuleType moduleType /*= DefaultM
 				it++;
 			}
 		}
+		else
+		{
+			it++;
+		}
 	}
 
 	return bFound ? S_OK : E_NOT_SET;
@@ -282,3 +420,57 @@ HRESULT WINAPI CModuleMgrService::QueryModule(__out IModule **&module, __out siz
 	}
 	return S_OK;
 }
+
+HRESULT WINAPI CModuleMgrService::Reload(__in LPCWSTR lpModulePath, __in DWORD flags, __out IModule **module)
+{
+	if (lpModulePath == NULL || module == NULL) return E_INVALIDARG;
+	*module = NULL;
+
+	HMODULE handle = NULL;
+	IModule * newModule = NULL;
+	BSTR name = NULL;
+	HRESULT hr = LoadPlugin(lpModulePath, flags, &handle, &newModule);
+	if (FAILED(hr)) return hr;
+	if (FAILED(hr = newModule->GetName(&name)))
+		goto Exit;
+
+	for (MODULE_ARRAY::iterator it = m_modules.begin(); it != m_modules.end(); ++it)
+	{
+		BSTR loadedName = NULL;
+		BOOL sameName = SUCCEEDED((*it)->GetName(&loadedName)) &&
+			(0 == _wcsnicmp((wchar_t const*)loadedName, (wchar_t const*)name, MAX_NAME));
+		if (loadedName)
+			SysFreeString(loadedName);
+		if (!sameName)
+			continue;
+
+		MODULE_INFO info;
+		if (FAILED(hr = (*it)->GetModuleInfo(&info)))
+			goto Exit;
+		// LoadPlugin() returned the library already loaded
+		if (info.handle == handle)
+		{
+			hr = E_NOT_VALID_STATE;
+			goto Exit;
+		}
+
+		// the scanners pin the library of the modules they still use
+		(*it)->Release();
+		FreePlugin(info.handle);
+		m_modules.erase(it);
+		break;
+	}
+
+	m_modules.push_back(newModule);
+	newModule->AddRef();
+	*module = newModule;
+	newModule = NULL;
+	handle = NULL;
+	hr = S_OK;
+
+Exit:
+	if (name) SysFreeString(name);
+	if (newModule) newModule->Release();
+	if (handle) FreePlugin(handle);
+	return hr;
+}
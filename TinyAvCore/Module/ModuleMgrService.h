@@ -10,6 +10,9 @@ class CModuleMgrService :
 protected:
 	MODULE_ARRAY m_modules;
 
+	HRESULT LoadModules(__in_opt LPCWSTR lpModuleDirectory, __in_opt LPCWSTR lpModuleName,
+		__in BOOL anyType, __in ModuleType moduleType, __in DWORD flags);
+
 public:
 	CModuleMgrService();
 	virtual ~CModuleMgrService();
@@ -37,4 +40,43 @@ public:
 
 	virtual HRESULT WINAPI QueryModule(__out IModule **&module, __out size_t& moduleCount, __in ModuleType moduleType = DefaultModuleType) override;
 
+
+	virtual HRESULT WINAPI Reload(__in LPCWSTR lpModulePath, __in DWORD flags, __out IModule **module) override;
+
+	/* Load a plug-in library and create its module object. With the functions
+	below, the only place that knows how a plug-in is loaded: LoadLibraryExW()
+	on Windows, dlopen() elsewhere.
+	@lpModulePath: full path of the plug-in
+	@flags: flags of LoadLibraryExW(), not used by dlopen()
+	@handle: a pointer to a variable storing the library
+	@module: a pointer to a variable storing the module object
+	@return: HRESULT on success, or other value on failure.
+	*/
+	static HRESULT LoadPlugin(__in LPCWSTR lpModulePath, __in DWORD flags, __out HMODULE * handle, __out IModule ** module);
+
+	// Unload a library returned by LoadPlugin() or PinPlugin(), NULL is ignored
+	static void FreePlugin(__in HMODULE handle);
+
+	/* Find an exported symbol of a plug-in library
+	@handle: a library returned by LoadPlugin()
+	@name: name of the symbol
+	@return: address of the symbol, or NULL if it is not found.
+	*/
+	static FARPROC FindPluginSymbol(__in HMODULE handle, __in LPCSTR name);
+
+	/* Add a reference to a loaded plug-in library
+	@handle: the library, as its module reports it in MODULE_INFO
+	@pinned: a pointer to a variable storing the library, to be passed to FreePlugin()
+	@return: HRESULT on success, or other value on failure.
+	*/
+	static HRESULT PinPlugin(__in HMODULE handle, __out HMODULE * pinned);
+
+	/* List the plug-ins of a directory
+	@lpDirectory: directory to search
+	@lpPattern: file name, wildcards allowed
+	@paths: full paths of the files found are added to it
+	@return: HRESULT on success, or other value on failure.
+	*/
+	static HRESULT FindPlugins(__in LPCWSTR lpDirectory, __in LPCWSTR lpPattern, __inout std::vector<StringW> & paths);
+
 };
@@ -0,0 +1,214 @@
+#include "DirectoryCosts.h"
+#include "EmulationClock.h"
+#include <vector>
+#include <algorithm>
+
+// Counters of the current thread
+typedef struct DIRECTORY_COST_THREAD_STATE
+{
+	ULONGLONG			files;		// counted by the thread since it started
+	ULONGLONG			bytes;
+
+	// the counters when the top-level file started
+	ULONGLONG			fileFiles;
+	ULONGLONG			fileBytes;
+	LONGLONG			fileTicks;
+	ULONG_PTR			fileEmulateUs;
+
+	// files of one directory, not added to their owner yet
+	CDirectoryCosts *	owner;		// NULL when nothing is held
+	WCHAR				directory[MAX_PATH];
+	DIRECTORY_COST		pending;
+}DIRECTORY_COST_THREAD_STATE;
+
+static __declspec(thread) DIRECTORY_COST_THREAD_STATE t_costs;
+
+// A directory with the directories under it
+typedef struct DIRECTORY_TREE
+{
+	DIRECTORY_COST	cost;
+	ULONG			children;	// subdirectories with costs
+	BOOL			hasFiles;	// files were found in the directory itself
+}DIRECTORY_TREE;
+
+typedef std::map<StringW, DIRECTORY_TREE> DIRECTORY_TREE_MAP;
+
+static void AddCost(__inout DIRECTORY_COST & total, __in const DIRECTORY_COST & cost)
+{
+	total.files += cost.files;
+	total.bytes += cost.bytes;
+	total.ticks += cost.ticks;
+	total.emulateUs += cost.emulateUs;
+}
+
+CDirectoryCosts::CDirectoryCosts()
+{
+	InitializeSRWLock(&m_lock);
+	QueryPerformanceFrequency(&m_frequency);
+}
+
+CDirectoryCosts::~CDirectoryCosts()
+{
+	// the walks flush what they hold before they end; this is what is left
+	// by a caller of Charge()
+	if (t_costs.owner == this)
+		t_costs.owner = NULL;
+}
+
+HRESULT WINAPI CDirectoryCosts::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown))
+	{
+		*ppvObject = static_cast<IUnknown*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+void CDirectoryCosts::CountFile(void)
+{
+	t_costs.files++;
+}
+
+void CDirectoryCosts::CountBytes(__in ULONGLONG bytes)
+{
+	t_costs.bytes += bytes;
+}
+
+void CDirectoryCosts::BeginFile(void)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	t_costs.fileFiles = t_costs.files;
+	t_costs.fileBytes = t_costs.bytes;
+	t_costs.fileTicks = now.QuadPart;
+	t_costs.fileEmulateUs = CEmulationClock::GetInstance()->Read();
+}
+
+void CDirectoryCosts::EndFile(__in_opt IVirtualFs * container, __in LPCWSTR fileName)
+{
+	if (fileName == NULL) return;
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	DIRECTORY_COST cost;
+	cost.files = t_costs.files - t_costs.fileFiles;
+	cost.bytes = t_costs.bytes - t_costs.fileBytes;
+	cost.ticks = now.QuadPart - t_costs.fileTicks;
+	// the clock wraps on 32-bit builds; a difference does not
+	cost.emulateUs = (ULONG_PTR)(CEmulationClock::GetInstance()->Read() - t_costs.fileEmulateUs);
+
+	StringW directory;
+	if (container)
+	{
+		BSTR containerPath = NULL;
+		if (FAILED(container->GetFullPath(&containerPath))) return;
+		directory = containerPath;
+		SysFreeString(containerPath);
+	}
+	else
+	{
+		// a file passed as the search container
+		LPCWSTR separator = wcsrchr(fileName, L'\\');
+		if (separator == NULL) return;
+		directory.assign(fileName, separator - fileName);
+	}
+	Charge(directory.c_str(), cost);
+}
+
+void CDirectoryCosts::Charge(__in LPCWSTR directory, __in const DIRECTORY_COST & cost)
+{
+	if (directory == NULL) return;
+	if (t_costs.owner == this && 0 == wcscmp(t_costs.directory, directory))
+	{
+		AddCost(t_costs.pending, cost);
+		return;
+	}
+
+	// the walk moved on: what the thread holds is final
+	if (t_costs.owner) t_costs.owner->Flush();
+	if (wcslen(directory) >= _countof(t_costs.directory))
+	{
+		Add(directory, cost);
+		return;
+	}
+	t_costs.owner = this;
+	wcscpy_s(t_costs.directory, directory);
+	t_costs.pending = cost;
+}
+
+void CDirectoryCosts::Flush(void)
+{
+	if (t_costs.owner != this) return;
+	t_costs.owner = NULL;
+	Add(t_costs.directory, t_costs.pending);
+}
+
+void CDirectoryCosts::Add(__in LPCWSTR directory, __in const DIRECTORY_COST & cost)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	AddCost(m_directories[directory], cost);
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+HRESULT CDirectoryCosts::Report(__out_ecount_part(*count, *count) SCAN_DIRECTORY_COST * costs, __inout ULONG * count)
+{
+	if (count == NULL || (costs == NULL && *count)) return E_INVALIDARG;
+
+	DIRECTORY_COST_MAP directories;
+	AcquireSRWLockShared(&m_lock);
+	directories = m_directories;
+	ReleaseSRWLockShared(&m_lock);
+
+	// add each directory to itself and to the directories above it
+	DIRECTORY_TREE_MAP trees;
+	DIRECTORY_TREE empty = {};
+	for (DIRECTORY_COST_MAP::const_iterator it = directories.begin(); it != directories.end(); ++it)
+	{
+		StringW path = it->first;
+		BOOL newChild = FALSE;
+		for (;;)
+		{
+			std::pair<DIRECTORY_TREE_MAP::iterator, bool> node = trees.insert(std::make_pair(path, empty));
+			DIRECTORY_TREE & tree = node.first->second;
+			if (newChild) tree.children++;
+			if (path.size() == it->first.size()) tree.hasFiles = TRUE;
+			AddCost(tree.cost, it->second);
+			newChild = node.second;
+
+			// up to the root of the drive or share
+			size_t separator = path.find_last_of(L'\\');
+			if (separator == StringW::npos || separator == 0 || path[separator - 1] == L'\\')
+				break;
+			path.resize(separator);
+		}
+	}
+
+	// a directory holding a single subtree costs the same as that subtree
+	std::vector<DIRECTORY_TREE_MAP::const_iterator> listed;
+	for (DIRECTORY_TREE_MAP::const_iterator it = trees.begin(); it != trees.end(); ++it)
+	{
+		if (it->second.hasFiles || it->second.children > 1)
+			listed.push_back(it);
+	}
+
+	ULONG n = (ULONG)min((size_t)*count, listed.size());
+	std::partial_sort(listed.begin(), listed.begin() + n, listed.end(),
+		[](const DIRECTORY_TREE_MAP::const_iterator & a, const DIRECTORY_TREE_MAP::const_iterator & b)
+		{ return a->second.cost.ticks > b->second.cost.ticks; });
+	for (ULONG i = 0; i < n; i++)
+	{
+		const DIRECTORY_COST & cost = listed[i]->second.cost;
+		wcsncpy_s(costs[i].path, listed[i]->first.c_str(), _TRUNCATE);
+		costs[i].files = cost.files;
+		costs[i].bytes = cost.bytes;
+		costs[i].wallUs = (ULONGLONG)(cost.ticks * 1000000 / m_frequency.QuadPart);
+		costs[i].emulateUs = cost.emulateUs;
+	}
+	*count = n;
+	return S_OK;
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <TinyAvCore.h>
+#include <map>
+
+// Cost of the files of one directory, its subdirectories left out
+typedef struct DIRECTORY_COST
+{
+	ULONGLONG	files;		// handed to the scan modules, files inside archives included
+	ULONGLONG	bytes;		// read from disk
+	LONGLONG	ticks;		// performance counter ticks spent on the files
+	ULONGLONG	emulateUs;
+}DIRECTORY_COST;
+
+typedef std::map<StringW, DIRECTORY_COST> DIRECTORY_COST_MAP;
+
+// Costs of the scanned files by directory, rolled up the tree when they are
+// read. Each thread counts the files it scans and the bytes it reads in
+// thread-local counters, and sums the top-level files of a directory on its
+// own: the shared map is only locked when the thread moves to another
+// directory or ends its walk.
+class CDirectoryCosts :
+	public CRefCount,
+	public IUnknown
+{
+protected:
+	SRWLOCK				m_lock;
+	DIRECTORY_COST_MAP	m_directories;
+	LARGE_INTEGER		m_frequency;
+
+	virtual ~CDirectoryCosts();
+
+	void Add(__in LPCWSTR directory, __in const DIRECTORY_COST & cost);
+
+public:
+	CDirectoryCosts();
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	// Count a file handed to the scan modules by the current thread
+	static void CountFile(void);
+
+	// Count bytes read from disk by the current thread
+	static void CountBytes(__in ULONGLONG bytes);
+
+	// Start the top-level file of the current thread
+	static void BeginFile(void);
+
+	/* Charge the top-level file of the current thread to its directory
+	@container: directory of the file, or NULL if fileName is a full path
+	@fileName: name of the file
+	*/
+	void EndFile(__in_opt IVirtualFs * container, __in LPCWSTR fileName);
+
+	/* Charge a cost to a directory
+	Consecutive costs of the same directory are summed by the current thread,
+	and added together when it charges another directory or calls Flush().
+	@directory: full path of the directory
+	@cost: cost of files found in it
+	*/
+	void Charge(__in LPCWSTR directory, __in const DIRECTORY_COST & cost);
+
+	// Add the costs the current thread holds for this object. Call it when a walk ends.
+	void Flush(void);
+
+	// See IScanner::GetDirectoryCosts()
+	HRESULT Report(__out_ecount_part(*count, *count) SCAN_DIRECTORY_COST * costs, __inout ULONG * count);
+};
+
+// Charges the scan of a top-level file, with the files inside it, to its directory
+class CDirectoryCostScope
+{
+protected:
+	CDirectoryCosts *	m_costs;
+	IVirtualFs *		m_container;
+	LPCWSTR				m_fileName;
+
+public:
+	CDirectoryCostScope(__in_opt CDirectoryCosts * costs, __in_opt IVirtualFs * container, __in LPCWSTR fileName)
+	{
+		m_costs = costs;
+		m_container = container;
+		m_fileName = fileName;
+		if (m_costs) CDirectoryCosts::BeginFile();
+	}
+
+	~CDirectoryCostScope()
+	{
+		if (m_costs) m_costs->EndFile(m_container, m_fileName);
+	}
+};
@@ -0,0 +1,44 @@
+#include "EmulationClock.h"
+#include "../Utils.h"
+
+#define EMULATION_CLOCK_MAPPING_FORMAT	L"Local\\TinyAvEmulationClock.%lu"
+
+CEmulationClock::CEmulationClock()
+{
+	m_table = NULL;
+	m_mapping = NULL;
+	m_slot = TLS_OUT_OF_INDEXES;
+	QueryPerformanceFrequency(&m_frequency);
+
+	// without the table, the clock stays off
+	m_table = (EMULATION_CLOCK_TABLE*)MapProcessTable(EMULATION_CLOCK_MAPPING_FORMAT, sizeof(EMULATION_CLOCK_TABLE), &m_mapping);
+	if (m_table == NULL) return;
+	m_slot = PublishTlsSlot(&m_table->slot);
+}
+
+CEmulationClock::~CEmulationClock()
+{
+	UnmapProcessTable(m_table, m_mapping);
+	m_table = NULL;
+	m_mapping = NULL;
+}
+
+CEmulationClock * CEmulationClock::GetInstance(void)
+{
+	static CEmulationClock s_clock;
+	return &s_clock;
+}
+
+void CEmulationClock::Add(__in LONGLONG ticks)
+{
+	if (m_slot == TLS_OUT_OF_INDEXES || ticks <= 0) return;
+	ULONG_PTR us = (ULONG_PTR)TlsGetValue(m_slot);
+	us += (ULONG_PTR)(ticks * 1000000 / m_frequency.QuadPart);
+	TlsSetValue(m_slot, (LPVOID)us);
+}
+
+ULONG_PTR CEmulationClock::Read(void)
+{
+	if (m_slot == TLS_OUT_OF_INDEXES) return 0;
+	return (ULONG_PTR)TlsGetValue(m_slot);
+}
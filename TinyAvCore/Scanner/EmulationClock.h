@@ -0,0 +1,55 @@
+#pragma once
+#include <TinyAvCore.h>
+
+// Index of the TLS slot holding the emulation time of each thread, shared by
+// every copy of TinyAvCore in the process through a named mapping: the
+// plug-ins emulate with their own copy, while the scanner charges the time
+// to the files it scans with another.
+typedef struct EMULATION_CLOCK_TABLE
+{
+	volatile LONG	slot;	// TLS index + 1, 0 until the first copy allocates it
+}EMULATION_CLOCK_TABLE;
+
+// Time each thread spent emulating code, in microseconds. It is always on:
+// an emulation costs two performance counter reads and a TLS access more.
+// The clock wraps on 32-bit builds, so only differences are meaningful.
+class CEmulationClock
+{
+protected:
+	EMULATION_CLOCK_TABLE *	m_table;	// NULL if the mapping could not be created
+	HANDLE					m_mapping;
+	DWORD					m_slot;		// TLS_OUT_OF_INDEXES when the clock is not available
+	LARGE_INTEGER			m_frequency;
+
+	CEmulationClock();
+	virtual ~CEmulationClock();
+
+public:
+	static CEmulationClock * GetInstance(void);
+
+	// Add the ticks of an emulation to the current thread
+	void Add(__in LONGLONG ticks);
+
+	// Emulation time of the current thread, 0 if the clock is not available
+	ULONG_PTR Read(void);
+};
+
+// Charges the time of a scope to the emulation clock of the thread
+class CEmulationScope
+{
+protected:
+	LARGE_INTEGER	m_start;
+
+public:
+	CEmulationScope()
+	{
+		QueryPerformanceCounter(&m_start);
+	}
+
+	~CEmulationScope()
+	{
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		CEmulationClock::GetInstance()->Add(now.QuadPart - m_start.QuadPart);
+	}
+};
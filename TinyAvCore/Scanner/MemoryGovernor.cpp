@@ -0,0 +1,97 @@
+#include "MemoryGovernor.h"
+#include "../Utils.h"
+
+#define MEMORY_LIMIT_ENV		L"TINYAV_MEMORY_LIMIT"
+#define GOVERNOR_MAPPING_FORMAT	L"Local\\TinyAvMemoryGovernor.%lu"
+
+CMemoryGovernor::CMemoryGovernor()
+{
+	m_table = NULL;
+	m_mapping = NULL;
+	m_limit = 0;
+	m_pressure = 0;
+	ZeroMemory(&m_local, sizeof(m_local));
+
+	WCHAR szValue[32];
+	DWORD length = GetEnvironmentVariableW(MEMORY_LIMIT_ENV, szValue, _countof(szValue));
+	if (length > 0 && length < _countof(szValue))
+		m_limit = _wtoi64(szValue) * 1024 * 1024;
+	else
+		m_limit = (LONG64)(GetJobMemoryLimit() / 4 * 3);
+	if (m_limit <= 0) return;
+	m_pressure = m_limit / 100 * GOVERNOR_PRESSURE_PERCENT;
+
+	// Without the table, each copy accounts for its own allocations:
+	// another process must not be able to raise the total and starve the scan.
+	GOVERNOR_TABLE * table = (GOVERNOR_TABLE*)MapProcessTable(GOVERNOR_MAPPING_FORMAT, sizeof(GOVERNOR_TABLE), &m_mapping);
+	m_table = table ? table : &m_local;
+}
+
+CMemoryGovernor::~CMemoryGovernor()
+{
+	UnmapProcessTable((m_table != &m_local) ? m_table : NULL, m_mapping);
+	m_table = NULL;
+	m_mapping = NULL;
+}
+
+CMemoryGovernor * CMemoryGovernor::GetInstance(void)
+{
+	static CMemoryGovernor s_governor;
+	return &s_governor;
+}
+
+// Memory limit of the job object of the process, 0 if there is none
+ULONGLONG CMemoryGovernor::GetJobMemoryLimit(void)
+{
+	JOBOBJECT_EXTENDED_LIMIT_INFORMATION info = {};
+	if (!QueryInformationJobObject(NULL, JobObjectExtendedLimitInformation, &info, sizeof(info), NULL))
+		return 0;
+
+	ULONGLONG limit = 0;
+	if (TEST_FLAG(info.BasicLimitInformation.LimitFlags, JOB_OBJECT_LIMIT_PROCESS_MEMORY))
+		limit = info.ProcessMemoryLimit;
+	if (TEST_FLAG(info.BasicLimitInformation.LimitFlags, JOB_OBJECT_LIMIT_JOB_MEMORY) &&
+		(limit == 0 || info.JobMemoryLimit < limit))
+		limit = info.JobMemoryLimit;
+	return limit;
+}
+
+BOOL CMemoryGovernor::IsUnderPressure(void)
+{
+	return m_table && m_table->total >= m_pressure;
+}
+
+BOOL CMemoryGovernor::Fits(__in ULONGLONG bytes)
+{
+	return m_table == NULL || m_table->total + (LONG64)bytes <= m_limit;
+}
+
+void CMemoryGovernor::Charge(__in MemoryUse use, __in LONG64 delta)
+{
+	if (m_table == NULL || use < 0 || use >= MemoryUseCount || delta == 0) return;
+	InterlockedExchangeAdd64(&m_table->total, delta);
+	InterlockedExchangeAdd64(&m_table->used[use], delta);
+}
+
+HRESULT CMemoryGovernor::Reserve(__in MemoryUse use, __in ULONGLONG bytes, __in ULONGLONG deadline)
+{
+	if (m_table == NULL || bytes == 0) return S_OK;
+	if (use < 0 || use >= MemoryUseCount) return E_INVALIDARG;
+	// a header asking for more than the limit is not worth waiting for
+	if (bytes > (ULONGLONG)m_limit) return E_OUTOFMEMORY;
+
+	ULONGLONG maxWait = GetTickCount64() + GOVERNOR_MAX_WAIT_MS;
+	if (deadline == 0 || deadline > maxWait) deadline = maxWait;
+	for (;;)
+	{
+		if (InterlockedExchangeAdd64(&m_table->total, (LONG64)bytes) + (LONG64)bytes <= m_limit)
+		{
+			InterlockedExchangeAdd64(&m_table->used[use], (LONG64)bytes);
+			return S_OK;
+		}
+		InterlockedExchangeAdd64(&m_table->total, -(LONG64)bytes);
+
+		if (GetTickCount64() >= deadline) return E_OUTOFMEMORY;
+		Sleep(GOVERNOR_POLL_MS);
+	}
+}
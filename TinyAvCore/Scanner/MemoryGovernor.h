@@ -0,0 +1,93 @@
+#pragma once
+#include <TinyAvCore.h>
+
+// Large allocations charged to the governor
+enum MemoryUse
+{
+	MemoryArchive = 0,	// archive members inflated in memory
+	MemoryEmulator,		// guest memory mapped by the emulator
+	MemoryStreamCache,	// blocks of the file being scanned, kept by CTeeStream
+	MemoryUseCount
+};
+
+#define GOVERNOR_PRESSURE_PERCENT	(80)				// pressure starts at this share of the limit
+#define GOVERNOR_SPILL_MIN_SIZE		(1024 * 1024)		// smaller archive members stay in memory
+#define GOVERNOR_POLL_MS			(50)
+#define GOVERNOR_MAX_WAIT_MS		(60 * 1000)
+
+// Bytes charged by all threads, shared by every copy of TinyAvCore in the
+// process through a named mapping, as the stage counters are
+typedef struct GOVERNOR_TABLE
+{
+	volatile LONG64	total;
+	volatile LONG64	used[MemoryUseCount];
+}GOVERNOR_TABLE;
+
+// Process-wide accountant of the large allocations of a scan. Near the limit
+// the scan applies backpressure instead of growing: the dispatcher holds back
+// large files and archives, archive members spill to temporary files, and
+// emulations wait for memory to be returned.
+// The limit is read from TINYAV_MEMORY_LIMIT, in megabytes. Without it, the
+// governor takes 3/4 of the memory limit of the job object the process runs
+// in, if any, so a scan stays inside the limit of its container.
+class CMemoryGovernor
+{
+protected:
+	GOVERNOR_TABLE *	m_table;	// NULL when there is no limit, m_local without the mapping
+	HANDLE				m_mapping;
+	GOVERNOR_TABLE		m_local;	// bytes charged by this copy alone
+	LONG64				m_limit;
+	LONG64				m_pressure;
+
+	CMemoryGovernor();
+	virtual ~CMemoryGovernor();
+
+	static ULONGLONG GetJobMemoryLimit(void);
+
+public:
+	static CMemoryGovernor * GetInstance(void);
+
+	BOOL IsEnabled(void) { return m_table != NULL; }
+
+	// TRUE when the charged bytes are past GOVERNOR_PRESSURE_PERCENT of the limit
+	BOOL IsUnderPressure(void);
+
+	// TRUE when bytes more can be charged without going over the limit
+	BOOL Fits(__in ULONGLONG bytes);
+
+	// Charge or, with a negative delta, return bytes whatever the limit
+	void Charge(__in MemoryUse use, __in LONG64 delta);
+
+	/* Charge bytes, waiting for other scans to return memory if needed
+	@use: what the memory is for
+	@bytes: bytes to charge
+	@deadline: GetTickCount64() value to stop waiting at, 0 for GOVERNOR_MAX_WAIT_MS
+	@return: S_OK, or E_OUTOFMEMORY if the bytes do not fit in time or not at all.
+	*/
+	HRESULT Reserve(__in MemoryUse use, __in ULONGLONG bytes, __in ULONGLONG deadline);
+
+	ULONGLONG GetLimit(void) { return (ULONGLONG)m_limit; }
+};
+
+// Bytes charged for the lifetime of a scope
+class CMemoryCharge
+{
+protected:
+	MemoryUse	m_use;
+	ULONGLONG	m_bytes;
+
+public:
+	CMemoryCharge(__in MemoryUse use) : m_use(use), m_bytes(0) {}
+
+	~CMemoryCharge()
+	{
+		if (m_bytes) CMemoryGovernor::GetInstance()->Charge(m_use, -(LONG64)m_bytes);
+	}
+
+	HRESULT Reserve(__in ULONGLONG bytes, __in ULONGLONG deadline)
+	{
+		HRESULT hr = CMemoryGovernor::GetInstance()->Reserve(m_use, bytes, deadline);
+		if (SUCCEEDED(hr) && CMemoryGovernor::GetInstance()->IsEnabled()) m_bytes += bytes;
+		return hr;
+	}
+};
@@ -0,0 +1,321 @@
+#include "ScanDispatcher.h"
+#include "MemoryGovernor.h"
+
+// Lanes a worker takes jobs from, home lane first. LaneCount ends a list.
+static const ScanLane s_borrowOrder[LaneCount][LaneCount] = {
+	{ LaneTiny, LaneNormal, LaneCount, LaneCount },
+	{ LaneNormal, LaneTiny, LaneLarge, LaneArchive },
+	{ LaneLarge, LaneTiny, LaneNormal, LaneArchive },
+	{ LaneArchive, LaneTiny, LaneNormal, LaneLarge },
+};
+
+// Home lanes of the workers, in creation order
+static const ScanLane s_homeLanes[] = {
+	LaneTiny, LaneNormal, LaneArchive, LaneLarge, LaneNormal, LaneTiny, LaneNormal, LaneNormal
+};
+
+CScanDispatcher::CScanDispatcher(__in IScanObserver * observer)
+{
+	m_observer = observer;
+	m_segregate = TRUE;
+	m_stopped = FALSE;
+	m_modules = NULL;
+	InitializeSRWLock(&m_lock);
+	InitializeConditionVariable(&m_workReady);
+	InitializeConditionVariable(&m_spaceReady);
+	InitializeConditionVariable(&m_jobDone);
+	for (int i = 0; i < LaneCount; i++)
+	{
+		m_lanes[i].config.maxWorkers = 1;
+		m_lanes[i].config.queueLength = 1;
+		m_lanes[i].running = 0;
+	}
+}
+
+CScanDispatcher::~CScanDispatcher()
+{
+	Stop();
+
+	size_t i, n;
+	n = m_workers.size();
+	for (i = 0; i < n; i++)
+	{
+		if (m_workers[i]->thread)
+		{
+			WaitForSingleObject(m_workers[i]->thread, INFINITE);
+			CloseHandle(m_workers[i]->thread);
+		}
+		m_workers[i]->worker->Release();
+		delete m_workers[i];
+	}
+
+	if (m_modules)
+		m_modules->Release();
+}
+
+HRESULT WINAPI CScanDispatcher::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown))
+	{
+		*ppvObject = static_cast<IUnknown*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+HRESULT CScanDispatcher::Initialize(__in CScanModuleSet * modules, __in ULONG workerCount, __in ULONG budgetMs,
+	__in BOOL segregate, __in_opt SCANJOBTIMEOUT onTimeout, __in_opt LPVOID userData)
+{
+	if (workerCount == 0 || modules == NULL) return E_INVALIDARG;
+	if (!m_workers.empty()) return E_NOT_VALID_STATE;
+	SetModules(modules);
+
+	// Long jobs may take a quarter of the workers; the rest stay free for
+	// the files that are quick to scan.
+	ULONG longJobs = max(workerCount / 4, 1);
+	m_segregate = segregate;
+	m_lanes[LaneTiny].config.maxWorkers = workerCount;
+	m_lanes[LaneTiny].config.queueLength = 4096;
+	m_lanes[LaneNormal].config.maxWorkers = workerCount;
+	m_lanes[LaneNormal].config.queueLength = 1024;
+	m_lanes[LaneLarge].config.maxWorkers = segregate ? longJobs : workerCount;
+	m_lanes[LaneLarge].config.queueLength = 256;
+	m_lanes[LaneArchive].config.maxWorkers = segregate ? longJobs : workerCount;
+	m_lanes[LaneArchive].config.queueLength = 256;
+
+	HRESULT hr = S_OK;
+	for (ULONG i = 0; i < workerCount; i++)
+	{
+		SCAN_WORKER_THREAD * thread = new SCAN_WORKER_THREAD;
+		if (thread == NULL) return E_OUTOFMEMORY;
+		thread->instance = this;
+		thread->thread = NULL;
+		thread->owner = NULL;
+		// a lone worker must be able to take every lane
+		thread->home = (segregate && workerCount > 1) ? s_homeLanes[i % _countof(s_homeLanes)] : LaneNormal;
+		thread->worker = new CScanWorker(m_observer);
+		if (thread->worker == NULL)
+		{
+			delete thread;
+			return E_OUTOFMEMORY;
+		}
+		m_workers.push_back(thread);
+
+		if (FAILED(hr = thread->worker->Initialize(modules, budgetMs, onTimeout, userData)))
+			return hr;
+
+		thread->thread = CreateThread(NULL, 0, &CScanDispatcher::WorkerThread, thread, 0, NULL);
+		if (thread->thread == NULL) return HRESULT_FROM_WIN32(GetLastError());
+	}
+	return S_OK;
+}
+
+void CScanDispatcher::SetModules(__in CScanModuleSet * modules)
+{
+	if (modules == NULL) return;
+	AcquireSRWLockExclusive(&m_lock);
+	if (m_modules == NULL || modules->GetGeneration() > m_modules->GetGeneration())
+	{
+		modules->AddRef();
+		if (m_modules)
+			m_modules->Release();
+		m_modules = modules;
+	}
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+HRESULT CScanDispatcher::SetLaneConfig(__in ScanLane lane, __in const SCAN_LANE_CONFIG & config)
+{
+	if (lane < 0 || lane >= LaneCount) return E_INVALIDARG;
+	if (config.maxWorkers == 0 || config.queueLength == 0) return E_INVALIDARG;
+
+	AcquireSRWLockExclusive(&m_lock);
+	m_lanes[lane].config = config;
+	ReleaseSRWLockExclusive(&m_lock);
+	WakeAllConditionVariable(&m_workReady);
+	WakeAllConditionVariable(&m_spaceReady);
+	return S_OK;
+}
+
+ScanLane CScanDispatcher::Classify(__in LPCWSTR lpPath, __in ULONGLONG size)
+{
+	if (size <= TINY_FILE_SIZE) return LaneTiny;
+	if (CScanProgress::Classify(lpPath) == CostArchive) return LaneArchive;
+	if (size >= LARGE_FILE_SIZE) return LaneLarge;
+	return LaneNormal;
+}
+
+HRESULT CScanDispatcher::Dispatch(__in const SCAN_JOB & job)
+{
+	if (job.path.empty()) return E_INVALIDARG;
+	if (m_workers.empty()) return E_NOT_VALID_STATE;
+
+	ScanLane lane = m_segregate ? Classify(job.path.c_str(), job.size) : LaneNormal;
+	AcquireSRWLockExclusive(&m_lock);
+	while (!m_stopped && m_lanes[lane].queue.size() >= m_lanes[lane].config.queueLength)
+		SleepConditionVariableSRW(&m_spaceReady, &m_lock, INFINITE, 0);
+	if (m_stopped)
+	{
+		ReleaseSRWLockExclusive(&m_lock);
+		return E_ABORT;
+	}
+
+	m_lanes[lane].queue.push_back(job);
+	QueryPerformanceCounter(&m_lanes[lane].queue.back().queuedTicks);
+	m_pending[job.owner]++;
+	ReleaseSRWLockExclusive(&m_lock);
+
+	// only some of the idle workers may take this lane
+	WakeAllConditionVariable(&m_workReady);
+	return S_OK;
+}
+
+void CScanDispatcher::Drain(__in LPVOID owner)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	while (m_pending.find(owner) != m_pending.end())
+		SleepConditionVariableSRW(&m_jobDone, &m_lock, INFINITE, 0);
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+// Call with m_lock held. A NULL owner drops every job.
+void CScanDispatcher::DropJobs(__in_opt LPVOID owner)
+{
+	for (int i = 0; i < LaneCount; i++)
+	{
+		std::deque<SCAN_JOB>::iterator it = m_lanes[i].queue.begin();
+		while (it != m_lanes[i].queue.end())
+		{
+			if (owner && it->owner != owner)
+			{
+				++it;
+				continue;
+			}
+			if (--m_pending[it->owner] == 0)
+				m_pending.erase(it->owner);
+			it = m_lanes[i].queue.erase(it);
+		}
+	}
+
+	size_t i, n;
+	n = m_workers.size();
+	for (i = 0; i < n; i++)
+	{
+		if (m_workers[i]->owner && (owner == NULL || m_workers[i]->owner == owner))
+			m_workers[i]->worker->Cancel();
+	}
+}
+
+void CScanDispatcher::Cancel(__in LPVOID owner)
+{
+	if (owner == NULL) return;
+	AcquireSRWLockExclusive(&m_lock);
+	DropJobs(owner);
+	ReleaseSRWLockExclusive(&m_lock);
+	WakeAllConditionVariable(&m_spaceReady);
+	WakeAllConditionVariable(&m_jobDone);
+}
+
+void CScanDispatcher::Stop(void)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	m_stopped = TRUE;
+	DropJobs(NULL);
+	ReleaseSRWLockExclusive(&m_lock);
+	WakeAllConditionVariable(&m_workReady);
+	WakeAllConditionVariable(&m_spaceReady);
+	WakeAllConditionVariable(&m_jobDone);
+}
+
+// Call with m_lock held. held is set when a job waits for memory.
+ScanLane CScanDispatcher::PickLane(__in ScanLane home, __out BOOL * held)
+{
+	// Near the memory limit, large files and archives wait until the jobs
+	// in flight return their memory. One of them still runs when nothing
+	// else does, so the scan cannot stall.
+	ULONG running = 0;
+	for (int i = 0; i < LaneCount; i++)
+		running += m_lanes[i].running;
+	BOOL pressure = (running > 0) && CMemoryGovernor::GetInstance()->IsUnderPressure();
+
+	*held = FALSE;
+	for (int i = 0; i < LaneCount; i++)
+	{
+		ScanLane lane = s_borrowOrder[home][i];
+		if (lane == LaneCount) break;
+		if (m_lanes[lane].queue.empty() || m_lanes[lane].running >= m_lanes[lane].config.maxWorkers)
+			continue;
+		if (pressure && (lane == LaneLarge || lane == LaneArchive))
+		{
+			*held = TRUE;
+			continue;
+		}
+		return lane;
+	}
+	return LaneCount;
+}
+
+DWORD WINAPI CScanDispatcher::WorkerThread(__in LPVOID lpParam)
+{
+	if (lpParam == NULL) return 0;
+	SCAN_WORKER_THREAD * thread = (SCAN_WORKER_THREAD*)lpParam;
+	thread->instance->OnWorkerThread(thread);
+	return 0;
+}
+
+void CScanDispatcher::OnWorkerThread(__in SCAN_WORKER_THREAD * thread)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	while (!m_stopped)
+	{
+		BOOL held;
+		ScanLane lane = PickLane(thread->home, &held);
+		if (lane == LaneCount)
+		{
+			// memory is returned by other modules too: poll while jobs are held
+			SleepConditionVariableSRW(&m_workReady, &m_lock, held ? GOVERNOR_POLL_MS : INFINITE, 0);
+			continue;
+		}
+
+		SCAN_JOB job = m_lanes[lane].queue.front();
+		m_lanes[lane].queue.pop_front();
+		m_lanes[lane].running++;
+		thread->owner = job.owner;
+		thread->worker->Reset();
+		CScanModuleSet * modules = m_modules;
+		if (modules)
+			modules->AddRef();
+		ReleaseSRWLockExclusive(&m_lock);
+		WakeAllConditionVariable(&m_spaceReady);
+
+		// modules were swapped since the last job of this worker
+		if (modules)
+		{
+			thread->worker->Update(modules);
+			modules->Release();
+		}
+
+		LARGE_INTEGER startTicks, endTicks;
+		QueryPerformanceCounter(&startTicks);
+		thread->worker->Scan(job);
+		QueryPerformanceCounter(&endTicks);
+		if (job.progress)
+			job.progress->OnFileScanned(job.path.c_str(), job.size, endTicks.QuadPart - startTicks.QuadPart);
+
+		AcquireSRWLockExclusive(&m_lock);
+		m_lanes[lane].running--;
+		thread->owner = NULL;
+		if (--m_pending[job.owner] == 0)
+		{
+			m_pending.erase(job.owner);
+			WakeAllConditionVariable(&m_jobDone);
+		}
+		// the lane is under its limit again
+		WakeAllConditionVariable(&m_workReady);
+	}
+	ReleaseSRWLockExclusive(&m_lock);
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <TinyAvCore.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include "ScanWorker.h"
+
+// Top-level files are queued by how long they are likely to take, so a few
+// large archives do not hold up thousands of small scripts behind them.
+enum ScanLane
+{
+	LaneTiny = 0,	// up to TINY_FILE_SIZE
+	LaneNormal,
+	LaneLarge,		// from LARGE_FILE_SIZE
+	LaneArchive,	// archives larger than TINY_FILE_SIZE
+	LaneCount
+};
+
+#define TINY_FILE_SIZE	(64 * 1024)
+#define LARGE_FILE_SIZE	(16 * 1024 * 1024)
+
+typedef struct SCAN_LANE_CONFIG
+{
+	ULONG	maxWorkers;		// jobs of the lane scanned at the same time, borrowed workers included
+	ULONG	queueLength;	// jobs waiting in the lane before Dispatch() blocks
+}SCAN_LANE_CONFIG;
+
+// Runs the jobs of all scans on a pool of workers. Every worker has a home
+// lane and borrows jobs from other lanes while its own is empty. Workers at
+// home in the tiny lane never borrow large files or archives, so small files
+// keep a short queue whatever else is in flight. Near the memory limit of
+// CMemoryGovernor, large files and archives are held back in their queues.
+class CScanDispatcher :
+	public CRefCount,
+	public IUnknown
+{
+protected:
+	virtual ~CScanDispatcher();
+
+	typedef struct SCAN_WORKER_THREAD
+	{
+		CScanDispatcher *	instance;
+		CScanWorker *		worker;
+		HANDLE				thread;
+		ScanLane			home;
+		LPVOID				owner;		// owner of the current job, NULL while idle
+	}SCAN_WORKER_THREAD;
+
+	typedef struct SCAN_LANE_QUEUE
+	{
+		SCAN_LANE_CONFIG		config;
+		std::deque<SCAN_JOB>	queue;
+		ULONG					running;
+	}SCAN_LANE_QUEUE;
+
+	IScanObserver *						m_observer;		// not referenced: it owns the dispatcher
+	std::vector<SCAN_WORKER_THREAD *>	m_workers;
+	SCAN_LANE_QUEUE						m_lanes[LaneCount];
+	CScanModuleSet *					m_modules;		// newest generation, NULL if never set
+	std::map<LPVOID, ULONG>				m_pending;		// queued and running jobs of each owner
+	BOOL								m_segregate;
+	BOOL								m_stopped;
+	SRWLOCK								m_lock;
+	CONDITION_VARIABLE					m_workReady;	// a job was queued or a lane went under its limit
+	CONDITION_VARIABLE					m_spaceReady;	// a job left a queue
+	CONDITION_VARIABLE					m_jobDone;		// an owner has no job left
+
+public:
+	CScanDispatcher(__in IScanObserver * observer);
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	/* Create the workers and start their threads. Each worker creates its
+	instances of the modules on its own thread, when it takes its first job.
+	@modules: module set of the scanner
+	@workerCount: number of workers
+	@budgetMs: time budget of each job, 0 for no limit
+	@segregate: FALSE to queue every job in LaneNormal, as one shared queue would
+	@onTimeout: receives the jobs that overrun the budget, see CScanWorker
+	@userData: passed to onTimeout
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT Initialize(__in CScanModuleSet * modules, __in ULONG workerCount, __in ULONG budgetMs,
+		__in BOOL segregate, __in_opt SCANJOBTIMEOUT onTimeout, __in_opt LPVOID userData);
+
+	/* Hand a new generation of the scan modules to the workers
+	Each worker clones the modules before its next job; the job it is running
+	finishes on the old ones. Older generations than the current one are ignored.
+	@modules: module set of the scanner
+	*/
+	void SetModules(__in CScanModuleSet * modules);
+
+	// Change the limits of a lane. The defaults depend on the number of workers.
+	HRESULT SetLaneConfig(__in ScanLane lane, __in const SCAN_LANE_CONFIG & config);
+
+	// Queue a job in its lane, waiting while the lane is full
+	HRESULT Dispatch(__in const SCAN_JOB & job);
+
+	// Wait until the jobs of an owner are scanned or dropped
+	void Drain(__in LPVOID owner);
+
+	// Drop the queued jobs of an owner and cut its running ones short
+	void Cancel(__in LPVOID owner);
+
+	// Drop every job and stop the workers
+	void Stop(void);
+
+	static ScanLane Classify(__in LPCWSTR lpPath, __in ULONGLONG size);
+
+private:
+	static DWORD WINAPI WorkerThread(__in LPVOID lpParam);
+	void OnWorkerThread(__in SCAN_WORKER_THREAD * thread);
+	ScanLane PickLane(__in ScanLane home, __out BOOL * held);
+	void DropJobs(__in_opt LPVOID owner);
+};
@@ -0,0 +1,256 @@
+#include "ScanModuleSet.h"
+#include "..\Module\ModuleMgrService.h"
+
+CScanModuleEntry::CScanModuleEntry()
+{
+	m_module = NULL;
+	m_library = NULL;
+	m_initResult = E_PENDING;
+	InitOnceInitialize(&m_initOnce);
+}
+
+CScanModuleEntry::~CScanModuleEntry()
+{
+	if (m_module)
+	{
+		// a module that was never needed was never initialized
+		if (m_initResult != E_PENDING)
+			m_module->OnScanShutdown();
+		m_module->Release();
+	}
+	// the code of the module is gone after this
+	CModuleMgrService::FreePlugin(m_library);
+}
+
+HRESULT WINAPI CScanModuleEntry::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown))
+	{
+		*ppvObject = static_cast<IUnknown*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+HRESULT CScanModuleEntry::Initialize(__in IScanModule * scanModule)
+{
+	if (scanModule == NULL) return E_INVALIDARG;
+	if (m_module) return E_NOT_VALID_STATE;
+
+	HRESULT hr = PinLibrary(scanModule, &m_library);
+	if (FAILED(hr)) return hr;
+
+	scanModule->AddRef();
+	m_module = scanModule;
+	return S_OK;
+}
+
+HRESULT CScanModuleEntry::EnsureInitialized(void)
+{
+	if (m_module == NULL) return E_NOT_VALID_STATE;
+	InitOnceExecuteOnce(&m_initOnce, &CScanModuleEntry::InitOnceCallback, this, NULL);
+	return m_initResult;
+}
+
+BOOL CALLBACK CScanModuleEntry::InitOnceCallback(__inout PINIT_ONCE initOnce, __inout_opt PVOID parameter, __out_opt PVOID * context)
+{
+	UNREFERENCED_PARAMETER(initOnce);
+	UNREFERENCED_PARAMETER(context);
+	CScanModuleEntry * entry = (CScanModuleEntry*)parameter;
+	HRESULT hr = entry->m_module->OnScanInitialize();
+	// E_PENDING is kept for a module that has not run OnScanInitialize()
+	entry->m_initResult = (hr == E_PENDING) ? E_FAIL : hr;
+	return TRUE;
+}
+
+VOID CALLBACK CScanModuleEntry::InitializeWork(__inout PTP_CALLBACK_INSTANCE instance, __inout_opt PVOID context, __inout PTP_WORK work)
+{
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(work);
+	((CScanModuleEntry*)context)->EnsureInitialized();
+}
+
+HRESULT CScanModuleEntry::InitializeAll(__in const std::vector<CScanModuleEntry *> & entries)
+{
+	std::vector<PTP_WORK> works;
+	size_t i, n;
+	n = entries.size();
+
+	// the last module is left to this thread
+	for (i = 0; i + 1 < n; i++)
+	{
+		BOOL pending = FALSE;
+		if (!InitOnceBeginInitialize(&entries[i]->m_initOnce, INIT_ONCE_CHECK_ONLY, &pending, NULL) || pending)
+		{
+			PTP_WORK work = CreateThreadpoolWork(&CScanModuleEntry::InitializeWork, entries[i], NULL);
+			if (work == NULL) continue;
+			SubmitThreadpoolWork(work);
+			works.push_back(work);
+		}
+	}
+
+	// waits for the modules the pool is initializing, and initializes the
+	// ones it has not started yet
+	HRESULT hr = S_OK;
+	for (i = 0; i < n; i++)
+	{
+		HRESULT hrInit = entries[i]->EnsureInitialized();
+		if (FAILED(hrInit) && SUCCEEDED(hr))
+			hr = hrInit;
+	}
+
+	for (i = 0; i < works.size(); i++)
+	{
+		WaitForThreadpoolWorkCallbacks(works[i], FALSE);
+		CloseThreadpoolWork(works[i]);
+	}
+	return hr;
+}
+
+HRESULT CScanModuleEntry::PinLibrary(__in IModule * module, __out HMODULE * library)
+{
+	if (module == NULL || library == NULL) return E_INVALIDARG;
+	*library = NULL;
+
+	MODULE_INFO info;
+	if (FAILED(module->GetModuleInfo(&info)) || info.handle == NULL)
+		return S_OK;
+
+	return CModuleMgrService::PinPlugin(info.handle, library);
+}
+
+CScanModuleSet::CScanModuleSet(__in ULONG generation)
+{
+	m_generation = generation;
+	m_prepared = FALSE;
+	m_signature = 0;
+}
+
+CScanModuleSet::~CScanModuleSet()
+{
+	size_t i, n;
+	n = m_entries.size();
+	for (i = 0; i < n; i++)
+	{
+		m_entries[i]->Release();
+	}
+}
+
+HRESULT WINAPI CScanModuleSet::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown))
+	{
+		*ppvObject = static_cast<IUnknown*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+HRESULT CScanModuleSet::Initialize(__in_opt CScanModuleSet * previous, __in_opt IScanModule * removed, __in_opt CScanModuleEntry * added)
+{
+	if (!m_entries.empty()) return E_NOT_VALID_STATE;
+
+	BOOL replaced = FALSE;
+	size_t i, n;
+	n = previous ? previous->m_entries.size() : 0;
+	for (i = 0; i < n; i++)
+	{
+		CScanModuleEntry * entry = previous->m_entries[i];
+		if (removed && entry->GetModule() == removed)
+		{
+			// the new version runs where the old one did
+			if (added == NULL) continue;
+			entry = added;
+			replaced = TRUE;
+		}
+		entry->AddRef();
+		m_entries.push_back(entry);
+		m_modules.push_back(entry->GetModule());
+	}
+
+	if (added && !replaced)
+	{
+		added->AddRef();
+		m_entries.push_back(added);
+		m_modules.push_back(added->GetModule());
+	}
+
+	ComputeSignature();
+	return S_OK;
+}
+
+void CScanModuleSet::ComputeSignature(void)
+{
+	// FNV-1a of the name of each module, then of the names and versions of
+	// all of them, in scan order
+	ULONG hash = 2166136261UL;
+	size_t i, n;
+	n = m_modules.size();
+	m_verdictModules.resize(n);
+	for (i = 0; i < n; i++)
+	{
+		VERDICT_MODULE & verdictModule = m_verdictModules[i];
+		MODULE_INFO info;
+		BSTR name = NULL;
+		verdictModule.id = 2166136261UL;
+		verdictModule.version = SUCCEEDED(m_modules[i]->GetModuleInfo(&info)) ? info.version : 0;
+		if (SUCCEEDED(m_modules[i]->GetName(&name)))
+		{
+			for (const WCHAR * p = name; *p; p++)
+			{
+				WCHAR c = (WCHAR)towlower(*p);
+				verdictModule.id = (verdictModule.id ^ (BYTE)c) * 16777619UL;
+				verdictModule.id = (verdictModule.id ^ (BYTE)(c >> 8)) * 16777619UL;
+			}
+			SysFreeString(name);
+		}
+
+		const BYTE * bytes = (const BYTE *)&verdictModule;
+		for (size_t j = 0; j < sizeof(verdictModule); j++)
+			hash = (hash ^ bytes[j]) * 16777619UL;
+	}
+
+	// 0 stands for no modules
+	m_signature = n ? (hash ? hash : 1) : 0;
+}
+
+HRESULT CScanModuleSet::Prepare(void)
+{
+	if (m_prepared) return S_OK;
+	// concurrent callers wait on the modules themselves
+	HRESULT hr = CScanModuleEntry::InitializeAll(m_entries);
+	m_prepared = TRUE;
+	return hr;
+}
+
+IScanModule * CScanModuleSet::FindByName(__in IModule * module)
+{
+	BSTR name = NULL;
+	IScanModule * found = NULL;
+	if (module == NULL || FAILED(module->GetName(&name))) return NULL;
+
+	size_t i, n;
+	n = m_modules.size();
+	for (i = 0; i < n && found == NULL; i++)
+	{
+		BSTR other = NULL;
+		if (SUCCEEDED(m_modules[i]->GetName(&other)) &&
+			(0 == _wcsnicmp((wchar_t const*)name, (wchar_t const*)other, MAX_NAME)))
+		{
+			found = m_modules[i];
+		}
+
+		if (other)
+			SysFreeString(other);
+	}
+	SysFreeString(name);
+	return found;
+}
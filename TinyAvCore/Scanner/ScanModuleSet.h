@@ -0,0 +1,110 @@
+#pragma once
+#include <TinyAvCore.h>
+#include <vector>
+#include "VerdictStamps.h"
+
+// A scan module and a pin on the library it comes from. The module manager
+// may unload the library while files are still being scanned: the pin keeps
+// it loaded until the module is shut down, when the last generation holding
+// the entry is released. The module is initialized when it is first needed.
+class CScanModuleEntry :
+	public CRefCount,
+	public IUnknown
+{
+protected:
+	virtual ~CScanModuleEntry();
+
+	IScanModule *	m_module;
+	HMODULE			m_library;	// NULL for a module linked into the process
+	INIT_ONCE		m_initOnce;
+	HRESULT			m_initResult;	// of OnScanInitialize(), E_PENDING until it has run
+
+	static BOOL CALLBACK InitOnceCallback(__inout PINIT_ONCE initOnce, __inout_opt PVOID parameter, __out_opt PVOID * context);
+	static VOID CALLBACK InitializeWork(__inout PTP_CALLBACK_INSTANCE instance, __inout_opt PVOID context, __inout PTP_WORK work);
+
+public:
+	CScanModuleEntry();
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	// Take a reference on a module and pin its library
+	HRESULT Initialize(__in IScanModule * scanModule);
+
+	IScanModule * GetModule(void) { return m_module; }
+
+	// Call OnScanInitialize() of the module once; later calls return its result
+	HRESULT EnsureInitialized(void);
+
+	/* Initialize modules at the same time on the thread pool
+	The calling thread takes its share of the work, so the call returns about
+	when the slowest module is initialized.
+	@entries: modules to initialize. Those already initialized are skipped.
+	@return: S_OK if every module is initialized, or the first error.
+	*/
+	static HRESULT InitializeAll(__in const std::vector<CScanModuleEntry *> & entries);
+
+	/* Add a reference to the library of a module, see CModuleMgrService::PinPlugin()
+	@module: a pointer to IModule object
+	@library: a pointer to a variable storing the library, to be passed to
+	CModuleMgrService::FreePlugin(). NULL if the module does not come from a plug-in.
+	@return: HRESULT on success, or other value on failure.
+	*/
+	static HRESULT PinLibrary(__in IModule * module, __out HMODULE * library);
+};
+
+// One generation of the scan modules of a scanner. Changing the modules
+// publishes a new generation; the old one lives on while a file scanned
+// with it holds a reference, so running scans never see a module go away.
+class CScanModuleSet :
+	public CRefCount,
+	public IUnknown
+{
+protected:
+	virtual ~CScanModuleSet();
+
+	std::vector<CScanModuleEntry *>	m_entries;
+	std::vector<IScanModule *>		m_modules;	// the modules of m_entries, in scan order
+	ULONG							m_generation;
+	volatile BOOL					m_prepared;
+	ULONG							m_signature;
+	std::vector<VERDICT_MODULE>		m_verdictModules;	// of m_modules, in scan order
+
+	void ComputeSignature(void);
+
+public:
+	CScanModuleSet(__in ULONG generation);
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	/* Fill the set from the previous generation
+	@previous: generation to copy, NULL for an empty set
+	@removed: module of previous to leave out, NULL for none
+	@added: entry to put in place of removed, or at the end. NULL for none
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT Initialize(__in_opt CScanModuleSet * previous, __in_opt IScanModule * removed, __in_opt CScanModuleEntry * added);
+
+	// Initialize the modules of the set on the first call, in parallel
+	HRESULT Prepare(void);
+
+	// Module of the set with the same name as another, or NULL
+	IScanModule * FindByName(__in IModule * module);
+
+	const std::vector<IScanModule *> & GetModules(void) { return m_modules; }
+
+	const std::vector<CScanModuleEntry *> & GetEntries(void) { return m_entries; }
+
+	ULONG GetGeneration(void) { return m_generation; }
+
+	// Identifies the modules of the set, for the verdicts they give; 0 when
+	// the set is empty. Sets with the same modules at the same versions have
+	// the same signature.
+	ULONG GetSignature(void) { return m_signature; }
+
+	// Name and version of each module, in the order of GetModules()
+	const std::vector<VERDICT_MODULE> & GetVerdictModules(void) { return m_verdictModules; }
+};
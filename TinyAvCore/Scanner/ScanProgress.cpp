@@ -0,0 +1,254 @@
+#include "ScanProgress.h"
+#include <limits.h>
+#include <Shlwapi.h>
+#pragma comment(lib, "Shlwapi.lib")
+
+// Fixed cost of a file (open, type checks, observers) expressed in bytes.
+// Without it, millions of tiny files would be estimated as free.
+#define SCAN_FILE_COST_BYTES	(64 * 1024)
+
+static LPCWSTR s_executableExt[] = { L".exe", L".dll", L".sys", L".scr", L".ocx", L".cpl", L".drv", L".com", L".efi", NULL };
+static LPCWSTR s_archiveExt[] = { L".zip", L".jar", L".apk", L".docx", L".xlsx", L".pptx", L".img", L".iso", L".dmp", L".bin", L".raw", NULL };
+
+CScanProgress::CScanProgress()
+{
+	for (int i = 0; i < CostClassCount; i++)
+	{
+		m_censusFiles[i] = 0;
+		m_censusBytes[i] = 0;
+		m_scannedFiles[i] = 0;
+		m_scannedBytes[i] = 0;
+		m_scanTicks[i] = 0;
+	}
+	m_censusDone = FALSE;
+	m_startTime = GetTickCount64();
+	QueryPerformanceFrequency(&m_frequency);
+
+	m_censusThread = NULL;
+	m_hStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_maxDepth = -1;
+	m_flags = 0;
+	m_maxFileSize = 0;
+}
+
+CScanProgress::~CScanProgress()
+{
+	StopCensus();
+	if (m_hStop)
+	{
+		CloseHandle(m_hStop);
+		m_hStop = NULL;
+	}
+}
+
+ScanCostClass CScanProgress::Classify(__in LPCWSTR fileName)
+{
+	if (fileName == NULL) return CostOther;
+	LPCWSTR ext = PathFindExtensionW(fileName);
+	if (ext == NULL || *ext == L'\0') return CostOther;
+
+	for (int i = 0; s_executableExt[i]; i++)
+	{
+		if (_wcsicmp(ext, s_executableExt[i]) == 0) return CostExecutable;
+	}
+	for (int i = 0; s_archiveExt[i]; i++)
+	{
+		if (_wcsicmp(ext, s_archiveExt[i]) == 0) return CostArchive;
+	}
+	return CostOther;
+}
+
+HRESULT CScanProgress::StartCensus(__in IFsEnumContext * context)
+{
+	if (context == NULL) return E_INVALIDARG;
+	if (m_censusThread || m_hStop == NULL) return E_NOT_VALID_STATE;
+
+	IVirtualFs * container = NULL;
+	BSTR containerPath = NULL;
+	BSTR pattern = NULL;
+	ULARGE_INTEGER maxFileSize = {};
+	HRESULT hr;
+
+	if (SUCCEEDED(hr = context->GetSearchContainer(&container)) &&
+		SUCCEEDED(hr = container->GetFullPath(&containerPath)) &&
+		SUCCEEDED(hr = context->GetSearchPattern(&pattern)) &&
+		SUCCEEDED(hr = context->GetMaxFileSize(&maxFileSize)))
+	{
+		m_root = containerPath;
+		m_pattern = pattern;
+		m_maxDepth = context->GetMaxDepth();
+		m_flags = context->GetFlags();
+		m_maxFileSize = maxFileSize.QuadPart;
+	}
+	if (container) container->Release();
+	if (containerPath) SysFreeString(containerPath);
+	if (pattern) SysFreeString(pattern);
+	if (FAILED(hr)) return hr;
+
+	ResetEvent(m_hStop);
+	m_censusThread = CreateThread(NULL, 0, &CScanProgress::CensusThread, this, 0, NULL);
+	if (m_censusThread == NULL)
+		return HRESULT_FROM_WIN32(GetLastError());
+	return S_OK;
+}
+
+void CScanProgress::StopCensus(void)
+{
+	if (m_censusThread == NULL) return;
+	SetEvent(m_hStop);
+	WaitForSingleObject(m_censusThread, INFINITE);
+	CloseHandle(m_censusThread);
+	m_censusThread = NULL;
+}
+
+DWORD WINAPI CScanProgress::CensusThread(__in LPVOID lpParam)
+{
+	CScanProgress * progress = (CScanProgress *)lpParam;
+	if (progress == NULL) return 0;
+
+	// Background mode lowers both CPU and I/O priority, so the census only
+	// uses what the scan leaves idle.
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+	progress->Census();
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+	return 0;
+}
+
+void CScanProgress::CountFile(__in LPCWSTR fileName, __in ULONGLONG size)
+{
+	// the walker does not scan these
+	if (m_maxFileSize < size && !TEST_FLAG(m_flags, IFsEnumContext::CarveImages))
+		return;
+
+	ScanCostClass costClass = Classify(fileName);
+	InterlockedIncrement64(&m_censusFiles[costClass]);
+	InterlockedExchangeAdd64(&m_censusBytes[costClass], (LONGLONG)size);
+}
+
+// Walk the search container like CFileFsEnum does, but only with the
+// metadata returned by the directory listing. No file is opened.
+void CScanProgress::Census(void)
+{
+	std::stack<std::pair<StringW, int> > dirStack;
+	WIN32_FIND_DATAW wfd;
+	HANDLE findHandle;
+
+	findHandle = FindFirstFileExW(m_root.c_str(), FindExInfoBasic, &wfd, FindExSearchNameMatch, NULL, 0);
+	if (findHandle != INVALID_HANDLE_VALUE)
+	{
+		FindClose(findHandle);
+		if (!TEST_FLAG(wfd.dwFileAttributes, FILE_ATTRIBUTE_DIRECTORY))
+		{
+			CountFile(wfd.cFileName, ((ULONGLONG)wfd.nFileSizeHigh << 32) | wfd.nFileSizeLow);
+			InterlockedExchange(&m_censusDone, TRUE);
+			return;
+		}
+	}
+
+	dirStack.push(std::make_pair(m_root, 0));
+	while (!dirStack.empty())
+	{
+		if (WaitForSingleObject(m_hStop, 0) == WAIT_OBJECT_0)
+			return;
+
+		std::pair<StringW, int> dir = dirStack.top();
+		dirStack.pop();
+
+		StringW searchPath = dir.first + L"\\" + m_pattern;
+		findHandle = FindFirstFileExW(searchPath.c_str(), FindExInfoBasic, &wfd,
+			FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+		if (findHandle == INVALID_HANDLE_VALUE)
+			continue;
+
+		do
+		{
+			if (!wcscmp(wfd.cFileName, L".") ||
+				!wcscmp(wfd.cFileName, L".."))
+				continue;
+
+			if (TEST_FLAG(wfd.dwFileAttributes, FILE_ATTRIBUTE_DIRECTORY) &&
+				TEST_FLAG(wfd.dwFileAttributes, FILE_ATTRIBUTE_REPARSE_POINT) &&
+				(wfd.dwReserved0 == IO_REPARSE_TAG_SYMLINK || wfd.dwReserved0 == IO_REPARSE_TAG_MOUNT_POINT) &&
+				!TEST_FLAG(m_flags, IFsEnumContext::FollowLinks))
+				continue;
+
+			if (TEST_FLAG(wfd.dwFileAttributes, FILE_ATTRIBUTE_DIRECTORY))
+			{
+				if (dir.second < (m_maxDepth - 1) || m_maxDepth == -1)
+					dirStack.push(std::make_pair(dir.first + L"\\" + wfd.cFileName, dir.second + 1));
+			}
+			else
+			{
+				CountFile(wfd.cFileName, ((ULONGLONG)wfd.nFileSizeHigh << 32) | wfd.nFileSizeLow);
+			}
+		} while (FindNextFileW(findHandle, &wfd));
+		FindClose(findHandle);
+	}
+
+	InterlockedExchange(&m_censusDone, TRUE);
+}
+
+void CScanProgress::OnFileScanned(__in LPCWSTR fileName, __in ULONGLONG size, __in LONGLONG ticks)
+{
+	ScanCostClass costClass = Classify(fileName);
+	InterlockedIncrement64(&m_scannedFiles[costClass]);
+	InterlockedExchangeAdd64(&m_scannedBytes[costClass], (LONGLONG)size);
+	InterlockedExchangeAdd64(&m_scanTicks[costClass], ticks);
+}
+
+HRESULT CScanProgress::Query(__out SCAN_PROGRESS * progress)
+{
+	if (progress == NULL) return E_INVALIDARG;
+	ZeroMemory(progress, sizeof(SCAN_PROGRESS));
+	progress->remainingMs = ULLONG_MAX;
+	progress->elapsedMs = GetTickCount64() - m_startTime;
+	progress->censusDone = (m_censusDone != FALSE);
+
+	double doneWork[CostClassCount], totalWork[CostClassCount];
+	double allDoneWork = 0, allTicks = 0;
+	for (int i = 0; i < CostClassCount; i++)
+	{
+		progress->totalFiles += m_censusFiles[i];
+		progress->totalBytes += m_censusBytes[i];
+		progress->scannedFiles += m_scannedFiles[i];
+		progress->scannedBytes += m_scannedBytes[i];
+
+		doneWork[i] = (double)m_scannedBytes[i] + (double)m_scannedFiles[i] * SCAN_FILE_COST_BYTES;
+		totalWork[i] = (double)m_censusBytes[i] + (double)m_censusFiles[i] * SCAN_FILE_COST_BYTES;
+		allDoneWork += doneWork[i];
+		allTicks += (double)m_scanTicks[i];
+	}
+
+	if (allDoneWork == 0 || allTicks == 0 || progress->totalFiles == 0)
+		return S_OK;
+
+	// Remaining work of each class at the speed measured for that class.
+	// Classes without a sample yet use the average speed.
+	double remainingTicks = 0;
+	for (int i = 0; i < CostClassCount; i++)
+	{
+		double left = totalWork[i] - doneWork[i];
+		if (left <= 0) continue;
+
+		double ticksPerUnit = (doneWork[i] > 0 && m_scanTicks[i] > 0) ?
+			(double)m_scanTicks[i] / doneWork[i] : allTicks / allDoneWork;
+		remainingTicks += left * ticksPerUnit;
+	}
+
+	// The measured ticks only cover the scan modules. Scale them by the
+	// wall-clock time, which also includes walking, archives and waiting.
+	double measuredMs = allTicks * 1000.0 / (double)m_frequency.QuadPart;
+	double wallScale = (progress->elapsedMs > measuredMs) ? (double)progress->elapsedMs / measuredMs : 1.0;
+	double remainingMs = remainingTicks * 1000.0 / (double)m_frequency.QuadPart * wallScale;
+
+	progress->remainingMs = (ULONGLONG)remainingMs;
+	if (progress->elapsedMs + remainingMs <= 0)
+	{
+		// all of it done within the first millisecond
+		progress->fraction = 1.0;
+		return S_OK;
+	}
+	progress->fraction = (double)progress->elapsedMs / ((double)progress->elapsedMs + remainingMs);
+	if (progress->fraction > 1.0) progress->fraction = 1.0;
+	return S_OK;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <TinyAvCore.h>
+
+// Files are grouped by how expensive they are to scan. Throughput is
+// measured separately for each group, so a tree full of executables is not
+// estimated with the speed of text files.
+enum ScanCostClass
+{
+	CostExecutable = 0,
+	CostArchive,
+	CostOther,
+	CostClassCount
+};
+
+// Progress of one scan: a background census of the search container and
+// the measured throughput of the scan itself.
+class CScanProgress
+{
+protected:
+	volatile LONGLONG	m_censusFiles[CostClassCount];
+	volatile LONGLONG	m_censusBytes[CostClassCount];
+	volatile LONGLONG	m_scannedFiles[CostClassCount];
+	volatile LONGLONG	m_scannedBytes[CostClassCount];
+	volatile LONGLONG	m_scanTicks[CostClassCount];	// performance counter ticks
+	volatile LONG		m_censusDone;
+
+	ULONGLONG	m_startTime;
+	LARGE_INTEGER m_frequency;
+
+	// census parameters, copied from the enumeration context
+	HANDLE		m_censusThread;
+	HANDLE		m_hStop;
+	StringW		m_root;
+	StringW		m_pattern;
+	int			m_maxDepth;
+	ULONG		m_flags;
+	ULONGLONG	m_maxFileSize;
+
+	static DWORD WINAPI CensusThread(__in LPVOID lpParam);
+	virtual void Census(void);
+	void CountFile(__in LPCWSTR fileName, __in ULONGLONG size);
+
+public:
+	CScanProgress();
+	virtual ~CScanProgress();
+
+	/* Start counting the files of the search container on a background thread
+	@context: enumeration context of the scan
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT StartCensus(__in IFsEnumContext * context);
+
+	// Stop the census thread and wait for it
+	void StopCensus(void);
+
+	/* Record a file handed to the scan modules
+	@fileName: name of the file, used to find its cost class
+	@size: size of the file in bytes
+	@ticks: performance counter ticks spent on the file
+	*/
+	void OnFileScanned(__in LPCWSTR fileName, __in ULONGLONG size, __in LONGLONG ticks);
+
+	// Combine the census with the measured throughput
+	HRESULT Query(__out SCAN_PROGRESS * progress);
+
+	static ScanCostClass Classify(__in LPCWSTR fileName);
+};
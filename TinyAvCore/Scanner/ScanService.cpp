@@ -1,17 +1,49 @@
 #include "ScanService.h"
 #include "..\FileSystem\FileFsEnum.h"
+#include "..\FileSystem\WatchFsEnum.h"
+#include "..\FileSystem\FileListFsEnum.h"
 #include "..\FileSystem\FileFsEnumContext.h"
 #include "..\FileSystem\FileFs.h"
+#include "..\FileSystem\TeeStream.h"
 #include "..\FileSystem\zip\ZipFsEnum.h"
+#include "..\FileSystem\carve\CarveFsEnum.h"
+#include "StageCounters.h"
 
 SCAN_CONTEXT_MAP CScanService::m_ContextMap;
+SRWLOCK CScanService::m_ContextLock = SRWLOCK_INIT;
 
 CScanService::CScanService()
 {
+	m_fileBudgetMs = 0;
+	m_slowLaneBudgetMs = 0;
+	m_slowLane = NULL;
+	InitializeCriticalSection(&m_slowLaneLock);
+	m_workerCount = 0;
+	m_dispatcher = NULL;
+	InitializeSRWLock(&m_moduleLock);
+	m_moduleSet = new CScanModuleSet(0);
+	m_stamps = new CVerdictStamps();
+	m_costs = new CDirectoryCosts();
+	CStageCounters::GetInstance()->Read(&m_stageBase);
 }
 
 CScanService::~CScanService()
 {
+	// the workers hand files to the slow lane
+	if (m_dispatcher)
+	{
+		m_dispatcher->Release();
+		m_dispatcher = NULL;
+	}
+
+	// the slow lane reports through this object and uses the plug-ins
+	if (m_slowLane)
+	{
+		m_slowLane->Release();
+		m_slowLane = NULL;
+	}
+	DeleteCriticalSection(&m_slowLaneLock);
+
 	size_t i, n;
 	n = m_Observers.size();
 	for (i = 0; i < n; i++)
@@ -19,11 +51,23 @@ CScanService::~CScanService()
 		m_Observers[i]->Release();
 	}
 
-	n = m_ScanModules.size();
-	for (i = 0; i < n; i++)
+	// the modules are shut down with the last generation holding them
+	if (m_moduleSet)
 	{
-		m_ScanModules[i]->OnScanShutdown();
-		m_ScanModules[i]->Release();
+		m_moduleSet->Release();
+		m_moduleSet = NULL;
+	}
+
+	if (m_stamps)
+	{
+		m_stamps->Release();
+		m_stamps = NULL;
+	}
+
+	if (m_costs)
+	{
+		m_costs->Release();
+		m_costs = NULL;
 	}
 }
 
@@ -73,46 +117,159 @@ HRESULT WINAPI CScanService::RemoveScanObserver(__in IScanObserver *observer)
 HRESULT WINAPI CScanService::AddScanModule(__in IScanModule *scanModule)
 {
 	if (scanModule == NULL) return E_INVALIDARG;
-	if (m_ScanModules.end() == std::find(m_ScanModules.begin(), m_ScanModules.end(), scanModule))
-	{
-		HRESULT hr = scanModule->OnScanInitialize();
-		if (SUCCEEDED(hr))
-		{
-			scanModule->AddRef();
-			m_ScanModules.push_back(scanModule);
-			return S_OK;
-		}
-		else
-		{
-			scanModule->OnScanShutdown();
-		}
-		return hr;
-	}
+	CScanModuleSet * modules = AcquireModules();
+	if (modules == NULL) return E_OUTOFMEMORY;
 
-	return E_NOT_VALID_STATE;
+	const std::vector<IScanModule *> & current = modules->GetModules();
+	BOOL found = (current.end() != std::find(current.begin(), current.end(), scanModule));
+	modules->Release();
+	if (found) return E_NOT_VALID_STATE;
+
+	return InstallModule(scanModule, NULL);
 }
 
 HRESULT WINAPI CScanService::RemoveScanModule(__in IScanModule *scanModule)
 {
 	if (scanModule == NULL) return E_INVALIDARG;
-	std::vector<IScanModule *>::iterator it;
-	it = std::find(m_ScanModules.begin(), m_ScanModules.end(), scanModule);
-	if (m_ScanModules.end() == it)
+	CScanModuleSet * modules = AcquireModules();
+	if (modules == NULL) return E_OUTOFMEMORY;
+
+	const std::vector<IScanModule *> & current = modules->GetModules();
+	BOOL found = (current.end() != std::find(current.begin(), current.end(), scanModule));
+	modules->Release();
+	if (!found) return E_NOT_SET;
+
+	// the files being scanned by the module finish before it is shut down
+	return PublishModules(scanModule, NULL);
+}
+
+HRESULT WINAPI CScanService::ReplaceScanModule(__in IScanModule *scanModule)
+{
+	if (scanModule == NULL) return E_INVALIDARG;
+	CScanModuleSet * modules = AcquireModules();
+	if (modules == NULL) return E_OUTOFMEMORY;
+
+	HRESULT hr;
+	IScanModule * replaced = modules->FindByName(scanModule);
+	if (replaced == scanModule)
+		hr = E_NOT_VALID_STATE;
+	else
+		hr = InstallModule(scanModule, replaced);
+	modules->Release();
+	return hr;
+}
+
+HRESULT WINAPI CScanService::ImportVerdicts(__in LPCWSTR lpPath)
+{
+	if (lpPath == NULL) return E_INVALIDARG;
+	if (m_stamps == NULL || m_stamps->GetCache() == NULL) return E_OUTOFMEMORY;
+	return m_stamps->GetCache()->Import(lpPath);
+}
+
+HRESULT WINAPI CScanService::ExportVerdicts(__in LPCWSTR lpPath)
+{
+	if (lpPath == NULL) return E_INVALIDARG;
+	if (m_stamps == NULL || m_stamps->GetCache() == NULL) return E_OUTOFMEMORY;
+	return m_stamps->GetCache()->Export(lpPath);
+}
+
+HRESULT WINAPI CScanService::GetDirectoryCosts(__out_ecount_part(*count, *count) SCAN_DIRECTORY_COST * costs, __inout ULONG * count)
+{
+	if (m_costs == NULL) return E_OUTOFMEMORY;
+	return m_costs->Report(costs, count);
+}
+
+CScanModuleSet * WINAPI CScanService::AcquireModules(void)
+{
+	AcquireSRWLockShared(&m_moduleLock);
+	CScanModuleSet * modules = m_moduleSet;
+	if (modules) modules->AddRef();
+	ReleaseSRWLockShared(&m_moduleLock);
+	return modules;
+}
+
+HRESULT WINAPI CScanService::InstallModule(__in IScanModule * scanModule, __in_opt IScanModule * replaced)
+{
+	// the module is initialized by the first file it scans
+	CScanModuleEntry * entry = new CScanModuleEntry();
+	if (entry == NULL) return E_OUTOFMEMORY;
+
+	HRESULT hr = entry->Initialize(scanModule);
+	if (SUCCEEDED(hr))
+		hr = PublishModules(replaced, entry);
+	entry->Release();
+	return hr;
+}
+
+HRESULT WINAPI CScanService::PublishModules(__in_opt IScanModule * removed, __in_opt CScanModuleEntry * added)
+{
+	AcquireSRWLockExclusive(&m_moduleLock);
+	ULONG generation = m_moduleSet ? m_moduleSet->GetGeneration() + 1 : 1;
+	CScanModuleSet * modules = new CScanModuleSet(generation);
+	HRESULT hr = modules ? modules->Initialize(m_moduleSet, removed, added) : E_OUTOFMEMORY;
+	if (FAILED(hr))
 	{
-		return E_NOT_SET;
+		if (modules) modules->Release();
+		ReleaseSRWLockExclusive(&m_moduleLock);
+		return hr;
 	}
 
-	(*it)->OnScanShutdown();
-	(*it)->Release();
-	m_ScanModules.erase(it);
+	// the old generation goes away with the last file scanned with it
+	if (m_moduleSet) m_moduleSet->Release();
+	m_moduleSet = modules;
+	if (m_stamps)
+	{
+		const std::vector<VERDICT_MODULE> & verdictModules = modules->GetVerdictModules();
+		m_stamps->SetModules(modules->GetSignature(), verdictModules.empty() ? NULL : &verdictModules[0], (ULONG)verdictModules.size());
+	}
+
+	// the workers clone the new modules before their next job
+	if (m_dispatcher) m_dispatcher->SetModules(modules);
+	EnterCriticalSection(&m_slowLaneLock);
+	if (m_slowLane) m_slowLane->SetModules(modules);
+	LeaveCriticalSection(&m_slowLaneLock);
+	ReleaseSRWLockExclusive(&m_moduleLock);
 	return S_OK;
 }
 
 HRESULT WINAPI CScanService::Start(__in IFsEnumContext *enumContext)
 {
 	HRESULT hr;
-	if (m_ContextMap.size() >= MAXIMUM_WAIT_OBJECTS)
+	AcquireSRWLockShared(&m_ContextLock);
+	size_t scans = m_ContextMap.size();
+	ReleaseSRWLockShared(&m_ContextLock);
+	if (scans >= MAXIMUM_WAIT_OBJECTS)
 		return E_NOT_VALID_STATE;
+
+	// the workers are shared by all scans
+	if (m_workerCount && m_dispatcher == NULL)
+	{
+		CScanModuleSet * modules = AcquireModules();
+		if (modules == NULL) return E_OUTOFMEMORY;
+		CScanDispatcher * dispatcher = new CScanDispatcher(static_cast<IScanObserver*>(this));
+		if (dispatcher == NULL)
+		{
+			modules->Release();
+			return E_OUTOFMEMORY;
+		}
+		hr = dispatcher->Initialize(modules, m_workerCount, m_fileBudgetMs, TRUE, &CScanService::OnJobTimeout, this);
+		modules->Release();
+		if (FAILED(hr))
+		{
+			dispatcher->Release();
+			return hr;
+		}
+
+		// modules swapped while the workers started
+		m_dispatcher = dispatcher;
+		modules = AcquireModules();
+		if (modules)
+		{
+			m_dispatcher->SetModules(modules);
+			modules->Release();
+		}
+	}
+
 	SCAN_THREAD_PARAM * scanParam = new SCAN_THREAD_PARAM;
 	if (scanParam == NULL) return E_OUTOFMEMORY;
 
@@ -123,7 +280,7 @@ HRESULT WINAPI CScanService::Start(__in IFsEnumContext *enumContext)
 		delete scanParam;
 		return hr;
 	}
-	scanParam->threadHandle = CreateThread(NULL, 0, &CScanService::ScanThread, scanParam, CREATE_SUSPENDED, NULL);
+	scanParam->threadHandle = CreateThread(NULL, 0, &CScanService::ScanThread, scanParam, CREATE_SUSPENDED, &scanParam->threadId);
 	if (scanParam->threadHandle == NULL)
 	{
 		hr = HRESULT_FROM_WIN32(GetLastError());
@@ -132,33 +289,61 @@ HRESULT WINAPI CScanService::Start(__in IFsEnumContext *enumContext)
 		return hr;
 	}
 	scanParam->enumurate = NULL;
+	scanParam->progress = NULL;
+	scanParam->deferred = FALSE;
+	scanParam->modules = NULL;
+	// carved files are found apart from the file they come from, see DispatchFile()
+	scanParam->stamps = NULL;
+	if (TEST_FLAG(enumContext->GetFlags(), IFsEnumContext::VerdictStamps) &&
+		!TEST_FLAG(enumContext->GetFlags(), IFsEnumContext::CarveImages))
+		scanParam->stamps = m_stamps;
+	scanParam->costs = TEST_FLAG(enumContext->GetFlags(), IFsEnumContext::DirectoryCosts) ? m_costs : NULL;
+	if (TEST_FLAG(enumContext->GetFlags(), IFsEnumContext::Census))
+		scanParam->progress = new CScanProgress;
 	scanParam->enumContext = enumContext;
 	enumContext->AddRef();
 	scanParam->instance = this;
+	AcquireSRWLockExclusive(&m_ContextLock);
 	m_ContextMap[enumContext] = scanParam;
+	ReleaseSRWLockExclusive(&m_ContextLock);
 	ResumeThread(scanParam->threadHandle);
 	return S_OK;
 }
 
 HRESULT WINAPI CScanService::Stop(__in IFsEnumContext *enumContext)
 {
-	if (m_ContextMap.find(enumContext) == m_ContextMap.end())  return E_NOT_SET;
-	if (m_ContextMap[enumContext] == NULL) return E_NOT_SET;
-	if (m_ContextMap[enumContext]->threadHandle == NULL) return E_NOT_VALID_STATE;
-
-	if (!SetEvent(m_ContextMap[enumContext]->stopEvent))
-	{
-		return HRESULT_FROM_WIN32(GetLastError());
-	}
-	if (m_ContextMap[enumContext]->enumurate)
-	{
-		m_ContextMap[enumContext]->enumurate->Stop();
-		return S_OK;
-	}
+	HRESULT hr;
+	// the scan thread deletes its parameters after it takes the lock exclusively
+	AcquireSRWLockShared(&m_ContextLock);
+	SCAN_CONTEXT_MAP::iterator it = m_ContextMap.find(enumContext);
+	SCAN_THREAD_PARAM * param = (it != m_ContextMap.end()) ? it->second : NULL;
+	if (param == NULL)
+		hr = E_NOT_SET;
+	else if (param->threadHandle == NULL)
+		hr = E_NOT_VALID_STATE;
+	else if (!SetEvent(param->stopEvent))
+		hr = HRESULT_FROM_WIN32(GetLastError());
 	else
 	{
-		return E_NOT_SET;
+		// The slow lane and the workers are shared by all scans: only the
+		// files of this one are dropped. Files deferred after this check
+		// the stop event, see DeferToSlowLane().
+		EnterCriticalSection(&m_slowLaneLock);
+		if (m_slowLane) m_slowLane->Cancel(enumContext);
+		LeaveCriticalSection(&m_slowLaneLock);
+		if (m_dispatcher) m_dispatcher->Cancel(enumContext);
+		if (param->enumurate)
+		{
+			param->enumurate->Stop();
+			hr = S_OK;
+		}
+		else
+		{
+			hr = E_NOT_SET;
+		}
 	}
+	ReleaseSRWLockShared(&m_ContextLock);
+	return hr;
 }
 
 HRESULT WINAPI CScanService::Pause(__in IFsEnumContext *enumContext)
@@ -166,10 +351,13 @@ HRESULT WINAPI CScanService::Pause(__in IFsEnumContext *enumContext)
 	HRESULT hr;
 	size_t i, n;
 
-	if (m_ContextMap.find(enumContext) == m_ContextMap.end())  return E_NOT_SET;
-	if (m_ContextMap[enumContext] == NULL) return E_NOT_SET;
-	if (m_ContextMap[enumContext]->threadHandle == NULL) return E_NOT_VALID_STATE;
-	SuspendThread(m_ContextMap[enumContext]->threadHandle);
+	AcquireSRWLockShared(&m_ContextLock);
+	SCAN_CONTEXT_MAP::iterator it = m_ContextMap.find(enumContext);
+	SCAN_THREAD_PARAM * param = (it != m_ContextMap.end()) ? it->second : NULL;
+	hr = (param == NULL) ? E_NOT_SET : (param->threadHandle == NULL) ? E_NOT_VALID_STATE : S_OK;
+	if (SUCCEEDED(hr)) SuspendThread(param->threadHandle);
+	ReleaseSRWLockShared(&m_ContextLock);
+	if (FAILED(hr)) return hr;
 
 	n = m_Observers.size();
 	for (i = 0; i < n; i++)
@@ -185,10 +373,13 @@ HRESULT WINAPI CScanService::Resume(__in IFsEnumContext *enumContext)
 	HRESULT hr;
 	size_t i, n;
 
-	if (m_ContextMap.find(enumContext) == m_ContextMap.end()) return E_NOT_SET;
-	if (m_ContextMap[enumContext] == NULL) return E_NOT_SET;
-	if (m_ContextMap[enumContext]->threadHandle == NULL) return E_NOT_VALID_STATE;
-	ResumeThread(m_ContextMap[enumContext]->threadHandle);
+	AcquireSRWLockShared(&m_ContextLock);
+	SCAN_CONTEXT_MAP::iterator it = m_ContextMap.find(enumContext);
+	SCAN_THREAD_PARAM * param = (it != m_ContextMap.end()) ? it->second : NULL;
+	hr = (param == NULL) ? E_NOT_SET : (param->threadHandle == NULL) ? E_NOT_VALID_STATE : S_OK;
+	if (SUCCEEDED(hr)) ResumeThread(param->threadHandle);
+	ReleaseSRWLockShared(&m_ContextLock);
+	if (FAILED(hr)) return hr;
 
 	n = m_Observers.size();
 	for (i = 0; i < n; i++)
@@ -223,15 +414,64 @@ void WINAPI CScanService::OnScanThread(__in SCAN_THREAD_PARAM * param)
 		}
 	}
 
-	param->enumurate = static_cast<IFsEnum*>(new CFileFsEnum);
-	if (param->enumurate == NULL)
+	CFileFsEnum * walker;
+	if (TEST_FLAG(param->enumContext->GetFlags(), IFsEnumContext::ScanFileList))
+		walker = new CFileListFsEnum;
+	else if (TEST_FLAG(param->enumContext->GetFlags(), IFsEnumContext::WatchChanges))
+		walker = new CWatchFsEnum;
+	else
+		walker = new CFileFsEnum;
+	if (walker == NULL)
 		return;
+	walker->SetVerdictStamps(param->stamps);
+	// With workers, the files are charged by the workers that scan them. The
+	// carving left on this thread is not: its time here includes waiting for
+	// room in the lanes.
+	if (m_dispatcher == NULL)
+		walker->SetDirectoryCosts(param->costs);
+	// Stop() reads it under the shared lock
+	AcquireSRWLockExclusive(&m_ContextLock);
+	param->enumurate = static_cast<IFsEnum*>(walker);
+	ReleaseSRWLockExclusive(&m_ContextLock);
+
+	// A census needs a finite tree to count
+	if (param->progress &&
+		!TEST_FLAG(param->enumContext->GetFlags(), IFsEnumContext::ScanFileList) &&
+		!TEST_FLAG(param->enumContext->GetFlags(), IFsEnumContext::WatchChanges))
+		param->progress->StartCensus(param->enumContext);
 
 	param->enumurate->AddObserver(static_cast<IFsEnumObserver*>(param->instance));
-	AddArchivers(param->enumurate);
+	// With workers, a file is opened as an archive by the worker that scans
+	// it. Carving stays here; see DispatchFile().
+	if (m_dispatcher)
+	{
+		IFsEnum * archiver = static_cast<IFsEnum *>(new CCarveFsEnum);
+		if (archiver)
+		{
+			param->enumurate->AddArchiver(archiver);
+			archiver->Release();
+		}
+	}
+	else
+	{
+		AddArchivers(param->enumurate);
+	}
 	param->enumurate->Enum(param->enumContext);
-	param->enumurate->Release();
+	AcquireSRWLockExclusive(&m_ContextLock);
 	param->enumurate = NULL;
+	ReleaseSRWLockExclusive(&m_ContextLock);
+	walker->Release();
+
+	// the workers may still defer files to the slow lane
+	if (m_dispatcher) m_dispatcher->Drain(param->enumContext);
+
+	// the slow lane is shared: wait for the files of this scan only
+	CSlowLane * slowLane = AcquireSlowLane();
+	if (slowLane)
+	{
+		slowLane->Drain(param->enumContext);
+		slowLane->Release();
+	}
 
 	n = m_Observers.size();
 	for (i = 0; i < n; i++)
@@ -240,8 +480,11 @@ void WINAPI CScanService::OnScanThread(__in SCAN_THREAD_PARAM * param)
 		if (FAILED(hr)) return;
 	}
 
+	AcquireSRWLockExclusive(&m_ContextLock);
 	m_ContextMap.erase(param->enumContext);
+	ReleaseSRWLockExclusive(&m_ContextLock);
 	param->enumContext->Release();
+	if (param->progress) delete param->progress;
 	delete param;
 }
 
@@ -252,36 +495,198 @@ void WINAPI CScanService::AddArchivers(__inout IFsEnum * enumurate)
 	if (archiver == NULL) return;
 	enumurate->AddArchiver(archiver);
 	archiver->Release();
+
+	archiver = static_cast<IFsEnum *>(new CCarveFsEnum);
+	if (archiver == NULL) return;
+	enumurate->AddArchiver(archiver);
+	archiver->Release();
 }
 
 HRESULT WINAPI CScanService::OnFileFound(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int currentDepth)
 {
 	UNREFERENCED_PARAMETER(currentDepth);
 	HRESULT hr = S_OK;
-	size_t i, n;
-	n = m_Observers.size();
-	for (i = 0; i < n; )
+	BOOL stopped = FALSE;
+
+	// Only top-level files are timed: their context is the one passed to Start()
+	SCAN_THREAD_PARAM * topLevel = NULL;
+	CScanProgress * progress = NULL;
+	LARGE_INTEGER startTicks = {};
+	topLevel = FindScan(context);
+	if (topLevel)
+	{
+		topLevel->deferred = FALSE;
+		// the budget covers the file and the files found inside it
+		context->SetDeadline(m_fileBudgetMs ? GetTickCount64() + m_fileBudgetMs : 0);
+		if (m_dispatcher)
+			return DispatchFile(file, topLevel);
+		if (topLevel->progress)
+		{
+			progress = topLevel->progress;
+			QueryPerformanceCounter(&startTicks);
+		}
+	}
+
+	// A top-level file and the files inside it are scanned with the modules
+	// of the generation current when it was found, even if they are swapped
+	// in the meantime.
+	CScanModuleSet * modules = NULL;
+	SCAN_THREAD_PARAM * param = topLevel ? NULL : FindScanThread(GetCurrentThreadId());
+	if (param && param->modules)
+	{
+		modules = param->modules;
+		modules->AddRef();
+	}
+	else
+	{
+		modules = AcquireModules();
+		if (topLevel && modules)
+		{
+			modules->AddRef();
+			topLevel->modules = modules;
+		}
+	}
+
+	// the content of a top-level file is hashed for its stamp
+	CVerdictHasher * hasher = NULL;
+	SCAN_THREAD_PARAM * owner = topLevel ? topLevel : param;
+	CVerdictStamps * stamps = owner ? owner->stamps : NULL;
+	if (topLevel && topLevel->stamps)
+		hasher = new CVerdictHasher();
+
+	if (modules)
+	{
+		hr = ScanWithModules(file, context, modules, stamps, hasher, &stopped);
+		modules->Release();
+	}
+	if (hasher) hasher->Release();
+	if (topLevel && topLevel->modules)
+	{
+		topLevel->modules->Release();
+		topLevel->modules = NULL;
+	}
+	if (stopped) return hr;
+
+	// a scan module ran out of time: rescan the file on the slow lane
+	if (topLevel && CFileFsEnum::IsPastDeadline(context))
+	{
+		BSTR fullPath = NULL;
+		if (SUCCEEDED(file->GetFullPath(&fullPath)))
+		{
+			topLevel->deferred = TRUE;
+			DeferToSlowLane(topLevel, fullPath);
+			SysFreeString(fullPath);
+		}
+	}
+
+	if (progress) RecordScanTime(progress, file, startTicks.QuadPart);
+	OnAllScanFinished(file, context);
+	return hr;
+}
+
+HRESULT WINAPI CScanService::ScanWithModules(__in IVirtualFs *file, __in IFsEnumContext *context, __in CScanModuleSet * modules, __in_opt CVerdictStamps * stamps, __in_opt CVerdictHasher * hasher, __out BOOL * stopped)
+{
+	HRESULT hr = S_OK;
+	size_t i, n, covered = 0;
+	const std::vector<CScanModuleEntry *> & entries = modules->GetEntries();
+	const std::vector<VERDICT_MODULE> & verdictModules = modules->GetVerdictModules();
+	std::vector<IScanModule *> ready;
+	std::vector<size_t> readyIndex;		// of each ready module in the set
+
+	// the first file initializes the modules, all at the same time
+	modules->Prepare();
+
+	// A module that failed to initialize is left out, and so is a module the
+	// stamp of the top-level file says found it clean at the same version.
+	// The top-level file is read before its stamp counts, see below.
+	n = entries.size();
+	for (i = 0; i < n; i++)
 	{
-		hr = m_ScanModules[i]->Scan(file, context, this);
-		if (m_ContextMap.find(context) != m_ContextMap.end())
+		if (stamps && hasher == NULL && CVerdictStamps::IsCovered(verdictModules[i]))
+			covered++;
+		else if (SUCCEEDED(entries[i]->EnsureInitialized()))
 		{
-			if (WaitForSingleObject(m_ContextMap[context]->stopEvent, 0) == WAIT_OBJECT_0)
+			ready.push_back(entries[i]->GetModule());
+			readyIndex.push_back(i);
+		}
+	}
+
+	// the modules read the file through one tee, which reads it once
+	CTeeStream * tee = NULL;
+	CTeeStream::Attach(file, ready, hasher, &tee);
+	if (tee)
+	{
+		CStageScope stage(StageModuleScan);
+		tee->Pump(file);
+	}
+
+	// the same modules found the same content clean before, or the content
+	// is the one the stamp of the file was made for
+	BYTE digest[SHA256_DIGEST_SIZE];
+	if (tee && stamps && hasher && SUCCEEDED(hasher->GetDigest(digest)))
+	{
+		if (stamps->FindCached(digest, hasher->GetSize(), modules->GetSignature(), context))
+		{
+			covered = entries.size();
+			ready.clear();
+		}
+		else if (CVerdictStamps::VerifyContent(digest))
+		{
+			size_t kept = 0;
+			for (i = 0; i < ready.size(); i++)
 			{
-				return hr;
+				if (CVerdictStamps::IsCovered(verdictModules[readyIndex[i]]))
+					covered++;
+				else
+					ready[kept++] = ready[i];
 			}
+			ready.resize(kept);
+			if (ready.empty() && covered == entries.size())
+			{
+				BSTR fullPath = NULL;
+				if (SUCCEEDED(file->GetFullPath(&fullPath)))
+				{
+					OnError(IFsEnum::FsEnumStamped, fullPath);
+					SysFreeString(fullPath);
+				}
+			}
+		}
+	}
+	if (!ready.empty())
+		CDirectoryCosts::CountFile();
+
+	// a top-level file of a scan without workers stops with the scan
+	SCAN_THREAD_PARAM * scan = FindScan(context);
+	HANDLE stopEvent = scan ? scan->stopEvent : NULL;
+
+	*stopped = FALSE;
+	n = ready.size();
+	for (i = 0; i < n; )
+	{
+		{
+			CStageScope stage(StageModuleScan);
+			hr = ready[i]->Scan(file, context, this);
+		}
+		if (stopEvent && WaitForSingleObject(stopEvent, 0) == WAIT_OBJECT_0)
+		{
+			*stopped = TRUE;
+			break;
 		}
 
 		if (hr == E_NOT_SET) break; // file is deleted.
 		if (hr == S_FALSE)			// file is disinfected. Rescan file.
 		{
+			if (tee)
+			{
+				CStageScope stage(StageModuleScan);
+				tee->Invalidate();
+				tee->Pump(file);
+			}
 			i = 0;
 			continue;
 		}
-		if (FAILED(hr))
-		{
-			OnAllScanFinished(file, context);
-			return hr;
-		}
+		if (FAILED(hr)) break;
+
 		ULONG flags;
 		if (SUCCEEDED(file->GetFlags(&flags)) && 
 			TEST_FLAG(flags, IVirtualFs::fsDeferredDeletion))
@@ -292,10 +697,163 @@ HRESULT WINAPI CScanService::OnFileFound(__in IVirtualFs *file, __in IFsEnumCont
 		i++;
 	}
 
-	OnAllScanFinished(file, context);
+	if (tee)
+	{
+		tee->Detach(file);
+		tee->Release();
+	}
+
+	// every module of the set went through the file
+	if (hasher && SUCCEEDED(hr) && !*stopped && ready.size() + covered == entries.size() &&
+		SUCCEEDED(hasher->GetDigest(digest)))
+		CVerdictStamps::OnFileScanned(modules->GetSignature(), digest);
+	return hr;
+}
+
+HRESULT WINAPI CScanService::DispatchFile(__in IVirtualFs *file, __in SCAN_THREAD_PARAM * param)
+{
+	BSTR fullPath = NULL;
+	SCAN_JOB job;
+	HRESULT hr = file->GetFullPath(&fullPath);
+	if (FAILED(hr)) return hr;
+	hr = CScanWorker::MakeJob(fullPath, param->enumContext, &job);
+	SysFreeString(fullPath);
+	if (FAILED(hr)) return hr;
+
+	ULARGE_INTEGER fileSize = {};
+	IFsAttribute * attribute = NULL;
+	if (SUCCEEDED(file->QueryInterface(__uuidof(IFsAttribute), (LPVOID*)&attribute)))
+	{
+		attribute->Size(&fileSize);
+		attribute->Release();
+	}
+	job.size = fileSize.QuadPart;
+	job.progress = param->progress;
+	job.stamps = param->stamps;
+	job.costs = param->costs;
+	// the walker of this thread carves the file, as it also carves the
+	// files that are too large to be dispatched
+	CLR_FLAG(job.flags, IFsEnumContext::CarveImages);
+
+	// The worker opens the file itself. A handle left open here could deny
+	// it write access, so the carver gets a read-only one.
+	if (TEST_FLAG(param->enumContext->GetFlags(), IFsEnumContext::CarveImages))
+		file->ReCreate(NULL, IVirtualFs::fsRead | IVirtualFs::fsSharedRead | IVirtualFs::fsSharedWrite | IVirtualFs::fsSharedDelete | IVirtualFs::fsOpenExisting | IVirtualFs::fsAttrNormal |
+			(TEST_FLAG(param->enumContext->GetFlags(), IFsEnumContext::NoCache) ? IVirtualFs::fsNoCache : 0));
+	else
+		file->Close();
+
+	return m_dispatcher->Dispatch(job);
+}
+
+void CALLBACK CScanService::OnJobTimeout(__in const SCAN_JOB * job, __in LPVOID userData)
+{
+	if (job == NULL || userData == NULL) return;
+	((CScanService*)userData)->DeferToSlowLane(*job);
+}
+
+HRESULT WINAPI CScanService::DeferToSlowLane(__in SCAN_THREAD_PARAM * param, __in LPCWSTR lpPath)
+{
+	SCAN_JOB job;
+	HRESULT hr = CScanWorker::MakeJob(lpPath, param->enumContext, &job);
+	if (FAILED(hr)) return hr;
+	job.stamps = param->stamps;
+	job.costs = param->costs;
+	return DeferToSlowLane(job);
+}
+
+HRESULT WINAPI CScanService::DeferToSlowLane(__in const SCAN_JOB & job)
+{
+	HRESULT hr;
+	// the scan is alive while its files are scanned; it is not while it stops
+	SCAN_THREAD_PARAM * scan = FindScan(static_cast<IFsEnumContext*>(job.owner));
+	// taken before m_slowLaneLock, which PublishModules() takes under m_moduleLock
+	CScanModuleSet * modules = AcquireModules();
+	EnterCriticalSection(&m_slowLaneLock);
+	// Stop() sets the event before it drops the files of the scan under m_slowLaneLock
+	if (scan && WaitForSingleObject(scan->stopEvent, 0) == WAIT_OBJECT_0)
+	{
+		hr = E_ABORT;
+	}
+	else
+	{
+		if (m_slowLane == NULL && modules)
+		{
+			m_slowLane = new CSlowLane(static_cast<IScanObserver*>(this));
+			if (m_slowLane && FAILED(m_slowLane->Initialize(modules, m_slowLaneBudgetMs)))
+			{
+				m_slowLane->Release();
+				m_slowLane = NULL;
+			}
+		}
+		hr = m_slowLane ? m_slowLane->Enqueue(job) : E_NOT_VALID_STATE;
+	}
+	LeaveCriticalSection(&m_slowLaneLock);
+	if (modules) modules->Release();
+
+	// without a slow lane the file stays cut short
+	size_t i, n;
+	n = m_Observers.size();
+	for (i = 0; i < n; i++)
+	{
+		m_Observers[i]->OnError(SUCCEEDED(hr) ? IFsEnum::FsEnumDeferred : IFsEnum::FsEnumTimeout, job.path.c_str());
+	}
 	return hr;
 }
 
+SCAN_THREAD_PARAM * WINAPI CScanService::FindScanThread(__in DWORD threadId)
+{
+	SCAN_THREAD_PARAM * param = NULL;
+	AcquireSRWLockShared(&m_ContextLock);
+	for (SCAN_CONTEXT_MAP::iterator it = m_ContextMap.begin(); it != m_ContextMap.end(); ++it)
+	{
+		if (it->second && it->second->threadId == threadId)
+		{
+			param = it->second;
+			break;
+		}
+	}
+	ReleaseSRWLockShared(&m_ContextLock);
+	return param;
+}
+
+SCAN_THREAD_PARAM * WINAPI CScanService::FindScan(__in IFsEnumContext * context)
+{
+	AcquireSRWLockShared(&m_ContextLock);
+	SCAN_CONTEXT_MAP::iterator it = m_ContextMap.find(context);
+	SCAN_THREAD_PARAM * param = (it != m_ContextMap.end()) ? it->second : NULL;
+	ReleaseSRWLockShared(&m_ContextLock);
+	return param;
+}
+
+CSlowLane * WINAPI CScanService::AcquireSlowLane(void)
+{
+	EnterCriticalSection(&m_slowLaneLock);
+	CSlowLane * slowLane = m_slowLane;
+	if (slowLane) slowLane->AddRef();
+	LeaveCriticalSection(&m_slowLaneLock);
+	return slowLane;
+}
+
+void WINAPI CScanService::RecordScanTime(__in CScanProgress * progress, __in IVirtualFs *file, __in LONGLONG startTicks)
+{
+	LARGE_INTEGER endTicks;
+	QueryPerformanceCounter(&endTicks);
+
+	BSTR fileName = NULL;
+	ULARGE_INTEGER fileSize = {};
+	IFsAttribute * attribute = NULL;
+	if (SUCCEEDED(file->QueryInterface(__uuidof(IFsAttribute), (LPVOID*)&attribute)))
+	{
+		attribute->Size(&fileSize);
+		attribute->Release();
+	}
+	file->GetFileName(&fileName);
+
+	progress->OnFileScanned(fileName, fileSize.QuadPart, endTicks.QuadPart - startTicks);
+	if (fileName) SysFreeString(fileName);
+}
+
 HRESULT WINAPI CScanService::OnScanStarted(__in IFsEnumContext * context)
 {
 	HRESULT hr;
@@ -384,6 +942,9 @@ HRESULT WINAPI CScanService::OnPreClean(__in IVirtualFs * file, __in IFsEnumCont
 {
 	HRESULT hr;
 	size_t i, n;
+	if (result && result->scanResult == VirusDetected)
+		CVerdictStamps::OnDetected();
+
 	n = m_Observers.size();
 	for (i = 0; i < n; i++)
 	{
@@ -398,6 +959,10 @@ HRESULT WINAPI CScanService::OnPostClean(__in IVirtualFs * file, __in IFsEnumCon
 {
 	HRESULT hr;
 	size_t i, n;
+	// a file with a detection, or holding one, is never stamped
+	if (result && result->scanResult == VirusDetected)
+		CVerdictStamps::OnDetected();
+
 	n = m_Observers.size();
 	for (i = 0; i < n; i++)
 	{
@@ -410,6 +975,22 @@ HRESULT WINAPI CScanService::OnPostClean(__in IVirtualFs * file, __in IFsEnumCon
 
 void WINAPI CScanService::OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR lpMessage /*= NULL*/)
 {
+	// The walker of a scan thread ran out of time inside a file. Reports
+	// from other threads come from the slow lane and are final.
+	if (dwErrorCode == IFsEnum::FsEnumTimeout && lpMessage)
+	{
+		SCAN_THREAD_PARAM * param = FindScanThread(GetCurrentThreadId());
+		if (param)
+		{
+			if (!param->deferred)
+			{
+				param->deferred = TRUE;
+				DeferToSlowLane(param, lpMessage);
+			}
+			return;
+		}
+	}
+
 	size_t i, n;
 	n = m_Observers.size();
 	for (i = 0; i < n; i++)
@@ -421,6 +1002,7 @@ void WINAPI CScanService::OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR lpMes
 void WINAPI CScanService::Forever(void)
 {
 	HANDLE waitTable[MAXIMUM_WAIT_OBJECTS] = {};
+	AcquireSRWLockShared(&m_ContextLock);
 	size_t n = m_ContextMap.size();
 	if (n > MAXIMUM_WAIT_OBJECTS)
 		n = MAXIMUM_WAIT_OBJECTS;
@@ -435,6 +1017,50 @@ void WINAPI CScanService::Forever(void)
 		else
 			break;
 	}
+	ReleaseSRWLockShared(&m_ContextLock);
 
 	WaitForMultipleObjects((DWORD)n, waitTable, TRUE, INFINITE);
 }
+
+HRESULT WINAPI CScanService::GetProgress(__in IFsEnumContext *enumContext, __out SCAN_PROGRESS * progress)
+{
+	if (progress == NULL) return E_INVALIDARG;
+	HRESULT hr = E_NOT_SET;
+	AcquireSRWLockShared(&m_ContextLock);
+	SCAN_CONTEXT_MAP::iterator it = m_ContextMap.find(enumContext);
+	if (it != m_ContextMap.end() && it->second && it->second->progress)
+		hr = it->second->progress->Query(progress);
+	ReleaseSRWLockShared(&m_ContextLock);
+	return hr;
+}
+
+
+HRESULT WINAPI CScanService::SetTimeBudget(__in ULONG fileMs, __in ULONG slowLaneMs)
+{
+	if (fileMs && slowLaneMs && slowLaneMs < fileMs) return E_INVALIDARG;
+	m_fileBudgetMs = fileMs;
+	m_slowLaneBudgetMs = slowLaneMs;
+	return S_OK;
+}
+
+HRESULT WINAPI CScanService::SetWorkerCount(__in ULONG workerCount)
+{
+	// the workers are created with the modules and budget of the first scan
+	if (m_dispatcher) return E_NOT_VALID_STATE;
+	m_workerCount = workerCount;
+	return S_OK;
+}
+
+HRESULT WINAPI CScanService::GetStageCounters(__out SCAN_STAGE_REPORT * report)
+{
+	HRESULT hr = CStageCounters::GetInstance()->Read(report);
+	if (FAILED(hr)) return hr;
+
+	for (int i = 0; i < StageCount; i++)
+	{
+		report->stages[i].calls -= m_stageBase.stages[i].calls;
+		report->stages[i].wallUs -= m_stageBase.stages[i].wallUs;
+		report->stages[i].cycles -= m_stageBase.stages[i].cycles;
+	}
+	return S_OK;
+}
\ No newline at end of file
@@ -2,6 +2,12 @@
 #include <TinyAvCore.h>
 #include <vector>
 #include <map>
+#include "ScanProgress.h"
+#include "SlowLane.h"
+#include "ScanDispatcher.h"
+#include "ScanModuleSet.h"
+#include "VerdictStamps.h"
+#include "DirectoryCosts.h"
 
 class CScanService;
 
@@ -11,6 +17,12 @@ typedef struct SCAN_THREAD_PARAM {
 	IFsEnumContext *enumContext;
 	IFsEnum * enumurate;
 	CScanService * instance;
+	CScanProgress * progress;	// NULL unless the scan has a census
+	DWORD threadId;
+	BOOL deferred;				// the current file was handed to the slow lane
+	CScanModuleSet * modules;	// generation the current top-level file is scanned with
+	CVerdictStamps * stamps;	// NULL unless the scan stamps the files it finds clean
+	CDirectoryCosts * costs;	// NULL unless the scan charges its files to their directory
 }SCAN_THREAD_PARAM;
 
 typedef std::map<IFsEnumContext *, SCAN_THREAD_PARAM*> SCAN_CONTEXT_MAP;
@@ -23,7 +35,25 @@ class CScanService:
 {
 protected:
 	std::vector<IScanObserver *> m_Observers;
-	std::vector<IScanModule *> m_ScanModules;
+	// current generation of the scan modules; a file keeps the one it started with
+	CScanModuleSet * m_moduleSet;
+	SRWLOCK m_moduleLock;
+
+	// files overrunning m_fileBudgetMs are rescanned by m_slowLane
+	ULONG m_fileBudgetMs;
+	ULONG m_slowLaneBudgetMs;
+	CSlowLane * m_slowLane;			// created on the first deferred file
+	CRITICAL_SECTION m_slowLaneLock;
+
+	// top-level files are scanned by m_dispatcher when m_workerCount is set
+	ULONG m_workerCount;
+	CScanDispatcher * m_dispatcher;	// created by the first Start()
+
+	SCAN_STAGE_REPORT m_stageBase;	// stage counters when the scanner was created
+
+	CVerdictStamps * m_stamps;		// signature of the current modules, for the stamps, and the verdict cache
+
+	CDirectoryCosts * m_costs;		// of the scans started with IFsEnumContext::DirectoryCosts
 
 	virtual ~CScanService();
 
@@ -79,12 +109,43 @@ public:
 
 	virtual void WINAPI Forever(void) override;
 
+	virtual HRESULT WINAPI GetProgress(__in IFsEnumContext *enumContext, __out SCAN_PROGRESS * progress) override;
+
+	virtual HRESULT WINAPI SetTimeBudget(__in ULONG fileMs, __in ULONG slowLaneMs) override;
+
+	virtual HRESULT WINAPI SetWorkerCount(__in ULONG workerCount) override;
+
+	virtual HRESULT WINAPI GetStageCounters(__out SCAN_STAGE_REPORT * report) override;
+
+	virtual HRESULT WINAPI ReplaceScanModule(__in IScanModule *scanModule) override;
+
+	virtual HRESULT WINAPI ImportVerdicts(__in LPCWSTR lpPath) override;
+
+	virtual HRESULT WINAPI ExportVerdicts(__in LPCWSTR lpPath) override;
+
+	virtual HRESULT WINAPI GetDirectoryCosts(__out_ecount_part(*count, *count) SCAN_DIRECTORY_COST * costs, __inout ULONG * count) override;
+
 
 private:
 	static DWORD WINAPI ScanThread(__in LPVOID lpParam);
 public:
 	static SCAN_CONTEXT_MAP m_ContextMap;
+	static SRWLOCK m_ContextLock;		// guards m_ContextMap, not the scans in it
 protected:
 	virtual void WINAPI OnScanThread(__in SCAN_THREAD_PARAM * param);
 	virtual void WINAPI AddArchivers(__inout IFsEnum * enumurate);
+	virtual void WINAPI RecordScanTime(__in CScanProgress * progress, __in IVirtualFs *file, __in LONGLONG startTicks);
+	virtual HRESULT WINAPI DeferToSlowLane(__in SCAN_THREAD_PARAM * param, __in LPCWSTR lpPath);
+	virtual HRESULT WINAPI DeferToSlowLane(__in const SCAN_JOB & job);
+	virtual HRESULT WINAPI DispatchFile(__in IVirtualFs *file, __in SCAN_THREAD_PARAM * param);
+	static void CALLBACK OnJobTimeout(__in const SCAN_JOB * job, __in LPVOID userData);
+	virtual SCAN_THREAD_PARAM * WINAPI FindScanThread(__in DWORD threadId);
+	// The scan started with a context, NULL if none. Only the threads working
+	// for the scan may use it: it is deleted when the scan ends.
+	virtual SCAN_THREAD_PARAM * WINAPI FindScan(__in IFsEnumContext * context);
+	virtual CSlowLane * WINAPI AcquireSlowLane(void);
+	virtual HRESULT WINAPI ScanWithModules(__in IVirtualFs *file, __in IFsEnumContext *context, __in CScanModuleSet * modules, __in_opt CVerdictStamps * stamps, __in_opt CVerdictHasher * hasher, __out BOOL * stopped);
+	virtual CScanModuleSet * WINAPI AcquireModules(void);
+	virtual HRESULT WINAPI InstallModule(__in IScanModule * scanModule, __in_opt IScanModule * replaced);
+	virtual HRESULT WINAPI PublishModules(__in_opt IScanModule * removed, __in_opt CScanModuleEntry * added);
 };
\ No newline at end of file
@@ -0,0 +1,422 @@
+#include "ScanWorker.h"
+#include "..\FileSystem\FileFsEnum.h"
+#include "..\FileSystem\FileFsEnumContext.h"
+#include "..\FileSystem\FileFs.h"
+#include "..\FileSystem\TeeStream.h"
+#include "..\FileSystem\zip\ZipFsEnum.h"
+#include "..\FileSystem\carve\CarveFsEnum.h"
+#include "StageCounters.h"
+#include "..\Module\ModuleMgrService.h"
+
+CScanWorker::CScanWorker(__in IScanObserver * observer)
+{
+	m_observer = observer;
+	m_enumurate = NULL;
+	m_context = NULL;
+	m_job = NULL;
+	m_cancelled = FALSE;
+	m_timedOut = FALSE;
+	m_budgetMs = 0;
+	m_onTimeout = NULL;
+	m_userData = NULL;
+	m_generation = 0;
+	m_signature = 0;
+	m_modules = NULL;
+	InitializeCriticalSection(&m_lock);
+}
+
+CScanWorker::~CScanWorker()
+{
+	m_ScanModules.clear();
+	ReleaseModules(m_entries);
+	if (m_modules) m_modules->Release();
+	DeleteCriticalSection(&m_lock);
+}
+
+HRESULT WINAPI CScanWorker::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown) ||
+		IsEqualIID(riid, __uuidof(IFsEnumObserver)))
+	{
+		*ppvObject = static_cast<IFsEnumObserver*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+HRESULT CScanWorker::CloneModule(__in IScanModule * scanModule, __out CScanModuleEntry ** clone)
+{
+	MODULE_INFO info;
+	HRESULT hr = scanModule->GetModuleInfo(&info);
+	if (FAILED(hr)) return hr;
+	if (info.handle == NULL) return E_NOT_SET;
+
+	CREATEMODULEOBJECT createModuleObj = (CREATEMODULEOBJECT)CModuleMgrService::FindPluginSymbol(info.handle, MODULE_EP);
+	if (createModuleObj == NULL) return HRESULT_FROM_WIN32(ERROR_PROC_NOT_FOUND);
+
+	IModule * module = NULL;
+	hr = createModuleObj(CLSID_NULL, 0, __uuidof(IModule), (LPVOID*)&module);
+	if (FAILED(hr)) return hr;
+
+	IScanModule * instance = NULL;
+	hr = module->QueryInterface(__uuidof(IScanModule), (LPVOID*)&instance);
+	module->Release();
+	if (FAILED(hr)) return hr;
+
+	// the entry pins the plug-in, so the clone never outlives its code
+	*clone = new CScanModuleEntry();
+	if (*clone == NULL)
+		hr = E_OUTOFMEMORY;
+	else if (FAILED(hr = (*clone)->Initialize(instance)))
+	{
+		(*clone)->Release();
+		*clone = NULL;
+	}
+	instance->Release();
+	return hr;
+}
+
+HRESULT CScanWorker::CloneModules(__in const std::vector<IScanModule *> & modules, __out std::vector<CScanModuleEntry *> & clones)
+{
+	HRESULT hr = S_OK;
+	size_t i, n;
+	n = modules.size();
+	for (i = 0; i < n; i++)
+	{
+		CScanModuleEntry * clone = NULL;
+		if (FAILED(hr = CloneModule(modules[i], &clone)))
+			break;
+		clones.push_back(clone);
+	}
+
+	// the instances are initialized at the same time
+	if (SUCCEEDED(hr) && n)
+		hr = CScanModuleEntry::InitializeAll(clones);
+
+	// scanning with only some of the modules would report files as clean
+	if (FAILED(hr) || n == 0)
+	{
+		ReleaseModules(clones);
+		return FAILED(hr) ? hr : E_NOT_VALID_STATE;
+	}
+	return S_OK;
+}
+
+void CScanWorker::ReleaseModules(__inout std::vector<CScanModuleEntry *> & clones)
+{
+	size_t i, n;
+	n = clones.size();
+	for (i = 0; i < n; i++)
+	{
+		clones[i]->Release();
+	}
+	clones.clear();
+}
+
+HRESULT CScanWorker::Initialize(__in CScanModuleSet * modules, __in ULONG budgetMs,
+	__in_opt SCANJOBTIMEOUT onTimeout, __in_opt LPVOID userData)
+{
+	if (modules == NULL) return E_INVALIDARG;
+	if (m_modules) return E_NOT_VALID_STATE;
+	if (modules->GetModules().empty()) return E_NOT_VALID_STATE;
+
+	// the instances are created by the first job
+	modules->AddRef();
+	m_modules = modules;
+	m_budgetMs = budgetMs;
+	m_onTimeout = onTimeout;
+	m_userData = userData;
+	return S_OK;
+}
+
+HRESULT CScanWorker::Update(__in CScanModuleSet * modules)
+{
+	if (modules == NULL) return E_INVALIDARG;
+	if (m_modules && modules->GetGeneration() <= m_modules->GetGeneration()) return S_FALSE;
+
+	modules->AddRef();
+	if (m_modules) m_modules->Release();
+	m_modules = modules;
+	return S_OK;
+}
+
+HRESULT CScanWorker::LoadModules(void)
+{
+	if (m_modules == NULL) return E_NOT_VALID_STATE;
+	if (!m_entries.empty() && m_modules->GetGeneration() == m_generation) return S_FALSE;
+
+	std::vector<CScanModuleEntry *> clones;
+	HRESULT hr = CloneModules(m_modules->GetModules(), clones);
+	if (FAILED(hr)) return hr;
+
+	m_entries.swap(clones);
+	m_generation = m_modules->GetGeneration();
+	m_signature = m_modules->GetSignature();
+	m_verdictModules = m_modules->GetVerdictModules();
+	m_ScanModules.clear();
+	for (size_t i = 0; i < m_entries.size(); i++)
+		m_ScanModules.push_back(m_entries[i]->GetModule());
+	ReleaseModules(clones);
+	return S_OK;
+}
+
+HRESULT CScanWorker::MakeJob(__in LPCWSTR lpPath, __in IFsEnumContext * context, __out SCAN_JOB * job)
+{
+	if (lpPath == NULL || context == NULL || job == NULL) return E_INVALIDARG;
+
+	BSTR pattern = NULL;
+	job->path = lpPath;
+	if (SUCCEEDED(context->GetSearchPattern(&pattern)))
+	{
+		job->searchPattern = pattern;
+		SysFreeString(pattern);
+	}
+	else
+	{
+		job->searchPattern = L"*.*";
+	}
+
+	// the file is scanned on its own
+	job->flags = context->GetFlags();
+	CLR_FLAG(job->flags, IFsEnumContext::WatchChanges | IFsEnumContext::ScanFileList | IFsEnumContext::Census);
+	job->maxDepthInArchive = context->GetMaxDepthInArchive();
+	context->GetMaxFileSize(&job->maxFileSize);
+	job->size = 0;
+	job->owner = context;
+	job->progress = NULL;
+	job->queuedTicks.QuadPart = 0;
+	job->stamps = NULL;
+	job->costs = NULL;
+	return S_OK;
+}
+
+void CScanWorker::Cancel(void)
+{
+	EnterCriticalSection(&m_lock);
+	m_cancelled = TRUE;
+	if (m_enumurate) m_enumurate->Stop();
+	LeaveCriticalSection(&m_lock);
+}
+
+void CScanWorker::Reset(void)
+{
+	EnterCriticalSection(&m_lock);
+	m_cancelled = FALSE;
+	LeaveCriticalSection(&m_lock);
+}
+
+HRESULT CScanWorker::Scan(__in const SCAN_JOB & job)
+{
+	// modules were swapped since the last job, or this is the first one
+	HRESULT hr = LoadModules();
+	if (FAILED(hr) && m_entries.empty())
+	{
+		m_observer->OnError(IFsEnum::FsEnumErr, job.path.c_str());
+		return hr;
+	}
+
+	IVirtualFs * container = static_cast<IVirtualFs*>(new CFileFs());
+	IFsEnumContext * context = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	CFileFsEnum * walker = new CFileFsEnum;
+	if (container == NULL || context == NULL || walker == NULL)
+	{
+		if (container) container->Release();
+		if (context) context->Release();
+		if (walker) walker->Release();
+		return E_OUTOFMEMORY;
+	}
+	walker->SetVerdictStamps(job.stamps);
+	walker->SetDirectoryCosts(job.costs);
+	IFsEnum * enumurate = static_cast<IFsEnum*>(walker);
+
+	if (SUCCEEDED(hr = container->Create(job.path.c_str(), 0)) &&
+		SUCCEEDED(hr = context->SetSearchContainer(container)) &&
+		SUCCEEDED(hr = context->SetSearchPattern(job.searchPattern.c_str())) &&
+		SUCCEEDED(hr = context->SetFlags(job.flags)) &&
+		SUCCEEDED(hr = context->SetMaxDepthInArchive(job.maxDepthInArchive)) &&
+		SUCCEEDED(hr = context->SetMaxFileSize(job.maxFileSize)))
+	{
+		IFsEnum * archiver = static_cast<IFsEnum *>(new CZipFsEnum);
+		if (archiver)
+		{
+			enumurate->AddArchiver(archiver);
+			archiver->Release();
+		}
+		archiver = static_cast<IFsEnum *>(new CCarveFsEnum);
+		if (archiver)
+		{
+			enumurate->AddArchiver(archiver);
+			archiver->Release();
+		}
+		enumurate->AddObserver(static_cast<IFsEnumObserver*>(this));
+
+		EnterCriticalSection(&m_lock);
+		BOOL cancelled = m_cancelled;
+		if (!cancelled)
+		{
+			m_enumurate = enumurate;
+			m_context = context;
+			m_job = &job;
+			m_timedOut = FALSE;
+		}
+		LeaveCriticalSection(&m_lock);
+
+		hr = cancelled ? E_ABORT : enumurate->Enum(context);
+
+		EnterCriticalSection(&m_lock);
+		m_enumurate = NULL;
+		m_context = NULL;
+		m_job = NULL;
+		LeaveCriticalSection(&m_lock);
+		enumurate->RemoveObserver(static_cast<IFsEnumObserver*>(this));
+	}
+
+	enumurate->Release();
+	context->Release();
+	container->Release();
+	return hr;
+}
+
+void CScanWorker::OnTimeout(void)
+{
+	if (m_timedOut || m_job == NULL) return;
+	m_timedOut = TRUE;
+	if (m_onTimeout)
+		m_onTimeout(m_job, m_userData);
+	else
+		m_observer->OnError(IFsEnum::FsEnumTimeout, m_job->path.c_str());
+}
+
+HRESULT WINAPI CScanWorker::OnFileFound(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int currentDepth)
+{
+	UNREFERENCED_PARAMETER(currentDepth);
+	HRESULT hr = S_OK;
+	size_t i, n;
+
+	// the budget covers the job and the files found inside it
+	if (context == m_context)
+		context->SetDeadline(m_budgetMs ? GetTickCount64() + m_budgetMs : 0);
+
+	// the content of the job's file is hashed for its stamp
+	CVerdictHasher * hasher = NULL;
+	if (context == m_context && m_job && m_job->stamps)
+		hasher = new CVerdictHasher();
+
+	// The modules the stamp of the job's file says found it clean at the
+	// same version are left out: at once for the files inside it, once its
+	// content is read and matches the stamp for the file itself.
+	std::vector<IScanModule *> uncovered;
+	const std::vector<IScanModule *> * scanModules = &m_ScanModules;
+	if (m_job && m_job->stamps && hasher == NULL)
+	{
+		n = m_ScanModules.size();
+		for (i = 0; i < n; i++)
+		{
+			if (!CVerdictStamps::IsCovered(m_verdictModules[i]))
+				uncovered.push_back(m_ScanModules[i]);
+		}
+		scanModules = &uncovered;
+	}
+
+	// the modules read the file through one tee, which reads it once
+	CTeeStream * tee = NULL;
+	CTeeStream::Attach(file, *scanModules, hasher, &tee);
+	if (tee)
+	{
+		CStageScope stage(StageModuleScan);
+		tee->Pump(file);
+	}
+
+	// the same modules found the same content clean before, or the content
+	// is the one the stamp of the file was made for
+	BYTE digest[SHA256_DIGEST_SIZE];
+	if (tee && hasher && SUCCEEDED(hasher->GetDigest(digest)))
+	{
+		if (m_job->stamps->FindCached(digest, hasher->GetSize(), m_signature, context))
+			scanModules = &uncovered;
+		else if (CVerdictStamps::VerifyContent(digest))
+		{
+			n = m_ScanModules.size();
+			for (i = 0; i < n; i++)
+			{
+				if (!CVerdictStamps::IsCovered(m_verdictModules[i]))
+					uncovered.push_back(m_ScanModules[i]);
+			}
+			scanModules = &uncovered;
+			if (uncovered.empty())
+				m_observer->OnError(IFsEnum::FsEnumStamped, m_job->path.c_str());
+		}
+	}
+	if (!scanModules->empty())
+		CDirectoryCosts::CountFile();
+
+	n = scanModules->size();
+	for (i = 0; i < n; )
+	{
+		{
+			CStageScope stage(StageModuleScan);
+			hr = (*scanModules)[i]->Scan(file, context, m_observer);
+		}
+		if (m_cancelled)
+			break;
+
+		if (hr == E_NOT_SET) break; // file is deleted.
+		if (hr == S_FALSE)			// file is disinfected. Rescan file.
+		{
+			if (tee)
+			{
+				CStageScope stage(StageModuleScan);
+				tee->Invalidate();
+				tee->Pump(file);
+			}
+			i = 0;
+			continue;
+		}
+		if (FAILED(hr)) break;
+
+		ULONG flags;
+		if (SUCCEEDED(file->GetFlags(&flags)) &&
+			TEST_FLAG(flags, IVirtualFs::fsDeferredDeletion))
+		{
+			break;
+		}
+
+		i++;
+	}
+
+	if (tee)
+	{
+		tee->Detach(file);
+		tee->Release();
+	}
+	if (hasher)
+	{
+		if (SUCCEEDED(hr) && !m_cancelled && SUCCEEDED(hasher->GetDigest(digest)))
+			CVerdictStamps::OnFileScanned(m_signature, digest);
+		hasher->Release();
+	}
+	if (m_cancelled)
+		return hr;
+
+	// a scan module ran out of time
+	if (context == m_context && CFileFsEnum::IsPastDeadline(context))
+		OnTimeout();
+
+	m_observer->OnAllScanFinished(file, context);
+	return hr;
+}
+
+void WINAPI CScanWorker::OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR lpMessage /*= NULL*/)
+{
+	// the walker ran out of time inside the job
+	if (dwErrorCode == IFsEnum::FsEnumTimeout)
+	{
+		OnTimeout();
+		return;
+	}
+	m_observer->OnError(dwErrorCode, lpMessage);
+}
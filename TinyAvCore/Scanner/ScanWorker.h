@@ -0,0 +1,111 @@
+#pragma once
+#include <TinyAvCore.h>
+#include <vector>
+#include "ScanProgress.h"
+#include "ScanModuleSet.h"
+#include "VerdictStamps.h"
+#include "DirectoryCosts.h"
+
+// A top-level file handed to a thread other than the walker's. The scan
+// settings are copied, so the job outlives the enumeration context.
+typedef struct SCAN_JOB
+{
+	StringW			path;
+	StringW			searchPattern;
+	ULONG			flags;
+	int				maxDepthInArchive;
+	ULARGE_INTEGER	maxFileSize;
+	ULONGLONG		size;			// bytes, used to pick a lane
+	LPVOID			owner;			// the scan the file belongs to
+	CScanProgress *	progress;		// NULL unless the scan has a census
+	LARGE_INTEGER	queuedTicks;	// performance counter at submission
+	CVerdictStamps *	stamps;		// NULL unless the file is stamped when found clean; owned by the scanner
+	CDirectoryCosts *	costs;		// NULL unless the file is charged to its directory; owned by the scanner
+}SCAN_JOB;
+
+// Called when a worker cuts a job short because it overran its budget
+typedef void (CALLBACK *SCANJOBTIMEOUT)(__in const SCAN_JOB * job, __in LPVOID userData);
+
+// Scans jobs one at a time with its own scan module objects. A scan module
+// object serves one thread at a time, so every worker creates its own
+// instances from the plug-ins of the modules it is given.
+class CScanWorker :
+	public CRefCount,
+	public IFsEnumObserver
+{
+protected:
+	virtual ~CScanWorker();
+
+	IScanObserver *				m_observer;		// not referenced: it owns the worker
+	std::vector<IScanModule *>	m_ScanModules;	// the modules of m_entries, in scan order
+	std::vector<CScanModuleEntry *>	m_entries;	// the worker's own instances
+	CScanModuleSet *			m_modules;		// newest module set, cloned before the next job
+	ULONG						m_generation;	// of the module set m_entries were cloned from
+	ULONG						m_signature;	// of that module set
+	std::vector<VERDICT_MODULE>	m_verdictModules;	// of m_ScanModules, in scan order
+	CRITICAL_SECTION			m_lock;
+	IFsEnum *					m_enumurate;	// walker of the current job
+	IFsEnumContext *			m_context;		// its context
+	const SCAN_JOB *			m_job;
+	volatile BOOL				m_cancelled;
+	BOOL						m_timedOut;		// the current job was handed to m_onTimeout
+	ULONG						m_budgetMs;
+	SCANJOBTIMEOUT				m_onTimeout;
+	LPVOID						m_userData;
+
+public:
+	CScanWorker(__in IScanObserver * observer);
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	/* Set up the worker. Its module instances are created and initialized
+	in parallel by its first job, on its own thread.
+	@modules: module set of the scanner
+	@budgetMs: time budget of each job, 0 for no limit
+	@onTimeout: receives the jobs that overrun the budget. If NULL, they are
+	reported to the observer with IFsEnum::FsEnumTimeout.
+	@userData: passed to onTimeout
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT Initialize(__in CScanModuleSet * modules, __in ULONG budgetMs,
+		__in_opt SCANJOBTIMEOUT onTimeout, __in_opt LPVOID userData);
+
+	/* Scan the next jobs with a newer generation of the modules
+	The worker clones them before its next job, and keeps its current instances
+	if one of the new modules fails to initialize. Call it on the worker's thread.
+	@modules: module set of the scanner
+	@return: S_OK on success, S_FALSE if the worker already has this generation
+	or a newer one.
+	*/
+	HRESULT Update(__in CScanModuleSet * modules);
+
+	// Scan a file and the files found inside it
+	HRESULT Scan(__in const SCAN_JOB & job);
+
+	// Cut the current job short, and the next one if it has not started yet
+	void Cancel(void);
+
+	// Forget a Cancel() that came after the last job
+	void Reset(void);
+
+	/* Fill a job with a file and the scan settings of a context
+	@lpPath: full path of the file
+	@context: enumeration context of the scan
+	@job: a pointer to a variable storing result
+	@return: HRESULT on success, or other value on failure.
+	*/
+	static HRESULT MakeJob(__in LPCWSTR lpPath, __in IFsEnumContext * context, __out SCAN_JOB * job);
+
+	// IFsEnumObserver interface implementation
+	virtual HRESULT WINAPI OnFileFound(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int currentDepth) override;
+	virtual void WINAPI OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR lpMessage = NULL) override;
+
+private:
+	void OnTimeout(void);
+	HRESULT LoadModules(void);
+	static HRESULT CloneModule(__in IScanModule * scanModule, __out CScanModuleEntry ** clone);
+	static HRESULT CloneModules(__in const std::vector<IScanModule *> & modules, __out std::vector<CScanModuleEntry *> & clones);
+	static void ReleaseModules(__inout std::vector<CScanModuleEntry *> & clones);
+};
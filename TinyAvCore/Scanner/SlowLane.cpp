@@ -0,0 +1,188 @@
+#include "SlowLane.h"
+
+CSlowLane::CSlowLane(__in IScanObserver * observer)
+{
+	m_observer = observer;
+	m_worker = NULL;
+	m_modules = NULL;
+	m_thread = NULL;
+	m_current = NULL;
+	InitializeCriticalSection(&m_lock);
+	InitializeConditionVariable(&m_jobDone);
+	m_hWork = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_hStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+CSlowLane::~CSlowLane()
+{
+	Stop();
+	if (m_thread)
+	{
+		WaitForSingleObject(m_thread, INFINITE);
+		CloseHandle(m_thread);
+		m_thread = NULL;
+	}
+	if (m_worker) m_worker->Release();
+	if (m_modules) m_modules->Release();
+
+	if (m_hWork) CloseHandle(m_hWork);
+	if (m_hStop) CloseHandle(m_hStop);
+	DeleteCriticalSection(&m_lock);
+}
+
+HRESULT WINAPI CSlowLane::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown))
+	{
+		*ppvObject = static_cast<IUnknown*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+HRESULT CSlowLane::Initialize(__in CScanModuleSet * modules, __in ULONG budgetMs)
+{
+	if (modules == NULL) return E_INVALIDARG;
+	if (m_thread || m_worker) return E_NOT_VALID_STATE;
+	if (m_hWork == NULL || m_hStop == NULL) return E_OUTOFMEMORY;
+
+	m_worker = new CScanWorker(m_observer);
+	if (m_worker == NULL) return E_OUTOFMEMORY;
+
+	// files that overrun the slow lane too are reported as timed out
+	HRESULT hr = m_worker->Initialize(modules, budgetMs, NULL, NULL);
+	if (FAILED(hr)) return hr;
+	SetModules(modules);
+
+	m_thread = CreateThread(NULL, 0, &CSlowLane::LaneThread, this, CREATE_SUSPENDED, NULL);
+	if (m_thread == NULL) return HRESULT_FROM_WIN32(GetLastError());
+	SetThreadPriority(m_thread, THREAD_PRIORITY_BELOW_NORMAL);
+	ResumeThread(m_thread);
+	return S_OK;
+}
+
+void CSlowLane::SetModules(__in CScanModuleSet * modules)
+{
+	if (modules == NULL) return;
+	EnterCriticalSection(&m_lock);
+	if (m_modules == NULL || modules->GetGeneration() > m_modules->GetGeneration())
+	{
+		modules->AddRef();
+		if (m_modules) m_modules->Release();
+		m_modules = modules;
+	}
+	LeaveCriticalSection(&m_lock);
+}
+
+HRESULT CSlowLane::Enqueue(__in const SCAN_JOB & job)
+{
+	if (m_thread == NULL) return E_NOT_VALID_STATE;
+	if (WaitForSingleObject(m_hStop, 0) == WAIT_OBJECT_0) return E_ABORT;
+
+	EnterCriticalSection(&m_lock);
+	m_queue.push_back(job);
+	// a slow file is not measured against the census of its scan
+	m_queue.back().progress = NULL;
+	m_pending[job.owner]++;
+	LeaveCriticalSection(&m_lock);
+	SetEvent(m_hWork);
+	return S_OK;
+}
+
+void CSlowLane::Drain(__in LPVOID owner)
+{
+	EnterCriticalSection(&m_lock);
+	while (m_pending.find(owner) != m_pending.end() && WaitForSingleObject(m_hStop, 0) != WAIT_OBJECT_0)
+		SleepConditionVariableCS(&m_jobDone, &m_lock, INFINITE);
+	LeaveCriticalSection(&m_lock);
+}
+
+// Call with m_lock held. A NULL owner drops every file.
+void CSlowLane::DropJobs(__in_opt LPVOID owner)
+{
+	std::deque<SCAN_JOB>::iterator it = m_queue.begin();
+	while (it != m_queue.end())
+	{
+		if (owner && it->owner != owner)
+		{
+			++it;
+			continue;
+		}
+		if (--m_pending[it->owner] == 0)
+			m_pending.erase(it->owner);
+		it = m_queue.erase(it);
+	}
+
+	// the worker is reset before each file, see OnLaneThread()
+	if (m_worker && m_current && (owner == NULL || m_current == owner))
+		m_worker->Cancel();
+}
+
+void CSlowLane::Cancel(__in LPVOID owner)
+{
+	if (owner == NULL) return;
+	EnterCriticalSection(&m_lock);
+	DropJobs(owner);
+	LeaveCriticalSection(&m_lock);
+	WakeAllConditionVariable(&m_jobDone);
+}
+
+void CSlowLane::Stop(void)
+{
+	if (m_hStop) SetEvent(m_hStop);
+
+	EnterCriticalSection(&m_lock);
+	DropJobs(NULL);
+	LeaveCriticalSection(&m_lock);
+	WakeAllConditionVariable(&m_jobDone);
+}
+
+DWORD WINAPI CSlowLane::LaneThread(__in LPVOID lpParam)
+{
+	if (lpParam == NULL) return 0;
+	((CSlowLane*)lpParam)->OnLaneThread();
+	return 0;
+}
+
+void CSlowLane::OnLaneThread(void)
+{
+	HANDLE waitTable[2] = { m_hStop, m_hWork };
+	while (WaitForMultipleObjects(2, waitTable, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+	{
+		for (;;)
+		{
+			EnterCriticalSection(&m_lock);
+			if (m_queue.empty() || WaitForSingleObject(m_hStop, 0) == WAIT_OBJECT_0)
+			{
+				LeaveCriticalSection(&m_lock);
+				break;
+			}
+			SCAN_JOB job = m_queue.front();
+			m_queue.pop_front();
+			// a Cancel() of the previous file's scan does not cut this one short
+			m_current = job.owner;
+			m_worker->Reset();
+			CScanModuleSet * modules = m_modules;
+			if (modules) modules->AddRef();
+			LeaveCriticalSection(&m_lock);
+
+			if (modules)
+			{
+				m_worker->Update(modules);
+				modules->Release();
+			}
+			m_worker->Scan(job);
+
+			EnterCriticalSection(&m_lock);
+			m_current = NULL;
+			if (--m_pending[job.owner] == 0)
+				m_pending.erase(job.owner);
+			LeaveCriticalSection(&m_lock);
+			WakeAllConditionVariable(&m_jobDone);
+		}
+	}
+}
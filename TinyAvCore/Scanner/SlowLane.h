@@ -0,0 +1,64 @@
+#pragma once
+#include <TinyAvCore.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include "ScanWorker.h"
+
+// Rescans files that overran their time budget on a low-priority thread with
+// a larger budget, so that one pathological file does not hold up the scan
+// threads.
+class CSlowLane :
+	public CRefCount,
+	public IUnknown
+{
+protected:
+	virtual ~CSlowLane();
+
+	IScanObserver *				m_observer;		// not referenced: it owns the lane
+	CScanWorker *				m_worker;
+	CScanModuleSet *			m_modules;		// newest generation of the scan modules
+	std::deque<SCAN_JOB>		m_queue;
+	std::map<LPVOID, ULONG>		m_pending;		// queued and running files of each scan
+	LPVOID						m_current;		// scan of the file being rescanned, NULL if none
+	CRITICAL_SECTION			m_lock;
+	CONDITION_VARIABLE			m_jobDone;		// a file is rescanned or dropped
+	HANDLE						m_thread;
+	HANDLE						m_hWork;		// auto-reset, set when items are queued
+	HANDLE						m_hStop;
+
+public:
+	CSlowLane(__in IScanObserver * observer);
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	// Create the lane's module instances and start its thread
+	// @modules: module set of the scanner
+	// @budgetMs: time budget of each rescanned file, 0 for no limit
+	HRESULT Initialize(__in CScanModuleSet * modules, __in ULONG budgetMs);
+
+	// Rescan the next files with a newer generation of the scan modules
+	void SetModules(__in CScanModuleSet * modules);
+
+	// Queue a file
+	HRESULT Enqueue(__in const SCAN_JOB & job);
+
+	// Wait until the files of a scan are rescanned or the lane is stopped
+	// @owner: the scan, see SCAN_JOB::owner
+	void Drain(__in LPVOID owner);
+
+	// Drop the queued files of a scan and cut its current one short
+	// @owner: the scan, see SCAN_JOB::owner
+	void Cancel(__in LPVOID owner);
+
+	// Drop the queued files of every scan and cut the current one short
+	void Stop(void);
+
+private:
+	// Call with m_lock held. A NULL owner drops every file.
+	void DropJobs(__in_opt LPVOID owner);
+	static DWORD WINAPI LaneThread(__in LPVOID lpParam);
+	void OnLaneThread(void);
+};
@@ -0,0 +1,131 @@
+#include "StageCounters.h"
+#include "../Utils.h"
+
+#define STAGE_COUNTERS_ENV		L"TINYAV_STAGE_COUNTERS"
+#define STAGE_MAPPING_FORMAT	L"Local\\TinyAvStageCounters.%lu"
+
+CStageCounters::CStageCounters()
+{
+	m_table = NULL;
+	m_mapping = NULL;
+	m_slot = TLS_OUT_OF_INDEXES;
+	QueryPerformanceFrequency(&m_frequency);
+
+	WCHAR szValue[16];
+	DWORD length = GetEnvironmentVariableW(STAGE_COUNTERS_ENV, szValue, _countof(szValue));
+	if (length == 0 || length >= _countof(szValue) || _wtoi(szValue) == 0)
+		return;
+
+	// without the slot, the stages of a thread cannot be shared
+	STAGE_TABLE * table = (STAGE_TABLE*)MapProcessTable(STAGE_MAPPING_FORMAT, sizeof(STAGE_TABLE), &m_mapping);
+	if (table == NULL) return;
+	m_slot = PublishTlsSlot(&table->slot);
+	if (m_slot == TLS_OUT_OF_INDEXES)
+	{
+		UnmapProcessTable(table, m_mapping);
+		m_mapping = NULL;
+		return;
+	}
+	m_table = table;
+}
+
+CStageCounters::~CStageCounters()
+{
+	UnmapProcessTable(m_table, m_mapping);
+	m_table = NULL;
+	m_mapping = NULL;
+}
+
+CStageCounters * CStageCounters::GetInstance(void)
+{
+	static CStageCounters s_counters;
+	return &s_counters;
+}
+
+void CStageCounters::Sample(__out LONG64 * ticks, __out LONG64 * cycles)
+{
+	LARGE_INTEGER now;
+	ULONG64 threadCycles = 0;
+	QueryPerformanceCounter(&now);
+	*ticks = now.QuadPart;
+	// cycles are left out when the thread cycle time cannot be read,
+	// for instance under some hypervisors
+	if (!QueryThreadCycleTime(GetCurrentThread(), &threadCycles))
+		m_table->cyclesUnavailable = TRUE;
+	*cycles = (LONG64)threadCycles;
+}
+
+void CStageCounters::Charge(__in const STAGE_THREAD_STATE * thread, __in ScanStage stage, __in LONG64 ticks, __in LONG64 cycles)
+{
+	InterlockedExchangeAdd64(&m_table->ticks[stage], ticks - thread->lastTicks);
+	InterlockedExchangeAdd64(&m_table->cycles[stage], cycles - thread->lastCycles);
+}
+
+void CStageCounters::Enter(__in ScanStage stage)
+{
+	if (m_table == NULL || stage < 0 || stage >= StageCount) return;
+
+	// The state of the thread lives while it is in a stage. It comes from
+	// the process heap: the copy that frees it may not be the one that
+	// allocated it.
+	STAGE_THREAD_STATE * thread = (STAGE_THREAD_STATE *)TlsGetValue(m_slot);
+	if (thread == NULL)
+	{
+		thread = (STAGE_THREAD_STATE *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(STAGE_THREAD_STATE));
+		if (thread == NULL) return;
+		if (!TlsSetValue(m_slot, thread))
+		{
+			HeapFree(GetProcessHeap(), 0, thread);
+			return;
+		}
+	}
+
+	LONG64 ticks, cycles;
+	Sample(&ticks, &cycles);
+	// stages too deep to track are charged to the deepest one tracked
+	if (thread->depth > 0)
+		Charge(thread, thread->stages[min(thread->depth, STAGE_MAX_DEPTH) - 1], ticks, cycles);
+	if (thread->depth < STAGE_MAX_DEPTH)
+		thread->stages[thread->depth] = stage;
+	thread->depth++;
+	thread->lastTicks = ticks;
+	thread->lastCycles = cycles;
+	InterlockedIncrement64(&m_table->calls[stage]);
+}
+
+void CStageCounters::Leave(void)
+{
+	if (m_table == NULL) return;
+	STAGE_THREAD_STATE * thread = (STAGE_THREAD_STATE *)TlsGetValue(m_slot);
+	if (thread == NULL || thread->depth == 0) return;
+
+	LONG64 ticks, cycles;
+	Sample(&ticks, &cycles);
+	Charge(thread, thread->stages[min(thread->depth, STAGE_MAX_DEPTH) - 1], ticks, cycles);
+	thread->depth--;
+	thread->lastTicks = ticks;
+	thread->lastCycles = cycles;
+
+	// out of the outermost stage: nothing is left to free when the thread ends
+	if (thread->depth == 0)
+	{
+		TlsSetValue(m_slot, NULL);
+		HeapFree(GetProcessHeap(), 0, thread);
+	}
+}
+
+HRESULT CStageCounters::Read(__out SCAN_STAGE_REPORT * report)
+{
+	if (report == NULL) return E_INVALIDARG;
+	ZeroMemory(report, sizeof(SCAN_STAGE_REPORT));
+	if (m_table == NULL) return E_NOT_SET;
+
+	report->cyclesAvailable = !m_table->cyclesUnavailable;
+	for (int i = 0; i < StageCount; i++)
+	{
+		report->stages[i].calls = (ULONGLONG)m_table->calls[i];
+		report->stages[i].wallUs = (ULONGLONG)(m_table->ticks[i] * 1000000 / m_frequency.QuadPart);
+		report->stages[i].cycles = report->cyclesAvailable ? (ULONGLONG)m_table->cycles[i] : 0;
+	}
+	return S_OK;
+}
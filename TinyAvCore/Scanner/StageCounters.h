@@ -0,0 +1,79 @@
+#pragma once
+#include <TinyAvCore.h>
+
+#define STAGE_MAX_DEPTH	(16)	// nesting of stages on one thread
+
+// Counters of all threads, shared by every copy of TinyAvCore in the
+// process through a named mapping: the plug-ins parse and emulate with
+// their own copy, while the scanner walks and opens files with another.
+// The stages each thread is in are shared the same way, through a TLS slot:
+// a parse in a plug-in pauses the module scan of the scanner around it.
+typedef struct STAGE_TABLE
+{
+	volatile LONG64	calls[StageCount];
+	volatile LONG64	ticks[StageCount];		// performance counter ticks
+	volatile LONG64	cycles[StageCount];
+	volatile LONG	cyclesUnavailable;
+	volatile LONG	slot;					// TLS index + 1, 0 until the first copy allocates it
+}STAGE_TABLE;
+
+// Stages entered by a thread, innermost last
+typedef struct STAGE_THREAD_STATE
+{
+	ULONG		depth;
+	ScanStage	stages[STAGE_MAX_DEPTH];
+	LONG64		lastTicks;		// when the innermost stage was last resumed
+	LONG64		lastCycles;
+}STAGE_THREAD_STATE;
+
+// Opt-in counters of the time and CPU cycles spent in each stage of a scan.
+// Set TINYAV_STAGE_COUNTERS=1 before the plug-ins are loaded to enable them.
+// Stages nest: time spent in an inner stage is not charged to the outer one,
+// so a module scan only counts what is left after parsing and emulation.
+class CStageCounters
+{
+protected:
+	STAGE_TABLE *	m_table;	// NULL when the counters are disabled
+	HANDLE			m_mapping;
+	DWORD			m_slot;		// holds the STAGE_THREAD_STATE of each thread
+	LARGE_INTEGER	m_frequency;
+
+	CStageCounters();
+	virtual ~CStageCounters();
+
+	void Sample(__out LONG64 * ticks, __out LONG64 * cycles);
+	void Charge(__in const STAGE_THREAD_STATE * thread, __in ScanStage stage, __in LONG64 ticks, __in LONG64 cycles);
+
+public:
+	static CStageCounters * GetInstance(void);
+
+	BOOL IsEnabled(void) { return m_table != NULL; }
+
+	// Enter a stage on the current thread, pausing the stage it is in
+	void Enter(__in ScanStage stage);
+
+	// Leave the stage entered last on the current thread
+	void Leave(void);
+
+	// Totals of all threads of the process since the counters were enabled
+	HRESULT Read(__out SCAN_STAGE_REPORT * report);
+};
+
+// Charges the time of a scope to a stage
+class CStageScope
+{
+protected:
+	BOOL m_active;
+
+public:
+	CStageScope(__in ScanStage stage)
+	{
+		m_active = CStageCounters::GetInstance()->IsEnabled();
+		if (m_active) CStageCounters::GetInstance()->Enter(stage);
+	}
+
+	~CStageScope()
+	{
+		if (m_active) CStageCounters::GetInstance()->Leave();
+	}
+};
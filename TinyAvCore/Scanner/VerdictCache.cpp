@@ -0,0 +1,263 @@
+#include "VerdictCache.h"
+#include "VerdictStamps.h"
+#include <algorithm>
+
+CVerdictCache::CVerdictCache()
+{
+	InitializeSRWLock(&m_lock);
+}
+
+HRESULT WINAPI CVerdictCache::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown))
+	{
+		*ppvObject = static_cast<IUnknown*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+int CVerdictCache::Compare(__in const VERDICT_CACHE_ENTRY & left, __in const VERDICT_CACHE_ENTRY & right)
+{
+	int order = memcmp(left.digest, right.digest, SHA256_DIGEST_SIZE);
+	if (order != 0) return order;
+	if (left.signature != right.signature) return (left.signature < right.signature) ? -1 : 1;
+	return 0;
+}
+
+BOOL CVerdictCache::Covers(__in const VERDICT_CACHE_ENTRY & entry, __in ULONGLONG fileSize, __in DWORD signature, __in LONG archiveDepth)
+{
+	// an entry covers the scans that go no deeper into archives than it did
+	return entry.fileSize == fileSize && entry.signature == signature &&
+		(entry.archiveDepth == -1 || (archiveDepth != -1 && entry.archiveDepth >= archiveDepth));
+}
+
+HRESULT CVerdictCache::Add(__in const VERDICT_CACHE_ENTRY & entry)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	m_pending.push_back(entry);
+	if (m_pending.size() >= VERDICT_CACHE_PENDING)
+		FlushPending();
+	ReleaseSRWLockExclusive(&m_lock);
+	return S_OK;
+}
+
+BOOL CVerdictCache::Find(__in_bcount(SHA256_DIGEST_SIZE) const BYTE * digest, __in ULONGLONG fileSize, __in DWORD signature, __in LONG archiveDepth)
+{
+	if (digest == NULL || signature == 0) return FALSE;
+	VERDICT_CACHE_ENTRY key;
+	ZeroMemory(&key, sizeof(key));
+	memcpy(key.digest, digest, SHA256_DIGEST_SIZE);
+	key.signature = signature;
+
+	AcquireSRWLockShared(&m_lock);
+	BOOL found = FALSE;
+	std::vector<VERDICT_CACHE_ENTRY>::const_iterator it = std::lower_bound(m_entries.begin(), m_entries.end(), key,
+		[](const VERDICT_CACHE_ENTRY & a, const VERDICT_CACHE_ENTRY & b) { return Compare(a, b) < 0; });
+	if (it != m_entries.end() && Compare(*it, key) == 0)
+		found = Covers(*it, fileSize, signature, archiveDepth);
+
+	// few entries wait for the next merge
+	for (size_t i = 0; i < m_pending.size() && !found; i++)
+	{
+		if (Compare(m_pending[i], key) == 0)
+			found = Covers(m_pending[i], fileSize, signature, archiveDepth);
+	}
+	ReleaseSRWLockShared(&m_lock);
+	return found;
+}
+
+void CVerdictCache::FlushPending(void)
+{
+	if (m_pending.empty()) return;
+
+	// make the pending entries a sorted run of their own
+	std::sort(m_pending.begin(), m_pending.end(),
+		[](const VERDICT_CACHE_ENTRY & a, const VERDICT_CACHE_ENTRY & b) { return Compare(a, b) < 0; });
+	size_t i, kept = 0;
+	for (i = 0; i < m_pending.size(); i++)
+	{
+		if (kept && Compare(m_pending[kept - 1], m_pending[i]) == 0)
+		{
+			if (Covers(m_pending[i], m_pending[i].fileSize, m_pending[i].signature, m_pending[kept - 1].archiveDepth))
+				m_pending[kept - 1] = m_pending[i];
+			continue;
+		}
+		m_pending[kept++] = m_pending[i];
+	}
+	m_pending.resize(kept);
+
+	MergeRun(&m_pending[0], m_pending.size());
+	m_pending.clear();
+}
+
+HRESULT CVerdictCache::Merge(__in_ecount(count) const VERDICT_CACHE_ENTRY * entries, __in size_t count)
+{
+	if (count == 0) return S_OK;
+	if (entries == NULL) return E_INVALIDARG;
+	for (size_t i = 1; i < count; i++)
+	{
+		if (Compare(entries[i - 1], entries[i]) >= 0)
+			return E_INVALIDARG;
+	}
+
+	AcquireSRWLockExclusive(&m_lock);
+	MergeRun(entries, count);
+	ReleaseSRWLockExclusive(&m_lock);
+	return S_OK;
+}
+
+void CVerdictCache::MergeRun(__in_ecount(count) const VERDICT_CACHE_ENTRY * entries, __in size_t count)
+{
+	std::vector<VERDICT_CACHE_ENTRY> merged;
+	merged.reserve(m_entries.size() + count);
+
+	// both runs are sorted: one pass over each
+	size_t i = 0, j = 0;
+	while (i < m_entries.size() || j < count)
+	{
+		int order;
+		if (i == m_entries.size()) order = 1;
+		else if (j == count) order = -1;
+		else order = Compare(m_entries[i], entries[j]);
+
+		if (order < 0)
+			merged.push_back(m_entries[i++]);
+		else if (order > 0)
+			merged.push_back(entries[j++]);
+		else
+		{
+			// the same content for the same modules: keep the deeper scan
+			const VERDICT_CACHE_ENTRY & mine = m_entries[i++];
+			const VERDICT_CACHE_ENTRY & theirs = entries[j++];
+			merged.push_back(Covers(theirs, theirs.fileSize, theirs.signature, mine.archiveDepth) ? theirs : mine);
+		}
+	}
+	m_entries.swap(merged);
+}
+
+HRESULT CVerdictCache::Import(__in LPCWSTR lpPath)
+{
+	if (lpPath == NULL) return E_INVALIDARG;
+	HANDLE hFile = CreateFileW(lpPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) return HRESULT_FROM_WIN32(GetLastError());
+
+	HRESULT hr = S_OK;
+	VERDICT_CACHE_HEADER header;
+	LARGE_INTEGER fileSize = {};
+	ULONGLONG body = 0;
+	DWORD readSize = 0;
+	std::vector<VERDICT_CACHE_ENTRY> entries;
+	if (!GetFileSizeEx(hFile, &fileSize) ||
+		!ReadFile(hFile, &header, sizeof(header), &readSize, NULL))
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	else if (readSize != sizeof(header) ||
+		header.magic != VERDICT_CACHE_MAGIC ||
+		header.version != VERDICT_CACHE_VERSION ||
+		header.entrySize != sizeof(VERDICT_CACHE_ENTRY) ||
+		(body = (ULONGLONG)fileSize.QuadPart - sizeof(header)) % sizeof(VERDICT_CACHE_ENTRY) != 0 ||
+		header.count != body / sizeof(VERDICT_CACHE_ENTRY))
+		hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+	// what an older engine found clean, this one may not
+	else if (header.engine != VERDICT_ENGINE_GENERATION)
+		hr = HRESULT_FROM_WIN32(ERROR_REVISION_MISMATCH);
+	else if (header.count)
+	{
+		entries.resize((size_t)header.count);
+		BYTE * data = (BYTE *)&entries[0];
+		ULONGLONG remaining = header.count * sizeof(VERDICT_CACHE_ENTRY);
+		while (remaining && SUCCEEDED(hr))
+		{
+			DWORD chunk = (DWORD)min(remaining, (ULONGLONG)0x1000000);
+			if (!ReadFile(hFile, data, chunk, &readSize, NULL))
+				hr = HRESULT_FROM_WIN32(GetLastError());
+			else if (readSize != chunk)
+				hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+			data += chunk;
+			remaining -= chunk;
+		}
+	}
+	CloseHandle(hFile);
+	if (FAILED(hr)) return hr;
+
+	BYTE checksum[SHA256_DIGEST_SIZE];
+	Checksum(&header, entries.empty() ? NULL : &entries[0], entries.size(), checksum);
+	if (memcmp(checksum, header.checksum, SHA256_DIGEST_SIZE) != 0)
+		return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+	hr = Merge(entries.empty() ? NULL : &entries[0], entries.size());
+	return (hr == E_INVALIDARG) ? HRESULT_FROM_WIN32(ERROR_INVALID_DATA) : hr;
+}
+
+HRESULT CVerdictCache::Export(__in LPCWSTR lpPath)
+{
+	if (lpPath == NULL) return E_INVALIDARG;
+
+	// a copy, so the scans go on while the file is written
+	std::vector<VERDICT_CACHE_ENTRY> entries;
+	AcquireSRWLockExclusive(&m_lock);
+	FlushPending();
+	entries = m_entries;
+	ReleaseSRWLockExclusive(&m_lock);
+
+	VERDICT_CACHE_HEADER header;
+	ZeroMemory(&header, sizeof(header));
+	header.magic = VERDICT_CACHE_MAGIC;
+	header.version = VERDICT_CACHE_VERSION;
+	header.entrySize = sizeof(VERDICT_CACHE_ENTRY);
+	header.engine = VERDICT_ENGINE_GENERATION;
+	header.count = entries.size();
+	Checksum(&header, entries.empty() ? NULL : &entries[0], entries.size(), header.checksum);
+
+	StringW tempPath = StringW(lpPath) + L".tmp";
+	HANDLE hFile = CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) return HRESULT_FROM_WIN32(GetLastError());
+
+	HRESULT hr = S_OK;
+	DWORD written = 0;
+	if (!WriteFile(hFile, &header, sizeof(header), &written, NULL))
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	const BYTE * data = entries.empty() ? NULL : (const BYTE *)&entries[0];
+	ULONGLONG remaining = entries.size() * sizeof(VERDICT_CACHE_ENTRY);
+	while (remaining && SUCCEEDED(hr))
+	{
+		DWORD chunk = (DWORD)min(remaining, (ULONGLONG)0x1000000);
+		if (!WriteFile(hFile, data, chunk, &written, NULL))
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		data += chunk;
+		remaining -= chunk;
+	}
+	CloseHandle(hFile);
+
+	if (SUCCEEDED(hr) && !MoveFileExW(tempPath.c_str(), lpPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	if (FAILED(hr))
+		DeleteFileW(tempPath.c_str());
+	return hr;
+}
+
+size_t CVerdictCache::GetCount(void)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	FlushPending();
+	size_t count = m_entries.size();
+	ReleaseSRWLockExclusive(&m_lock);
+	return count;
+}
+
+void CVerdictCache::Checksum(__in const VERDICT_CACHE_HEADER * header, __in_ecount(count) const VERDICT_CACHE_ENTRY * entries,
+	__in size_t count, __out_bcount(SHA256_DIGEST_SIZE) BYTE * checksum)
+{
+	VERDICT_CACHE_HEADER copy = *header;
+	ZeroMemory(copy.checksum, sizeof(copy.checksum));
+	CSha256 sha;
+	sha.Init();
+	sha.Update(&copy, sizeof(copy));
+	if (count)
+		sha.Update(entries, count * sizeof(VERDICT_CACHE_ENTRY));
+	sha.Final(checksum);
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <TinyAvCore.h>
+#include <vector>
+#include "../Hash/Sha256.h"
+
+#define VERDICT_CACHE_MAGIC		(0x43564154)	// "TAVC"
+#define VERDICT_CACHE_VERSION	(1)
+#define VERDICT_CACHE_PENDING	(1024)			// entries added before they are merged into the sorted run
+
+// Content the scan found clean. Entries are sorted by digest, then signature.
+typedef struct VERDICT_CACHE_ENTRY
+{
+	BYTE		digest[SHA256_DIGEST_SIZE];	// SHA-256 of the content
+	ULONGLONG	fileSize;
+	DWORD		signature;		// of the scan modules, see CScanModuleSet::GetSignature()
+	LONG		archiveDepth;	// depth scanned into archives, -1 for any
+}VERDICT_CACHE_ENTRY;
+
+// Header of an exported cache, followed by its entries in sorted order
+typedef struct VERDICT_CACHE_HEADER
+{
+	DWORD		magic;
+	WORD		version;
+	WORD		entrySize;		// sizeof(VERDICT_CACHE_ENTRY)
+	DWORD		engine;			// VERDICT_ENGINE_GENERATION of the scanner that wrote it
+	DWORD		reserved;
+	ULONGLONG	count;
+	BYTE		checksum[SHA256_DIGEST_SIZE];	// SHA-256 of the header, with this field zeroed, and the entries
+}VERDICT_CACHE_HEADER;
+
+// Verdicts of a scanner by content. Hosts built from the same images have
+// the same files: a cache exported by one of them lets the others skip the
+// content it found clean, wherever it lies.
+class CVerdictCache :
+	public CRefCount,
+	public IUnknown
+{
+protected:
+	SRWLOCK								m_lock;
+	std::vector<VERDICT_CACHE_ENTRY>	m_entries;	// sorted, one per digest and signature
+	std::vector<VERDICT_CACHE_ENTRY>	m_pending;	// added since the last merge, in any order
+
+	virtual ~CVerdictCache() {}
+
+	// Merge m_pending into m_entries, with the lock held exclusively
+	void FlushPending(void);
+
+	// Merge a sorted run into m_entries, with the lock held exclusively
+	void MergeRun(__in_ecount(count) const VERDICT_CACHE_ENTRY * entries, __in size_t count);
+
+	static BOOL Covers(__in const VERDICT_CACHE_ENTRY & entry, __in ULONGLONG fileSize, __in DWORD signature, __in LONG archiveDepth);
+
+public:
+	CVerdictCache();
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	// Record content the scan found clean
+	HRESULT Add(__in const VERDICT_CACHE_ENTRY & entry);
+
+	/* Look up content
+	@digest: SHA-256 of the content
+	@fileSize: size of the content
+	@signature: of the modules the content would be scanned with
+	@archiveDepth: depth the scan goes into archives, -1 for any
+	@return: TRUE if the modules found the content clean, as deep into archives.
+	*/
+	BOOL Find(__in_bcount(SHA256_DIGEST_SIZE) const BYTE * digest, __in ULONGLONG fileSize, __in DWORD signature, __in LONG archiveDepth);
+
+	/* Merge a sorted run of entries into the cache
+	For the same digest and signature, the entry that went deeper into archives is kept.
+	@entries: entries in the order of Compare(), without duplicates
+	@count: number of entries
+	@return: HRESULT on success, E_INVALIDARG if the entries are not sorted.
+	*/
+	HRESULT Merge(__in_ecount(count) const VERDICT_CACHE_ENTRY * entries, __in size_t count);
+
+	/* Merge a cache written by Export()
+	@lpPath: path of the file
+	@return: S_OK, HRESULT_FROM_WIN32(ERROR_REVISION_MISMATCH) if another engine
+	generation wrote it, HRESULT_FROM_WIN32(ERROR_INVALID_DATA) if it is damaged,
+	or other value on failure. The cache is left as it was on failure.
+	*/
+	HRESULT Import(__in LPCWSTR lpPath);
+
+	/* Write the cache to a file
+	The file is replaced only once the new one is complete.
+	@lpPath: path of the file
+	@return: HRESULT on success, or other value on failure.
+	*/
+	HRESULT Export(__in LPCWSTR lpPath);
+
+	size_t GetCount(void);
+
+	// Order of the entries: digest, then signature
+	static int Compare(__in const VERDICT_CACHE_ENTRY & left, __in const VERDICT_CACHE_ENTRY & right);
+
+	static void Checksum(__in const VERDICT_CACHE_HEADER * header, __in_ecount(count) const VERDICT_CACHE_ENTRY * entries,
+		__in size_t count, __out_bcount(SHA256_DIGEST_SIZE) BYTE * checksum);
+};
@@ -0,0 +1,521 @@
+#include "VerdictStamps.h"
+#include <shlobj.h>
+#include <sddl.h>
+#include <aclapi.h>
+#include <bcrypt.h>
+#pragma comment(lib, "bcrypt.lib")
+
+// What happened to the top-level file being scanned by the calling thread
+typedef struct VERDICT_FILE_STATE
+{
+	BOOL	scanned;	// every module scanned the file to its end
+	BOOL	detected;	// a module found something in the file or in a file inside it
+	DWORD	signature;	// of the modules that scanned it
+	BYTE	digest[SHA256_DIGEST_SIZE];
+	BOOL	cached;		// the cache covers every module
+	BOOL	verified;	// the content matches the digest of the stamp
+	BYTE	stampDigest[SHA256_DIGEST_SIZE];
+	DWORD	coveredCount;	// modules the stamp of the file lists
+	VERDICT_MODULE	covered[VERDICT_STAMP_MODULES];
+}VERDICT_FILE_STATE;
+
+static __declspec(thread) VERDICT_FILE_STATE t_file;
+
+CVerdictHasher::CVerdictHasher()
+{
+	m_size = 0;
+	m_received = 0;
+	m_done = FALSE;
+	ZeroMemory(m_digest, sizeof(m_digest));
+}
+
+HRESULT WINAPI CVerdictHasher::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown) ||
+		IsEqualIID(riid, __uuidof(IFsStreamConsumer)))
+	{
+		*ppvObject = static_cast<IFsStreamConsumer*>(this);
+		AddRef();
+		return S_OK;
+	}
+	else if (IsEqualIID(riid, __uuidof(IFsSparseConsumer)))
+	{
+		*ppvObject = static_cast<IFsSparseConsumer*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+HRESULT CVerdictHasher::GetDigest(__out_bcount(SHA256_DIGEST_SIZE) BYTE * digest)
+{
+	if (digest == NULL) return E_INVALIDARG;
+	if (!m_done) return E_NOT_SET;
+	memcpy(digest, m_digest, SHA256_DIGEST_SIZE);
+	return S_OK;
+}
+
+HRESULT WINAPI CVerdictHasher::OnStreamBegin(__in IVirtualFs * file, __in ULONGLONG size)
+{
+	UNREFERENCED_PARAMETER(file);
+	// a disinfected file is read again from its start
+	m_sha.Init();
+	m_size = size;
+	m_received = 0;
+	m_done = FALSE;
+	return S_OK;
+}
+
+HRESULT WINAPI CVerdictHasher::OnStreamBlock(__in ULONGLONG offset, __in_bcount(size) const BYTE * data, __in ULONG size)
+{
+	if (offset != m_received) return E_UNEXPECTED;
+	m_sha.Update(data, size);
+	m_received += size;
+	return S_OK;
+}
+
+HRESULT WINAPI CVerdictHasher::OnStreamHole(__in ULONGLONG offset, __in ULONGLONG size)
+{
+	if (offset != m_received) return E_UNEXPECTED;
+	m_sha.UpdateZeros(size);
+	m_received += size;
+	return S_OK;
+}
+
+HRESULT WINAPI CVerdictHasher::OnStreamEnd(__in HRESULT status)
+{
+	// a file read in part has no digest
+	if (SUCCEEDED(status) && m_received == m_size)
+	{
+		m_sha.Final(m_digest);
+		m_done = TRUE;
+	}
+	return S_OK;
+}
+
+CVerdictStamps::CVerdictStamps()
+{
+	InitializeSRWLock(&m_lock);
+	m_signature = 0;
+	m_moduleCount = 0;
+	ZeroMemory(m_modules, sizeof(m_modules));
+	m_cache = new CVerdictCache();
+	m_keyLoaded = FALSE;
+	m_keyed = FALSE;
+	ZeroMemory(m_key, sizeof(m_key));
+}
+
+CVerdictStamps::~CVerdictStamps()
+{
+	SecureZeroMemory(m_key, sizeof(m_key));
+	if (m_cache)
+	{
+		m_cache->Release();
+		m_cache = NULL;
+	}
+}
+
+HRESULT WINAPI CVerdictStamps::QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+{
+	if (ppvObject == NULL) return E_INVALIDARG;
+	if (IsEqualIID(riid, IID_IUnknown))
+	{
+		*ppvObject = static_cast<IUnknown*>(this);
+		AddRef();
+		return S_OK;
+	}
+
+	*ppvObject = NULL;
+	return E_NOINTERFACE;
+}
+
+void CVerdictStamps::SetModules(__in DWORD signature, __in_ecount_opt(count) const VERDICT_MODULE * modules, __in ULONG count)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	m_signature = signature;
+	// too many to list: a stamp is current only for the same modules
+	m_moduleCount = (modules && count <= VERDICT_STAMP_MODULES) ? count : 0;
+	ZeroMemory(m_modules, sizeof(m_modules));
+	if (m_moduleCount)
+		memcpy(m_modules, modules, m_moduleCount * sizeof(VERDICT_MODULE));
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+HRESULT CVerdictStamps::SetKey(__in_bcount_opt(size) const BYTE * key, __in ULONG size)
+{
+	if (key && size != VERDICT_KEY_SIZE) return E_INVALIDARG;
+	AcquireSRWLockExclusive(&m_lock);
+	m_keyLoaded = TRUE;
+	m_keyed = (key != NULL);
+	if (key)
+		memcpy(m_key, key, VERDICT_KEY_SIZE);
+	else
+		SecureZeroMemory(m_key, sizeof(m_key));
+	ReleaseSRWLockExclusive(&m_lock);
+	return S_OK;
+}
+
+BOOL CVerdictStamps::HasKey(void)
+{
+	AcquireSRWLockShared(&m_lock);
+	BOOL loaded = m_keyLoaded;
+	BOOL keyed = m_keyed;
+	ReleaseSRWLockShared(&m_lock);
+	if (loaded) return keyed;
+
+	// the threads of the first files may all look for it; the first one sets it
+	BYTE key[VERDICT_KEY_SIZE];
+	HRESULT hr = LoadKey(key);
+	AcquireSRWLockExclusive(&m_lock);
+	if (!m_keyLoaded)
+	{
+		m_keyLoaded = TRUE;
+		m_keyed = SUCCEEDED(hr);
+		if (m_keyed) memcpy(m_key, key, sizeof(m_key));
+	}
+	keyed = m_keyed;
+	ReleaseSRWLockExclusive(&m_lock);
+	SecureZeroMemory(key, sizeof(key));
+	return keyed;
+}
+
+HRESULT CVerdictStamps::LoadKey(__out_bcount(VERDICT_KEY_SIZE) BYTE * key)
+{
+	WCHAR szPath[MAX_PATH];
+	HRESULT hr = SHGetFolderPathW(NULL, CSIDL_COMMON_APPDATA, NULL, SHGFP_TYPE_CURRENT, szPath);
+	if (FAILED(hr)) return hr;
+	StringW directory = StringW(szPath) + L"\\" VERDICT_KEY_DIRECTORY;
+	StringW keyPath = directory + L"\\" VERDICT_KEY_FILE;
+
+	hr = ReadKey(keyPath.c_str(), key);
+	if (hr != HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) && hr != HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND))
+		return hr;
+
+	// only an elevated scan can make it; another one may have made it meanwhile
+	hr = CreateKey(directory.c_str(), keyPath.c_str());
+	if (FAILED(hr) && hr != HRESULT_FROM_WIN32(ERROR_FILE_EXISTS)) return hr;
+	return ReadKey(keyPath.c_str(), key);
+}
+
+HRESULT CVerdictStamps::ReadKey(__in LPCWSTR lpPath, __out_bcount(VERDICT_KEY_SIZE) BYTE * key)
+{
+	HANDLE hFile = CreateFileW(lpPath, GENERIC_READ | READ_CONTROL, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) return HRESULT_FROM_WIN32(GetLastError());
+
+	// a key a user could have put there is no key
+	PSID owner = NULL;
+	PSECURITY_DESCRIPTOR sd = NULL;
+	HRESULT hr = HRESULT_FROM_WIN32(GetSecurityInfo(hFile, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION, &owner, NULL, NULL, NULL, &sd));
+	if (SUCCEEDED(hr) && !IsWellKnownSid(owner, WinBuiltinAdministratorsSid) && !IsWellKnownSid(owner, WinLocalSystemSid))
+		hr = E_ACCESSDENIED;
+	if (sd) LocalFree(sd);
+
+	LARGE_INTEGER fileSize;
+	DWORD readSize = 0;
+	if (SUCCEEDED(hr) &&
+		(!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart != VERDICT_KEY_SIZE ||
+		!ReadFile(hFile, key, VERDICT_KEY_SIZE, &readSize, NULL) || readSize != VERDICT_KEY_SIZE))
+		hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+	CloseHandle(hFile);
+	return hr;
+}
+
+HRESULT CVerdictStamps::CreateKey(__in LPCWSTR lpDirectory, __in LPCWSTR lpPath)
+{
+	PSECURITY_DESCRIPTOR sd = NULL;
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(VERDICT_KEY_SDDL, SDDL_REVISION_1, &sd, NULL))
+		return HRESULT_FROM_WIN32(GetLastError());
+	SECURITY_ATTRIBUTES sa = { sizeof(sa), sd, FALSE };
+
+	HRESULT hr = S_OK;
+	if (!CreateDirectoryW(lpDirectory, &sa))
+	{
+		DWORD error = GetLastError();
+		if (error != ERROR_ALREADY_EXISTS) hr = HRESULT_FROM_WIN32(error);
+	}
+
+	BYTE key[VERDICT_KEY_SIZE];
+	if (SUCCEEDED(hr) && !BCRYPT_SUCCESS(BCryptGenRandom(NULL, key, sizeof(key), BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+		hr = E_FAIL;
+	if (SUCCEEDED(hr))
+	{
+		HANDLE hFile = CreateFileW(lpPath, GENERIC_WRITE, 0, &sa, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		else
+		{
+			DWORD written = 0;
+			if (!WriteFile(hFile, key, sizeof(key), &written, NULL) || written != sizeof(key))
+				hr = HRESULT_FROM_WIN32(GetLastError());
+			CloseHandle(hFile);
+			if (FAILED(hr)) DeleteFileW(lpPath);
+		}
+	}
+	SecureZeroMemory(key, sizeof(key));
+	LocalFree(sd);
+	return hr;
+}
+
+DWORD CVerdictStamps::GetSignature(void)
+{
+	AcquireSRWLockShared(&m_lock);
+	DWORD signature = m_signature;
+	ReleaseSRWLockShared(&m_lock);
+	return signature;
+}
+
+BOOL CVerdictStamps::Covers(__in const VERDICT_STAMP * stamp)
+{
+	AcquireSRWLockShared(&m_lock);
+	BOOL covered = (m_signature != 0 && stamp->signature == m_signature);
+	if (!covered && m_signature != 0 && m_moduleCount && stamp->moduleCount)
+	{
+		covered = TRUE;
+		for (DWORD i = 0; i < m_moduleCount && covered; i++)
+		{
+			covered = FALSE;
+			for (DWORD j = 0; j < stamp->moduleCount && j < VERDICT_STAMP_MODULES; j++)
+			{
+				if (stamp->modules[j].id == m_modules[i].id &&
+					stamp->modules[j].version == m_modules[i].version)
+				{
+					covered = TRUE;
+					break;
+				}
+			}
+		}
+	}
+	ReleaseSRWLockShared(&m_lock);
+	return covered;
+}
+
+BOOL CVerdictStamps::IsCurrent(__in LPCWSTR lpPath, __in_opt const WIN32_FIND_DATAW * findData, __in IFsEnumContext * context,
+	__out_opt VERDICT_STAMP * stamp)
+{
+	if (stamp) ZeroMemory(stamp, sizeof(*stamp));
+	if (lpPath == NULL || context == NULL) return FALSE;
+	if (GetSignature() == 0 || !HasKey()) return FALSE;
+
+	WIN32_FIND_DATAW wfd;
+	if (findData == NULL)
+	{
+		HANDLE hFind = FindFirstFileW(lpPath, &wfd);
+		if (hFind == INVALID_HANDLE_VALUE) return FALSE;
+		FindClose(hFind);
+		findData = &wfd;
+	}
+
+	VERDICT_STAMP found;
+	if (FAILED(Read(lpPath, &found))) return FALSE;
+
+	ULARGE_INTEGER fileSize;
+	fileSize.HighPart = findData->nFileSizeHigh;
+	fileSize.LowPart = findData->nFileSizeLow;
+	if (found.engine != VERDICT_ENGINE_GENERATION ||
+		found.fileSize != fileSize.QuadPart ||
+		CompareFileTime(&found.lastWrite, &findData->ftLastWriteTime) != 0)
+		return FALSE;
+
+	// a stamp covers the scans that go no deeper into archives than it did
+	int archiveDepth = context->GetMaxDepthInArchive();
+	if (found.archiveDepth != -1 && (archiveDepth == -1 || found.archiveDepth < archiveDepth))
+		return FALSE;
+
+	if (stamp) *stamp = found;
+	if (!Covers(&found)) return FALSE;
+
+	// files stamped before the cache was kept still go into it
+	if (m_cache && found.signature == GetSignature() &&
+		!m_cache->Find(found.digest, found.fileSize, found.signature, found.archiveDepth))
+	{
+		VERDICT_CACHE_ENTRY entry;
+		ZeroMemory(&entry, sizeof(entry));
+		memcpy(entry.digest, found.digest, SHA256_DIGEST_SIZE);
+		entry.fileSize = found.fileSize;
+		entry.signature = found.signature;
+		entry.archiveDepth = found.archiveDepth;
+		m_cache->Add(entry);
+	}
+	return TRUE;
+}
+
+HRESULT CVerdictStamps::EndFile(__in IVirtualFs * file, __in IFsEnumContext * context)
+{
+	if (file == NULL || context == NULL) return E_INVALIDARG;
+
+	VERDICT_STAMP stamp;
+	ZeroMemory(&stamp, sizeof(stamp));
+	stamp.engine = VERDICT_ENGINE_GENERATION;
+	stamp.signature = t_file.signature;
+	stamp.archiveDepth = context->GetMaxDepthInArchive();
+	memcpy(stamp.digest, t_file.digest, sizeof(stamp.digest));
+
+	// the skipped modules found this content clean under the old stamp and the others in
+	// this scan, so the new stamp lists them all.
+	// Modules swapped during the scan of the file leave it unstamped.
+	AcquireSRWLockShared(&m_lock);
+	BOOL clean = t_file.scanned && !t_file.detected && t_file.signature == m_signature;
+	stamp.moduleCount = m_moduleCount;
+	memcpy(stamp.modules, m_modules, sizeof(stamp.modules));
+	ReleaseSRWLockShared(&m_lock);
+	BeginFile();
+	if (!clean || !HasKey()) return S_FALSE;
+
+	// the size and time the walker sees in the directory entry
+	IFsAttribute * attribute = NULL;
+	ULARGE_INTEGER fileSize = {};
+	HRESULT hr = file->QueryInterface(__uuidof(IFsAttribute), (LPVOID*)&attribute);
+	if (FAILED(hr)) return hr;
+	if (SUCCEEDED(hr = attribute->Size(&fileSize)))
+		hr = attribute->Time(NULL, NULL, &stamp.lastWrite);
+	attribute->Release();
+	if (FAILED(hr)) return hr;
+	stamp.fileSize = fileSize.QuadPart;
+
+	if (m_cache)
+	{
+		VERDICT_CACHE_ENTRY entry;
+		ZeroMemory(&entry, sizeof(entry));
+		memcpy(entry.digest, stamp.digest, SHA256_DIGEST_SIZE);
+		entry.fileSize = stamp.fileSize;
+		entry.signature = stamp.signature;
+		entry.archiveDepth = stamp.archiveDepth;
+		m_cache->Add(entry);
+	}
+
+	BSTR fullPath = NULL;
+	if (FAILED(hr = file->GetFullPath(&fullPath))) return hr;
+	hr = Write(fullPath, &stamp);
+	SysFreeString(fullPath);
+	return hr;
+}
+
+BOOL CVerdictStamps::FindCached(__in_bcount(SHA256_DIGEST_SIZE) const BYTE * digest, __in ULONGLONG fileSize, __in DWORD signature, __in IFsEnumContext * context)
+{
+	if (digest == NULL || context == NULL || m_cache == NULL) return FALSE;
+	if (!m_cache->Find(digest, fileSize, signature, context->GetMaxDepthInArchive())) return FALSE;
+	t_file.cached = TRUE;
+	return TRUE;
+}
+
+void CVerdictStamps::BeginFile(__in_opt const VERDICT_STAMP * stamp)
+{
+	ZeroMemory(&t_file, sizeof(t_file));
+	if (stamp && stamp->moduleCount <= VERDICT_STAMP_MODULES)
+	{
+		t_file.coveredCount = stamp->moduleCount;
+		memcpy(t_file.covered, stamp->modules, stamp->moduleCount * sizeof(VERDICT_MODULE));
+		memcpy(t_file.stampDigest, stamp->digest, SHA256_DIGEST_SIZE);
+	}
+}
+
+BOOL CVerdictStamps::VerifyContent(__in_bcount(SHA256_DIGEST_SIZE) const BYTE * digest)
+{
+	if (digest && t_file.coveredCount && 0 == memcmp(digest, t_file.stampDigest, SHA256_DIGEST_SIZE))
+		t_file.verified = TRUE;
+	return t_file.verified;
+}
+
+BOOL CVerdictStamps::IsCovered(__in const VERDICT_MODULE & module)
+{
+	if (t_file.cached) return TRUE;
+	if (!t_file.verified) return FALSE;
+	for (DWORD i = 0; i < t_file.coveredCount; i++)
+	{
+		if (t_file.covered[i].id == module.id && t_file.covered[i].version == module.version)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+void CVerdictStamps::OnFileScanned(__in DWORD signature, __in_bcount(SHA256_DIGEST_SIZE) const BYTE * digest)
+{
+	t_file.scanned = TRUE;
+	t_file.signature = signature;
+	memcpy(t_file.digest, digest, SHA256_DIGEST_SIZE);
+}
+
+void CVerdictStamps::OnDetected(void)
+{
+	t_file.detected = TRUE;
+}
+
+HRESULT CVerdictStamps::Read(__in LPCWSTR lpPath, __out VERDICT_STAMP * stamp)
+{
+	if (lpPath == NULL || stamp == NULL) return E_INVALIDARG;
+	StringW streamPath = StringW(lpPath) + VERDICT_STAMP_STREAM;
+	HANDLE hStream = CreateFileW(streamPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hStream == INVALID_HANDLE_VALUE) return HRESULT_FROM_WIN32(GetLastError());
+
+	DWORD readSize = 0;
+	BOOL ok = ReadFile(hStream, stamp, sizeof(*stamp), &readSize, NULL);
+	CloseHandle(hStream);
+	if (!ok || readSize != sizeof(*stamp) ||
+		stamp->magic != VERDICT_STAMP_MAGIC ||
+		stamp->version != VERDICT_STAMP_VERSION ||
+		stamp->size != sizeof(*stamp))
+		return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+	// forged, made by another install, or copied from another file
+	BYTE mac[SHA256_DIGEST_SIZE];
+	HRESULT hr = Sign(lpPath, stamp, mac);
+	if (FAILED(hr)) return hr;
+	BYTE diff = 0;
+	for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+		diff |= mac[i] ^ stamp->mac[i];
+	return diff ? HRESULT_FROM_WIN32(ERROR_INVALID_DATA) : S_OK;
+}
+
+HRESULT CVerdictStamps::Write(__in LPCWSTR lpPath, __inout VERDICT_STAMP * stamp)
+{
+	if (lpPath == NULL || stamp == NULL) return E_INVALIDARG;
+	stamp->magic = VERDICT_STAMP_MAGIC;
+	stamp->version = VERDICT_STAMP_VERSION;
+	stamp->size = sizeof(*stamp);
+	HRESULT hr = Sign(lpPath, stamp, stamp->mac);
+	if (FAILED(hr)) return hr;
+
+	StringW streamPath = StringW(lpPath) + VERDICT_STAMP_STREAM;
+	HANDLE hStream = CreateFileW(streamPath.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hStream == INVALID_HANDLE_VALUE) return HRESULT_FROM_WIN32(GetLastError());
+
+	// writes through this handle leave the times of the file alone, so the
+	// stamp still matches the last write time it records
+	FILETIME keep = { 0xFFFFFFFF, 0xFFFFFFFF };
+	SetFileTime(hStream, NULL, &keep, &keep);
+
+	DWORD written = 0;
+	if (!WriteFile(hStream, stamp, sizeof(*stamp), &written, NULL) || !SetEndOfFile(hStream))
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	CloseHandle(hStream);
+	return hr;
+}
+
+HRESULT CVerdictStamps::Sign(__in LPCWSTR lpPath, __in const VERDICT_STAMP * stamp, __out_bcount(SHA256_DIGEST_SIZE) BYTE * mac)
+{
+	if (!HasKey()) return NTE_NO_KEY;
+
+	// a stamp holds for the file it was written to
+	HANDLE hFile = CreateFileW(lpPath, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) return HRESULT_FROM_WIN32(GetLastError());
+	BY_HANDLE_FILE_INFORMATION info;
+	BOOL ok = GetFileInformationByHandle(hFile, &info);
+	CloseHandle(hFile);
+	if (!ok) return HRESULT_FROM_WIN32(GetLastError());
+	VERDICT_FILE_ID id = { info.dwVolumeSerialNumber, info.nFileIndexHigh, info.nFileIndexLow };
+
+	CHmacSha256 hmac;
+	AcquireSRWLockShared(&m_lock);
+	hmac.Init(m_key, sizeof(m_key));
+	ReleaseSRWLockShared(&m_lock);
+	hmac.Update(stamp, offsetof(VERDICT_STAMP, mac));
+	hmac.Update(&id, sizeof(id));
+	hmac.Final(mac);
+	return S_OK;
+}
@@ -0,0 +1,224 @@
+#pragma once
+#include <TinyAvCore.h>
+#include "../Hash/Sha256.h"
+#include "VerdictCache.h"
+
+#define VERDICT_STAMP_STREAM		L":tinyav"		// alternate data stream holding the stamp
+#define VERDICT_STAMP_MAGIC			(0x53564154)	// "TAVS"
+#define VERDICT_STAMP_VERSION		(3)
+#define VERDICT_ENGINE_GENERATION	(1)				// raise it when the core changes what a scan finds
+#define VERDICT_STAMP_MODULES		(16)			// modules listed in a stamp
+#define VERDICT_KEY_SIZE			(32)			// bytes of the key signing the stamps
+#define VERDICT_KEY_DIRECTORY		L"TinyAntivirus"	// under the common application data
+#define VERDICT_KEY_FILE			L"verdict.key"
+// owned by the administrators, who can read and write it with the system only
+#define VERDICT_KEY_SDDL			L"O:BAD:P(A;;FA;;;SY)(A;;FA;;;BA)"
+
+// A scan module, as far as its verdicts go
+typedef struct VERDICT_MODULE
+{
+	DWORD		id;				// FNV-1a of the lowercase name of the module
+	DWORD		version;		// MODULE_INFO::version
+}VERDICT_MODULE;
+
+// Stamp of a file the scan found clean, kept in the VERDICT_STAMP_STREAM of
+// the file. It is signed with the key of the install and bound to the volume
+// and the file ID of the file: renames keep the stamp, copies do not. Each
+// module it lists found the file clean at its version; the modules that are
+// still loaded at that version need not scan the file again, once the
+// content read by the scan matches the digest of the stamp.
+typedef struct VERDICT_STAMP
+{
+	DWORD		magic;
+	WORD		version;
+	WORD		size;			// of the stamp in bytes
+	DWORD		engine;			// VERDICT_ENGINE_GENERATION of the scanner
+	DWORD		signature;		// of the scan modules, see CScanModuleSet::GetSignature()
+	LONG		archiveDepth;	// depth scanned into archives, -1 for any
+	DWORD		reserved;
+	ULONGLONG	fileSize;
+	FILETIME	lastWrite;
+	BYTE		digest[SHA256_DIGEST_SIZE];	// SHA-256 of the content
+	DWORD		moduleCount;	// 0 when the modules did not fit: only the signature counts
+	VERDICT_MODULE	modules[VERDICT_STAMP_MODULES];
+	BYTE		mac[SHA256_DIGEST_SIZE];	// HMAC-SHA256 of the bytes before it and of the VERDICT_FILE_ID
+}VERDICT_STAMP;
+
+// The file a stamp is written to, signed with the stamp
+typedef struct VERDICT_FILE_ID
+{
+	DWORD		volumeSerial;
+	DWORD		fileIndexHigh;
+	DWORD		fileIndexLow;
+}VERDICT_FILE_ID;
+
+// Hashes the bytes of a file as the tee reads it
+class CVerdictHasher :
+	public CRefCount,
+	public IFsStreamConsumer,
+	public IFsSparseConsumer
+{
+protected:
+	CSha256		m_sha;
+	ULONGLONG	m_size;
+	ULONGLONG	m_received;
+	BOOL		m_done;
+	BYTE		m_digest[SHA256_DIGEST_SIZE];
+
+	virtual ~CVerdictHasher() {}
+
+public:
+	CVerdictHasher();
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	/* Digest of the last file
+	@digest: a buffer of SHA256_DIGEST_SIZE bytes receiving the digest
+	@return: S_OK, or E_NOT_SET if the file was not read to its end.
+	*/
+	HRESULT GetDigest(__out_bcount(SHA256_DIGEST_SIZE) BYTE * digest);
+
+	// Size of the last file
+	ULONGLONG GetSize(void) { return m_size; }
+
+	// implement IFsStreamConsumer interface
+	virtual HRESULT WINAPI OnStreamBegin(__in IVirtualFs * file, __in ULONGLONG size) override;
+	virtual HRESULT WINAPI OnStreamBlock(__in ULONGLONG offset, __in_bcount(size) const BYTE * data, __in ULONG size) override;
+	virtual HRESULT WINAPI OnStreamEnd(__in HRESULT status) override;
+
+	// implement IFsSparseConsumer interface
+	virtual HRESULT WINAPI OnStreamHole(__in ULONGLONG offset, __in ULONGLONG size) override;
+};
+
+// Verdict stamps of a scanner. The walker reads the stamp of each top-level
+// file and stamps the files the scan finds clean. A stamp is only trusted
+// once the file is read and its content matches the digest of the stamp:
+// the size and the last write time can be rolled back, the content cannot.
+// The modules the stamp lists then skip the file; the others scan it. A
+// stamp saves the scan by the modules, not the read: every stamped file is
+// opened and hashed in full, and a copy is scanned again by every module.
+// Content found clean under another path, or on another host whose cache
+// was imported, is not scanned again. What happens to a file is tracked per
+// thread: the file and the files inside it are scanned on the thread of the
+// walker that found it.
+//
+// Without the key of the install, read from a file only the administrators
+// can read, no stamp is trusted nor written.
+class CVerdictStamps :
+	public CRefCount,
+	public IUnknown
+{
+protected:
+	SRWLOCK			m_lock;
+	DWORD			m_signature;	// of the current scan modules, 0 when there are none
+	DWORD			m_moduleCount;	// 0 when they do not fit in a stamp
+	VERDICT_MODULE	m_modules[VERDICT_STAMP_MODULES];
+	CVerdictCache *	m_cache;		// verdicts by content
+	BOOL			m_keyLoaded;	// the key was looked for, or set
+	BOOL			m_keyed;		// m_key holds the key
+	BYTE			m_key[VERDICT_KEY_SIZE];
+
+	virtual ~CVerdictStamps();
+
+	// TRUE if the stamp lists every current module, or was made by them
+	BOOL Covers(__in const VERDICT_STAMP * stamp);
+
+	/* Sign a stamp for a file
+	@lpPath: full path of the file
+	@mac: a buffer of SHA256_DIGEST_SIZE bytes receiving the MAC
+	@return: S_OK, NTE_NO_KEY if there is no key, or the error opening the file.
+	*/
+	HRESULT Sign(__in LPCWSTR lpPath, __in const VERDICT_STAMP * stamp, __out_bcount(SHA256_DIGEST_SIZE) BYTE * mac);
+
+	// Read the key of the install, or make it if there is none yet
+	static HRESULT LoadKey(__out_bcount(VERDICT_KEY_SIZE) BYTE * key);
+	static HRESULT ReadKey(__in LPCWSTR lpPath, __out_bcount(VERDICT_KEY_SIZE) BYTE * key);
+	static HRESULT CreateKey(__in LPCWSTR lpDirectory, __in LPCWSTR lpPath);
+
+public:
+	CVerdictStamps();
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject);
+
+	/* Set the scan modules, when they change
+	@signature: of the modules, see CScanModuleSet::GetSignature()
+	@modules: the modules in scan order, see CScanModuleSet::GetVerdictModules()
+	@count: number of modules
+	*/
+	void SetModules(__in DWORD signature, __in_ecount_opt(count) const VERDICT_MODULE * modules, __in ULONG count);
+
+	DWORD GetSignature(void);
+
+	CVerdictCache * GetCache(void) { return m_cache; }
+
+	/* Set the key signing the stamps, in place of the key of the install
+	@key: VERDICT_KEY_SIZE bytes, NULL to sign no stamp
+	@size: size of the key
+	*/
+	HRESULT SetKey(__in_bcount_opt(size) const BYTE * key, __in ULONG size);
+
+	// TRUE if there is a key; the key of the install is loaded on the first call
+	BOOL HasKey(void);
+
+	/* Check the stamp of a file before it is opened
+	@lpPath: full path of the file
+	@findData: directory entry of the file, NULL to look it up
+	@context: enumeration context of the scan
+	@stamp: a pointer to a variable receiving the stamp if it is signed for
+	the file and matches the engine, the scan settings and the size and last
+	write time of the file, even if it was made by other modules. Zeroed
+	otherwise. May be NULL.
+	@return: TRUE if the stamp also covers every current module. The file is
+	still read, see VerifyContent().
+	*/
+	BOOL IsCurrent(__in LPCWSTR lpPath, __in_opt const WIN32_FIND_DATAW * findData, __in IFsEnumContext * context,
+		__out_opt VERDICT_STAMP * stamp = NULL);
+
+	// Stamp the file if the scan found it clean, called by the walker once
+	// the file and the files inside it are scanned
+	HRESULT EndFile(__in IVirtualFs * file, __in IFsEnumContext * context);
+
+	/* Look up the content of the top-level file in the cache, once it is read
+	On a hit, no module scans the file nor the files inside it, see IsCovered().
+	@digest: SHA-256 of the content
+	@fileSize: size of the content
+	@signature: of the modules the file is scanned with
+	@context: enumeration context of the scan
+	@return: TRUE if the modules found the same content clean before.
+	*/
+	BOOL FindCached(__in_bcount(SHA256_DIGEST_SIZE) const BYTE * digest, __in ULONGLONG fileSize, __in DWORD signature, __in IFsEnumContext * context);
+
+	/* A top-level file is found by the walker of the calling thread
+	@stamp: stamp of the file from IsCurrent(), NULL if it has none. The
+	modules it lists are skipped by the scan of the file once its content is
+	verified, see VerifyContent() and IsCovered().
+	*/
+	static void BeginFile(__in_opt const VERDICT_STAMP * stamp = NULL);
+
+	/* The top-level file of the calling thread is read
+	@digest: SHA-256 of its content
+	@return: TRUE if the file has a stamp and the content is the one stamped.
+	*/
+	static BOOL VerifyContent(__in_bcount(SHA256_DIGEST_SIZE) const BYTE * digest);
+
+	// TRUE if the verified stamp of the file being scanned by the calling
+	// thread says the module found it clean at the same version, or if the
+	// cache covers the file
+	static BOOL IsCovered(__in const VERDICT_MODULE & module);
+
+	// The modules scanned the file to its end
+	static void OnFileScanned(__in DWORD signature, __in_bcount(SHA256_DIGEST_SIZE) const BYTE * digest);
+
+	// A module found something in the file or in a file inside it
+	static void OnDetected(void);
+
+	// Read the stamp of a file; fails unless it is signed for the file with the key
+	HRESULT Read(__in LPCWSTR lpPath, __out VERDICT_STAMP * stamp);
+
+	// Sign a stamp for a file and write it
+	HRESULT Write(__in LPCWSTR lpPath, __inout VERDICT_STAMP * stamp);
+};
@@ -4,9 +4,14 @@
 #include "Module\ModuleMgrService.h"
 #include "Emulator\PeEmulator.h"
 #include "FileType\PeFileParser.h"
+#include "FileType\PeTriage.h"
 #include "Scanner\ScanService.h"
 #include "FileSystem\FileFsEnumContext.h"
 #include "FileSystem\FileFs.h"
+#include "Hash\HashBatch.h"
+#include <sddl.h>
+#include <aclapi.h>
+#include <stdio.h>
 
 StringW AnsiToUnicode(__in StringA * str)
 {
@@ -15,13 +20,11 @@ StringW AnsiToUnicode(__in StringA * str)
 	int nRequired = MultiByteToWideChar(CP_UTF8, 0, str->c_str(), (int)str->length(), NULL, 0);
 	if (nRequired == 0) return L"";
 
-	WCHAR * lpWideChar = new WCHAR[nRequired + 1];
-	if (lpWideChar == NULL) return L"";
-	nRequired = MultiByteToWideChar(CP_UTF8, 0, str->c_str(), (int)str->length(), lpWideChar, nRequired);
+	// convert straight into the result, without a temporary buffer
+	StringW wstr(nRequired, L'\0');
+	nRequired = MultiByteToWideChar(CP_UTF8, 0, str->c_str(), (int)str->length(), &wstr[0], nRequired);
 	if (nRequired == 0) return L"";
-	lpWideChar[nRequired] = L'\0';
-	StringW wstr = lpWideChar;
-	delete[]lpWideChar;
+	wstr.resize(nRequired);
 	return wstr;
 }
 
@@ -37,14 +40,11 @@ StringA UnicodeToAnsi(__in StringW * str)
 	int nRequired = WideCharToMultiByte(CP_UTF8, 0, str->c_str(), (int)str->length(), NULL, 0, NULL, NULL);
 	if (nRequired == 0) return "";
 
-	CHAR * lpWideChar = new CHAR[nRequired + 1];
-	if (lpWideChar == NULL) return "";
-	nRequired = WideCharToMultiByte(CP_UTF8, 0, str->c_str(), (int)str->length(), lpWideChar, nRequired, NULL, NULL);
+	StringA astr(nRequired, '\0');
+	nRequired = WideCharToMultiByte(CP_UTF8, 0, str->c_str(), (int)str->length(), &astr[0], nRequired, NULL, NULL);
 	if (nRequired == 0) return "";
-	lpWideChar[nRequired] = '\0';
-	StringA wstr = lpWideChar;
-	delete[]lpWideChar;
-	return wstr;
+	astr.resize(nRequired);
+	return astr;
 }
 
 StringA UnicodeToAnsi(__in StringW& str)
@@ -52,6 +52,92 @@ StringA UnicodeToAnsi(__in StringW& str)
 	return UnicodeToAnsi(&str);
 }
 
+HANDLE CreateProcessMapping(__in LPCWSTR lpName, __in DWORD size)
+{
+	if (lpName == NULL || size == 0) return NULL;
+
+	// the user of the process token
+	HANDLE hToken = NULL;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &hToken)) return NULL;
+	DWORD_PTR tokenUser[(sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE) / sizeof(DWORD_PTR) + 1];
+	DWORD length = 0;
+	BOOL ok = GetTokenInformation(hToken, TokenUser, tokenUser, sizeof(tokenUser), &length);
+	CloseHandle(hToken);
+	if (!ok) return NULL;
+	PSID user = ((TOKEN_USER *)tokenUser)->User.Sid;
+
+	// owned by the user, who alone has access
+	LPWSTR szUser = NULL;
+	if (!ConvertSidToStringSidW(user, &szUser)) return NULL;
+	WCHAR szSddl[256];
+	int written = swprintf_s(szSddl, L"O:%sD:P(A;;GA;;;%s)", szUser, szUser);
+	LocalFree(szUser);
+	PSECURITY_DESCRIPTOR sd = NULL;
+	if (written < 0 || !ConvertStringSecurityDescriptorToSecurityDescriptorW(szSddl, SDDL_REVISION_1, &sd, NULL))
+		return NULL;
+	SECURITY_ATTRIBUTES sa = { sizeof(sa), sd, FALSE };
+	HANDLE hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, &sa, PAGE_READWRITE, 0, size, lpName);
+	DWORD error = GetLastError();
+	LocalFree(sd);
+	if (hMapping == NULL || error != ERROR_ALREADY_EXISTS) return hMapping;
+
+	// made by another copy, or by another process before this one: the
+	// other copies make it the same way
+	PSID owner = NULL;
+	PSECURITY_DESCRIPTOR existing = NULL;
+	ok = (ERROR_SUCCESS == GetSecurityInfo(hMapping, SE_KERNEL_OBJECT, OWNER_SECURITY_INFORMATION, &owner, NULL, NULL, NULL, &existing)) &&
+		EqualSid(owner, user);
+	if (existing) LocalFree(existing);
+	if (!ok)
+	{
+		CloseHandle(hMapping);
+		return NULL;
+	}
+	return hMapping;
+}
+
+LPVOID MapProcessTable(__in LPCWSTR lpFormat, __in DWORD size, __out HANDLE * mapping)
+{
+	if (mapping == NULL) return NULL;
+	*mapping = NULL;
+	if (lpFormat == NULL) return NULL;
+
+	WCHAR szName[64];
+	if (swprintf_s(szName, lpFormat, GetCurrentProcessId()) < 0) return NULL;
+	HANDLE hMapping = CreateProcessMapping(szName, size);
+	if (hMapping == NULL) return NULL;
+	LPVOID table = MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, size);
+	if (table == NULL)
+	{
+		CloseHandle(hMapping);
+		return NULL;
+	}
+	*mapping = hMapping;
+	return table;
+}
+
+void UnmapProcessTable(__in_opt LPVOID table, __in_opt HANDLE mapping)
+{
+	if (table) UnmapViewOfFile(table);
+	if (mapping) CloseHandle(mapping);
+}
+
+DWORD PublishTlsSlot(__inout volatile LONG * published)
+{
+	// Copies loading at the same time race to publish a slot; the losers
+	// free theirs. The published slot is never freed: other copies may
+	// outlive the one that allocated it.
+	if (*published == 0)
+	{
+		DWORD slot = TlsAlloc();
+		if (slot != TLS_OUT_OF_INDEXES &&
+			InterlockedCompareExchange(published, (LONG)slot + 1, 0) != 0)
+			TlsFree(slot);
+	}
+	if (*published == 0) return TLS_OUT_OF_INDEXES;
+	return (DWORD)(*published - 1);
+}
+
 HRESULT WINAPI CreateClassObject(__in REFCLSID rclsid, __in DWORD dwClsContext, __in REFIID riid, __out LPVOID *ppv)
 {
 	UNREFERENCED_PARAMETER(dwClsContext);
@@ -79,6 +165,20 @@ HRESULT WINAPI CreateClassObject(__in REFCLSID rclsid, __in DWORD dwClsContext,
 		return S_OK;
 	}
 
+	else if (IsEqualCLSID(rclsid, CLSID_CPeTriage) ||
+		IsEqualIID(riid, __uuidof(IPeTriage)))
+	{
+		*ppv = static_cast<IPeTriage*>(new CPeTriage());
+		return S_OK;
+	}
+
+	else if (IsEqualCLSID(rclsid, CLSID_CHashBatch) ||
+		IsEqualIID(riid, __uuidof(IHashBatch)))
+	{
+		*ppv = static_cast<IHashBatch*>(new CHashBatch());
+		return S_OK;
+	}
+
 	else if (IsEqualCLSID(rclsid, CLSID_CScanService) ||
 		IsEqualIID(riid, __uuidof(IScanner)))
 	{
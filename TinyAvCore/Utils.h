@@ -4,4 +4,33 @@
 StringW AnsiToUnicode(__in StringA * str);
 StringW AnsiToUnicode(__in StringA& str);
 StringA UnicodeToAnsi(__in StringW * str);
-StringA UnicodeToAnsi(__in StringW& str);
\ No newline at end of file
+StringA UnicodeToAnsi(__in StringW& str);
+
+/* Create, or open, a mapping shared by the copies of TinyAvCore in the process
+Only the user of the process can open the mapping it creates. A mapping of
+the same name made by anyone else is not used.
+@lpName: name of the mapping, with the id of the process in it
+@size: size of the mapping in bytes
+@return: a handle to the mapping, zero-filled when it is created, or NULL.
+*/
+HANDLE CreateProcessMapping(__in LPCWSTR lpName, __in DWORD size);
+
+/* Map a table shared by the copies of TinyAvCore in the process
+The first copy creates the table, zero-filled; the others open it. A table
+made by another process is not used, see CreateProcessMapping().
+@lpFormat: name of the mapping, with %lu for the id of the process
+@size: size of the table in bytes
+@mapping: a pointer to a variable storing the mapping, NULL on failure
+@return: the table, or NULL. Release it with UnmapProcessTable().
+*/
+LPVOID MapProcessTable(__in LPCWSTR lpFormat, __in DWORD size, __out HANDLE * mapping);
+
+// Release a table returned by MapProcessTable(), NULL is ignored
+void UnmapProcessTable(__in_opt LPVOID table, __in_opt HANDLE mapping);
+
+/* Get the TLS slot shared by the copies of TinyAvCore through a table
+The first copy to get here allocates the slot and publishes it.
+@published: slot + 1 in the table, 0 until a copy publishes one
+@return: the slot, or TLS_OUT_OF_INDEXES.
+*/
+DWORD PublishTlsSlot(__inout volatile LONG * published);
\ No newline at end of file
@@ -12,7 +12,8 @@ public:
 		EmulatorErr = EMULATOR_ERROR_CODE_BASE,
 		EmulatorIsNotFound,
 		EmulatorIsNotRunable,
-		EmulatorInternalError
+		EmulatorInternalError,
+		EmulatorOutOfMemory		// the memory governor refused the guest memory, the file was not emulated
 	};
 
 	BEGIN_INTERFACE
@@ -161,5 +162,24 @@ public:
 	*/
 	virtual HRESULT WINAPI RemoveHook(__in size_t hookHandle) = 0;
 
+	/*
+	Replay an emulation run recorded into a trace file.
+	Runs are recorded when the TINYAV_EMUL_TRACE environment variable names a directory.
+	The trace holds the mapped memory and registers, so no file or scanner is needed.
+
+	@lpTraceFile: path of the trace file
+	@return: HRESULT on success, or other value on failure.
+	*/
+	virtual HRESULT WINAPI EmulateTrace(__in LPCWSTR lpTraceFile) = 0;
+
+	/*
+	Limit the wall time of the following emulation runs.
+	A run that reaches the deadline is stopped and returns HRESULT_FROM_WIN32(ERROR_TIMEOUT).
+
+	@deadline: GetTickCount64() value to stop at, 0 for no limit
+	@return: HRESULT on success, or other value on failure.
+	*/
+	virtual HRESULT WINAPI SetDeadline(__in ULONGLONG deadline) = 0;
+
 	END_INTERFACE
 };
\ No newline at end of file
@@ -12,7 +12,11 @@ public:
 	{
 		FsEnumErr = ENUMERATION_ERROR_CODE_BASE,
 		FsEnumAccessDenied,
-		FsEnumNotFound
+		FsEnumNotFound,
+		FsEnumDuplicate,	// hard link or directory already visited, skipped
+		FsEnumTimeout,		// file overran its time budget, its scan was cut short
+		FsEnumDeferred,		// file overran its time budget and was queued to the slow lane
+		FsEnumStamped		// file unchanged since it was stamped clean, read but not scanned
 	};
 
 	/*
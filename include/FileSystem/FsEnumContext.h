@@ -9,8 +9,16 @@ IFsEnumContext: public IUnknown
 public:
 	enum EnumContextFlags
 	{
-		DetectOnly = 1,
-		Disinfect  = 2
+		DetectOnly  = 1,
+		Disinfect   = 2,
+		CarveImages = 4,	// look for executables embedded in raw images and dumps
+		WatchChanges = 8,	// keep watching the search container and scan changed files
+		ScanFileList = 16,	// the search container is a list of files to scan ("-" for stdin)
+		FollowLinks = 32,	// descend into directory symbolic links and junctions
+		Census = 64,		// count the files to scan in the background to estimate progress
+		NoCache = 128,		// read the files past the system file cache (IVirtualFs::fsNoCache)
+		VerdictStamps = 256,	// stamp the files found clean, and skip those whose stamp is current
+		DirectoryCosts = 512,	// charge the time, reads and emulation of each file to its directory
 	};
 
 	BEGIN_INTERFACE
@@ -74,6 +82,13 @@ public:
 	virtual HRESULT WINAPI SetFlags(__in const ULONG flags) = 0;
 	virtual ULONG WINAPI GetFlags( void ) = 0;
 
+	// Set the time the current file must be finished by.
+	// Enumerators and scan modules stop their work on the file once it passes
+	// and return HRESULT_FROM_WIN32(ERROR_TIMEOUT).
+	// @deadline: GetTickCount64() value, 0 for no limit
+	virtual HRESULT WINAPI SetDeadline(__in const ULONGLONG deadline) = 0;
+	virtual ULONGLONG WINAPI GetDeadline(void) = 0;
+
 	// #todo: must implement
 	virtual HRESULT WINAPI AddIgnoreItem(__in LPCWSTR lpPath) = 0;
 	virtual HRESULT WINAPI RemoveIgnoreItem(__in LPCWSTR lpPath) = 0;
@@ -30,6 +30,8 @@ IVirtualFs : public IUnknown
         fsAttrDeleteOnClose = 1 << 14,  // The file is to be deleted immediately after all of its handles are closed.
         fsDeferredCreation  = 1 << 15,  // Defer the creation of file when creating or opening until application re-creates file.
         fsDeferredDeletion  = 1 << 16,  // Defer the deletion of file until application closes it
+        fsNoCache           = 1 << 17,  // Read large blocks past the system file cache, so a scan does not evict the cache of other programs.
+        fsRandomAccess      = 1 << 18,  // The file is read at random offsets rather than from start to end.
     };
 
     BEGIN_INTERFACE
@@ -125,6 +127,14 @@ public:
     */
     virtual HRESULT WINAPI DeferredDelete(void) = 0;
 
+    /* Read the file through another stream
+    QueryInterface(IFsStream) returns the attached stream instead of the
+    file's own until it is detached.
+    @stream: stream to attach, or NULL to detach
+    @return: HRESULT on success, or other value on failure.
+    */
+    virtual HRESULT WINAPI AttachStream(__in_opt IFsStream * stream) = 0;
+
     END_INTERFACE
 };
 
@@ -98,3 +98,23 @@ public:
 
 	END_INTERFACE
 };
+
+// Stream of a file that may have holes: ranges that are not stored on disk
+// and read as zeros, as in sparse files. Streams without this interface are
+// all data.
+MIDL_INTERFACE("123FEF70-3EAF-4A7F-AD66-4B1162135D42")
+IFsSparseStream : public IUnknown
+{
+public:
+	BEGIN_INTERFACE
+
+	/* Find the first range of stored data at or after an offset
+	@offset: offset to search from
+	@dataStart: a pointer to a variable receiving the start of the range, offset itself if it is in data
+	@dataEnd: a pointer to a variable receiving the end of the range, where the next hole starts
+	@return: S_OK, or S_FALSE if there is no data past offset; then both are set to the size of the stream.
+	*/
+	virtual HRESULT WINAPI GetDataRange(__in ULONGLONG offset, __out ULONGLONG * dataStart, __out ULONGLONG * dataEnd) = 0;
+
+	END_INTERFACE
+};
@@ -0,0 +1,56 @@
+#pragma once
+#include "../TinyAvBase.h"
+#include "FsObject.h"
+
+// A scan module that also exposes this interface is given the bytes of every
+// file as the scanner reads it, once and in order, before the modules scan
+// the file. Hashers, matchers and similar whole-file passes then need no
+// reads of their own. Scan() is still called afterwards, to report.
+MIDL_INTERFACE("2A4EBBB7-3396-4259-8483-4C60FF6A4A4F")
+IFsStreamConsumer : public IUnknown
+{
+public:
+	BEGIN_INTERFACE
+
+	/* Called before the first block of a file
+	@file: the file to be read
+	@size: size of the file in bytes
+	@return: S_OK to receive the blocks, S_FALSE to skip the file.
+	*/
+	virtual HRESULT WINAPI OnStreamBegin(__in IVirtualFs * file, __in ULONGLONG size) = 0;
+
+	/* Called for each block of the file, in order of offset
+	@offset: offset of the block in the file
+	@data: bytes of the block, valid until the call returns
+	@size: number of bytes
+	@return: S_OK for more blocks, or a failure code to stop receiving the file.
+	*/
+	virtual HRESULT WINAPI OnStreamBlock(__in ULONGLONG offset, __in_bcount(size) const BYTE * data, __in ULONG size) = 0;
+
+	/* Called after the last block, or when the file could not be read to its end
+	@status: S_OK if every block was given, or the error that stopped the reads
+	@return: ignored.
+	*/
+	virtual HRESULT WINAPI OnStreamEnd(__in HRESULT status) = 0;
+
+	END_INTERFACE
+};
+
+// A stream consumer that also exposes this interface is told of the holes of
+// sparse files instead of being given their zeros. A hasher can then account
+// for the zeros without reading them.
+MIDL_INTERFACE("B6FB3EA6-74BC-4188-8DBF-74A74D549329")
+IFsSparseConsumer : public IUnknown
+{
+public:
+	BEGIN_INTERFACE
+
+	/* Called for a run of zeros not stored on disk, in order of offset with the blocks
+	@offset: offset of the run in the file
+	@size: number of zero bytes
+	@return: S_OK for more blocks, or a failure code to stop receiving the file.
+	*/
+	virtual HRESULT WINAPI OnStreamHole(__in ULONGLONG offset, __in ULONGLONG size) = 0;
+
+	END_INTERFACE
+};
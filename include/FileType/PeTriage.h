@@ -0,0 +1,69 @@
+#pragma once
+
+#include "../TinyAvBase.h"
+#include "PEFile.h"
+
+// Classes of x86 instructions counted by the triage
+enum PeTriageOpClass
+{
+	TriageOpMove = 0,	// mov, lea, xchg, movzx, cmov, setcc
+	TriageOpArith,		// add, sub, adc, sbb, cmp, inc, dec, neg, mul, div
+	TriageOpLogic,		// xor, and, or, not, test, shifts, rotates, bit tests
+	TriageOpStack,		// push, pop, pushad, enter, leave
+	TriageOpBranch,		// jcc, jmp, loop
+	TriageOpCall,		// call, ret
+	TriageOpString,		// lods, stos, movs, scas, cmps
+	TriageOpRare,		// segment, BCD, port, interrupt and system instructions
+	TriageOpFloat,		// x87, MMX and SSE
+	TriageOpOther,		// nop, flag instructions
+	TriageOpClassCount
+};
+
+// Features of the code at the entry point and at the start of the last
+// section, and the score the linear model gives them
+typedef struct PE_TRIAGE_RESULT
+{
+	DOUBLE	score;
+	BOOL	suspicious;			// score >= threshold: worth an emulation
+	UINT	instructions;		// decoded in both windows
+	UINT	invalidBytes;		// bytes skipped because they did not decode
+	UINT	histogram[TriageOpClassCount];
+	BOOL	epInLastSection;
+	BOOL	epWritable;			// the section of the entry point is writable
+	BOOL	jumpsToLastSection;	// a call or jmp near the entry point lands in the last section
+	BOOL	getPc;				// call $+5, or fnstenv after an x87 instruction
+	BOOL	backwardLoop;		// a short branch back into the window, as a decryptor loop
+	BOOL	lastSectionOpen;	// the last section is both writable and executable
+	BOOL	epOutsideCode;		// the entry point is not in the first code section
+}PE_TRIAGE_RESULT;
+
+// Cheap static look at a PE file before it is emulated. Most clean files
+// start with compiler-generated code that looks nothing like the stub of a
+// file infector; those can skip the emulator. Infectors that obscure the
+// entry point leave it alone, so the layouts they leave behind are always
+// suspicious, whatever the score.
+MIDL_INTERFACE("EBFCB78F-FEE3-4783-AB33-8FFE89F59942")
+IPeTriage : public IUnknown
+{
+public:
+	BEGIN_INTERFACE
+
+	/* Score the file currently opened by a parser
+	@parser: a pointer to IPeFile object that has matched the file
+	@result: a pointer to a variable storing result.
+	@return: HRESULT on success, or other value on failure.
+	*/
+	virtual HRESULT WINAPI Classify(__in IPeFile * parser, __out PE_TRIAGE_RESULT * result) = 0;
+
+	/* Change the score from which a file is suspicious
+	@threshold: new threshold. PE_TRIAGE_DEFAULT_THRESHOLD by default.
+	@return: HRESULT on success, or other value on failure.
+	*/
+	virtual HRESULT WINAPI SetThreshold(__in DOUBLE threshold) = 0;
+
+	virtual DOUBLE WINAPI GetThreshold(void) = 0;
+
+	END_INTERFACE
+};
+
+#define PE_TRIAGE_DEFAULT_THRESHOLD	(0.0)
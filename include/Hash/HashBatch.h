@@ -0,0 +1,50 @@
+#pragma once
+#include "../TinyAvBase.h"
+
+#define SHA256_DIGEST_SIZE	(32)
+
+// Code hashing the messages of a batch
+enum HashEngine
+{
+	HashEngineScalar = 0,	// one message at a time, in C
+	HashEngineShaNi,		// one message at a time, with the SHA extensions
+	HashEngineAvx2,			// eight messages at a time, one per AVX2 lane
+	HashEngineCount
+};
+
+// SHA-256 of many messages at once. Small files leave most of a vector
+// unit idle when hashed one by one; a batch interleaves the blocks of
+// several files instead. The engine is picked from the CPU: the SHA
+// extensions when present, AVX2 lanes otherwise, plain code on older CPUs.
+// Messages are whole buffers: the batch is not fed by the scan, which
+// streams each file once and hashes it block by block.
+MIDL_INTERFACE("82F04F43-C6F9-4BFF-B4A8-803A27F5414C")
+IHashBatch : public IUnknown
+{
+public:
+	BEGIN_INTERFACE
+
+	/* Queue a message
+	@data: bytes of the message. They must stay valid until Flush() returns.
+	@size: number of bytes
+	@digest: a buffer of SHA256_DIGEST_SIZE bytes receiving the digest when
+	Flush() returns
+	@return: HRESULT on success, or other value on failure.
+	*/
+	virtual HRESULT WINAPI Add(__in_bcount(size) const BYTE * data, __in SIZE_T size, __out_bcount(SHA256_DIGEST_SIZE) BYTE * digest) = 0;
+
+	/* Hash every queued message, and empty the batch
+	@return: HRESULT on success, or other value on failure.
+	*/
+	virtual HRESULT WINAPI Flush(void) = 0;
+
+	/* Choose the engine instead of the CPU
+	@engine: engine to use
+	@return: S_OK, or E_NOTIMPL if the CPU does not have it.
+	*/
+	virtual HRESULT WINAPI SetEngine(__in HashEngine engine) = 0;
+
+	virtual HashEngine WINAPI GetEngine(void) = 0;
+
+	END_INTERFACE
+};
@@ -11,6 +11,7 @@ typedef struct MODULE_INFO {
 	ModuleType type;
 	WCHAR      name[MAX_NAME + 1];
 	HMODULE	   handle;
+	DWORD      version;	// of what the module detects; raised when a file it found clean may no longer be
 }MODULE_INFO, *LPMODULE_INFO;
 
 MIDL_INTERFACE("151BBAB1-5D35-4A40-9940-09C08A412B89")
@@ -52,5 +52,18 @@ public:
 	@return: HRESULT on success, or other value on failure.
 	*/
 	virtual HRESULT WINAPI QueryModule(__out IModule **&module, __out size_t& moduleCount, __in ModuleType moduleType = DefaultModuleType) = 0;
+
+	/*Load a new version of a plug-in module in place of the loaded one
+	The module replaces the loaded module with the same name, which is released.
+	Its library stays loaded as long as a scanner holds its modules, so pass the
+	new module to IScanner::ReplaceScanModule() to swap it without stopping the scans.
+	A loaded library cannot be overwritten: the new version must be another file.
+	@lpModulePath: full path of the new plug-in
+	@flags: The action to be taken when loading the module.
+	@module: a pointer to a variable storing the new module
+	@return: HRESULT on success, E_NOT_VALID_STATE if the file is the library
+	of the loaded module, or other value on failure.
+	*/
+	virtual HRESULT WINAPI Reload(__in LPCWSTR lpModulePath, __in DWORD flags, __out IModule **module) = 0;
 	END_INTERFACE
 };
@@ -3,6 +3,57 @@
 #include "ScanModule.h"
 #include "ScanObserver.h"
 
+// Progress of a running scan. Totals come from the census pass, which only
+// exists when the scan was started with IFsEnumContext::Census.
+typedef struct SCAN_PROGRESS
+{
+	ULONGLONG	totalFiles;		// files found by the census so far
+	ULONGLONG	totalBytes;
+	ULONGLONG	scannedFiles;	// files handed to the scan modules
+	ULONGLONG	scannedBytes;
+	BOOL		censusDone;		// TRUE when the totals are final
+	DOUBLE		fraction;		// 0.0 .. 1.0, estimated from time, not from bytes
+	ULONGLONG	elapsedMs;
+	ULONGLONG	remainingMs;	// ULLONG_MAX while there is not enough data
+}SCAN_PROGRESS;
+
+// Stages of a scan measured by the optional stage counters
+enum ScanStage
+{
+	StageEnumerate = 0,	// walking directories and archives
+	StageOpen,			// opening files
+	StageParse,			// matching file types
+	StageModuleScan,	// scan modules, less the parsing and emulation they do
+	StageEmulate,		// emulating code
+	StageCount
+};
+
+// Totals of one stage over all threads. Nested stages are not counted in
+// the stage that called them.
+typedef struct SCAN_STAGE_COUNTERS
+{
+	ULONGLONG	calls;
+	ULONGLONG	wallUs;		// time spent in the stage, in microseconds
+	ULONGLONG	cycles;		// CPU cycles of the threads in the stage, 0 if not available
+}SCAN_STAGE_COUNTERS;
+
+typedef struct SCAN_STAGE_REPORT
+{
+	BOOL				cyclesAvailable;
+	SCAN_STAGE_COUNTERS	stages[StageCount];
+}SCAN_STAGE_REPORT;
+
+// Cost of a directory and the directories under it, over the scans that
+// charge their files to their directory (IFsEnumContext::DirectoryCosts)
+typedef struct SCAN_DIRECTORY_COST
+{
+	WCHAR		path[MAX_PATH];	// cut short if longer
+	ULONGLONG	files;		// files handed to the scan modules, files inside archives included
+	ULONGLONG	bytes;		// bytes read from disk
+	ULONGLONG	wallUs;		// time spent on the files, in microseconds
+	ULONGLONG	emulateUs;	// of which emulating code
+}SCAN_DIRECTORY_COST;
+
 MIDL_INTERFACE("6BC6668B-E083-4FDA-9F27-EA4905BED319")
 IScanner : public IUnknown
 {
@@ -22,6 +73,9 @@ public:
 	virtual HRESULT WINAPI RemoveScanObserver(__in IScanObserver *observer) = 0;
 
 	/* Add scan module to engine
+	The module is initialized when the first file is scanned with it, at the
+	same time as the other modules added before that file. A module that
+	fails to initialize is left out of the scans.
 	@observer: a pointer to IScanObserver object
 	@return: HRESULT on success, or other value on failure.
 	*/
@@ -59,6 +113,80 @@ public:
 	
 	// wait for all threads to stop
 	virtual void WINAPI Forever(void) = 0;
+
+	/* Poll the progress of a running scan
+	@enumContext: a pointer to IFsEnumContext object passed to Start()
+	@progress: a pointer to a variable storing result.
+	@return: HRESULT on success, E_NOT_SET if the scan is not running.
+	*/
+	virtual HRESULT WINAPI GetProgress(__in IFsEnumContext *enumContext, __out SCAN_PROGRESS * progress) = 0;
+
+	/* Limit the time spent on each file found by the walk
+	A file that overruns its budget is cut short, reported with IFsEnum::FsEnumDeferred
+	and rescanned on a low-priority slow lane, while the scan goes on with the next file.
+	A file that overruns the slow-lane budget too is reported with IFsEnum::FsEnumTimeout.
+	@fileMs: budget of a file, including the files inside it. 0 for no limit
+	@slowLaneMs: budget of a file in the slow lane. 0 for no limit
+	@return: HRESULT on success, or other value on failure.
+	*/
+	virtual HRESULT WINAPI SetTimeBudget(__in ULONG fileMs, __in ULONG slowLaneMs) = 0;
+
+	/* Scan the files found by the walk on a pool of workers
+	Files are queued in lanes by size and type, so small files are not held up by
+	large archives. Each worker has its own instances of the scan modules. Call it
+	before the first Start(); the workers use the time budget set at that point.
+	@workerCount: number of workers. 0 scans each file on the thread of its walk
+	@return: HRESULT on success, E_NOT_VALID_STATE if the workers are running.
+	*/
+	virtual HRESULT WINAPI SetWorkerCount(__in ULONG workerCount) = 0;
+
+	/* Read the stage counters of the scans run by this scanner
+	The counters are process-wide: scans of other scanners running at the same
+	time are counted too. They are enabled by setting the TINYAV_STAGE_COUNTERS
+	environment variable to 1 before the plug-ins are loaded.
+	@report: a pointer to a variable storing result.
+	@return: HRESULT on success, E_NOT_SET if the counters are disabled.
+	*/
+	virtual HRESULT WINAPI GetStageCounters(__out SCAN_STAGE_REPORT * report) = 0;
+
+	/* Swap a scan module for another version while scans are running
+	Files found from now on are scanned by the new module. A file that is being
+	scanned, with the files inside it, finishes on the old one, which is shut
+	down and whose plug-in is released once no file uses it.
+	@scanModule: the new module. It replaces the module with the same name, or
+	is added after the others if there is none.
+	@return: HRESULT on success, E_NOT_VALID_STATE if the module is already in use.
+	*/
+	virtual HRESULT WINAPI ReplaceScanModule(__in IScanModule *scanModule) = 0;
+
+	/* Merge the verdicts exported by another scanner
+	Content they list as clean is not scanned again by scans with verdict stamps
+	(IFsEnumContext::VerdictStamps), if it is scanned with the same modules at
+	the same versions, no deeper into archives.
+	@lpPath: file written by ExportVerdicts()
+	@return: HRESULT on success, HRESULT_FROM_WIN32(ERROR_REVISION_MISMATCH) if it was
+	written by another engine generation, HRESULT_FROM_WIN32(ERROR_INVALID_DATA) if
+	it is damaged.
+	*/
+	virtual HRESULT WINAPI ImportVerdicts(__in LPCWSTR lpPath) = 0;
+
+	/* Write the verdicts of the scanner by content, imported ones included
+	@lpPath: path of the file, replaced once the new one is complete
+	@return: HRESULT on success, or other value on failure.
+	*/
+	virtual HRESULT WINAPI ExportVerdicts(__in LPCWSTR lpPath) = 0;
+
+	/* Read the most expensive directory trees of the scans run by this scanner
+	Only scans started with IFsEnumContext::DirectoryCosts are counted. A tree is
+	listed if files were found in its top directory or in more than one of its
+	subtrees, so a chain of directories holding a single subtree is listed once.
+	Call it when the scans are over: a running walk adds the files of a directory
+	once it moves to the next one.
+	@costs: array receiving the trees, most expensive in time first
+	@count: size of the array on input, number of trees written on output
+	@return: HRESULT on success, or other value on failure.
+	*/
+	virtual HRESULT WINAPI GetDirectoryCosts(__out_ecount_part(*count, *count) SCAN_DIRECTORY_COST * costs, __inout ULONG * count) = 0;
 	
 	END_INTERFACE
 };
\ No newline at end of file
@@ -3,11 +3,14 @@
 #include "Module/Module.h"
 #include "Scanner/ScanModule.h"
 #include "FileType/PEFile.h"
+#include "FileType/PeTriage.h"
 #include "Emulator/Emulator.h"
 #include "Module/ModuleManager.h"
 #include "Scanner/Scanner.h"
 #include "FileSystem/FsObject.h"
 #include "FileSystem/FsEnum.h"
+#include "FileSystem/FsStreamConsumer.h"
+#include "Hash/HashBatch.h"
 #include <unicorn/unicorn.h>
 
 #ifdef __cplusplus
@@ -58,3 +61,11 @@ DEFINE_GUID(CLSID_CFileFsEnumContext,
 DEFINE_GUID(CLSID_CFileFs,
 	0x2928278f, 0xce4e, 0x4263, 0x9f, 0x8c, 0x7, 0x8, 0x97, 0x96, 0x64, 0x3c);
 
+// {36A76D6F-F35F-4770-BC7A-8B678E135B67}
+DEFINE_GUID(CLSID_CPeTriage,
+	0x36a76d6f, 0xf35f, 0x4770, 0xbc, 0x7a, 0x8b, 0x67, 0x8e, 0x13, 0x5b, 0x67);
+
+// {3B274731-6975-4288-87DD-BA96504A2590}
+DEFINE_GUID(CLSID_CHashBatch,
+	0x3b274731, 0x6975, 0x4288, 0x87, 0xdd, 0xba, 0x96, 0x50, 0x4a, 0x25, 0x90);
+
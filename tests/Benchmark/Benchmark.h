@@ -0,0 +1,38 @@
+#pragma once
+#include <windows.h>
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+#include <TinyAvCore.h>
+
+// Milliseconds between two performance counter values
+inline double ElapsedMs(__in LARGE_INTEGER start, __in LARGE_INTEGER end)
+{
+	static LARGE_INTEGER frequency = {};
+	if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+	return (double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+}
+
+// p-th percentile (0..100) of a list of samples; the list is sorted in place
+inline double Percentile(__inout std::vector<double> & samples, __in double p)
+{
+	if (samples.empty()) return 0;
+	std::sort(samples.begin(), samples.end());
+	size_t index = (size_t)(p / 100.0 * (samples.size() - 1) + 0.5);
+	return samples[min(index, samples.size() - 1)];
+}
+
+// Replay emulation traces: emul <trace file or directory> [iterations]
+int EmulBenchmark(int argc, wchar_t* argv[]);
+
+// Latency of small files with large archives in flight: lanes [workers]
+int LanesBenchmark(int argc, wchar_t* argv[]);
+
+// Recall of the PE triage and emulations it avoids: triage <infected> [clean] [threshold]
+int TriageBenchmark(int argc, wchar_t* argv[]);
+
+// First emulation and emulators started by several threads: startup [emulators] [threads]
+int StartupBenchmark(int argc, wchar_t* argv[]);
+
+// SHA-256 engines on many small files, one by one and batched: hash [files] [size]
+int HashBenchmark(int argc, wchar_t* argv[]);
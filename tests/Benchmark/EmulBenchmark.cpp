@@ -0,0 +1,78 @@
+#include "Benchmark.h"
+#include <shlwapi.h>
+
+#define DEFAULT_ITERATIONS	(5)
+
+// Replay one trace several times and print the median and best time
+static double ReplayTrace(__in IEmulator * emulator, __in LPCWSTR lpTraceFile, __in int iterations)
+{
+	std::vector<double> samples;
+	HRESULT hr = S_OK;
+	for (int i = 0; i < iterations; i++)
+	{
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		hr = emulator->EmulateTrace(lpTraceFile);
+		QueryPerformanceCounter(&end);
+		// a failed replay did not run the recorded instructions: it is not a sample
+		if (FAILED(hr))
+			break;
+		samples.push_back(ElapsedMs(start, end));
+	}
+
+	if (samples.empty())
+	{
+		wprintf(L"%-40s failed (0x%08X)\n", PathFindFileNameW(lpTraceFile), hr);
+		return 0;
+	}
+
+	double median = Percentile(samples, 50);
+	wprintf(L"%-40s median %10.3f ms  best %10.3f ms\n", PathFindFileNameW(lpTraceFile), median, samples[0]);
+	return median;
+}
+
+int EmulBenchmark(int argc, wchar_t* argv[])
+{
+	if (argc < 1)
+	{
+		puts("usage: Benchmark.exe emul <trace file or directory> [iterations]");
+		return 1;
+	}
+
+	int iterations = (argc >= 2) ? _wtoi(argv[1]) : DEFAULT_ITERATIONS;
+	if (iterations <= 0) iterations = DEFAULT_ITERATIONS;
+
+	IEmulator * emulator = NULL;
+	if (FAILED(CreateClassObject(CLSID_CPeEmulator, 0, __uuidof(IEmulator), (LPVOID*)&emulator)))
+		return 1;
+
+	std::vector<StringW> traces;
+	if (PathIsDirectoryW(argv[0]))
+	{
+		WIN32_FIND_DATAW wfd;
+		StringW pattern = StringW(argv[0]) + L"\\*.tavt";
+		HANDLE findHandle = FindFirstFileW(pattern.c_str(), &wfd);
+		if (findHandle != INVALID_HANDLE_VALUE)
+		{
+			do
+			{
+				traces.push_back(StringW(argv[0]) + L"\\" + wfd.cFileName);
+			} while (FindNextFileW(findHandle, &wfd));
+			FindClose(findHandle);
+		}
+		// stable order, so two runs can be compared line by line
+		std::sort(traces.begin(), traces.end());
+	}
+	else
+	{
+		traces.push_back(argv[0]);
+	}
+
+	double total = 0;
+	for (size_t i = 0; i < traces.size(); i++)
+		total += ReplayTrace(emulator, traces[i].c_str(), iterations);
+	wprintf(L"%zu trace(s), sum of medians %.3f ms\n", traces.size(), total);
+
+	emulator->Release();
+	return 0;
+}
@@ -0,0 +1,88 @@
+#include "Benchmark.h"
+
+#define DEFAULT_FILES	(20000)
+#define DEFAULT_SIZE	(4096)
+
+static const wchar_t * s_engineNames[HashEngineCount] = { L"scalar", L"sha-ni", L"avx2" };
+
+// Hash every message with an engine, in one batch or one message per flush
+static HRESULT HashAll(__in IHashBatch * batch, __in const std::vector<BYTE> & data, __in int files, __in int size,
+	__in BOOL oneByOne, __out std::vector<BYTE> & digests, __out double * elapsedMs)
+{
+	HRESULT hr = S_OK;
+	LARGE_INTEGER start, end;
+	digests.assign((size_t)files * SHA256_DIGEST_SIZE, 0);
+
+	QueryPerformanceCounter(&start);
+	for (int i = 0; i < files && SUCCEEDED(hr); i++)
+	{
+		hr = batch->Add(&data[(size_t)i * size], size, &digests[(size_t)i * SHA256_DIGEST_SIZE]);
+		if (SUCCEEDED(hr) && oneByOne) hr = batch->Flush();
+	}
+	if (SUCCEEDED(hr)) hr = batch->Flush();
+	QueryPerformanceCounter(&end);
+
+	*elapsedMs = ElapsedMs(start, end);
+	return hr;
+}
+
+// Throughput of each hashing engine on many small in-memory files, hashed
+// one by one and as a batch
+int HashBenchmark(int argc, wchar_t* argv[])
+{
+	int files = (argc >= 1) ? _wtoi(argv[0]) : DEFAULT_FILES;
+	int size = (argc >= 2) ? _wtoi(argv[1]) : DEFAULT_SIZE;
+	if (files <= 0) files = DEFAULT_FILES;
+	if (size <= 0) size = DEFAULT_SIZE;
+
+	std::vector<BYTE> data((size_t)files * size);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (BYTE)(i * 31 + i / 4093);
+
+	IHashBatch * batch = NULL;
+	HRESULT hr = CreateClassObject(CLSID_CHashBatch, 0, __uuidof(IHashBatch), (LPVOID*)&batch);
+	if (FAILED(hr))
+	{
+		wprintf(L"no hash batch (0x%08X)\n", hr);
+		return 1;
+	}
+	wprintf(L"default engine: %s\n", s_engineNames[batch->GetEngine()]);
+
+	std::vector<BYTE> reference, digests;
+	double megabytes = (double)data.size() / (1024.0 * 1024.0);
+	int mismatches = 0;
+
+	for (int engine = HashEngineScalar; engine < HashEngineCount; engine++)
+	{
+		if (FAILED(batch->SetEngine((HashEngine)engine)))
+		{
+			wprintf(L"%-8s not supported by this CPU\n", s_engineNames[engine]);
+			continue;
+		}
+
+		for (int oneByOne = 1; oneByOne >= 0; oneByOne--)
+		{
+			double elapsed = 0;
+			hr = HashAll(batch, data, files, size, oneByOne, digests, &elapsed);
+			if (FAILED(hr))
+			{
+				wprintf(L"%-8s failed (0x%08X)\n", s_engineNames[engine], hr);
+				mismatches++;
+				continue;
+			}
+
+			// every engine gives the digests of the scalar one
+			if (reference.empty())
+				reference = digests;
+			else if (digests != reference)
+				mismatches++;
+
+			wprintf(L"%-8s %-12s %10.3f ms %10.1f MB/s\n", s_engineNames[engine],
+				oneByOne ? L"one by one" : L"batch", elapsed, elapsed > 0 ? megabytes * 1000.0 / elapsed : 0);
+		}
+	}
+
+	batch->Release();
+	wprintf(L"%d file(s) of %d bytes, %d mismatch(es)\n", files, size, mismatches);
+	return mismatches ? 1 : 0;
+}
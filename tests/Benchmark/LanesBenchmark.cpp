@@ -0,0 +1,324 @@
+#include "Benchmark.h"
+#include <map>
+#include <shlwapi.h>
+#include "../TinyAvCore/Scanner/ScanDispatcher.h"
+
+#define TINY_FILES			(2000)
+#define TINY_FILE_BYTES		(4 * 1024)
+#define ARCHIVE_FILES		(8)
+#define ARCHIVE_FILE_BYTES	(64 * 1024 * 1024)
+#define HASH_ROUNDS			(4)		// scan cost of a byte
+#define DEFAULT_WORKERS		(4)
+
+// A scan module whose cost grows with the size of the file: it reads the
+// whole file and hashes it a few times. The dispatcher creates its workers'
+// instances through CreateModuleObject, exported by this executable.
+class CBenchModule :
+	public CRefCount,
+	public IScanModule
+{
+protected:
+	volatile UINT32 m_hash;		// keeps the hashing from being optimized away
+
+	virtual ~CBenchModule() {}
+
+public:
+	CBenchModule() : m_hash(0) {}
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out void **ppvObject)
+	{
+		if (ppvObject == NULL) return E_INVALIDARG;
+		if (IsEqualIID(riid, IID_IUnknown) ||
+			IsEqualIID(riid, __uuidof(IModule)) ||
+			IsEqualIID(riid, __uuidof(IScanModule)))
+		{
+			*ppvObject = static_cast<IScanModule*>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppvObject = NULL;
+		return E_NOINTERFACE;
+	}
+
+	virtual HRESULT WINAPI GetModuleInfo(__out MODULE_INFO * scanInfo) override
+	{
+		if (scanInfo == NULL) return E_INVALIDARG;
+		scanInfo->type = ScanModule;
+		wcscpy_s(scanInfo->name, L"Benchmark");
+		scanInfo->handle = GetModuleHandleW(NULL);
+		scanInfo->version = 1;
+		return S_OK;
+	}
+
+	virtual ModuleType WINAPI GetType(void) override { return ScanModule; }
+
+	virtual HRESULT WINAPI GetName(__out BSTR *name) override
+	{
+		if (name == NULL) return E_INVALIDARG;
+		*name = SysAllocString(L"Benchmark");
+		return *name ? S_OK : E_OUTOFMEMORY;
+	}
+
+	virtual HRESULT WINAPI OnScanInitialize(void) override { return S_OK; }
+
+	virtual HRESULT WINAPI Scan(__in IVirtualFs * file, __in IFsEnumContext * context, __in IScanObserver * observer) override
+	{
+		UNREFERENCED_PARAMETER(context);
+		UNREFERENCED_PARAMETER(observer);
+		IFsStream * stream = NULL;
+		if (FAILED(file->QueryInterface(__uuidof(IFsStream), (LPVOID*)&stream)))
+			return E_NOINTERFACE;
+
+		BYTE buffer[16 * 1024];
+		ULONG readSize = 0;
+		UINT32 hash = 2166136261u;
+		while (SUCCEEDED(stream->Read(buffer, sizeof(buffer), &readSize)) && readSize)
+		{
+			for (int round = 0; round < HASH_ROUNDS; round++)
+			{
+				for (ULONG i = 0; i < readSize; i++)
+					hash = (hash ^ buffer[i]) * 16777619u;
+			}
+		}
+		stream->Release();
+		m_hash = hash;
+		return S_OK;
+	}
+
+	virtual HRESULT WINAPI OnScanShutdown(void) override { return S_OK; }
+};
+
+extern "C" HRESULT WINAPI CreateModuleObject(__in REFCLSID rclsid, __in DWORD dwClsContext, __in REFIID riid, __out LPVOID *ppv)
+{
+	UNREFERENCED_PARAMETER(rclsid);
+	UNREFERENCED_PARAMETER(dwClsContext);
+	if (ppv == NULL) return E_INVALIDARG;
+
+	if (IsEqualIID(riid, __uuidof(IModule)))
+	{
+		*ppv = static_cast<IModule*>(new CBenchModule());
+		return S_OK;
+	}
+	return E_NOINTERFACE;
+}
+
+// Measures the time from submission to the end of the scan of each file
+class CLatencyObserver :
+	public CRefCount,
+	public IScanObserver
+{
+protected:
+	SRWLOCK m_lock;
+	std::map<StringW, LARGE_INTEGER> m_submitted;
+	std::vector<double> m_tinyLatency;
+
+	virtual ~CLatencyObserver() {}
+
+public:
+	CLatencyObserver() { InitializeSRWLock(&m_lock); }
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out void **ppvObject)
+	{
+		if (ppvObject == NULL) return E_INVALIDARG;
+		if (IsEqualIID(riid, IID_IUnknown) || IsEqualIID(riid, __uuidof(IScanObserver)))
+		{
+			*ppvObject = static_cast<IScanObserver*>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppvObject = NULL;
+		return E_NOINTERFACE;
+	}
+
+	void Submitted(__in const StringW & path)
+	{
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		AcquireSRWLockExclusive(&m_lock);
+		m_submitted[path] = now;
+		ReleaseSRWLockExclusive(&m_lock);
+	}
+
+	std::vector<double> & TinyLatency(void) { return m_tinyLatency; }
+
+	virtual HRESULT WINAPI OnAllScanFinished(__in IVirtualFs * file, __in IFsEnumContext * context) override
+	{
+		UNREFERENCED_PARAMETER(context);
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		BSTR fullPath = NULL;
+		if (FAILED(file->GetFullPath(&fullPath))) return S_OK;
+
+		AcquireSRWLockExclusive(&m_lock);
+		std::map<StringW, LARGE_INTEGER>::iterator it = m_submitted.find(fullPath);
+		if (it != m_submitted.end() && _wcsicmp(PathFindExtensionW(fullPath), L".js") == 0)
+			m_tinyLatency.push_back(ElapsedMs(it->second, now));
+		ReleaseSRWLockExclusive(&m_lock);
+		SysFreeString(fullPath);
+		return S_OK;
+	}
+
+	virtual HRESULT WINAPI OnScanStarted(__in IFsEnumContext * context) override { UNREFERENCED_PARAMETER(context); return S_OK; }
+	virtual HRESULT WINAPI OnScanPaused(__in IFsEnumContext * context) override { UNREFERENCED_PARAMETER(context); return S_OK; }
+	virtual HRESULT WINAPI OnScanResumed(__in IFsEnumContext * context) override { UNREFERENCED_PARAMETER(context); return S_OK; }
+	virtual HRESULT WINAPI OnScanStopping(__in IFsEnumContext * context) override { UNREFERENCED_PARAMETER(context); return S_OK; }
+	virtual HRESULT WINAPI OnPreScan(__in IVirtualFs * file, __in IFsEnumContext * context) override
+	{
+		UNREFERENCED_PARAMETER(file);
+		UNREFERENCED_PARAMETER(context);
+		return S_OK;
+	}
+	virtual HRESULT WINAPI OnPreClean(__in IVirtualFs * file, __in IFsEnumContext * context, __inout SCAN_RESULT * result) override
+	{
+		UNREFERENCED_PARAMETER(file);
+		UNREFERENCED_PARAMETER(context);
+		UNREFERENCED_PARAMETER(result);
+		return S_OK;
+	}
+	virtual HRESULT WINAPI OnPostClean(__in IVirtualFs * file, __in IFsEnumContext * context, __in SCAN_RESULT * result) override
+	{
+		UNREFERENCED_PARAMETER(file);
+		UNREFERENCED_PARAMETER(context);
+		UNREFERENCED_PARAMETER(result);
+		return S_OK;
+	}
+	virtual void WINAPI OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR lpMessage = NULL) override
+	{
+		UNREFERENCED_PARAMETER(dwErrorCode);
+		UNREFERENCED_PARAMETER(lpMessage);
+	}
+};
+
+static BOOL WriteSampleFile(__in const StringW & path, __in ULONGLONG size)
+{
+	HANDLE hFile = CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+	static BYTE block[64 * 1024];
+	for (size_t i = 0; i < sizeof(block); i++)
+		block[i] = (BYTE)(i * 31);
+
+	DWORD written;
+	BOOL ok = TRUE;
+	while (ok && size)
+	{
+		DWORD chunk = (DWORD)min(size, (ULONGLONG)sizeof(block));
+		ok = WriteFile(hFile, block, chunk, &written, NULL);
+		size -= chunk;
+	}
+	CloseHandle(hFile);
+	return ok;
+}
+
+static int s_owner;	// owner of the benchmark's jobs
+
+static SCAN_JOB MakeJob(__in const StringW & path, __in ULONGLONG size)
+{
+	SCAN_JOB job;
+	job.path = path;
+	job.searchPattern = L"*.*";
+	job.flags = IFsEnumContext::DetectOnly;
+	job.maxDepthInArchive = -1;
+	job.maxFileSize.QuadPart = ULLONG_MAX;
+	job.size = size;
+	job.owner = &s_owner;
+	job.progress = NULL;
+	job.queuedTicks.QuadPart = 0;
+	job.stamps = NULL;
+	job.costs = NULL;
+	return job;
+}
+
+// Scan the tiny files, with or without the archives in flight, and print
+// the latency of the tiny files
+static void RunCase(__in const std::vector<StringW> & tinyFiles, __in const std::vector<StringW> & archives,
+	__in ULONG workers, __in BOOL segregate, __in BOOL withArchives)
+{
+	CLatencyObserver * observer = new CLatencyObserver;
+	CBenchModule * module = new CBenchModule;
+	CScanModuleEntry * entry = new CScanModuleEntry;
+	CScanModuleSet * modules = new CScanModuleSet(1);
+	CScanDispatcher * dispatcher = new CScanDispatcher(static_cast<IScanObserver*>(observer));
+
+	HRESULT hr = entry->Initialize(static_cast<IScanModule*>(module));
+	if (SUCCEEDED(hr))
+		hr = modules->Initialize(NULL, NULL, entry);
+	if (SUCCEEDED(hr))
+		hr = dispatcher->Initialize(modules, workers, 0, segregate, NULL, NULL);
+	if (FAILED(hr))
+	{
+		wprintf(L"cannot start the workers (0x%08X)\n", hr);
+	}
+	else
+	{
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		// the archives go first, as a walk might find them
+		for (size_t i = 0; withArchives && i < archives.size(); i++)
+		{
+			observer->Submitted(archives[i]);
+			dispatcher->Dispatch(MakeJob(archives[i], ARCHIVE_FILE_BYTES));
+		}
+		for (size_t i = 0; i < tinyFiles.size(); i++)
+		{
+			observer->Submitted(tinyFiles[i]);
+			dispatcher->Dispatch(MakeJob(tinyFiles[i], TINY_FILE_BYTES));
+		}
+		dispatcher->Drain(&s_owner);
+		QueryPerformanceCounter(&end);
+
+		std::vector<double> & latency = observer->TinyLatency();
+		double p50 = Percentile(latency, 50);
+		double p99 = Percentile(latency, 99);
+		wprintf(L"%-8s %-9s tiny p50 %10.3f ms  p99 %10.3f ms  total %10.3f ms\n",
+			segregate ? L"lanes" : L"shared", withArchives ? L"archives" : L"alone", p50, p99, ElapsedMs(start, end));
+	}
+
+	dispatcher->Release();
+	modules->Release();
+	entry->Release();
+	module->Release();
+	observer->Release();
+}
+
+int LanesBenchmark(int argc, wchar_t* argv[])
+{
+	ULONG workers = (argc >= 1) ? (ULONG)_wtoi(argv[0]) : DEFAULT_WORKERS;
+	if (workers == 0) workers = DEFAULT_WORKERS;
+
+	WCHAR szTempDir[MAX_PATH];
+	GetTempPathW(MAX_PATH, szTempDir);
+	PathAppendW(szTempDir, L"TinyAvLanes");
+	CreateDirectoryW(szTempDir, NULL);
+
+	std::vector<StringW> tinyFiles, archives;
+	WCHAR szName[32];
+	for (int i = 0; i < TINY_FILES; i++)
+	{
+		swprintf_s(szName, L"\\script%04d.js", i);
+		tinyFiles.push_back(StringW(szTempDir) + szName);
+		if (!WriteSampleFile(tinyFiles.back(), TINY_FILE_BYTES)) return 1;
+	}
+	for (int i = 0; i < ARCHIVE_FILES; i++)
+	{
+		swprintf_s(szName, L"\\bundle%02d.zip", i);
+		archives.push_back(StringW(szTempDir) + szName);
+		if (!WriteSampleFile(archives.back(), ARCHIVE_FILE_BYTES)) return 1;
+	}
+
+	wprintf(L"%u worker(s), %d tiny file(s), %d archive(s) of %d MB\n",
+		workers, TINY_FILES, ARCHIVE_FILES, ARCHIVE_FILE_BYTES / (1024 * 1024));
+	RunCase(tinyFiles, archives, workers, FALSE, FALSE);
+	RunCase(tinyFiles, archives, workers, FALSE, TRUE);
+	RunCase(tinyFiles, archives, workers, TRUE, FALSE);
+	RunCase(tinyFiles, archives, workers, TRUE, TRUE);
+
+	for (size_t i = 0; i < tinyFiles.size(); i++) DeleteFileW(tinyFiles[i].c_str());
+	for (size_t i = 0; i < archives.size(); i++) DeleteFileW(archives[i].c_str());
+	RemoveDirectoryW(szTempDir);
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include "Benchmark.h"
+
+#define DEFAULT_EMULATORS	(200)
+#define DEFAULT_THREADS		(4)
+#define CODE_BASE			(0x400000)
+#define STACK_SIZE			(0x10000)
+
+// a few nops, so the time is the one of starting an emulation
+static BYTE s_code[] = { 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90 };
+
+typedef struct STARTUP_THREAD
+{
+	int						emulators;
+	std::vector<double>		samples;	// creation and first emulation, in ms
+	int						failures;
+}STARTUP_THREAD;
+
+// Create an emulator, run its first emulation and destroy it
+static HRESULT StartEmulator(__out double * elapsedMs)
+{
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+
+	IEmulator * emulator = NULL;
+	HRESULT hr = CreateClassObject(CLSID_CPeEmulator, 0, __uuidof(IEmulator), (LPVOID*)&emulator);
+	if (FAILED(hr)) return hr;
+	hr = emulator->EmulateCode(s_code, sizeof(s_code), CODE_BASE, STACK_SIZE, STACK_SIZE, CODE_BASE, sizeof(s_code));
+	emulator->Release();
+
+	QueryPerformanceCounter(&end);
+	*elapsedMs = ElapsedMs(start, end);
+	return hr;
+}
+
+static DWORD WINAPI StartupThread(__in LPVOID lpParameter)
+{
+	STARTUP_THREAD * thread = (STARTUP_THREAD*)lpParameter;
+	for (int i = 0; i < thread->emulators; i++)
+	{
+		double elapsed = 0;
+		if (FAILED(StartEmulator(&elapsed)))
+			thread->failures++;
+		else
+			thread->samples.push_back(elapsed);
+	}
+	return 0;
+}
+
+// Cost of the first emulation, which loads the engine, and of emulators
+// created and destroyed by several threads at once
+int StartupBenchmark(int argc, wchar_t* argv[])
+{
+	int emulators = (argc >= 1) ? _wtoi(argv[0]) : DEFAULT_EMULATORS;
+	int threads = (argc >= 2) ? _wtoi(argv[1]) : DEFAULT_THREADS;
+	if (emulators <= 0) emulators = DEFAULT_EMULATORS;
+	if (threads <= 0 || threads > MAXIMUM_WAIT_OBJECTS) threads = DEFAULT_THREADS;
+
+	double first = 0;
+	HRESULT hr = StartEmulator(&first);
+	if (FAILED(hr))
+	{
+		wprintf(L"first emulation failed (0x%08X)\n", hr);
+		return 1;
+	}
+	wprintf(L"%-40s %10.3f ms\n", L"first emulation (engine load)", first);
+
+	std::vector<STARTUP_THREAD> params(threads);
+	std::vector<HANDLE> handles;
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	for (int i = 0; i < threads; i++)
+	{
+		params[i].emulators = emulators;
+		params[i].failures = 0;
+		HANDLE hThread = CreateThread(NULL, 0, StartupThread, &params[i], 0, NULL);
+		if (hThread) handles.push_back(hThread);
+	}
+	WaitForMultipleObjects((DWORD)handles.size(), &handles[0], TRUE, INFINITE);
+	QueryPerformanceCounter(&end);
+
+	std::vector<double> samples;
+	int failures = 0;
+	for (size_t i = 0; i < handles.size(); i++)
+	{
+		CloseHandle(handles[i]);
+		samples.insert(samples.end(), params[i].samples.begin(), params[i].samples.end());
+		failures += params[i].failures;
+	}
+
+	double p50 = Percentile(samples, 50);
+	double p99 = Percentile(samples, 99);
+	wprintf(L"%-40s median %10.3f ms  p99 %10.3f ms\n", L"later emulations", p50, p99);
+	wprintf(L"%zu thread(s), %zu emulator(s) in %.3f ms, %d failure(s)\n",
+		handles.size(), samples.size(), ElapsedMs(start, end), failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,95 @@
+#include "Benchmark.h"
+#include <shlwapi.h>
+
+typedef struct TRIAGE_COUNTS
+{
+	ULONG	files;			// PE files classified
+	ULONG	suspicious;
+	double	totalMs;
+}TRIAGE_COUNTS;
+
+// Classify the PE files of a directory tree
+static void TriageDirectory(__in IPeFile * parser, __in IPeTriage * triage, __in const StringW & directory,
+	__in BOOL verbose, __inout TRIAGE_COUNTS * counts)
+{
+	WIN32_FIND_DATAW wfd;
+	StringW pattern = directory + L"\\*";
+	HANDLE findHandle = FindFirstFileW(pattern.c_str(), &wfd);
+	if (findHandle == INVALID_HANDLE_VALUE) return;
+
+	do
+	{
+		if (wcscmp(wfd.cFileName, L".") == 0 || wcscmp(wfd.cFileName, L"..") == 0) continue;
+		StringW path = directory + L"\\" + wfd.cFileName;
+		if (TEST_FLAG(wfd.dwFileAttributes, FILE_ATTRIBUTE_DIRECTORY))
+		{
+			TriageDirectory(parser, triage, path, verbose, counts);
+			continue;
+		}
+
+		IVirtualFs * file = NULL;
+		if (FAILED(CreateClassObject(CLSID_CFileFs, 0, __uuidof(IVirtualFs), (LPVOID*)&file))) continue;
+		BOOL isMatched = FALSE;
+		if (SUCCEEDED(file->Create(path.c_str(), IVirtualFs::fsRead | IVirtualFs::fsSharedRead | IVirtualFs::fsOpenExisting)) &&
+			SUCCEEDED(parser->CheckType(file, &isMatched)) && isMatched)
+		{
+			PE_TRIAGE_RESULT result;
+			LARGE_INTEGER start, end;
+			QueryPerformanceCounter(&start);
+			HRESULT hr = triage->Classify(parser, &result);
+			QueryPerformanceCounter(&end);
+			if (SUCCEEDED(hr))
+			{
+				counts->files++;
+				counts->totalMs += ElapsedMs(start, end);
+				if (result.suspicious) counts->suspicious++;
+				if (verbose && !result.suspicious)
+					wprintf(L"missed %7.3f  %s\n", result.score, path.c_str());
+			}
+			parser->ReleaseCurrentFile();
+		}
+		file->Release();
+	} while (FindNextFileW(findHandle, &wfd));
+	FindClose(findHandle);
+}
+
+int TriageBenchmark(int argc, wchar_t* argv[])
+{
+	if (argc < 1)
+	{
+		puts("usage: Benchmark.exe triage <infected directory> [clean directory] [threshold]");
+		return 1;
+	}
+
+	IPeFile * parser = NULL;
+	IPeTriage * triage = NULL;
+	if (FAILED(CreateClassObject(CLSID_CPeFileParser, 0, __uuidof(IPeFile), (LPVOID*)&parser)))
+		return 1;
+	if (FAILED(CreateClassObject(CLSID_CPeTriage, 0, __uuidof(IPeTriage), (LPVOID*)&triage)))
+	{
+		parser->Release();
+		return 1;
+	}
+	if (argc >= 3) triage->SetThreshold(_wtof(argv[2]));
+
+	// every infected file the triage lets through is a missed detection
+	TRIAGE_COUNTS infected = {};
+	TriageDirectory(parser, triage, argv[0], TRUE, &infected);
+	wprintf(L"infected: %lu PE file(s), recall %.2f%%, %.3f ms per file\n", infected.files,
+		infected.files ? 100.0 * infected.suspicious / infected.files : 0.0,
+		infected.files ? infected.totalMs / infected.files : 0.0);
+
+	if (argc >= 2)
+	{
+		TRIAGE_COUNTS clean = {};
+		TriageDirectory(parser, triage, argv[1], FALSE, &clean);
+		wprintf(L"clean:    %lu PE file(s), emulations avoided %.2f%%, %.3f ms per file\n", clean.files,
+			clean.files ? 100.0 * (clean.files - clean.suspicious) / clean.files : 0.0,
+			clean.files ? clean.totalMs / clean.files : 0.0);
+	}
+	wprintf(L"threshold %.3f\n", triage->GetThreshold());
+
+	triage->Release();
+	parser->Release();
+	return 0;
+}
@@ -0,0 +1,27 @@
+#include "Benchmark.h"
+#pragma comment(lib, "TinyAvCore.lib" )
+#include <shlwapi.h>
+#pragma comment(lib, "shlwapi.lib" )
+
+// Stable, file-free performance checks. Each benchmark prints one line per
+// case and a total, so runs before and after a change can be diffed.
+int wmain(int argc, wchar_t* argv[])
+{
+	if (argc >= 2 && _wcsicmp(argv[1], L"emul") == 0)
+		return EmulBenchmark(argc - 2, argv + 2);
+	if (argc >= 2 && _wcsicmp(argv[1], L"lanes") == 0)
+		return LanesBenchmark(argc - 2, argv + 2);
+	if (argc >= 2 && _wcsicmp(argv[1], L"triage") == 0)
+		return TriageBenchmark(argc - 2, argv + 2);
+	if (argc >= 2 && _wcsicmp(argv[1], L"startup") == 0)
+		return StartupBenchmark(argc - 2, argv + 2);
+	if (argc >= 2 && _wcsicmp(argv[1], L"hash") == 0)
+		return HashBenchmark(argc - 2, argv + 2);
+
+	puts("usage: Benchmark.exe emul <trace file or directory> [iterations]");
+	puts("       Benchmark.exe lanes [workers]");
+	puts("       Benchmark.exe triage <infected directory> [clean directory] [threshold]");
+	puts("       Benchmark.exe startup [emulators per thread] [threads]");
+	puts("       Benchmark.exe hash [files] [file size]");
+	return 1;
+}
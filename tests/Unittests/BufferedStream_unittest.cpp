@@ -0,0 +1,125 @@
+#include <gtest/gtest.h>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/FileSystem/BufferedStream.h"
+
+static std::vector<BYTE> MakeContent(__in size_t size)
+{
+	std::vector<BYTE> content(size);
+	for (size_t i = 0; i < size; i++)
+		content[i] = (BYTE)(i * 11 + i / 509);
+	return content;
+}
+
+// Write the content in pieces of growing sizes
+static void WritePieces(__in CBufferedStream * stream, __in const std::vector<BYTE> & content)
+{
+	size_t offset = 0, size = 1;
+	while (offset < content.size())
+	{
+		ULONG count = (ULONG)min(size, content.size() - offset);
+		ULONG written = 0;
+		EXPECT_EQ(S_OK, stream->Write(&content[offset], count, &written));
+		EXPECT_EQ(count, written);
+		offset += count;
+		size = size * 2 + 7;
+	}
+}
+
+static void ExpectReadAt(__in CBufferedStream * stream, __in ULONG offset, __in ULONG size, __in const std::vector<BYTE> & content)
+{
+	std::vector<BYTE> buffer(size);
+	LARGE_INTEGER position;
+	position.QuadPart = offset;
+	ULONG readSize = 0;
+	EXPECT_EQ(S_OK, stream->ReadAt(position, IFsStream::FsStreamBegin, &buffer[0], size, &readSize));
+	ASSERT_EQ(size, readSize);
+	EXPECT_EQ(0, memcmp(&buffer[0], &content[offset], size));
+}
+
+TEST(CBufferedStream, Chunks)
+{
+	std::vector<BYTE> content = MakeContent(3 * BUFFERED_CHUNK_SIZE + 123);
+	CBufferedStream * stream = new CBufferedStream();
+	WritePieces(stream, content);
+	EXPECT_GT(stream->GetChunkCount(), 1U);
+
+	// reads within a chunk and across the chunk boundaries
+	ExpectReadAt(stream, 0, (ULONG)content.size(), content);
+	ExpectReadAt(stream, 10, 20, content);
+	ExpectReadAt(stream, BUFFERED_CHUNK_SIZE - 100, BUFFERED_CHUNK_SIZE + 200, content);
+	ExpectReadAt(stream, (ULONG)content.size() - 50, 50, content);
+
+	// an overwrite across a boundary
+	BYTE patch[300];
+	memset(patch, 0xAB, sizeof(patch));
+	LARGE_INTEGER position;
+	position.QuadPart = 2 * BUFFERED_CHUNK_SIZE - 150;
+	ULONG written = 0;
+	EXPECT_EQ(S_OK, stream->WriteAt(position, IFsStream::FsStreamBegin, patch, sizeof(patch), &written));
+	EXPECT_EQ((ULONG)sizeof(patch), written);
+	memcpy(&content[(size_t)position.QuadPart], patch, sizeof(patch));
+	ExpectReadAt(stream, 0, (ULONG)content.size(), content);
+
+	stream->Release();
+}
+
+TEST(CBufferedStream, Reserve)
+{
+	std::vector<BYTE> content = MakeContent(5 * BUFFERED_CHUNK_SIZE + 1);
+	CBufferedStream * stream = new CBufferedStream();
+	EXPECT_EQ(S_OK, stream->Reserve(content.size()));
+	EXPECT_EQ(1U, stream->GetChunkCount());
+
+	// the declared size holds every write
+	WritePieces(stream, content);
+	EXPECT_EQ(1U, stream->GetChunkCount());
+	ExpectReadAt(stream, 0, (ULONG)content.size(), content);
+
+	// a second reservation does nothing, a member larger than declared grows
+	EXPECT_EQ(S_FALSE, stream->Reserve(content.size() * 2));
+	BYTE more[100];
+	memset(more, 0x5A, sizeof(more));
+	ULONG written = 0;
+	EXPECT_EQ(S_OK, stream->Write(more, sizeof(more), &written));
+	EXPECT_EQ(2U, stream->GetChunkCount());
+	content.insert(content.end(), more, more + sizeof(more));
+	ExpectReadAt(stream, 0, (ULONG)content.size(), content);
+
+	stream->Release();
+
+	// sizes that cannot be trusted are not reserved
+	stream = new CBufferedStream();
+	EXPECT_EQ(S_FALSE, stream->Reserve((ULONGLONG)BUFFERED_RESERVE_MAX + 1));
+	EXPECT_EQ(S_FALSE, stream->Reserve(0));
+	EXPECT_EQ(0U, stream->GetChunkCount());
+	stream->Release();
+}
+
+TEST(CBufferedStream, Shrink)
+{
+	std::vector<BYTE> content = MakeContent(4 * BUFFERED_CHUNK_SIZE);
+	CBufferedStream * stream = new CBufferedStream();
+	WritePieces(stream, content);
+	size_t chunks = stream->GetChunkCount();
+
+	LARGE_INTEGER position;
+	position.QuadPart = BUFFERED_CHUNK_SIZE / 2;
+	EXPECT_EQ(S_OK, stream->Seek(NULL, position, IFsStream::FsStreamBegin));
+	EXPECT_EQ(S_OK, stream->Shrink());
+	EXPECT_LT(stream->GetChunkCount(), chunks);
+
+	ULARGE_INTEGER end = {};
+	position.QuadPart = 0;
+	EXPECT_EQ(S_OK, stream->Seek(&end, position, IFsStream::FsStreamEnd));
+	EXPECT_EQ((ULONGLONG)BUFFERED_CHUNK_SIZE / 2, end.QuadPart);
+	ExpectReadAt(stream, 0, BUFFERED_CHUNK_SIZE / 2, content);
+
+	// the stream grows again from its new end
+	ULONG written = 0;
+	position.QuadPart = 0;
+	EXPECT_EQ(S_OK, stream->Seek(NULL, position, IFsStream::FsStreamEnd));
+	EXPECT_EQ(S_OK, stream->Write(&content[BUFFERED_CHUNK_SIZE / 2], 2 * BUFFERED_CHUNK_SIZE, &written));
+	ExpectReadAt(stream, 0, BUFFERED_CHUNK_SIZE / 2 + 2 * BUFFERED_CHUNK_SIZE, content);
+
+	stream->Release();
+}
@@ -0,0 +1,47 @@
+#include <gtest/gtest.h>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/FileSystem/ByteName.h"
+
+TEST(CByteName, Assign)
+{
+	CByteName name;
+	EXPECT_TRUE(name.empty());
+	EXPECT_STREQ("", name.c_str());
+
+	BYTE_NAME_VIEW view = { "dir/file.exe", 12 };
+	EXPECT_EQ(S_OK, name.Assign(view));
+	EXPECT_EQ(12UL, name.length());
+	EXPECT_STREQ("dir/file.exe", name.c_str());
+	EXPECT_EQ((ULONG)BYTE_NAME_INLINE_SIZE, name.Capacity());
+
+	// a long name moves to the heap
+	StringA longName(1000, 'a');
+	view.data = longName.c_str();
+	view.length = (ULONG)longName.length();
+	EXPECT_EQ(S_OK, name.Assign(view));
+	EXPECT_EQ(1000UL, name.length());
+	EXPECT_EQ(longName, StringA(name.c_str()));
+
+	name.Clear();
+	EXPECT_TRUE(name.empty());
+}
+
+TEST(CByteName, ToUnicode)
+{
+	StringW str;
+	BYTE_NAME_VIEW view = { "\xC3\xA9t\xC3\xA9.txt", 10 };
+	EXPECT_EQ(S_OK, CByteName::ToUnicode(view, CP_UTF8, &str));
+	EXPECT_EQ(StringW(L"\x00E9t\x00E9.txt"), str);
+
+	// not UTF-8
+	view.data = "\x82t\x82.txt";
+	view.length = 8;
+	EXPECT_TRUE(FAILED(CByteName::ToUnicode(view, CP_UTF8, &str)));
+	EXPECT_TRUE(str.empty());
+	EXPECT_EQ(S_OK, CByteName::ToUnicode(view, CP_UTF8, &str, FALSE));
+	EXPECT_EQ(StringW(L"\xFFFDt\xFFFD.txt"), str);
+
+	view.length = 0;
+	EXPECT_EQ(S_OK, CByteName::ToUnicode(view, CP_UTF8, &str));
+	EXPECT_TRUE(str.empty());
+}
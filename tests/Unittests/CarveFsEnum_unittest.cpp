@@ -0,0 +1,460 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <vector>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/FileSystem/FileFsEnumContext.h"
+#include "../TinyAvCore/FileSystem/FileFsEnum.h"
+#include "../TinyAvCore/FileSystem/FileFs.h"
+#include "../TinyAvCore/FileSystem/carve/CarveFsEnum.h"
+#include "../TinyAvCore/FileSystem/zip/ZipFsEnum.h"
+
+#define CARVE_TEST_FILL		(0xCC)
+#define CARVE_TEST_PE_SIZE	(0x400)
+
+// A file reported by the carver
+typedef struct CARVED_FILE
+{
+	ULONGLONG	offset;		// in the container, from the name of the file
+	ULONGLONG	size;
+	int			depth;
+	int			depthInArchive;
+}CARVED_FILE;
+
+class CCarveEnumObserver
+	: public CRefCount
+	, public IFsEnumObserver
+{
+private:
+	std::vector<CARVED_FILE> m_carved;
+	std::vector<StringW> m_names;	// of the files not carved
+	UINT m_Count;
+public:
+	CCarveEnumObserver() : m_Count(0) {}
+	virtual ~CCarveEnumObserver() {}
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __in void **ppvObject)
+	{
+		if (ppvObject == NULL) return E_INVALIDARG;
+		if (IsEqualIID(riid, IID_IUnknown) ||
+			IsEqualIID(riid, __uuidof(IFsEnumObserver))
+			)
+		{
+			*ppvObject = static_cast<IFsEnumObserver*>(this);
+			AddRef();
+			return S_OK;
+		}
+		else
+		{
+			*ppvObject = NULL;
+		}
+		return E_NOINTERFACE;
+	}
+	DECLARE_REF_COUNT();
+
+	// files reported, carved or not
+	UINT GetFileCount(void)
+	{
+		return m_Count;
+	}
+
+	const std::vector<CARVED_FILE> & GetCarved(void)
+	{
+		return m_carved;
+	}
+
+	// TRUE if a file not carved has this name
+	BOOL IsFound(__in LPCWSTR lpFileName)
+	{
+		for (size_t i = 0; i < m_names.size(); i++)
+		{
+			if (0 == _wcsicmp(m_names[i].c_str(), lpFileName)) return TRUE;
+		}
+		return FALSE;
+	}
+
+	virtual HRESULT WINAPI OnFileFound(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int currentDepth) override
+	{
+		m_Count++;
+		BSTR lpFullPath = NULL;
+		if (FAILED(file->GetFullPath(&lpFullPath))) return S_OK;
+		LPCWSTR lpName = wcsrchr(lpFullPath, L'@');
+		if (lpName)
+		{
+			CARVED_FILE carved = {};
+			carved.offset = wcstoull(lpName + 1, NULL, 16);
+			carved.depth = currentDepth;
+			carved.depthInArchive = context->GetDepthInArchive();
+			IFsAttribute * attribute = NULL;
+			ULARGE_INTEGER size = {};
+			if (SUCCEEDED(file->QueryInterface(__uuidof(IFsAttribute), (LPVOID*)&attribute)))
+			{
+				if (SUCCEEDED(attribute->Size(&size)))
+					carved.size = size.QuadPart;
+				attribute->Release();
+			}
+			m_carved.push_back(carved);
+		}
+		else
+		{
+			LPCWSTR lpSeparator = wcsrchr(lpFullPath, L'\\');
+			m_names.push_back(lpSeparator ? lpSeparator + 1 : lpFullPath);
+		}
+		SysFreeString(lpFullPath);
+		return S_OK;
+	}
+
+	virtual void WINAPI OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR lpMessage = NULL) override
+	{
+		UNREFERENCED_PARAMETER(dwErrorCode);
+		UNREFERENCED_PARAMETER(lpMessage);
+	}
+};
+
+// Write the smallest image the PE parser accepts: the headers and one section
+static void PutImage(__inout std::vector<BYTE> & data, __in size_t offset)
+{
+	if (data.size() < offset + CARVE_TEST_PE_SIZE)
+		data.resize(offset + CARVE_TEST_PE_SIZE, CARVE_TEST_FILL);
+	BYTE * image = &data[offset];
+	ZeroMemory(image, CARVE_TEST_PE_SIZE);
+
+	IMAGE_DOS_HEADER * dosHeader = (IMAGE_DOS_HEADER*)image;
+	dosHeader->e_magic = IMAGE_DOS_SIGNATURE;
+	dosHeader->e_lfanew = sizeof(IMAGE_DOS_HEADER);
+
+	IMAGE_NT_HEADERS32 * peHeader = (IMAGE_NT_HEADERS32*)(image + dosHeader->e_lfanew);
+	peHeader->Signature = IMAGE_NT_SIGNATURE;
+	peHeader->FileHeader.Machine = IMAGE_FILE_MACHINE_I386;
+	peHeader->FileHeader.NumberOfSections = 1;
+	peHeader->FileHeader.SizeOfOptionalHeader = sizeof(IMAGE_OPTIONAL_HEADER32);
+	peHeader->FileHeader.Characteristics = IMAGE_FILE_EXECUTABLE_IMAGE | IMAGE_FILE_32BIT_MACHINE;
+	peHeader->OptionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR32_MAGIC;
+	peHeader->OptionalHeader.AddressOfEntryPoint = 0x1000;
+	peHeader->OptionalHeader.ImageBase = 0x400000;
+	peHeader->OptionalHeader.SectionAlignment = 0x1000;
+	peHeader->OptionalHeader.FileAlignment = 0x200;
+	peHeader->OptionalHeader.SizeOfImage = 0x2000;
+	peHeader->OptionalHeader.SizeOfHeaders = 0x200;
+	peHeader->OptionalHeader.SizeOfStackReserve = 0x100000;
+	peHeader->OptionalHeader.SizeOfStackCommit = 0x1000;
+
+	IMAGE_SECTION_HEADER * section = IMAGE_FIRST_SECTION(peHeader);
+	memcpy(section->Name, ".text", 5);
+	section->Misc.VirtualSize = 0x1000;
+	section->VirtualAddress = 0x1000;
+	section->SizeOfRawData = 0x200;
+	section->PointerToRawData = 0x200;
+	section->Characteristics = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ;
+	image[0x200] = 0xC3;	// ret
+}
+
+static void PutU16(__inout std::vector<BYTE> & data, __in WORD value)
+{
+	data.push_back((BYTE)value);
+	data.push_back((BYTE)(value >> 8));
+}
+
+static void PutU32(__inout std::vector<BYTE> & data, __in DWORD value)
+{
+	PutU16(data, (WORD)value);
+	PutU16(data, (WORD)(value >> 16));
+}
+
+static DWORD Crc32(__in const std::vector<BYTE> & data)
+{
+	DWORD crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < data.size(); i++)
+	{
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+	}
+	return ~crc;
+}
+
+// Write a zip archive holding one stored member
+static void PutZip(__inout std::vector<BYTE> & data, __in LPCSTR lpName, __in const std::vector<BYTE> & content)
+{
+	WORD nameLength = (WORD)strlen(lpName);
+	DWORD crc = Crc32(content);
+	data.clear();
+
+	// local file header
+	PutU32(data, 0x04034B50);
+	PutU16(data, 20);				// version needed
+	PutU16(data, 0);				// flags
+	PutU16(data, 0);				// stored
+	PutU32(data, 0);				// time and date
+	PutU32(data, crc);
+	PutU32(data, (DWORD)content.size());
+	PutU32(data, (DWORD)content.size());
+	PutU16(data, nameLength);
+	PutU16(data, 0);				// extra field
+	data.insert(data.end(), lpName, lpName + nameLength);
+	data.insert(data.end(), content.begin(), content.end());
+
+	// central directory
+	DWORD directoryOffset = (DWORD)data.size();
+	PutU32(data, 0x02014B50);
+	PutU16(data, 20);				// version made by
+	PutU16(data, 20);				// version needed
+	PutU16(data, 0);				// flags
+	PutU16(data, 0);				// stored
+	PutU32(data, 0);				// time and date
+	PutU32(data, crc);
+	PutU32(data, (DWORD)content.size());
+	PutU32(data, (DWORD)content.size());
+	PutU16(data, nameLength);
+	PutU16(data, 0);				// extra field
+	PutU16(data, 0);				// comment
+	PutU16(data, 0);				// disk
+	PutU16(data, 0);				// internal attributes
+	PutU32(data, 0);				// external attributes
+	PutU32(data, 0);				// offset of the local header
+	data.insert(data.end(), lpName, lpName + nameLength);
+	DWORD directorySize = (DWORD)data.size() - directoryOffset;
+
+	// end of central directory
+	PutU32(data, 0x06054B50);
+	PutU16(data, 0);				// disk
+	PutU16(data, 0);				// disk of the directory
+	PutU16(data, 1);				// entries on the disk
+	PutU16(data, 1);				// entries
+	PutU32(data, directorySize);
+	PutU32(data, directoryOffset);
+	PutU16(data, 0);				// comment
+}
+
+static BOOL WriteContainer(__in const std::vector<BYTE> & data, __out_ecount(MAX_PATH) LPWSTR lpFileName)
+{
+	WCHAR szTempDir[MAX_PATH] = {};
+	if (!GetTempPathW(MAX_PATH, szTempDir) || !GetTempFileNameW(szTempDir, L"crv", 0, lpFileName))
+		return FALSE;
+	HANDLE hFile = CreateFileW(lpFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+	DWORD dwWritten = 0;
+	BOOL bResult = WriteFile(hFile, data.data(), (DWORD)data.size(), &dwWritten, NULL) && dwWritten == data.size();
+	CloseHandle(hFile);
+	return bResult;
+}
+
+/* Carve a container the way an archiver is called for a file found at a depth
+@data: content of the container
+@depth: depth of the container
+@testObj: observer of the carved files
+*/
+static HRESULT CarveContainer(__in const std::vector<BYTE> & data, __in int depth, __in CCarveEnumObserver * testObj)
+{
+	WCHAR szFile[MAX_PATH] = {};
+	if (!WriteContainer(data, szFile)) return E_FAIL;
+
+	HRESULT hr = E_OUTOFMEMORY;
+	IFsEnum * enumObj = static_cast<IFsEnum*>(new CCarveFsEnum);
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	IVirtualFs * container = static_cast<IVirtualFs*>(new CFileFs);
+	if (enumObj && enumContext && container &&
+		SUCCEEDED(hr = container->Create(szFile, IVirtualFs::fsRead)) &&
+		SUCCEEDED(hr = enumContext->SetSearchContainer(container)) &&
+		SUCCEEDED(hr = enumContext->SetFlags(IFsEnumContext::DetectOnly | IFsEnumContext::CarveImages)) &&
+		SUCCEEDED(hr = enumContext->SetMaxDepth(-1)) &&
+		SUCCEEDED(hr = enumContext->SetDepth(depth)) &&
+		SUCCEEDED(hr = enumContext->SetDepthInArchive(0)) &&
+		SUCCEEDED(hr = enumObj->AddObserver(testObj)))
+	{
+		hr = enumObj->Enum(enumContext);
+		enumObj->RemoveObserver(testObj);
+	}
+
+	if (container)
+	{
+		container->Close();
+		container->Release();
+	}
+	if (enumContext) enumContext->Release();
+	if (enumObj) enumObj->Release();
+	DeleteFileW(szFile);
+	return hr;
+}
+
+TEST(CarveFsEnum, Offset)
+{
+	// the image at offset 0 is the container itself
+	std::vector<BYTE> data;
+	PutImage(data, 0);
+	data.resize(0x1234, CARVE_TEST_FILL);
+	PutImage(data, 0x1234);
+	data.resize(data.size() + 0x100, CARVE_TEST_FILL);
+
+	CCarveEnumObserver * testObj = new CCarveEnumObserver();
+	ASSERT_HRESULT_SUCCEEDED(CarveContainer(data, 0, testObj));
+	ASSERT_EQ(1, testObj->GetCarved().size());
+	EXPECT_EQ(0x1234, testObj->GetCarved()[0].offset);
+	// the image ends with the raw data of its section
+	EXPECT_EQ(CARVE_TEST_PE_SIZE, testObj->GetCarved()[0].size);
+	testObj->Release();
+}
+
+TEST(CarveFsEnum, Truncated)
+{
+	CCarveEnumObserver * testObj = new CCarveEnumObserver();
+
+	// the headers go past the end of the container
+	std::vector<BYTE> data(0x100, CARVE_TEST_FILL);
+	PutImage(data, 0x100);
+	data.resize(0x100 + sizeof(IMAGE_DOS_HEADER) + 0x20);
+	ASSERT_HRESULT_SUCCEEDED(CarveContainer(data, 0, testObj));
+	EXPECT_EQ(0, testObj->GetFileCount());
+
+	// a pair, then a lone 'M', in the last bytes
+	data.assign(0x100, CARVE_TEST_FILL);
+	data.push_back('M');
+	data.push_back('Z');
+	ASSERT_HRESULT_SUCCEEDED(CarveContainer(data, 0, testObj));
+	data.back() = 'M';
+	ASSERT_HRESULT_SUCCEEDED(CarveContainer(data, 0, testObj));
+	EXPECT_EQ(0, testObj->GetFileCount());
+
+	// complete headers, the raw data cut short: the image ends with the container
+	data.assign(0x100, CARVE_TEST_FILL);
+	PutImage(data, 0x100);
+	data.resize(0x100 + 0x280);
+	ASSERT_HRESULT_SUCCEEDED(CarveContainer(data, 0, testObj));
+	ASSERT_EQ(1, testObj->GetCarved().size());
+	EXPECT_EQ(0x100, testObj->GetCarved()[0].offset);
+	EXPECT_EQ(0x280, testObj->GetCarved()[0].size);
+	testObj->Release();
+}
+
+TEST(CarveFsEnum, BlockBoundary)
+{
+	// Three images back to back. The 'M' of the second is the last byte of
+	// the first block, its 'Z' the first byte of the next one.
+	const size_t second = CARVE_BLOCK_SIZE - 1;
+	std::vector<BYTE> data(second - CARVE_TEST_PE_SIZE, CARVE_TEST_FILL);
+	PutImage(data, second - CARVE_TEST_PE_SIZE);
+	PutImage(data, second);
+	PutImage(data, second + CARVE_TEST_PE_SIZE);
+
+	// each is reported once, though the blocks overlap by a byte
+	CCarveEnumObserver * testObj = new CCarveEnumObserver();
+	ASSERT_HRESULT_SUCCEEDED(CarveContainer(data, 0, testObj));
+	ASSERT_EQ(3, testObj->GetCarved().size());
+	EXPECT_EQ(second - CARVE_TEST_PE_SIZE, testObj->GetCarved()[0].offset);
+	EXPECT_EQ(second, testObj->GetCarved()[1].offset);
+	EXPECT_EQ(second + CARVE_TEST_PE_SIZE, testObj->GetCarved()[2].offset);
+	for (size_t i = 0; i < testObj->GetCarved().size(); i++)
+		EXPECT_EQ(CARVE_TEST_PE_SIZE, testObj->GetCarved()[i].size);
+	testObj->Release();
+
+	// the headers of an image starting near the end of a block are read from the stream
+	data.assign(CARVE_BLOCK_SIZE - 0x20, CARVE_TEST_FILL);
+	PutImage(data, CARVE_BLOCK_SIZE - 0x20);
+	testObj = new CCarveEnumObserver();
+	ASSERT_HRESULT_SUCCEEDED(CarveContainer(data, 0, testObj));
+	ASSERT_EQ(1, testObj->GetCarved().size());
+	EXPECT_EQ(CARVE_BLOCK_SIZE - 0x20, testObj->GetCarved()[0].offset);
+	testObj->Release();
+}
+
+TEST(CarveFsEnum, Depth)
+{
+	std::vector<BYTE> data(0x200, CARVE_TEST_FILL);
+	PutImage(data, 0x200);
+
+	// one level below the container, one archive level deeper
+	CCarveEnumObserver * testObj = new CCarveEnumObserver();
+	ASSERT_HRESULT_SUCCEEDED(CarveContainer(data, 3, testObj));
+	ASSERT_EQ(1, testObj->GetCarved().size());
+	EXPECT_EQ(4, testObj->GetCarved()[0].depth);
+	EXPECT_EQ(1, testObj->GetCarved()[0].depthInArchive);
+	testObj->Release();
+
+	// through a walk: the carver is called as an archiver of the file found
+	WCHAR szFile[MAX_PATH] = {};
+	ASSERT_TRUE(WriteContainer(data, szFile));
+	for (int maxDepthInArchive = 0; maxDepthInArchive <= 1; maxDepthInArchive++)
+	{
+		IFsEnum * enumObj = static_cast<IFsEnum*>(new CFileFsEnum);
+		IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+		IFsEnum * carver = static_cast<IFsEnum*>(new CCarveFsEnum);
+		IVirtualFs * container = static_cast<IVirtualFs*>(new CFileFs);
+		testObj = new CCarveEnumObserver();
+
+		EXPECT_HRESULT_SUCCEEDED(enumContext->SetMaxDepth(-1));
+		EXPECT_HRESULT_SUCCEEDED(enumContext->SetMaxDepthInArchive(maxDepthInArchive));
+		EXPECT_HRESULT_SUCCEEDED(enumContext->SetSearchPattern(L"*.*"));
+		EXPECT_HRESULT_SUCCEEDED(container->Create(szFile, 0));
+		EXPECT_HRESULT_SUCCEEDED(enumContext->SetSearchContainer(container));
+		EXPECT_HRESULT_SUCCEEDED(enumContext->SetFlags(IFsEnumContext::DetectOnly | IFsEnumContext::CarveImages));
+		EXPECT_HRESULT_SUCCEEDED(enumObj->AddObserver(testObj));
+		EXPECT_HRESULT_SUCCEEDED(enumObj->AddArchiver(carver));
+		EXPECT_HRESULT_SUCCEEDED(enumObj->Enum(enumContext));
+
+		// the container, and the image only when an archive level is allowed
+		EXPECT_EQ((UINT)(1 + maxDepthInArchive), testObj->GetFileCount());
+		EXPECT_EQ((size_t)maxDepthInArchive, testObj->GetCarved().size());
+		if (testObj->GetCarved().size())
+		{
+			EXPECT_EQ(1, testObj->GetCarved()[0].depthInArchive);
+		}
+
+		enumObj->RemoveArchiver(carver);
+		enumObj->RemoveObserver(testObj);
+		testObj->Release();
+		container->Release();
+		carver->Release();
+		enumContext->Release();
+		enumObj->Release();
+	}
+	DeleteFileW(szFile);
+}
+
+TEST(CarveFsEnum, OversizedArchive)
+{
+	std::vector<BYTE> image, data;
+	PutImage(image, 0);
+	PutZip(data, "inner.exe", image);
+	const ULONGLONG imageOffset = 30 + strlen("inner.exe");
+
+	WCHAR szFile[MAX_PATH] = {};
+	ASSERT_TRUE(WriteContainer(data, szFile));
+	for (int oversized = 0; oversized <= 1; oversized++)
+	{
+		IFsEnum * enumObj = static_cast<IFsEnum*>(new CFileFsEnum);
+		IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+		IFsEnum * unzipper = static_cast<IFsEnum*>(new CZipFsEnum);
+		IFsEnum * carver = static_cast<IFsEnum*>(new CCarveFsEnum);
+		IVirtualFs * container = static_cast<IVirtualFs*>(new CFileFs);
+		CCarveEnumObserver * testObj = new CCarveEnumObserver();
+		ULARGE_INTEGER maxFileSize;
+		maxFileSize.QuadPart = oversized ? 0x100 : MAX_FILE_SIZE;
+
+		EXPECT_HRESULT_SUCCEEDED(enumContext->SetMaxDepth(-1));
+		EXPECT_HRESULT_SUCCEEDED(enumContext->SetMaxFileSize(maxFileSize));
+		EXPECT_HRESULT_SUCCEEDED(enumContext->SetSearchPattern(L"*.*"));
+		EXPECT_HRESULT_SUCCEEDED(container->Create(szFile, 0));
+		EXPECT_HRESULT_SUCCEEDED(enumContext->SetSearchContainer(container));
+		EXPECT_HRESULT_SUCCEEDED(enumContext->SetFlags(IFsEnumContext::DetectOnly | IFsEnumContext::CarveImages));
+		EXPECT_HRESULT_SUCCEEDED(enumObj->AddObserver(testObj));
+		EXPECT_HRESULT_SUCCEEDED(enumObj->AddArchiver(unzipper));
+		EXPECT_HRESULT_SUCCEEDED(enumObj->AddArchiver(carver));
+		EXPECT_HRESULT_SUCCEEDED(enumObj->Enum(enumContext));
+
+		// the image is carved out of the archive either way; an archive over
+		// the size limit is not opened, and neither it nor its member is scanned
+		ASSERT_EQ(1, testObj->GetCarved().size());
+		EXPECT_EQ(imageOffset, testObj->GetCarved()[0].offset);
+		EXPECT_EQ(!oversized, testObj->IsFound(L"inner.exe"));
+		EXPECT_EQ((UINT)(oversized ? 1 : 3), testObj->GetFileCount());
+
+		enumObj->RemoveArchiver(carver);
+		enumObj->RemoveArchiver(unzipper);
+		enumObj->RemoveObserver(testObj);
+		testObj->Release();
+		container->Release();
+		carver->Release();
+		unzipper->Release();
+		enumContext->Release();
+		enumObj->Release();
+	}
+	DeleteFileW(szFile);
+}
@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/Scanner/DirectoryCosts.h"
+#include "../TinyAvCore/Scanner/EmulationClock.h"
+
+static DIRECTORY_COST MakeCost(__in LONGLONG seconds)
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	DIRECTORY_COST cost = { 1, 100, seconds * frequency.QuadPart, 5 };
+	return cost;
+}
+
+TEST(DirectoryCosts, Report)
+{
+	CDirectoryCosts * costs = new CDirectoryCosts();
+	costs->Charge(L"C:\\scan\\a", MakeCost(1));
+	costs->Charge(L"C:\\scan\\a\\x", MakeCost(2));
+	costs->Charge(L"C:\\scan\\a\\y", MakeCost(3));
+	costs->Charge(L"C:\\scan\\a\\y", MakeCost(1));
+	costs->Charge(L"C:\\scan\\b\\deep\\z", MakeCost(8));
+
+	// the directory the thread is in is added when it moves on
+	SCAN_DIRECTORY_COST report[10];
+	ULONG count = _countof(report);
+	ASSERT_EQ(S_OK, costs->Report(report, &count));
+	ASSERT_EQ(3, count);
+	ASSERT_STREQ(L"C:\\scan\\a", report[0].path);
+	ASSERT_EQ(7000000, report[0].wallUs);
+	costs->Flush();
+
+	// chains of directories holding a single subtree are left out
+	count = _countof(report);
+	ASSERT_EQ(S_OK, costs->Report(report, &count));
+	ASSERT_EQ(5, count);
+	ASSERT_STREQ(L"C:\\scan", report[0].path);
+	ASSERT_EQ(5, report[0].files);
+	ASSERT_EQ(500, report[0].bytes);
+	ASSERT_EQ(15000000, report[0].wallUs);
+	ASSERT_EQ(25, report[0].emulateUs);
+	ASSERT_STREQ(L"C:\\scan\\b\\deep\\z", report[1].path);
+	ASSERT_STREQ(L"C:\\scan\\a", report[2].path);
+	ASSERT_EQ(7000000, report[2].wallUs);
+	ASSERT_STREQ(L"C:\\scan\\a\\y", report[3].path);
+	ASSERT_EQ(2, report[3].files);
+	ASSERT_STREQ(L"C:\\scan\\a\\x", report[4].path);
+
+	// the most expensive first
+	count = 2;
+	ASSERT_EQ(S_OK, costs->Report(report, &count));
+	ASSERT_EQ(2, count);
+	ASSERT_STREQ(L"C:\\scan", report[0].path);
+	ASSERT_STREQ(L"C:\\scan\\b\\deep\\z", report[1].path);
+
+	count = 0;
+	ASSERT_EQ(S_OK, costs->Report(NULL, &count));
+	ASSERT_EQ(0, count);
+	ASSERT_EQ(E_INVALIDARG, costs->Report(report, NULL));
+
+	costs->Release();
+}
+
+TEST(DirectoryCosts, Files)
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	CDirectoryCosts * costs = new CDirectoryCosts();
+
+	// the files and bytes of a top-level file, and its emulations
+	CDirectoryCosts::BeginFile();
+	CDirectoryCosts::CountFile();
+	CDirectoryCosts::CountFile();
+	CDirectoryCosts::CountBytes(4096);
+	CEmulationClock::GetInstance()->Add(frequency.QuadPart / 100);
+	costs->EndFile(NULL, L"C:\\scan\\a\\file.exe");
+
+	// not counted before the next file
+	CDirectoryCosts::CountBytes(512);
+	CDirectoryCosts::BeginFile();
+	CDirectoryCosts::CountBytes(1024);
+	costs->EndFile(NULL, L"C:\\scan\\a\\other.dll");
+	costs->EndFile(NULL, L"file.exe");
+	costs->Flush();
+
+	SCAN_DIRECTORY_COST report[4];
+	ULONG count = _countof(report);
+	ASSERT_EQ(S_OK, costs->Report(report, &count));
+	ASSERT_EQ(1, count);
+	ASSERT_STREQ(L"C:\\scan\\a", report[0].path);
+	ASSERT_EQ(2, report[0].files);
+	ASSERT_EQ(4096 + 1024, report[0].bytes);
+	ASSERT_GE(report[0].emulateUs, 9999);
+	ASSERT_LE(report[0].emulateUs, 10000);
+
+	costs->Release();
+}
+
+TEST(EmulationClock, Add)
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	CEmulationClock * clock = CEmulationClock::GetInstance();
+	ULONG_PTR start = clock->Read();
+	clock->Add(frequency.QuadPart);
+	ASSERT_EQ(1000000, clock->Read() - start);
+	clock->Add(-1);
+	ASSERT_EQ(1000000, clock->Read() - start);
+	{
+		CEmulationScope emulation;
+		Sleep(20);
+	}
+	ASSERT_GT(clock->Read() - start, 1000000);
+}
@@ -0,0 +1,30 @@
+#include <gtest/gtest.h>
+#include <TinyAvCore.h>
+// as TinyAvCore is built: the engine is loaded at run time, not linked
+#define DYNLOAD
+#include "../TinyAvCore/Emulator/EmulRuntime.h"
+
+TEST(EmulRuntime, Timeout)
+{
+	uint64_t timeout = 1;
+
+	// no deadline, no limit
+	EXPECT_TRUE(CEmulRuntime::TimeoutFromDeadline(0, 5000, &timeout));
+	EXPECT_EQ(0ULL, timeout);
+
+	// milliseconds to the deadline, in microseconds
+	EXPECT_TRUE(CEmulRuntime::TimeoutFromDeadline(5250, 5000, &timeout));
+	EXPECT_EQ(250000ULL, timeout);
+	EXPECT_TRUE(CEmulRuntime::TimeoutFromDeadline(5001, 5000, &timeout));
+	EXPECT_EQ(1000ULL, timeout);
+
+	// at or past the deadline
+	timeout = 1;
+	EXPECT_FALSE(CEmulRuntime::TimeoutFromDeadline(5000, 5000, &timeout));
+	EXPECT_EQ(0ULL, timeout);
+	EXPECT_FALSE(CEmulRuntime::TimeoutFromDeadline(4000, 5000, &timeout));
+
+	// too far to count in microseconds
+	EXPECT_TRUE(CEmulRuntime::TimeoutFromDeadline((ULONGLONG)-1, 1, &timeout));
+	EXPECT_EQ(0ULL, timeout);
+}
@@ -99,4 +99,67 @@ TEST(FileFsEnum, All)
 		if (zip) zip->Release();
 		if (enumContext) enumContext->Release();
 		if (enumObj) enumObj->Release();
-}
\ No newline at end of file
+}
+
+// Runs every file out of time as soon as it is found
+class CDeadlineEnumObserver
+	: public CTestEnumObserver
+{
+private:
+	UINT m_TimeoutCount;
+public:
+	CDeadlineEnumObserver() : m_TimeoutCount(0) {}
+
+	UINT GetTimeoutCount(void)
+	{
+		return m_TimeoutCount;
+	}
+
+	virtual HRESULT WINAPI OnFileFound(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int currentDepth) override
+	{
+		HRESULT hr = CTestEnumObserver::OnFileFound(file, context, currentDepth);
+		context->SetDeadline(1);
+		return hr;
+	}
+
+	virtual void WINAPI OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR lpMessage = NULL) override
+	{
+		UNREFERENCED_PARAMETER(lpMessage);
+		if (dwErrorCode == IFsEnum::FsEnumTimeout)
+			m_TimeoutCount++;
+	}
+};
+
+TEST(FileFsEnum, Deadline)
+{
+	IFsEnum * enumObj = static_cast<IFsEnum*>(new CFileFsEnum);
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	CDeadlineEnumObserver * testObj = new CDeadlineEnumObserver();
+	IFsEnum * zip = new CZipFsEnum;
+	IVirtualFs * container = static_cast<IVirtualFs*>(new CFileFs);
+
+	if (!enumObj || !enumContext || !testObj || !zip || !container)
+		goto EXIT;
+
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetMaxDepth(-1));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchPattern(L"*.*"));
+	ASSERT_HRESULT_SUCCEEDED(container->Create(szSampleDir, 0));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchContainer(container));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetFlags(IFsEnumContext::DetectOnly));
+	ASSERT_HRESULT_SUCCEEDED(enumObj->AddObserver(testObj));
+	ASSERT_HRESULT_SUCCEEDED(enumObj->AddArchiver(zip));
+	ASSERT_HRESULT_SUCCEEDED(enumObj->Enum(enumContext));
+
+	// each file is reported once and nothing inside an archive is reached
+	ASSERT_LT(0u, testObj->GetTimeoutCount());
+	ASSERT_EQ(testObj->GetFileCount(), testObj->GetTimeoutCount());
+	ASSERT_HRESULT_SUCCEEDED(enumObj->RemoveArchiver(zip));
+	ASSERT_HRESULT_SUCCEEDED(enumObj->RemoveObserver(testObj));
+
+	EXIT:
+		if (testObj) testObj->Release();
+		if (container) container->Release();
+		if (zip) zip->Release();
+		if (enumContext) enumContext->Release();
+		if (enumObj) enumObj->Release();
+}
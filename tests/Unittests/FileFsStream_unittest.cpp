@@ -155,4 +155,55 @@ TEST(FileFsStream, WriteAt)
 	
 	CloseHandle(hFile);
 	fsStream->Release();
-}
\ No newline at end of file
+}
+
+TEST(FileFsStream, ReadDirect)
+{
+	// the bytes of the test case, as read through the system cache
+	HANDLE hFile = CreateFileW(szTestcase, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	ASSERT_NE(INVALID_HANDLE_VALUE, hFile);
+	std::vector<BYTE> content(0x100000);
+	DWORD r = 0;
+	ASSERT_TRUE(ReadFile(hFile, &content[0], (DWORD)content.size(), &r, NULL));
+	ASSERT_EQ(content.size(), r);
+
+	CFileFsStream * fsStream = new CFileFsStream();
+	fsStream->SetFileHandle((void*)hFile);
+	ASSERT_HRESULT_SUCCEEDED(fsStream->OpenDirect(szTestcase));
+	ASSERT_TRUE(fsStream->IsDirect());
+
+	// unaligned offsets and sizes, a read larger than the aligned buffer and
+	// one that runs past the end of the file
+	struct { ULONG offset; ULONG size; ULONG expected; } reads[] = {
+		{ 0, DIRECT_READ_MIN, DIRECT_READ_MIN },
+		{ 1, DIRECT_READ_MIN + 3, DIRECT_READ_MIN + 3 },
+		{ DIRECT_ALIGN - 1, 3 * DIRECT_READ_MIN, 3 * DIRECT_READ_MIN },
+		{ 100, 0x100000 - 100, 0x100000 - 100 },
+		{ 0x100000 - 70000, 100000, 70000 },
+	};
+	std::vector<BYTE> buffer(0x100000);
+	for (size_t i = 0; i < _countof(reads); i++)
+	{
+		LARGE_INTEGER offset = {};
+		ULARGE_INTEGER pos;
+		ULONG readSize = 0;
+		offset.QuadPart = reads[i].offset;
+		ASSERT_HRESULT_SUCCEEDED(fsStream->ReadAt(offset, IFsStream::FsStreamBegin, &buffer[0], reads[i].size, &readSize));
+		ASSERT_EQ(reads[i].expected, readSize);
+		ASSERT_TRUE(0 == memcmp(&buffer[0], &content[reads[i].offset], readSize));
+		ASSERT_HRESULT_SUCCEEDED(fsStream->Tell(&pos));
+		ASSERT_EQ(reads[i].offset + readSize, pos.QuadPart);
+	}
+
+	// small reads still go through the cached handle
+	LARGE_INTEGER offset = {};
+	ULONG readSize = 0;
+	offset.QuadPart = 0x1234;
+	ASSERT_HRESULT_SUCCEEDED(fsStream->ReadAt(offset, IFsStream::FsStreamBegin, &buffer[0], 100, &readSize));
+	ASSERT_EQ(100, readSize);
+	ASSERT_TRUE(0 == memcmp(&buffer[0], &content[0x1234], 100));
+	ASSERT_TRUE(fsStream->IsDirect());
+
+	CloseHandle(hFile);
+	fsStream->Release();
+}
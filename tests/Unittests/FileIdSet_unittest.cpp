@@ -0,0 +1,50 @@
+#include <gtest/gtest.h>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/FileSystem/FileIdSet.h"
+
+TEST(CFileIdSet, Insert)
+{
+	CFileIdSet set;
+	FILE_ID id = { 0x1234, 42 };
+	EXPECT_EQ(S_OK, set.Insert(id));
+	EXPECT_EQ(S_FALSE, set.Insert(id));
+
+	id.volume = 0x4321;
+	EXPECT_EQ(S_OK, set.Insert(id));
+
+	// force the table to grow several times
+	for (ULONGLONG i = 0; i < 100000; i++)
+	{
+		FILE_ID other = { 7, i };
+		EXPECT_EQ(S_OK, set.Insert(other));
+	}
+	for (ULONGLONG i = 0; i < 100000; i += 997)
+	{
+		FILE_ID other = { 7, i };
+		EXPECT_EQ(S_FALSE, set.Insert(other));
+	}
+
+	set.Clear();
+	EXPECT_EQ(S_OK, set.Insert(id));
+}
+
+TEST(CFileIdSet, HardLink)
+{
+	WCHAR szTempDir[MAX_PATH], szFile[MAX_PATH], szLink[MAX_PATH];
+	GetTempPathW(MAX_PATH, szTempDir);
+	GetTempFileNameW(szTempDir, L"fid", 0, szFile);
+	swprintf_s(szLink, L"%s.lnk", szFile);
+	DeleteFileW(szLink);
+	ASSERT_TRUE(CreateHardLinkW(szLink, szFile, NULL));
+
+	FILE_ID id1, id2;
+	EXPECT_EQ(S_OK, CFileIdSet::QueryFileId(szFile, &id1));
+	EXPECT_EQ(S_OK, CFileIdSet::QueryFileId(szLink, &id2));
+
+	CFileIdSet set;
+	EXPECT_EQ(S_OK, set.Insert(id1));
+	EXPECT_EQ(S_FALSE, set.Insert(id2));
+
+	DeleteFileW(szLink);
+	DeleteFileW(szFile);
+}
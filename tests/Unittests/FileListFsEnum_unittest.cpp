@@ -0,0 +1,172 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <TinyAvCore.h>
+#include <shlwapi.h>
+#include "../TinyAvCore/FileSystem/FileFsEnumContext.h"
+#include "../TinyAvCore/FileSystem/FileListFsEnum.h"
+#include "../TinyAvCore/FileSystem/FileFs.h"
+
+extern WCHAR szSampleDir[MAX_PATH];
+
+class CListEnumObserver
+	: public CRefCount
+	, public IFsEnumObserver
+{
+private:
+	UINT m_Count;
+	UINT m_NotFound;
+public:
+	CListEnumObserver() : m_Count(0), m_NotFound(0) {}
+	virtual ~CListEnumObserver() {}
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __in void **ppvObject)
+	{
+		if (ppvObject == NULL) return E_INVALIDARG;
+		if (IsEqualIID(riid, IID_IUnknown) ||
+			IsEqualIID(riid, __uuidof(IFsEnumObserver))
+			)
+		{
+			*ppvObject = static_cast<IFsEnumObserver*>(this);
+			AddRef();
+			return S_OK;
+		}
+		else
+		{
+			*ppvObject = NULL;
+		}
+		return E_NOINTERFACE;
+	}
+	DECLARE_REF_COUNT();
+
+	UINT GetFileCount(void)
+	{
+		return m_Count;
+	}
+
+	UINT GetNotFoundCount(void)
+	{
+		return m_NotFound;
+	}
+
+	virtual HRESULT WINAPI OnFileFound(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int currentDepth) override
+	{
+		UNREFERENCED_PARAMETER(file);
+		UNREFERENCED_PARAMETER(context);
+		UNREFERENCED_PARAMETER(currentDepth);
+		m_Count++;
+		return S_OK;
+	}
+
+	virtual void WINAPI OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR lpMessage = NULL) override
+	{
+		UNREFERENCED_PARAMETER(lpMessage);
+		if (dwErrorCode == IFsEnum::FsEnumNotFound)
+			m_NotFound++;
+	}
+};
+
+static void AppendListEntry(__inout StringA & list, __in LPCWSTR lpFileName, __in const char * terminator)
+{
+	WCHAR szPath[MAX_PATH] = {};
+	char szPathA[MAX_PATH * 3] = {};
+	wcscpy_s(szPath, MAX_PATH, szSampleDir);
+	PathAppendW(szPath, lpFileName);
+	WideCharToMultiByte(CP_UTF8, 0, szPath, -1, szPathA, sizeof(szPathA), NULL, NULL);
+	list += szPathA;
+	list.append(terminator, strlen(terminator) ? strlen(terminator) : 1);
+}
+
+TEST(FileListFsEnum, All)
+{
+	WCHAR szTempDir[MAX_PATH] = {};
+	WCHAR szListFile[MAX_PATH] = {};
+	ASSERT_NE(0, GetTempPathW(MAX_PATH, szTempDir));
+	ASSERT_NE(0, GetTempFileNameW(szTempDir, L"tav", 0, szListFile));
+
+	// mixed terminators: CR-LF, NUL and none for the last entry
+	StringA list;
+	AppendListEntry(list, L"testcase.bin", "\r\n");
+	AppendListEntry(list, L"sub\\testcase.zip", "");
+	AppendListEntry(list, L"missing.bin", "\n");
+	AppendListEntry(list, L"container.zip", "");
+	list.resize(list.size() - 1);
+
+	HANDLE hFile = CreateFileW(szListFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	ASSERT_NE(INVALID_HANDLE_VALUE, hFile);
+	DWORD dwWritten = 0;
+	ASSERT_TRUE(WriteFile(hFile, list.c_str(), (DWORD)list.size(), &dwWritten, NULL));
+	CloseHandle(hFile);
+
+	IFsEnum * enumObj = static_cast<IFsEnum*>(new CFileListFsEnum);
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	CListEnumObserver * testObj = new CListEnumObserver();
+	IVirtualFs * container = static_cast<IVirtualFs*>(new CFileFs);
+
+	if (!enumObj || !enumContext || !testObj || !container)
+		goto EXIT;
+
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetMaxDepth(-1));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchPattern(L"*.*"));
+	ASSERT_HRESULT_SUCCEEDED(container->Create(szListFile, 0));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchContainer(container));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetFlags(IFsEnumContext::DetectOnly | IFsEnumContext::ScanFileList));
+	ASSERT_HRESULT_SUCCEEDED(enumObj->AddObserver(testObj));
+	ASSERT_HRESULT_SUCCEEDED(enumObj->Enum(enumContext));
+	ASSERT_EQ(3, testObj->GetFileCount());
+	ASSERT_EQ(1, testObj->GetNotFoundCount());
+	ASSERT_HRESULT_SUCCEEDED(enumObj->RemoveObserver(testObj));
+
+EXIT:
+	if (testObj) testObj->Release();
+	if (container) container->Release();
+	if (enumContext) enumContext->Release();
+	if (enumObj) enumObj->Release();
+	DeleteFileW(szListFile);
+}
+
+TEST(FileListFsEnum, ReadError)
+{
+	WCHAR szTempDir[MAX_PATH] = {};
+	WCHAR szListFile[MAX_PATH] = {};
+	ASSERT_NE(0, GetTempPathW(MAX_PATH, szTempDir));
+	ASSERT_NE(0, GetTempFileNameW(szTempDir, L"tav", 0, szListFile));
+
+	// the list is read from a handle that cannot be read: the bytes in it are
+	// never an entry, and the error is the result of the enumeration
+	StringA list;
+	AppendListEntry(list, L"testcase.bin", "");
+	list.resize(list.size() - 1);
+	HANDLE hFile = CreateFileW(szListFile, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	ASSERT_NE(INVALID_HANDLE_VALUE, hFile);
+	DWORD dwWritten = 0;
+	ASSERT_TRUE(WriteFile(hFile, list.c_str(), (DWORD)list.size(), &dwWritten, NULL));
+	HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+	ASSERT_TRUE(SetStdHandle(STD_INPUT_HANDLE, hFile));
+
+	IFsEnum * enumObj = static_cast<IFsEnum*>(new CFileListFsEnum);
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	CListEnumObserver * testObj = new CListEnumObserver();
+	IVirtualFs * container = static_cast<IVirtualFs*>(new CFileFs);
+
+	if (!enumObj || !enumContext || !testObj || !container)
+		goto EXIT;
+
+	EXPECT_HRESULT_SUCCEEDED(enumContext->SetMaxDepth(-1));
+	EXPECT_HRESULT_SUCCEEDED(enumContext->SetSearchPattern(L"*.*"));
+	EXPECT_HRESULT_SUCCEEDED(container->Create(L"-", 0));
+	EXPECT_HRESULT_SUCCEEDED(enumContext->SetSearchContainer(container));
+	EXPECT_HRESULT_SUCCEEDED(enumContext->SetFlags(IFsEnumContext::DetectOnly | IFsEnumContext::ScanFileList));
+	EXPECT_HRESULT_SUCCEEDED(enumObj->AddObserver(testObj));
+	EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED), enumObj->Enum(enumContext));
+	EXPECT_EQ(0, testObj->GetFileCount());
+	EXPECT_EQ(0, testObj->GetNotFoundCount());
+	EXPECT_HRESULT_SUCCEEDED(enumObj->RemoveObserver(testObj));
+
+EXIT:
+	SetStdHandle(STD_INPUT_HANDLE, hStdin);
+	CloseHandle(hFile);
+	if (testObj) testObj->Release();
+	if (container) container->Release();
+	if (enumContext) enumContext->Release();
+	if (enumObj) enumObj->Release();
+	DeleteFileW(szListFile);
+}
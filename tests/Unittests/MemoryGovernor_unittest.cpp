@@ -0,0 +1,96 @@
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/Utils.h"
+#include "../TinyAvCore/Scanner/MemoryGovernor.h"
+
+// A governor of its own, with the totals in view. It shares the table of the
+// process with the governor of the scan, which charges nothing while the
+// tests run.
+class CTestGovernor : public CMemoryGovernor
+{
+public:
+	CTestGovernor() {}
+	virtual ~CTestGovernor() {}
+
+	LONG64 GetTotal(void) { return m_table ? m_table->total : 0; }
+	LONG64 GetUsed(__in MemoryUse use) { return m_table ? m_table->used[use] : 0; }
+};
+
+#define MB	(1024 * 1024)
+
+TEST(MemoryGovernor, Reserve)
+{
+	SetEnvironmentVariableW(L"TINYAV_MEMORY_LIMIT", L"1");
+	CTestGovernor governor;
+	SetEnvironmentVariableW(L"TINYAV_MEMORY_LIMIT", NULL);
+	ASSERT_TRUE(governor.IsEnabled());
+	ASSERT_EQ(MB, governor.GetLimit());
+	ASSERT_EQ(0, governor.GetTotal());
+
+	ASSERT_EQ(S_OK, governor.Reserve(MemoryEmulator, MB / 2, 0));
+	ASSERT_EQ(S_OK, governor.Reserve(MemoryArchive, MB / 4, 0));
+	ASSERT_EQ(MB / 2 + MB / 4, governor.GetTotal());
+	ASSERT_EQ(MB / 2, governor.GetUsed(MemoryEmulator));
+	ASSERT_EQ(MB / 4, governor.GetUsed(MemoryArchive));
+	ASSERT_FALSE(governor.Fits(MB / 2));
+	ASSERT_TRUE(governor.Fits(MB / 4));
+
+	// more than the limit is refused at once, and what does not fit in time
+	// leaves the totals as they were
+	ASSERT_EQ(E_OUTOFMEMORY, governor.Reserve(MemoryArchive, 2 * MB, 0));
+	ASSERT_EQ(E_OUTOFMEMORY, governor.Reserve(MemoryArchive, MB / 2, GetTickCount64() + 2 * GOVERNOR_POLL_MS));
+	ASSERT_EQ(MB / 2 + MB / 4, governor.GetTotal());
+	ASSERT_EQ(MB / 4, governor.GetUsed(MemoryArchive));
+	ASSERT_EQ(E_INVALIDARG, governor.Reserve(MemoryUseCount, 1, 0));
+
+	// pressure starts at GOVERNOR_PRESSURE_PERCENT of the limit
+	ASSERT_FALSE(governor.IsUnderPressure());
+	ASSERT_EQ(S_OK, governor.Reserve(MemoryStreamCache, MB / 8, 0));
+	ASSERT_TRUE(governor.IsUnderPressure());
+
+	// returned, whatever the limit
+	governor.Charge(MemoryStreamCache, -(LONG64)(MB / 8));
+	governor.Charge(MemoryArchive, -(LONG64)(MB / 4));
+	governor.Charge(MemoryEmulator, -(LONG64)(MB / 2));
+	ASSERT_EQ(0, governor.GetTotal());
+	for (int use = 0; use < MemoryUseCount; use++)
+		ASSERT_EQ(0, governor.GetUsed((MemoryUse)use));
+}
+
+TEST(MemoryGovernor, NoLimit)
+{
+	// nothing is charged without a limit
+	SetEnvironmentVariableW(L"TINYAV_MEMORY_LIMIT", L"0");
+	CTestGovernor governor;
+	SetEnvironmentVariableW(L"TINYAV_MEMORY_LIMIT", NULL);
+	ASSERT_FALSE(governor.IsEnabled());
+	ASSERT_EQ(S_OK, governor.Reserve(MemoryEmulator, 0x7FFFFFFF, 0));
+	ASSERT_TRUE(governor.Fits(0x7FFFFFFF));
+	ASSERT_FALSE(governor.IsUnderPressure());
+}
+
+TEST(MemoryGovernor, ProcessMapping)
+{
+	WCHAR szName[64];
+	swprintf_s(szName, L"Local\\TinyAvTestMapping.%lu", GetCurrentProcessId());
+
+	// the copies of the process share the memory
+	HANDLE first = CreateProcessMapping(szName, sizeof(LONG));
+	ASSERT_TRUE(first != NULL);
+	HANDLE second = CreateProcessMapping(szName, sizeof(LONG));
+	ASSERT_TRUE(second != NULL);
+	volatile LONG * a = (volatile LONG *)MapViewOfFile(first, FILE_MAP_WRITE, 0, 0, sizeof(LONG));
+	volatile LONG * b = (volatile LONG *)MapViewOfFile(second, FILE_MAP_WRITE, 0, 0, sizeof(LONG));
+	ASSERT_TRUE(a != NULL && b != NULL);
+	ASSERT_EQ(0, *b);
+	*a = 42;
+	ASSERT_EQ(42, *b);
+	UnmapViewOfFile((LPCVOID)a);
+	UnmapViewOfFile((LPCVOID)b);
+	CloseHandle(second);
+	CloseHandle(first);
+
+	ASSERT_TRUE(CreateProcessMapping(NULL, sizeof(LONG)) == NULL);
+	ASSERT_TRUE(CreateProcessMapping(szName, 0) == NULL);
+}
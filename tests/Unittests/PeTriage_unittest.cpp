@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/FileType/PeTriage.h"
+
+static UINT Decode(__in std::initializer_list<BYTE> bytes, __out PeTriageOpClass * opClass)
+{
+	std::vector<BYTE> code(bytes);
+	return CPeTriage::DecodeLength(code.data(), (ULONG)code.size(), opClass);
+}
+
+TEST(CPeTriage, DecodeLength)
+{
+	PeTriageOpClass opClass;
+	EXPECT_EQ(1, Decode({ 0x55 }, &opClass));								// push ebp
+	EXPECT_EQ(TriageOpStack, opClass);
+	EXPECT_EQ(2, Decode({ 0x8B, 0xEC }, &opClass));						// mov ebp, esp
+	EXPECT_EQ(TriageOpMove, opClass);
+	EXPECT_EQ(3, Decode({ 0x83, 0xEC, 0x10 }, &opClass));					// sub esp, 10h
+	EXPECT_EQ(TriageOpArith, opClass);
+	EXPECT_EQ(3, Decode({ 0x80, 0x36, 0x5A }, &opClass));					// xor byte ptr [esi], 5Ah
+	EXPECT_EQ(TriageOpLogic, opClass);
+	EXPECT_EQ(4, Decode({ 0x8B, 0x44, 0x24, 0x08 }, &opClass));			// mov eax, [esp+8]
+	EXPECT_EQ(7, Decode({ 0x89, 0x04, 0x25, 1, 2, 3, 4 }, &opClass));		// mov [disp32], eax with SIB
+	EXPECT_EQ(10, Decode({ 0xC7, 0x85, 1, 2, 3, 4, 5, 6, 7, 8 }, &opClass));	// mov [ebp+disp32], imm32
+	EXPECT_EQ(5, Decode({ 0xA1, 1, 2, 3, 4 }, &opClass));					// mov eax, [moffs32]
+	EXPECT_EQ(4, Decode({ 0x66, 0xB8, 1, 2 }, &opClass));					// mov ax, imm16
+	EXPECT_EQ(6, Decode({ 0x0F, 0x85, 1, 2, 3, 4 }, &opClass));			// jne rel32
+	EXPECT_EQ(TriageOpBranch, opClass);
+	EXPECT_EQ(4, Decode({ 0x0F, 0x38, 0x00, 0xC1 }, &opClass));			// pshufb mm0, mm1
+	EXPECT_EQ(TriageOpFloat, opClass);
+	EXPECT_EQ(4, Decode({ 0xC8, 0x10, 0x00, 0x00 }, &opClass));			// enter 10h, 0
+	EXPECT_EQ(TriageOpStack, opClass);
+}
+
+TEST(CPeTriage, Groups)
+{
+	PeTriageOpClass opClass;
+	EXPECT_EQ(6, Decode({ 0xF7, 0xC0, 1, 2, 3, 4 }, &opClass));			// test eax, imm32
+	EXPECT_EQ(TriageOpLogic, opClass);
+	EXPECT_EQ(2, Decode({ 0xF7, 0xE1 }, &opClass));						// mul ecx
+	EXPECT_EQ(TriageOpArith, opClass);
+	EXPECT_EQ(2, Decode({ 0xFF, 0x10 }, &opClass));						// call [eax]
+	EXPECT_EQ(TriageOpCall, opClass);
+	EXPECT_EQ(6, Decode({ 0xFF, 0x25, 1, 2, 3, 4 }, &opClass));			// jmp [disp32]
+	EXPECT_EQ(TriageOpBranch, opClass);
+	EXPECT_EQ(2, Decode({ 0xFF, 0x30 }, &opClass));						// push [eax]
+	EXPECT_EQ(TriageOpStack, opClass);
+}
+
+TEST(CPeTriage, Invalid)
+{
+	PeTriageOpClass opClass;
+	EXPECT_EQ(0, Decode({ 0xE8, 0x00, 0x00 }, &opClass));					// truncated call
+	EXPECT_EQ(0, Decode({ 0xFF, 0x38 }, &opClass));						// FF /7
+	EXPECT_EQ(0, Decode({ 0x0F, 0x04 }, &opClass));						// undefined two-byte opcode
+	EXPECT_EQ(0, Decode({ 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+		0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x90 }, &opClass));		// longer than 15 bytes
+}
+
+static DOUBLE ScoreCode(__in const BYTE * code, __in ULONG size, __out TRIAGE_SWEEP * sweep)
+{
+	PE_TRIAGE_RESULT result = {};
+	CPeTriage::Sweep(code, size, sweep);
+	result.instructions = sweep->instructions;
+	result.invalidBytes = sweep->invalidBytes;
+	memcpy(result.histogram, sweep->histogram, sizeof(result.histogram));
+	result.getPc = sweep->getPc;
+	result.backwardLoop = sweep->backwardLoop;
+	return CPeTriage::Score(&result);
+}
+
+TEST(CPeTriage, Score)
+{
+	// function prologue and epilogue of a compiled program
+	static const BYTE prologue[] = {
+		0x55, 0x8B, 0xEC, 0x83, 0xEC, 0x10, 0x53, 0x56, 0x57, 0x8B, 0x7D, 0x08,
+		0x8B, 0x75, 0x0C, 0x8D, 0x45, 0xF0, 0x50, 0xE8, 0x10, 0x00, 0x00, 0x00,
+		0x83, 0xC4, 0x04, 0x8B, 0xC6, 0x5F, 0x5E, 0x5B, 0x8B, 0xE5, 0x5D, 0xC3 };
+	// call $+5 / pop ebp, then an xor and rol loop over the body of the virus
+	static const BYTE decryptor[] = {
+		0xE8, 0x00, 0x00, 0x00, 0x00, 0x5D, 0x81, 0xED, 0x05, 0x10, 0x40, 0x00,
+		0x8D, 0xB5, 0x00, 0x20, 0x00, 0x00, 0xB9, 0x00, 0x01, 0x00, 0x00, 0x80,
+		0x36, 0x5A, 0xC0, 0x06, 0x03, 0x46, 0xE2, 0xF7, 0xE9, 0x00, 0xF0, 0xFF, 0xFF };
+
+	TRIAGE_SWEEP clean, infected;
+	DOUBLE cleanScore = ScoreCode(prologue, sizeof(prologue), &clean);
+	DOUBLE infectedScore = ScoreCode(decryptor, sizeof(decryptor), &infected);
+
+	EXPECT_EQ(0, clean.invalidBytes);
+	EXPECT_FALSE(clean.getPc);
+	EXPECT_FALSE(clean.backwardLoop);
+	EXPECT_TRUE(infected.getPc);
+	EXPECT_TRUE(infected.backwardLoop);
+	ASSERT_EQ(2, infected.nearTargetCount);
+	EXPECT_EQ(5, infected.nearTargets[0]);
+	EXPECT_EQ(37 - 0x1000, infected.nearTargets[1]);
+
+	EXPECT_LT(cleanScore, PE_TRIAGE_DEFAULT_THRESHOLD);
+	EXPECT_GE(infectedScore, PE_TRIAGE_DEFAULT_THRESHOLD);
+}
@@ -0,0 +1,223 @@
+#include <gtest/gtest.h>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/Scanner/ScanModuleSet.h"
+
+// Scan module linked into the test: it has no plug-in to pin
+class CTestModule :
+	public CRefCount,
+	public IScanModule
+{
+protected:
+	virtual ~CTestModule() {}
+
+public:
+	LPCWSTR			m_name;
+	volatile LONG	m_initialized;
+	BOOL			m_shutdown;
+	HRESULT			m_initResult;
+	DWORD			m_version;
+
+	CTestModule(__in LPCWSTR name) : m_name(name), m_initialized(0), m_shutdown(FALSE), m_initResult(S_OK), m_version(1) {}
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+	{
+		if (ppvObject == NULL) return E_INVALIDARG;
+		*ppvObject = NULL;
+		return E_NOINTERFACE;
+	}
+
+	virtual HRESULT WINAPI GetModuleInfo(__out MODULE_INFO * scanInfo) override
+	{
+		if (scanInfo == NULL) return E_INVALIDARG;
+		scanInfo->type = ScanModule;
+		wcscpy_s(scanInfo->name, m_name);
+		scanInfo->handle = NULL;
+		scanInfo->version = m_version;
+		return S_OK;
+	}
+
+	virtual ModuleType WINAPI GetType(void) override { return ScanModule; }
+
+	virtual HRESULT WINAPI GetName(__out BSTR *name) override
+	{
+		if (name == NULL) return E_INVALIDARG;
+		*name = SysAllocString(m_name);
+		return *name ? S_OK : E_OUTOFMEMORY;
+	}
+
+	virtual HRESULT WINAPI OnScanInitialize(void) override
+	{
+		Sleep(50);
+		InterlockedIncrement(&m_initialized);
+		return m_initResult;
+	}
+
+	virtual HRESULT WINAPI Scan(__in IVirtualFs * file, __in IFsEnumContext * context, __in IScanObserver * observer) override
+	{
+		UNREFERENCED_PARAMETER(file);
+		UNREFERENCED_PARAMETER(context);
+		UNREFERENCED_PARAMETER(observer);
+		return S_OK;
+	}
+
+	virtual HRESULT WINAPI OnScanShutdown(void) override { m_shutdown = TRUE; return S_OK; }
+};
+
+static CScanModuleEntry * MakeEntry(__in CTestModule * module)
+{
+	CScanModuleEntry * entry = new CScanModuleEntry();
+	EXPECT_EQ(S_OK, entry->Initialize(module));
+	return entry;
+}
+
+TEST(CScanModuleSet, Replace)
+{
+	CTestModule * first = new CTestModule(L"First");
+	CTestModule * second = new CTestModule(L"Second");
+	CTestModule * newFirst = new CTestModule(L"first");
+
+	CScanModuleSet * gen1 = new CScanModuleSet(1);
+	CScanModuleEntry * entry = MakeEntry(first);
+	EXPECT_EQ(S_OK, gen1->Initialize(NULL, NULL, entry));
+	entry->Release();
+
+	CScanModuleSet * gen2 = new CScanModuleSet(2);
+	entry = MakeEntry(second);
+	EXPECT_EQ(S_OK, gen2->Initialize(gen1, NULL, entry));
+	entry->Release();
+	ASSERT_EQ(2U, gen2->GetModules().size());
+	EXPECT_EQ(first, gen2->GetModules()[0]);
+	EXPECT_EQ(second, gen2->GetModules()[1]);
+	gen1->Release();
+
+	// the new version takes the place of the old one
+	EXPECT_EQ(first, gen2->FindByName(newFirst));
+	CScanModuleSet * gen3 = new CScanModuleSet(3);
+	entry = MakeEntry(newFirst);
+	EXPECT_EQ(S_OK, gen3->Initialize(gen2, first, entry));
+	entry->Release();
+	ASSERT_EQ(2U, gen3->GetModules().size());
+	EXPECT_EQ(newFirst, gen3->GetModules()[0]);
+	EXPECT_EQ(second, gen3->GetModules()[1]);
+	EXPECT_EQ(3UL, gen3->GetGeneration());
+	EXPECT_EQ(S_OK, gen2->Prepare());
+	EXPECT_EQ(S_OK, gen3->Prepare());
+	EXPECT_EQ(1, first->m_initialized);
+	EXPECT_EQ(1, second->m_initialized);
+	EXPECT_EQ(1, newFirst->m_initialized);
+
+	// a file still scanned with the second generation keeps the old module
+	EXPECT_FALSE(first->m_shutdown);
+	gen2->Release();
+	EXPECT_TRUE(first->m_shutdown);
+	EXPECT_FALSE(second->m_shutdown);
+
+	gen3->Release();
+	EXPECT_TRUE(second->m_shutdown);
+	EXPECT_TRUE(newFirst->m_shutdown);
+
+	first->Release();
+	second->Release();
+	newFirst->Release();
+}
+
+TEST(CScanModuleSet, Remove)
+{
+	CTestModule * module = new CTestModule(L"Module");
+
+	CScanModuleSet * gen1 = new CScanModuleSet(1);
+	CScanModuleEntry * entry = MakeEntry(module);
+	EXPECT_EQ(S_OK, gen1->Initialize(NULL, NULL, entry));
+	entry->Release();
+
+	CScanModuleSet * gen2 = new CScanModuleSet(2);
+	EXPECT_EQ(S_OK, gen2->Initialize(gen1, module, NULL));
+	EXPECT_TRUE(gen2->GetModules().empty());
+
+	// never used, so never initialized nor shut down
+	gen1->Release();
+	EXPECT_EQ(0, module->m_initialized);
+	EXPECT_FALSE(module->m_shutdown);
+
+	gen2->Release();
+	module->Release();
+}
+
+TEST(CScanModuleSet, Signature)
+{
+	CTestModule * first = new CTestModule(L"First");
+	CTestModule * second = new CTestModule(L"Second");
+	CTestModule * newSecond = new CTestModule(L"SECOND");
+	newSecond->m_version = 2;
+
+	CScanModuleSet * empty = new CScanModuleSet(1);
+	EXPECT_EQ(S_OK, empty->Initialize(NULL, NULL, NULL));
+	EXPECT_EQ(0, empty->GetSignature());
+
+	CScanModuleSet * gen1 = new CScanModuleSet(2);
+	CScanModuleEntry * entry = MakeEntry(first);
+	EXPECT_EQ(S_OK, gen1->Initialize(empty, NULL, entry));
+	entry->Release();
+	CScanModuleSet * gen2 = new CScanModuleSet(3);
+	entry = MakeEntry(second);
+	EXPECT_EQ(S_OK, gen2->Initialize(gen1, NULL, entry));
+	entry->Release();
+	EXPECT_NE(0, gen1->GetSignature());
+	EXPECT_NE(gen1->GetSignature(), gen2->GetSignature());
+
+	// a module keeps its id across versions, not the set its signature
+	CScanModuleSet * gen3 = new CScanModuleSet(4);
+	entry = MakeEntry(newSecond);
+	EXPECT_EQ(S_OK, gen3->Initialize(gen2, second, entry));
+	entry->Release();
+	ASSERT_EQ(2, gen3->GetVerdictModules().size());
+	EXPECT_EQ(gen2->GetVerdictModules()[0].id, gen3->GetVerdictModules()[0].id);
+	EXPECT_EQ(gen2->GetVerdictModules()[1].id, gen3->GetVerdictModules()[1].id);
+	EXPECT_EQ(1, gen2->GetVerdictModules()[1].version);
+	EXPECT_EQ(2, gen3->GetVerdictModules()[1].version);
+	EXPECT_NE(gen2->GetSignature(), gen3->GetSignature());
+
+	empty->Release();
+	gen1->Release();
+	gen2->Release();
+	gen3->Release();
+	first->Release();
+	second->Release();
+	newSecond->Release();
+}
+
+TEST(CScanModuleEntry, InitializeAll)
+{
+	const int count = 8;
+	CTestModule * modules[count];
+	std::vector<CScanModuleEntry *> entries;
+	for (int i = 0; i < count; i++)
+	{
+		modules[i] = new CTestModule(L"Module");
+		entries.push_back(MakeEntry(modules[i]));
+	}
+	modules[3]->m_initResult = E_FAIL;
+
+	// the modules sleep 50 ms each: in parallel it takes far less than the sum
+	ULONGLONG start = GetTickCount64();
+	EXPECT_EQ(E_FAIL, CScanModuleEntry::InitializeAll(entries));
+	EXPECT_LT(GetTickCount64() - start, (ULONGLONG)(count * 50));
+
+	for (int i = 0; i < count; i++)
+	{
+		EXPECT_EQ(1, modules[i]->m_initialized);
+		EXPECT_EQ(i == 3 ? E_FAIL : S_OK, entries[i]->EnsureInitialized());
+	}
+	// only once
+	EXPECT_EQ(E_FAIL, CScanModuleEntry::InitializeAll(entries));
+	EXPECT_EQ(1, modules[0]->m_initialized);
+
+	for (int i = 0; i < count; i++)
+	{
+		entries[i]->Release();
+		EXPECT_TRUE(modules[i]->m_shutdown);
+		modules[i]->Release();
+	}
+}
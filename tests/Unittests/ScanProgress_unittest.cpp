@@ -0,0 +1,174 @@
+#include <gtest/gtest.h>
+#include <limits.h>
+#include <TinyAvCore.h>
+#include <shlwapi.h>
+#include "../TinyAvCore/FileSystem/FileFsEnumContext.h"
+#include "../TinyAvCore/FileSystem/FileFs.h"
+#include "../TinyAvCore/Scanner/ScanProgress.h"
+#include "TestTree.h"
+
+#define CENSUS_TEST_TIMEOUT	(30 * 1000)
+
+// root: a.exe (100), b.zip (200), c.txt (300), big.txt (4096)
+// root\sub: d.dll (400)
+// root\sub\deep: e.txt (500)
+static void MakeCensusTree(__out_ecount(MAX_PATH) LPWSTR lpDirectory)
+{
+	WCHAR szPath[MAX_PATH] = {}, szDeep[MAX_PATH] = {};
+	MakeTestDirectory(L"cns", lpDirectory);
+	WriteTestFile(lpDirectory, L"a.exe", CREATE_ALWAYS, 100);
+	WriteTestFile(lpDirectory, L"b.zip", CREATE_ALWAYS, 200);
+	WriteTestFile(lpDirectory, L"c.txt", CREATE_ALWAYS, 300);
+	WriteTestFile(lpDirectory, L"big.txt", CREATE_ALWAYS, 4096);
+
+	MakeTestSubdirectory(lpDirectory, L"sub", szPath);
+	WriteTestFile(szPath, L"d.dll", CREATE_ALWAYS, 400);
+	MakeTestSubdirectory(szPath, L"deep", szDeep);
+	WriteTestFile(szDeep, L"e.txt", CREATE_ALWAYS, 500);
+}
+
+static BOOL WaitForCensus(__in CScanProgress * progress, __out SCAN_PROGRESS * result)
+{
+	ULONGLONG deadline = GetTickCount64() + CENSUS_TEST_TIMEOUT;
+	for (;;)
+	{
+		if (FAILED(progress->Query(result))) return FALSE;
+		if (result->censusDone) return TRUE;
+		if (GetTickCount64() > deadline) return FALSE;
+		Sleep(10);
+	}
+}
+
+TEST(ScanProgress, Classify)
+{
+	EXPECT_EQ(CostExecutable, CScanProgress::Classify(L"C:\\dir\\setup.EXE"));
+	EXPECT_EQ(CostExecutable, CScanProgress::Classify(L"driver.sys"));
+	EXPECT_EQ(CostArchive, CScanProgress::Classify(L"C:\\dir\\pack.zip"));
+	EXPECT_EQ(CostArchive, CScanProgress::Classify(L"disk.iso"));
+	EXPECT_EQ(CostOther, CScanProgress::Classify(L"notes.txt"));
+	EXPECT_EQ(CostOther, CScanProgress::Classify(L"C:\\dir.exe\\noext"));
+	EXPECT_EQ(CostOther, CScanProgress::Classify(NULL));
+}
+
+TEST(ScanProgress, Census)
+{
+	WCHAR szDirectory[MAX_PATH] = {};
+	MakeCensusTree(szDirectory);
+
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	IVirtualFs * container = static_cast<IVirtualFs*>(new CFileFs);
+	CScanProgress * progress = NULL;
+	SCAN_PROGRESS result = {};
+	ULARGE_INTEGER maxFileSize = {};
+
+	if (!enumContext || !container)
+		goto EXIT;
+
+	ASSERT_HRESULT_SUCCEEDED(container->Create(szDirectory, 0));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchContainer(container));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchPattern(L"*.*"));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetFlags(IFsEnumContext::Census));
+	maxFileSize.QuadPart = 1024;
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetMaxFileSize(maxFileSize));
+
+	// the whole tree, without the file the walker skips for its size
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetMaxDepth(-1));
+	progress = new CScanProgress();
+	EXPECT_EQ(E_INVALIDARG, progress->StartCensus(NULL));
+	ASSERT_HRESULT_SUCCEEDED(progress->StartCensus(enumContext));
+	EXPECT_EQ(E_NOT_VALID_STATE, progress->StartCensus(enumContext));
+	ASSERT_TRUE(WaitForCensus(progress, &result));
+	EXPECT_EQ(5, result.totalFiles);
+	EXPECT_EQ(1500, result.totalBytes);
+	EXPECT_EQ(0, result.scannedFiles);
+	EXPECT_EQ(ULLONG_MAX, result.remainingMs);
+	progress->StopCensus();
+	delete progress;
+
+	// two levels: the root and sub
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetMaxDepth(2));
+	progress = new CScanProgress();
+	ASSERT_HRESULT_SUCCEEDED(progress->StartCensus(enumContext));
+	ASSERT_TRUE(WaitForCensus(progress, &result));
+	EXPECT_EQ(4, result.totalFiles);
+	EXPECT_EQ(1000, result.totalBytes);
+	delete progress;
+
+	// large files are counted when images are carved out of them
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetFlags(IFsEnumContext::Census | IFsEnumContext::CarveImages));
+	progress = new CScanProgress();
+	ASSERT_HRESULT_SUCCEEDED(progress->StartCensus(enumContext));
+	ASSERT_TRUE(WaitForCensus(progress, &result));
+	EXPECT_EQ(5, result.totalFiles);
+	EXPECT_EQ(5096, result.totalBytes);
+	delete progress;
+	progress = NULL;
+
+EXIT:
+	if (progress) delete progress;
+	if (container) container->Release();
+	if (enumContext) enumContext->Release();
+	RemoveTestDirectory(szDirectory);
+}
+
+TEST(ScanProgress, Estimate)
+{
+	WCHAR szDirectory[MAX_PATH] = {};
+	MakeCensusTree(szDirectory);
+
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	IVirtualFs * container = static_cast<IVirtualFs*>(new CFileFs);
+	CScanProgress * progress = new CScanProgress();
+	SCAN_PROGRESS result = {};
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	if (!enumContext || !container || !progress)
+		goto EXIT;
+
+	// nothing scanned, no census: no estimate
+	EXPECT_EQ(E_INVALIDARG, progress->Query(NULL));
+	ASSERT_HRESULT_SUCCEEDED(progress->Query(&result));
+	EXPECT_FALSE(result.censusDone);
+	EXPECT_EQ(0, result.totalFiles);
+	EXPECT_EQ(ULLONG_MAX, result.remainingMs);
+	EXPECT_EQ(0.0, result.fraction);
+
+	ASSERT_HRESULT_SUCCEEDED(container->Create(szDirectory, 0));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchContainer(container));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchPattern(L"*.*"));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetMaxDepth(-1));
+	ASSERT_HRESULT_SUCCEEDED(progress->StartCensus(enumContext));
+	ASSERT_TRUE(WaitForCensus(progress, &result));
+	ASSERT_EQ(6, result.totalFiles);
+	// time passes while the files are scanned
+	Sleep(50);
+
+	// executables measured slow, the other files at their own speed
+	progress->OnFileScanned(L"a.exe", 100, frequency.QuadPart);
+	progress->OnFileScanned(L"c.txt", 300, frequency.QuadPart / 1000);
+	ASSERT_HRESULT_SUCCEEDED(progress->Query(&result));
+	EXPECT_EQ(2, result.scannedFiles);
+	EXPECT_EQ(400, result.scannedBytes);
+	ASSERT_NE(ULLONG_MAX, result.remainingMs);
+	// d.dll, one more executable, is about a second of scan modules
+	EXPECT_GE(result.remainingMs, 900ULL);
+	EXPECT_GT(result.fraction, 0.0);
+	EXPECT_LT(result.fraction, 1.0);
+
+	// the rest of the files
+	progress->OnFileScanned(L"b.zip", 200, 1);
+	progress->OnFileScanned(L"big.txt", 4096, 1);
+	progress->OnFileScanned(L"d.dll", 400, 1);
+	progress->OnFileScanned(L"e.txt", 500, 1);
+	ASSERT_HRESULT_SUCCEEDED(progress->Query(&result));
+	EXPECT_EQ(6, result.scannedFiles);
+	EXPECT_EQ(0, result.remainingMs);
+	EXPECT_EQ(1.0, result.fraction);
+
+EXIT:
+	if (progress) delete progress;
+	if (container) container->Release();
+	if (enumContext) enumContext->Release();
+	RemoveTestDirectory(szDirectory);
+}
@@ -0,0 +1,159 @@
+#include <gtest/gtest.h>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/Hash/Sha256.h"
+#include "../TinyAvCore/Hash/HashBatch.h"
+
+static std::string ToHex(__in const BYTE * digest)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+	{
+		hex += digits[digest[i] >> 4];
+		hex += digits[digest[i] & 15];
+	}
+	return hex;
+}
+
+static std::vector<BYTE> MakeMessage(__in size_t size, __in UINT seed)
+{
+	std::vector<BYTE> message(size);
+	for (size_t i = 0; i < size; i++)
+		message[i] = (BYTE)(i * 13 + seed + i / 97);
+	return message;
+}
+
+TEST(CSha256, KnownDigests)
+{
+	BYTE digest[SHA256_DIGEST_SIZE];
+
+	CSha256::Hash("abc", 3, digest);
+	EXPECT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", ToHex(digest));
+
+	CSha256::Hash(NULL, 0, digest);
+	EXPECT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", ToHex(digest));
+
+	std::vector<BYTE> million(1000000, 'a');
+	CSha256::Hash(&million[0], million.size(), digest);
+	EXPECT_EQ("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", ToHex(digest));
+}
+
+TEST(CSha256, Update)
+{
+	std::vector<BYTE> message = MakeMessage(1000, 1);
+	BYTE whole[SHA256_DIGEST_SIZE], pieces[SHA256_DIGEST_SIZE];
+	CSha256::Hash(&message[0], message.size(), whole);
+
+	// pieces that end inside a block, on a block and across several blocks
+	CSha256 sha;
+	size_t offset = 0, size = 1;
+	while (offset < message.size())
+	{
+		size_t count = min(size, message.size() - offset);
+		sha.Update(&message[offset], count);
+		offset += count;
+		size = size * 3 + 1;
+	}
+	sha.Final(pieces);
+	EXPECT_EQ(0, memcmp(whole, pieces, sizeof(whole)));
+}
+
+TEST(CSha256, UpdateZeros)
+{
+	static const size_t sizes[] = { 0, 1, 63, 64, 65, 1000, 4096 + 1, 64 * 64 * 3 + 5 };
+	std::vector<BYTE> head = MakeMessage(70, 3);
+
+	// after nothing, after a partial block and after more than a block
+	for (size_t before = 0; before <= head.size(); before += 35)
+	{
+		for (size_t i = 0; i < _countof(sizes); i++)
+		{
+			std::vector<BYTE> zeros(sizes[i] + 1, 0);
+			BYTE expected[SHA256_DIGEST_SIZE], digest[SHA256_DIGEST_SIZE];
+
+			CSha256 plain, sparse;
+			plain.Update(&head[0], before);
+			plain.Update(&zeros[0], sizes[i]);
+			plain.Final(expected);
+			sparse.Update(&head[0], before);
+			sparse.UpdateZeros(sizes[i]);
+			sparse.Final(digest);
+			EXPECT_EQ(0, memcmp(expected, digest, sizeof(digest))) << before << " + " << sizes[i];
+		}
+	}
+
+	UINT32 expected[8], state[8];
+	BYTE blocks[3 * SHA256_BLOCK_SIZE] = {};
+	memcpy(expected, CSha256::H0, sizeof(expected));
+	memcpy(state, CSha256::H0, sizeof(state));
+	CSha256::CompressScalar(expected, blocks, 3);
+	CSha256::CompressZeros(state, 3);
+	EXPECT_EQ(0, memcmp(expected, state, sizeof(state)));
+}
+
+TEST(CHashBatch, Engines)
+{
+	std::vector<std::vector<BYTE> > messages;
+	for (size_t size = 0; size <= 300; size++)
+		messages.push_back(MakeMessage(size, (UINT)size));
+	for (UINT i = 0; i < 20; i++)
+		messages.push_back(MakeMessage(1000 + i * 4099, i));
+
+	std::vector<BYTE> expected(messages.size() * SHA256_DIGEST_SIZE);
+	for (size_t i = 0; i < messages.size(); i++)
+		CSha256::Hash(messages[i].empty() ? NULL : &messages[i][0], messages[i].size(), &expected[i * SHA256_DIGEST_SIZE]);
+
+	IHashBatch * batch = NULL;
+	ASSERT_EQ(S_OK, CreateClassObject(CLSID_CHashBatch, 0, __uuidof(IHashBatch), (LPVOID*)&batch));
+
+	for (int engine = HashEngineScalar; engine < HashEngineCount; engine++)
+	{
+		if (!CHashBatch::IsEngineSupported((HashEngine)engine))
+		{
+			EXPECT_EQ(E_NOTIMPL, batch->SetEngine((HashEngine)engine));
+			continue;
+		}
+		EXPECT_EQ(S_OK, batch->SetEngine((HashEngine)engine));
+		EXPECT_EQ(engine, batch->GetEngine());
+
+		std::vector<BYTE> digests(expected.size());
+		for (size_t i = 0; i < messages.size(); i++)
+			EXPECT_EQ(S_OK, batch->Add(messages[i].empty() ? NULL : &messages[i][0], messages[i].size(), &digests[i * SHA256_DIGEST_SIZE]));
+		EXPECT_EQ(S_OK, batch->Flush());
+		EXPECT_TRUE(digests == expected) << "engine " << engine;
+
+		// the batch is empty after a flush
+		EXPECT_EQ(S_OK, batch->Flush());
+	}
+
+	EXPECT_EQ(E_INVALIDARG, batch->SetEngine(HashEngineCount));
+	batch->Release();
+}
+
+TEST(CHmacSha256, KnownMacs)
+{
+	// RFC 4231 test cases 1, 2 and 6
+	BYTE mac[SHA256_DIGEST_SIZE];
+	CHmacSha256 hmac;
+
+	BYTE key[131];
+	memset(key, 0x0b, 20);
+	hmac.Init(key, 20);
+	hmac.Update("Hi There", 8);
+	hmac.Final(mac);
+	EXPECT_EQ("b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7", ToHex(mac));
+
+	hmac.Init("Jefe", 4);
+	hmac.Update("what do ya ", 11);
+	hmac.Update("want for nothing?", 17);
+	hmac.Final(mac);
+	EXPECT_EQ("5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843", ToHex(mac));
+
+	// a key longer than a block
+	memset(key, 0xaa, sizeof(key));
+	hmac.Init(key, sizeof(key));
+	const char message[] = "Test Using Larger Than Block-Size Key - Hash Key First";
+	hmac.Update(message, sizeof(message) - 1);
+	hmac.Final(mac);
+	EXPECT_EQ("60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54", ToHex(mac));
+}
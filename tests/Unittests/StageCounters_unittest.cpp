@@ -0,0 +1,104 @@
+#include <gtest/gtest.h>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/Scanner/StageCounters.h"
+
+// Counters of their own, enabled whatever the environment of the tests. Two
+// of them stand for the copies of TinyAvCore in the scanner and in a
+// plug-in: they share the table and the stages of each thread.
+class CTestCounters : public CStageCounters
+{
+public:
+	CTestCounters() {}
+	virtual ~CTestCounters() {}
+};
+
+static CTestCounters * MakeCounters(void)
+{
+	SetEnvironmentVariableW(L"TINYAV_STAGE_COUNTERS", L"1");
+	CTestCounters * counters = new CTestCounters();
+	SetEnvironmentVariableW(L"TINYAV_STAGE_COUNTERS", NULL);
+	return counters;
+}
+
+TEST(StageCounters, Disabled)
+{
+	SetEnvironmentVariableW(L"TINYAV_STAGE_COUNTERS", L"0");
+	CTestCounters counters;
+	SetEnvironmentVariableW(L"TINYAV_STAGE_COUNTERS", NULL);
+	ASSERT_FALSE(counters.IsEnabled());
+	counters.Enter(StageParse);
+	counters.Leave();
+	SCAN_STAGE_REPORT report;
+	ASSERT_EQ(E_NOT_SET, counters.Read(&report));
+	ASSERT_EQ(E_INVALIDARG, counters.Read(NULL));
+}
+
+TEST(StageCounters, Nesting)
+{
+	CTestCounters * scanner = MakeCounters();
+	CTestCounters * plugin = MakeCounters();
+	ASSERT_TRUE(scanner->IsEnabled());
+	ASSERT_TRUE(plugin->IsEnabled());
+
+	SCAN_STAGE_REPORT before, after;
+	ASSERT_EQ(S_OK, scanner->Read(&before));
+
+	// a module scan of the scanner, with a parse and an emulation of the
+	// plug-in inside it, and a stage left that was never entered
+	scanner->Enter(StageModuleScan);
+	Sleep(20);
+	plugin->Enter(StageParse);
+	Sleep(50);
+	plugin->Enter(StageEmulate);
+	Sleep(100);
+	plugin->Leave();
+	plugin->Leave();
+	scanner->Leave();
+	scanner->Leave();
+
+	// both copies read the same totals
+	ASSERT_EQ(S_OK, plugin->Read(&after));
+	ASSERT_EQ(before.stages[StageModuleScan].calls + 1, after.stages[StageModuleScan].calls);
+	ASSERT_EQ(before.stages[StageParse].calls + 1, after.stages[StageParse].calls);
+	ASSERT_EQ(before.stages[StageEmulate].calls + 1, after.stages[StageEmulate].calls);
+
+	// the inner stages are not charged to the outer ones
+	ULONGLONG scanUs = after.stages[StageModuleScan].wallUs - before.stages[StageModuleScan].wallUs;
+	ULONGLONG parseUs = after.stages[StageParse].wallUs - before.stages[StageParse].wallUs;
+	ULONGLONG emulateUs = after.stages[StageEmulate].wallUs - before.stages[StageEmulate].wallUs;
+	ASSERT_GE(scanUs, 15000);
+	ASSERT_LT(scanUs, 50000);
+	ASSERT_GE(parseUs, 45000);
+	ASSERT_LT(parseUs, 100000);
+	ASSERT_GE(emulateUs, 95000);
+
+	delete plugin;
+	delete scanner;
+}
+
+TEST(StageCounters, Threads)
+{
+	CTestCounters * counters = MakeCounters();
+	SCAN_STAGE_REPORT before, after;
+	ASSERT_EQ(S_OK, counters->Read(&before));
+
+	// each thread has its own stages
+	counters->Enter(StageModuleScan);
+	HANDLE thread = CreateThread(NULL, 0, [](LPVOID parameter) -> DWORD
+	{
+		CTestCounters * counters = (CTestCounters *)parameter;
+		counters->Enter(StageEmulate);
+		Sleep(50);
+		counters->Leave();
+		return 0;
+	}, counters, 0, NULL);
+	ASSERT_TRUE(thread != NULL);
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	counters->Leave();
+
+	ASSERT_EQ(S_OK, counters->Read(&after));
+	ASSERT_GE(after.stages[StageModuleScan].wallUs - before.stages[StageModuleScan].wallUs, 45000);
+	ASSERT_GE(after.stages[StageEmulate].wallUs - before.stages[StageEmulate].wallUs, 45000);
+	delete counters;
+}
@@ -0,0 +1,359 @@
+#include <gtest/gtest.h>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/FileSystem/TeeStream.h"
+#include "../TinyAvCore/FileSystem/BufferedStream.h"
+
+#define TEST_FILE_SIZE	(2 * TEE_BLOCK_SIZE + 1000)
+
+// Keeps the bytes it is given, and checks they come in order
+class CTestConsumer :
+	public CRefCount,
+	public IFsStreamConsumer
+{
+protected:
+	virtual ~CTestConsumer() {}
+
+public:
+	std::vector<BYTE>	m_data;
+	int					m_begun;
+	int					m_ended;
+	HRESULT				m_status;
+	BOOL				m_skip;
+
+	CTestConsumer() : m_begun(0), m_ended(0), m_status(E_PENDING), m_skip(FALSE) {}
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+	{
+		if (ppvObject == NULL) return E_INVALIDARG;
+		*ppvObject = NULL;
+		return E_NOINTERFACE;
+	}
+
+	virtual HRESULT WINAPI OnStreamBegin(__in IVirtualFs * file, __in ULONGLONG size) override
+	{
+		UNREFERENCED_PARAMETER(file);
+		UNREFERENCED_PARAMETER(size);
+		m_begun++;
+		m_data.clear();
+		return m_skip ? S_FALSE : S_OK;
+	}
+
+	virtual HRESULT WINAPI OnStreamBlock(__in ULONGLONG offset, __in_bcount(size) const BYTE * data, __in ULONG size) override
+	{
+		EXPECT_EQ((ULONGLONG)m_data.size(), offset);
+		m_data.insert(m_data.end(), data, data + size);
+		return S_OK;
+	}
+
+	virtual HRESULT WINAPI OnStreamEnd(__in HRESULT status) override
+	{
+		m_ended++;
+		m_status = status;
+		return S_OK;
+	}
+};
+
+// Takes the holes of sparse files as holes
+class CTestHoleConsumer :
+	public CTestConsumer,
+	public IFsSparseConsumer
+{
+protected:
+	virtual ~CTestHoleConsumer() {}
+
+public:
+	ULONGLONG	m_holes;
+
+	CTestHoleConsumer() : m_holes(0) {}
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+	{
+		if (ppvObject == NULL) return E_INVALIDARG;
+		if (IsEqualIID(riid, __uuidof(IFsSparseConsumer)))
+		{
+			*ppvObject = static_cast<IFsSparseConsumer*>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppvObject = NULL;
+		return E_NOINTERFACE;
+	}
+
+	virtual HRESULT WINAPI OnStreamHole(__in ULONGLONG offset, __in ULONGLONG size) override
+	{
+		EXPECT_EQ((ULONGLONG)m_data.size(), offset);
+		m_data.resize(m_data.size() + (size_t)size, 0);
+		m_holes += size;
+		return S_OK;
+	}
+};
+
+// A buffered stream with the holes of a sparse file
+class CTestSparseSource :
+	public CRefCount,
+	public IFsStream,
+	public IFsSparseStream
+{
+protected:
+	CBufferedStream *	m_inner;
+	std::vector<std::pair<ULONGLONG, ULONGLONG> >	m_ranges;	// start and end of the data
+
+	virtual ~CTestSparseSource() { m_inner->Release(); }
+
+public:
+	CTestSparseSource(__in CBufferedStream * inner, __in const std::vector<std::pair<ULONGLONG, ULONGLONG> > & ranges) :
+		m_inner(inner), m_ranges(ranges)
+	{
+		m_inner->AddRef();
+	}
+
+	DECLARE_REF_COUNT();
+
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __out _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject)
+	{
+		if (ppvObject == NULL) return E_INVALIDARG;
+		if (IsEqualIID(riid, IID_IUnknown) || IsEqualIID(riid, __uuidof(IFsStream)))
+			*ppvObject = static_cast<IFsStream*>(this);
+		else if (IsEqualIID(riid, __uuidof(IFsSparseStream)))
+			*ppvObject = static_cast<IFsSparseStream*>(this);
+		else
+		{
+			*ppvObject = NULL;
+			return E_NOINTERFACE;
+		}
+		AddRef();
+		return S_OK;
+	}
+
+	virtual HRESULT WINAPI GetDataRange(__in ULONGLONG offset, __out ULONGLONG * dataStart, __out ULONGLONG * dataEnd) override
+	{
+		for (size_t i = 0; i < m_ranges.size(); i++)
+		{
+			if (m_ranges[i].second <= offset) continue;
+			*dataStart = max(offset, m_ranges[i].first);
+			*dataEnd = m_ranges[i].second;
+			return S_OK;
+		}
+		ULARGE_INTEGER end = {};
+		LARGE_INTEGER zero = {};
+		m_inner->Seek(&end, zero, IFsStream::FsStreamEnd);
+		*dataStart = *dataEnd = end.QuadPart;
+		return S_FALSE;
+	}
+
+	virtual void WINAPI SetFileHandle(__in void* const handle) override { m_inner->SetFileHandle(handle); }
+
+	virtual HRESULT WINAPI Read(__out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out_opt ULONG * readSize) override
+	{
+		return m_inner->Read(buffer, bufferSize, readSize);
+	}
+
+	virtual HRESULT WINAPI ReadAt(__in LARGE_INTEGER const offset, __in const FsStreamSeek moveMethod,
+		__out_bcount(bufferSize) LPVOID buffer, __in ULONG bufferSize, __out_opt ULONG * readSize) override
+	{
+		return m_inner->ReadAt(offset, moveMethod, buffer, bufferSize, readSize);
+	}
+
+	virtual HRESULT WINAPI Write(__in_bcount(bufferSize) LPCVOID buffer, __in ULONG bufferSize, __out_opt ULONG * writtenSize) override
+	{
+		return m_inner->Write(buffer, bufferSize, writtenSize);
+	}
+
+	virtual HRESULT WINAPI WriteAt(__in LARGE_INTEGER const offset, __in const FsStreamSeek moveMethod,
+		__in_bcount(bufferSize) LPCVOID buffer, __in ULONG bufferSize, __out_opt ULONG * writtenSize) override
+	{
+		return m_inner->WriteAt(offset, moveMethod, buffer, bufferSize, writtenSize);
+	}
+
+	virtual HRESULT WINAPI Tell(__out ULARGE_INTEGER * pos) override { return m_inner->Tell(pos); }
+
+	virtual HRESULT WINAPI Seek(__out_opt ULARGE_INTEGER * pos, __in LARGE_INTEGER const distanceToMove, __in const FsStreamSeek MoveMethod) override
+	{
+		return m_inner->Seek(pos, distanceToMove, MoveMethod);
+	}
+
+	virtual HRESULT WINAPI Shrink(void) override { return m_inner->Shrink(); }
+};
+
+static CBufferedStream * MakeSource(__out std::vector<BYTE> & content)
+{
+	content.resize(TEST_FILE_SIZE);
+	for (size_t i = 0; i < content.size(); i++)
+		content[i] = (BYTE)(i * 7 + i / 251);
+
+	CBufferedStream * source = new CBufferedStream();
+	ULONG written = 0;
+	EXPECT_EQ(S_OK, source->Write(&content[0], (ULONG)content.size(), &written));
+	EXPECT_EQ((ULONG)content.size(), written);
+	return source;
+}
+
+static void ExpectReadAt(__in IFsStream * stream, __in ULONG offset, __in ULONG size, __in const std::vector<BYTE> & content)
+{
+	std::vector<BYTE> buffer(size);
+	LARGE_INTEGER position;
+	position.QuadPart = offset;
+	ULONG readSize = 0;
+	EXPECT_EQ(S_OK, stream->ReadAt(position, IFsStream::FsStreamBegin, &buffer[0], size, &readSize));
+	ASSERT_EQ(size, readSize);
+	EXPECT_EQ(0, memcmp(&buffer[0], &content[offset], size));
+}
+
+TEST(CTeeStream, Pump)
+{
+	std::vector<BYTE> content;
+	CBufferedStream * source = MakeSource(content);
+	CTeeStream * tee = new CTeeStream();
+	EXPECT_EQ(S_OK, tee->Initialize(source, content.size(), 64 * 1024 * 1024));
+
+	CTestConsumer * first = new CTestConsumer();
+	CTestConsumer * second = new CTestConsumer();
+	CTestConsumer * skipped = new CTestConsumer();
+	skipped->m_skip = TRUE;
+	tee->AddConsumer(first);
+	tee->AddConsumer(second);
+	tee->AddConsumer(skipped);
+
+	EXPECT_EQ(S_OK, tee->Pump(NULL));
+	EXPECT_TRUE(first->m_data == content);
+	EXPECT_TRUE(second->m_data == content);
+	EXPECT_EQ(S_OK, first->m_status);
+	EXPECT_EQ(1, skipped->m_begun);
+	EXPECT_EQ(0, skipped->m_ended);
+	EXPECT_TRUE(skipped->m_data.empty());
+
+	// every consumer got the file from a single read of it
+	EXPECT_EQ((ULONGLONG)content.size(), tee->GetSourceBytes());
+
+	// the modules reading at random offsets are served from the blocks
+	ExpectReadAt(tee, 0, 64, content);
+	ExpectReadAt(tee, TEE_BLOCK_SIZE - 10, 20, content);
+	ExpectReadAt(tee, TEST_FILE_SIZE - 100, 100, content);
+	EXPECT_EQ((ULONGLONG)content.size(), tee->GetSourceBytes());
+
+	// reading past the end stops at the end
+	BYTE buffer[200];
+	LARGE_INTEGER position;
+	position.QuadPart = TEST_FILE_SIZE - 100;
+	ULONG readSize = 0;
+	EXPECT_EQ(S_OK, tee->ReadAt(position, IFsStream::FsStreamBegin, buffer, sizeof(buffer), &readSize));
+	EXPECT_EQ(100UL, readSize);
+
+	tee->Release();
+	first->Release();
+	second->Release();
+	skipped->Release();
+	source->Release();
+}
+
+TEST(CTeeStream, NoCache)
+{
+	std::vector<BYTE> content;
+	CBufferedStream * source = MakeSource(content);
+	CTeeStream * tee = new CTeeStream();
+	EXPECT_EQ(S_OK, tee->Initialize(source, content.size(), 0));
+
+	CTestConsumer * consumer = new CTestConsumer();
+	tee->AddConsumer(consumer);
+	EXPECT_EQ(S_OK, tee->Pump(NULL));
+	EXPECT_TRUE(consumer->m_data == content);
+
+	// without a cache the reads go to the source
+	ExpectReadAt(tee, 100, 100, content);
+	EXPECT_EQ((ULONGLONG)content.size() + 100, tee->GetSourceBytes());
+
+	tee->Release();
+	consumer->Release();
+	source->Release();
+}
+
+TEST(CTeeStream, Write)
+{
+	std::vector<BYTE> content;
+	CBufferedStream * source = MakeSource(content);
+	CTeeStream * tee = new CTeeStream();
+	EXPECT_EQ(S_OK, tee->Initialize(source, content.size(), 64 * 1024 * 1024));
+	ExpectReadAt(tee, TEE_BLOCK_SIZE, 100, content);
+
+	// a write reaches the file and is seen by the next reads
+	BYTE patch[16];
+	memset(patch, 0xCC, sizeof(patch));
+	LARGE_INTEGER position;
+	position.QuadPart = TEE_BLOCK_SIZE + 10;
+	ULONG writtenSize = 0;
+	EXPECT_EQ(S_OK, tee->WriteAt(position, IFsStream::FsStreamBegin, patch, sizeof(patch), &writtenSize));
+	EXPECT_EQ((ULONG)sizeof(patch), writtenSize);
+	memcpy(&content[TEE_BLOCK_SIZE + 10], patch, sizeof(patch));
+	ExpectReadAt(tee, TEE_BLOCK_SIZE, 100, content);
+	ExpectReadAt(source, TEE_BLOCK_SIZE, 100, content);
+
+	// so is a shrink
+	position.QuadPart = TEE_BLOCK_SIZE;
+	ULARGE_INTEGER end = {};
+	EXPECT_EQ(S_OK, tee->Seek(NULL, position, IFsStream::FsStreamBegin));
+	EXPECT_EQ(S_OK, tee->Shrink());
+	position.QuadPart = 0;
+	EXPECT_EQ(S_OK, tee->Seek(&end, position, IFsStream::FsStreamEnd));
+	EXPECT_EQ((ULONGLONG)TEE_BLOCK_SIZE, end.QuadPart);
+
+	tee->Release();
+	source->Release();
+}
+
+TEST(CTeeStream, Sparse)
+{
+	// data at the start and inside the sixth block, holes elsewhere
+	std::vector<std::pair<ULONGLONG, ULONGLONG> > ranges;
+	ranges.push_back(std::make_pair(0ULL, 1000ULL));
+	ranges.push_back(std::make_pair(5ULL * TEE_BLOCK_SIZE + 100, 6ULL * TEE_BLOCK_SIZE));
+	std::vector<BYTE> content(8 * TEE_BLOCK_SIZE, 0);
+	for (size_t r = 0; r < ranges.size(); r++)
+	{
+		for (size_t i = (size_t)ranges[r].first; i < (size_t)ranges[r].second; i++)
+			content[i] = (BYTE)(i * 7 + 1);
+	}
+
+	CBufferedStream * inner = new CBufferedStream();
+	ULONG written = 0;
+	EXPECT_EQ(S_OK, inner->Write(&content[0], (ULONG)content.size(), &written));
+	CTestSparseSource * source = new CTestSparseSource(inner, ranges);
+	CTeeStream * tee = new CTeeStream();
+	EXPECT_EQ(S_OK, tee->Initialize(source, content.size(), 64 * 1024 * 1024));
+
+	CTestConsumer * zeros = new CTestConsumer();
+	CTestHoleConsumer * holes = new CTestHoleConsumer();
+	tee->AddConsumer(zeros);
+	tee->AddConsumer(holes);
+	EXPECT_EQ(S_OK, tee->Pump(NULL));
+
+	// both see the file; only the two blocks with data are read
+	EXPECT_TRUE(zeros->m_data == content);
+	EXPECT_TRUE(holes->m_data == content);
+	EXPECT_EQ(6ULL * TEE_BLOCK_SIZE, holes->m_holes);
+	EXPECT_EQ(2ULL * TEE_BLOCK_SIZE, tee->GetSourceBytes());
+	EXPECT_EQ(6ULL * TEE_BLOCK_SIZE, tee->GetHoleBytes());
+
+	// the holes are served as zeros without reads
+	ExpectReadAt(tee, 2 * TEE_BLOCK_SIZE + 5, 100, content);
+	ExpectReadAt(tee, 5 * TEE_BLOCK_SIZE, TEE_BLOCK_SIZE + 10, content);
+	EXPECT_EQ(2ULL * TEE_BLOCK_SIZE, tee->GetSourceBytes());
+
+	// a write in a hole is read back
+	BYTE patch[16];
+	memset(patch, 0xCC, sizeof(patch));
+	LARGE_INTEGER position;
+	position.QuadPart = 3 * TEE_BLOCK_SIZE + 10;
+	EXPECT_EQ(S_OK, tee->WriteAt(position, IFsStream::FsStreamBegin, patch, sizeof(patch), &written));
+	memcpy(&content[3 * TEE_BLOCK_SIZE + 10], patch, sizeof(patch));
+	ExpectReadAt(tee, 3 * TEE_BLOCK_SIZE, 100, content);
+
+	tee->Release();
+	zeros->Release();
+	holes->Release();
+	source->Release();
+	inner->Release();
+}
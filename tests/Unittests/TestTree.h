@@ -0,0 +1,68 @@
+#pragma once
+#include <windows.h>
+#include <shlwapi.h>
+#include <TinyAvCore.h>
+
+// Creates an empty directory with a unique name in the temporary directory
+inline void MakeTestDirectory(__in LPCWSTR lpPrefix, __out_ecount(MAX_PATH) LPWSTR lpDirectory)
+{
+	WCHAR szTempDir[MAX_PATH] = {};
+	GetTempPathW(MAX_PATH, szTempDir);
+	GetTempFileNameW(szTempDir, lpPrefix, 0, lpDirectory);
+	DeleteFileW(lpDirectory);
+	CreateDirectoryW(lpDirectory, NULL);
+}
+
+// Creates lpName in lpDirectory; lpPath receives its full path
+inline BOOL MakeTestSubdirectory(__in LPCWSTR lpDirectory, __in LPCWSTR lpName, __out_ecount(MAX_PATH) LPWSTR lpPath)
+{
+	wcscpy_s(lpPath, MAX_PATH, lpDirectory);
+	PathAppendW(lpPath, lpName);
+	return CreateDirectoryW(lpPath, NULL);
+}
+
+// Opens the file with dwCreation and appends dwSize bytes to it
+inline BOOL WriteTestFile(__in LPCWSTR lpDirectory, __in LPCWSTR lpFileName, __in DWORD dwCreation, __in DWORD dwSize)
+{
+	WCHAR szPath[MAX_PATH] = {};
+	wcscpy_s(szPath, lpDirectory);
+	PathAppendW(szPath, lpFileName);
+	HANDLE hFile = CreateFileW(szPath, FILE_APPEND_DATA, 0, NULL, dwCreation, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+	BYTE buffer[256] = {};
+	BOOL bResult = TRUE;
+	while (bResult && dwSize)
+	{
+		DWORD dwWritten = 0;
+		bResult = WriteFile(hFile, buffer, min(dwSize, (DWORD)sizeof(buffer)), &dwWritten, NULL);
+		dwSize -= dwWritten;
+	}
+	CloseHandle(hFile);
+	return bResult;
+}
+
+// Deletes the directory with everything below it
+inline void RemoveTestDirectory(__in LPCWSTR lpDirectory)
+{
+	WCHAR szPath[MAX_PATH] = {};
+	wcscpy_s(szPath, lpDirectory);
+	PathAppendW(szPath, L"*");
+	WIN32_FIND_DATAW wfd = {};
+	HANDLE hFind = FindFirstFileW(szPath, &wfd);
+	if (hFind != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			if (!wcscmp(wfd.cFileName, L".") || !wcscmp(wfd.cFileName, L".."))
+				continue;
+			wcscpy_s(szPath, lpDirectory);
+			PathAppendW(szPath, wfd.cFileName);
+			if (TEST_FLAG(wfd.dwFileAttributes, FILE_ATTRIBUTE_DIRECTORY))
+				RemoveTestDirectory(szPath);
+			else
+				DeleteFileW(szPath);
+		} while (FindNextFileW(hFind, &wfd));
+		FindClose(hFind);
+	}
+	RemoveDirectoryW(lpDirectory);
+}
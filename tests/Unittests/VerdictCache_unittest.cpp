@@ -0,0 +1,174 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <vector>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/FileSystem/FileFsEnumContext.h"
+#include "../TinyAvCore/Scanner/VerdictStamps.h"
+#include "../TinyAvCore/Scanner/VerdictCache.h"
+
+extern WCHAR szTestcase[MAX_PATH];
+
+static VERDICT_CACHE_ENTRY MakeEntry(__in BYTE tag, __in DWORD signature, __in LONG archiveDepth)
+{
+	VERDICT_CACHE_ENTRY entry;
+	ZeroMemory(&entry, sizeof(entry));
+	memset(entry.digest, tag, sizeof(entry.digest));
+	entry.fileSize = 1000 + tag;
+	entry.signature = signature;
+	entry.archiveDepth = archiveDepth;
+	return entry;
+}
+
+static void WriteCache(__in LPCWSTR lpPath, __in const VERDICT_CACHE_HEADER * header, __in_ecount(count) const VERDICT_CACHE_ENTRY * entries, __in size_t count)
+{
+	HANDLE hFile = CreateFileW(lpPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	ASSERT_NE(INVALID_HANDLE_VALUE, hFile);
+	DWORD written = 0;
+	ASSERT_TRUE(WriteFile(hFile, header, sizeof(*header), &written, NULL));
+	ASSERT_TRUE(WriteFile(hFile, entries, (DWORD)(count * sizeof(VERDICT_CACHE_ENTRY)), &written, NULL));
+	CloseHandle(hFile);
+}
+
+TEST(VerdictCache, Merge)
+{
+	CVerdictCache * cache = new CVerdictCache();
+	VERDICT_CACHE_ENTRY first[] = { MakeEntry(1, 7, 2), MakeEntry(3, 7, 2), MakeEntry(5, 7, 2) };
+	VERDICT_CACHE_ENTRY second[] = { MakeEntry(2, 7, 2), MakeEntry(3, 7, -1), MakeEntry(3, 9, 2), MakeEntry(6, 7, 2) };
+	ASSERT_EQ(S_OK, cache->Merge(first, _countof(first)));
+	ASSERT_EQ(S_OK, cache->Merge(second, _countof(second)));
+	ASSERT_EQ(6, cache->GetCount());
+
+	// by digest, signature, size and depth into archives
+	ASSERT_TRUE(cache->Find(first[0].digest, first[0].fileSize, 7, 2));
+	ASSERT_TRUE(cache->Find(first[0].digest, first[0].fileSize, 7, 1));
+	ASSERT_FALSE(cache->Find(first[0].digest, first[0].fileSize, 7, 3));
+	ASSERT_FALSE(cache->Find(first[0].digest, first[0].fileSize, 7, -1));
+	ASSERT_FALSE(cache->Find(first[0].digest, first[0].fileSize, 8, 2));
+	ASSERT_FALSE(cache->Find(first[0].digest, first[0].fileSize + 1, 7, 2));
+	ASSERT_TRUE(cache->Find(second[2].digest, second[2].fileSize, 9, 2));
+	VERDICT_CACHE_ENTRY missing = MakeEntry(4, 7, 2);
+	ASSERT_FALSE(cache->Find(missing.digest, missing.fileSize, 7, 2));
+
+	// the deeper scan of the same content is kept
+	ASSERT_TRUE(cache->Find(first[1].digest, first[1].fileSize, 7, -1));
+
+	// a run out of order is refused
+	VERDICT_CACHE_ENTRY unsorted[] = { MakeEntry(9, 7, 2), MakeEntry(8, 7, 2) };
+	ASSERT_EQ(E_INVALIDARG, cache->Merge(unsorted, _countof(unsorted)));
+	VERDICT_CACHE_ENTRY duplicates[] = { MakeEntry(9, 7, 2), MakeEntry(9, 7, 2) };
+	ASSERT_EQ(E_INVALIDARG, cache->Merge(duplicates, _countof(duplicates)));
+	ASSERT_EQ(6, cache->GetCount());
+
+	cache->Release();
+}
+
+TEST(VerdictCache, Add)
+{
+	CVerdictCache * cache = new CVerdictCache();
+
+	// found before and after the entries are merged
+	for (int i = VERDICT_CACHE_PENDING + 10; i > 0; i--)
+	{
+		VERDICT_CACHE_ENTRY entry = MakeEntry(0, 7, 2);
+		*(int *)entry.digest = i;
+		ASSERT_EQ(S_OK, cache->Add(entry));
+		ASSERT_TRUE(cache->Find(entry.digest, entry.fileSize, 7, 2));
+	}
+	VERDICT_CACHE_ENTRY deeper = MakeEntry(0, 7, -1);
+	*(int *)deeper.digest = 1;
+	ASSERT_EQ(S_OK, cache->Add(deeper));
+	ASSERT_EQ(S_OK, cache->Add(MakeEntry(0x11, 7, 2)));
+	ASSERT_EQ(VERDICT_CACHE_PENDING + 11, cache->GetCount());
+	ASSERT_TRUE(cache->Find(deeper.digest, deeper.fileSize, 7, -1));
+
+	cache->Release();
+}
+
+TEST(VerdictCache, ExportImport)
+{
+	WCHAR szCache[MAX_PATH];
+	wcscpy_s(szCache, MAX_PATH, szTestcase);
+	wcscat_s(szCache, MAX_PATH, L".verdicts");
+
+	CVerdictCache * cache = new CVerdictCache();
+	VERDICT_CACHE_ENTRY entries[] = { MakeEntry(1, 7, 2), MakeEntry(3, 7, 2), MakeEntry(5, 7, -1) };
+	ASSERT_EQ(S_OK, cache->Merge(entries, _countof(entries)));
+	ASSERT_EQ(S_OK, cache->Add(MakeEntry(4, 7, 2)));
+	ASSERT_HRESULT_SUCCEEDED(cache->Export(szCache));
+	cache->Release();
+
+	// into another host's cache
+	cache = new CVerdictCache();
+	ASSERT_EQ(S_OK, cache->Add(MakeEntry(2, 7, 2)));
+	ASSERT_HRESULT_SUCCEEDED(cache->Import(szCache));
+	ASSERT_EQ(5, cache->GetCount());
+	for (BYTE tag = 1; tag <= 5; tag++)
+	{
+		VERDICT_CACHE_ENTRY entry = MakeEntry(tag, 7, 2);
+		ASSERT_TRUE(cache->Find(entry.digest, entry.fileSize, 7, 2));
+	}
+	// once more changes nothing
+	ASSERT_HRESULT_SUCCEEDED(cache->Import(szCache));
+	ASSERT_EQ(5, cache->GetCount());
+	cache->Release();
+
+	// a damaged file
+	VERDICT_CACHE_HEADER header;
+	ZeroMemory(&header, sizeof(header));
+	header.magic = VERDICT_CACHE_MAGIC;
+	header.version = VERDICT_CACHE_VERSION;
+	header.entrySize = sizeof(VERDICT_CACHE_ENTRY);
+	header.engine = VERDICT_ENGINE_GENERATION;
+	header.count = _countof(entries);
+	CVerdictCache::Checksum(&header, entries, _countof(entries), header.checksum);
+	entries[1].archiveDepth = -1;
+	WriteCache(szCache, &header, entries, _countof(entries));
+	cache = new CVerdictCache();
+	ASSERT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), cache->Import(szCache));
+	entries[1].archiveDepth = 2;
+
+	// a file cut short
+	WriteCache(szCache, &header, entries, _countof(entries) - 1);
+	ASSERT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), cache->Import(szCache));
+
+	// entries out of order
+	VERDICT_CACHE_ENTRY unsorted[] = { entries[1], entries[0], entries[2] };
+	CVerdictCache::Checksum(&header, unsorted, _countof(unsorted), header.checksum);
+	WriteCache(szCache, &header, unsorted, _countof(unsorted));
+	ASSERT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), cache->Import(szCache));
+
+	// written by another engine generation
+	header.engine = VERDICT_ENGINE_GENERATION + 1;
+	CVerdictCache::Checksum(&header, entries, _countof(entries), header.checksum);
+	WriteCache(szCache, &header, entries, _countof(entries));
+	ASSERT_EQ(HRESULT_FROM_WIN32(ERROR_REVISION_MISMATCH), cache->Import(szCache));
+	ASSERT_EQ(0, cache->GetCount());
+	cache->Release();
+
+	DeleteFileW(szCache);
+}
+
+TEST(VerdictCache, Stamps)
+{
+	CVerdictStamps * stamps = new CVerdictStamps();
+	ASSERT_TRUE(stamps->GetCache() != NULL);
+	VERDICT_MODULE modules[] = { { 0x10, 1 }, { 0x20, 1 } };
+	stamps->SetModules(7, modules, _countof(modules));
+	ASSERT_EQ(S_OK, stamps->GetCache()->Add(MakeEntry(1, 7, -1)));
+
+	// a hit leaves out every module, for the files inside the file too
+	VERDICT_CACHE_ENTRY entry = MakeEntry(1, 7, -1);
+	CVerdictStamps::BeginFile();
+	ASSERT_FALSE(CVerdictStamps::IsCovered(modules[0]));
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	ASSERT_FALSE(stamps->FindCached(entry.digest, entry.fileSize, 8, enumContext));
+	ASSERT_FALSE(CVerdictStamps::IsCovered(modules[0]));
+	ASSERT_TRUE(stamps->FindCached(entry.digest, entry.fileSize, 7, enumContext));
+	ASSERT_TRUE(CVerdictStamps::IsCovered(modules[0]));
+	ASSERT_TRUE(CVerdictStamps::IsCovered(modules[1]));
+	CVerdictStamps::BeginFile();
+	ASSERT_FALSE(CVerdictStamps::IsCovered(modules[1]));
+
+	enumContext->Release();
+	stamps->Release();
+}
@@ -0,0 +1,320 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <vector>
+#include <TinyAvCore.h>
+#include "../TinyAvCore/FileSystem/FileFsEnumContext.h"
+#include "../TinyAvCore/FileSystem/FileFs.h"
+#include "../TinyAvCore/Scanner/VerdictStamps.h"
+
+extern WCHAR szTestcase[MAX_PATH];
+
+static void MakeStampedCopy(__out_ecount(MAX_PATH) WCHAR * szCopy)
+{
+	wcscpy_s(szCopy, MAX_PATH, szTestcase);
+	wcscat_s(szCopy, MAX_PATH, L".stamp");
+	CopyFileW(szTestcase, szCopy, FALSE);
+}
+
+static CVerdictStamps * MakeStamps(__in BYTE seed = 0x42)
+{
+	BYTE key[VERDICT_KEY_SIZE];
+	memset(key, seed, sizeof(key));
+	CVerdictStamps * stamps = MakeStamps();
+	stamps->SetKey(key, sizeof(key));
+	return stamps;
+}
+
+static void FindEntry(__in LPCWSTR lpPath, __out WIN32_FIND_DATAW * wfd)
+{
+	HANDLE hFind = FindFirstFileW(lpPath, wfd);
+	ASSERT_NE(INVALID_HANDLE_VALUE, hFind);
+	FindClose(hFind);
+}
+
+TEST(VerdictStamps, ReadWrite)
+{
+	WCHAR szCopy[MAX_PATH];
+	MakeStampedCopy(szCopy);
+	WIN32_FIND_DATAW before;
+	FindEntry(szCopy, &before);
+	CVerdictStamps * stamps = MakeStamps();
+
+	VERDICT_STAMP stamp = {}, read = {};
+	stamp.engine = VERDICT_ENGINE_GENERATION;
+	stamp.signature = 0x1234;
+	stamp.archiveDepth = -1;
+	stamp.fileSize = 0x100000;
+	stamp.lastWrite = before.ftLastWriteTime;
+	memset(stamp.digest, 0xAB, sizeof(stamp.digest));
+	ASSERT_HRESULT_SUCCEEDED(stamps->Write(szCopy, &stamp));
+	ASSERT_HRESULT_SUCCEEDED(stamps->Read(szCopy, &read));
+	ASSERT_TRUE(0 == memcmp(&stamp, &read, sizeof(stamp)));
+
+	// the stamp leaves the size and last write time of the file alone
+	WIN32_FIND_DATAW after;
+	FindEntry(szCopy, &after);
+	ASSERT_EQ(before.nFileSizeLow, after.nFileSizeLow);
+	ASSERT_EQ(0, CompareFileTime(&before.ftLastWriteTime, &after.ftLastWriteTime));
+
+	// a damaged stamp is not read
+	StringW streamPath = StringW(szCopy) + VERDICT_STAMP_STREAM;
+	HANDLE hStream = CreateFileW(streamPath.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	ASSERT_NE(INVALID_HANDLE_VALUE, hStream);
+	DWORD written = 0;
+	SetFilePointer(hStream, offsetof(VERDICT_STAMP, signature), NULL, FILE_BEGIN);
+	ASSERT_TRUE(WriteFile(hStream, "\xFF", 1, &written, NULL));
+	CloseHandle(hStream);
+	ASSERT_HRESULT_FAILED(stamps->Read(szCopy, &read));
+
+	DeleteFileW(szCopy);
+	ASSERT_HRESULT_FAILED(stamps->Read(szCopy, &read));
+	stamps->Release();
+}
+
+TEST(VerdictStamps, Key)
+{
+	WCHAR szCopy[MAX_PATH], szOther[MAX_PATH];
+	MakeStampedCopy(szCopy);
+	wcscpy_s(szOther, szCopy);
+	wcscat_s(szOther, L".copy");
+	CVerdictStamps * stamps = MakeStamps();
+	CVerdictStamps * others = MakeStamps(0x24);
+
+	VERDICT_STAMP stamp = {}, read = {};
+	stamp.engine = VERDICT_ENGINE_GENERATION;
+	stamp.signature = 0x1234;
+	ASSERT_HRESULT_SUCCEEDED(stamps->Write(szCopy, &stamp));
+	ASSERT_HRESULT_SUCCEEDED(stamps->Read(szCopy, &read));
+
+	// made with another key
+	ASSERT_HRESULT_FAILED(others->Read(szCopy, &read));
+
+	// copied with the file to another one
+	ASSERT_TRUE(CopyFileW(szCopy, szOther, FALSE));
+	ASSERT_HRESULT_FAILED(stamps->Read(szOther, &read));
+
+	// no key, no stamp
+	ASSERT_EQ(E_INVALIDARG, others->SetKey(stamp.digest, 4));
+	ASSERT_HRESULT_SUCCEEDED(others->SetKey(NULL, 0));
+	ASSERT_FALSE(others->HasKey());
+	ASSERT_EQ(NTE_NO_KEY, others->Read(szCopy, &read));
+	ASSERT_EQ(NTE_NO_KEY, others->Write(szCopy, &stamp));
+	ASSERT_HRESULT_SUCCEEDED(stamps->Read(szCopy, &read));
+
+	others->Release();
+	stamps->Release();
+	DeleteFileW(szOther);
+	DeleteFileW(szCopy);
+}
+
+TEST(VerdictStamps, IsCurrent)
+{
+	WCHAR szCopy[MAX_PATH];
+	MakeStampedCopy(szCopy);
+	WIN32_FIND_DATAW wfd;
+	FindEntry(szCopy, &wfd);
+
+	CVerdictStamps * stamps = MakeStamps();
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	stamps->SetModules(0x1234, NULL, 0);
+	enumContext->SetMaxDepthInArchive(2);
+	ASSERT_FALSE(stamps->IsCurrent(szCopy, &wfd, enumContext));
+
+	VERDICT_STAMP stamp = {};
+	stamp.engine = VERDICT_ENGINE_GENERATION;
+	stamp.signature = 0x1234;
+	stamp.archiveDepth = 2;
+	stamp.fileSize = ((ULONGLONG)wfd.nFileSizeHigh << 32) | wfd.nFileSizeLow;
+	stamp.lastWrite = wfd.ftLastWriteTime;
+	ASSERT_HRESULT_SUCCEEDED(stamps->Write(szCopy, &stamp));
+	ASSERT_TRUE(stamps->IsCurrent(szCopy, &wfd, enumContext));
+	ASSERT_TRUE(stamps->IsCurrent(szCopy, NULL, enumContext));
+
+	// a stamp covers the scans that go no deeper into archives
+	enumContext->SetMaxDepthInArchive(1);
+	ASSERT_TRUE(stamps->IsCurrent(szCopy, &wfd, enumContext));
+	enumContext->SetMaxDepthInArchive(3);
+	ASSERT_FALSE(stamps->IsCurrent(szCopy, &wfd, enumContext));
+	enumContext->SetMaxDepthInArchive(-1);
+	ASSERT_FALSE(stamps->IsCurrent(szCopy, &wfd, enumContext));
+	enumContext->SetMaxDepthInArchive(2);
+
+	// other modules
+	stamps->SetModules(0x4321, NULL, 0);
+	ASSERT_FALSE(stamps->IsCurrent(szCopy, &wfd, enumContext));
+	stamps->SetModules(0, NULL, 0);
+	ASSERT_FALSE(stamps->IsCurrent(szCopy, &wfd, enumContext));
+	stamps->SetModules(0x1234, NULL, 0);
+
+	// the file is written after it was stamped
+	HANDLE hFile = CreateFileW(szCopy, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	ASSERT_NE(INVALID_HANDLE_VALUE, hFile);
+	FILETIME later = wfd.ftLastWriteTime;
+	later.dwHighDateTime++;
+	ASSERT_TRUE(SetFileTime(hFile, NULL, NULL, &later));
+	CloseHandle(hFile);
+	ASSERT_FALSE(stamps->IsCurrent(szCopy, NULL, enumContext));
+
+	enumContext->Release();
+	stamps->Release();
+	DeleteFileW(szCopy);
+}
+
+TEST(VerdictStamps, EndFile)
+{
+	WCHAR szCopy[MAX_PATH];
+	MakeStampedCopy(szCopy);
+	WIN32_FIND_DATAW wfd;
+	FindEntry(szCopy, &wfd);
+
+	CVerdictStamps * stamps = MakeStamps();
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	IVirtualFs * fs = new CFileFs();
+	ASSERT_HRESULT_SUCCEEDED(fs->Create(szCopy, 0));
+	stamps->SetModules(0x1234, NULL, 0);
+	BYTE digest[SHA256_DIGEST_SIZE];
+	memset(digest, 0x5A, sizeof(digest));
+	VERDICT_STAMP stamp;
+
+	// not scanned to its end
+	CVerdictStamps::BeginFile();
+	ASSERT_EQ(S_FALSE, stamps->EndFile(fs, enumContext));
+	ASSERT_HRESULT_FAILED(stamps->Read(szCopy, &stamp));
+
+	// something was found
+	CVerdictStamps::BeginFile();
+	CVerdictStamps::OnFileScanned(0x1234, digest);
+	CVerdictStamps::OnDetected();
+	ASSERT_EQ(S_FALSE, stamps->EndFile(fs, enumContext));
+	ASSERT_HRESULT_FAILED(stamps->Read(szCopy, &stamp));
+
+	// the modules changed during the scan
+	CVerdictStamps::BeginFile();
+	CVerdictStamps::OnFileScanned(0x4321, digest);
+	ASSERT_EQ(S_FALSE, stamps->EndFile(fs, enumContext));
+
+	// clean
+	CVerdictStamps::BeginFile();
+	CVerdictStamps::OnFileScanned(0x1234, digest);
+	ASSERT_EQ(S_OK, stamps->EndFile(fs, enumContext));
+	ASSERT_HRESULT_SUCCEEDED(stamps->Read(szCopy, &stamp));
+	ASSERT_EQ(0x1234, stamp.signature);
+	ASSERT_EQ(enumContext->GetMaxDepthInArchive(), stamp.archiveDepth);
+	ASSERT_TRUE(0 == memcmp(digest, stamp.digest, sizeof(digest)));
+	ASSERT_TRUE(stamps->IsCurrent(szCopy, &wfd, enumContext));
+
+	// the state is consumed by EndFile
+	ASSERT_EQ(S_FALSE, stamps->EndFile(fs, enumContext));
+
+	fs->Release();
+	enumContext->Release();
+	stamps->Release();
+	DeleteFileW(szCopy);
+}
+
+TEST(VerdictStamps, Modules)
+{
+	WCHAR szCopy[MAX_PATH];
+	MakeStampedCopy(szCopy);
+	WIN32_FIND_DATAW wfd;
+	FindEntry(szCopy, &wfd);
+
+	CVerdictStamps * stamps = MakeStamps();
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	IVirtualFs * fs = new CFileFs();
+	ASSERT_HRESULT_SUCCEEDED(fs->Create(szCopy, 0));
+	BYTE digest[SHA256_DIGEST_SIZE] = {};
+	VERDICT_MODULE modules[] = { { 0x10, 1 }, { 0x20, 1 }, { 0x30, 1 } };
+
+	// stamped by the first two modules
+	memset(digest, 0x5A, sizeof(digest));
+	stamps->SetModules(0x1234, modules, 2);
+	CVerdictStamps::BeginFile();
+	CVerdictStamps::OnFileScanned(0x1234, digest);
+	ASSERT_EQ(S_OK, stamps->EndFile(fs, enumContext));
+	VERDICT_STAMP stamp;
+	ASSERT_TRUE(stamps->IsCurrent(szCopy, &wfd, enumContext, &stamp));
+	ASSERT_EQ(2, stamp.moduleCount);
+
+	// one of them is removed: the other one still covers the file
+	stamps->SetModules(0x5678, &modules[1], 1);
+	ASSERT_TRUE(stamps->IsCurrent(szCopy, &wfd, enumContext));
+
+	// a module is added and another one updated: only they scan the file
+	VERDICT_MODULE updated[] = { { 0x10, 1 }, { 0x20, 2 }, { 0x30, 1 } };
+	stamps->SetModules(0x9ABC, updated, 3);
+	ASSERT_FALSE(stamps->IsCurrent(szCopy, &wfd, enumContext, &stamp));
+	ASSERT_EQ(0x1234, stamp.signature);
+	CVerdictStamps::BeginFile(&stamp);
+
+	// not before the content is read and matches the stamp
+	ASSERT_FALSE(CVerdictStamps::IsCovered(updated[0]));
+	ASSERT_TRUE(CVerdictStamps::VerifyContent(digest));
+	ASSERT_TRUE(CVerdictStamps::IsCovered(updated[0]));
+	ASSERT_FALSE(CVerdictStamps::IsCovered(updated[1]));
+	ASSERT_FALSE(CVerdictStamps::IsCovered(updated[2]));
+
+	// the new stamp lists every module
+	CVerdictStamps::OnFileScanned(0x9ABC, digest);
+	ASSERT_EQ(S_OK, stamps->EndFile(fs, enumContext));
+	ASSERT_FALSE(CVerdictStamps::IsCovered(updated[0]));
+	ASSERT_TRUE(stamps->IsCurrent(szCopy, &wfd, enumContext, &stamp));
+	ASSERT_EQ(3, stamp.moduleCount);
+	ASSERT_TRUE(0 == memcmp(updated, stamp.modules, sizeof(updated)));
+
+	// the file is changed and its size and last write time put back
+	BYTE other[SHA256_DIGEST_SIZE];
+	memset(other, 0xA5, sizeof(other));
+	CVerdictStamps::BeginFile(&stamp);
+	ASSERT_FALSE(CVerdictStamps::VerifyContent(other));
+	ASSERT_FALSE(CVerdictStamps::IsCovered(updated[0]));
+
+	// a changed file covers nothing
+	VERDICT_STAMP none;
+	WIN32_FIND_DATAW changed = wfd;
+	changed.nFileSizeLow++;
+	ASSERT_FALSE(stamps->IsCurrent(szCopy, &changed, enumContext, &none));
+	CVerdictStamps::BeginFile(&none);
+	ASSERT_FALSE(CVerdictStamps::IsCovered(updated[0]));
+
+	fs->Release();
+	enumContext->Release();
+	stamps->Release();
+	DeleteFileW(szCopy);
+}
+
+TEST(VerdictStamps, Hasher)
+{
+	std::vector<BYTE> content(3 * 4096, 0);
+	for (size_t i = 0; i < 4096; i++)
+		content[i] = (BYTE)(i * 7);
+	for (size_t i = 2 * 4096; i < content.size(); i++)
+		content[i] = (BYTE)(i * 13);
+	BYTE expected[SHA256_DIGEST_SIZE], digest[SHA256_DIGEST_SIZE];
+	CSha256::Hash(&content[0], content.size(), expected);
+
+	// a block, a hole and a block
+	CVerdictHasher * hasher = new CVerdictHasher();
+	ASSERT_EQ(E_NOT_SET, hasher->GetDigest(digest));
+	ASSERT_HRESULT_SUCCEEDED(hasher->OnStreamBegin(NULL, content.size()));
+	ASSERT_HRESULT_SUCCEEDED(hasher->OnStreamBlock(0, &content[0], 4096));
+	ASSERT_HRESULT_SUCCEEDED(hasher->OnStreamHole(4096, 4096));
+	ASSERT_HRESULT_SUCCEEDED(hasher->OnStreamBlock(2 * 4096, &content[2 * 4096], 4096));
+	ASSERT_HRESULT_SUCCEEDED(hasher->OnStreamEnd(S_OK));
+	ASSERT_HRESULT_SUCCEEDED(hasher->GetDigest(digest));
+	ASSERT_TRUE(0 == memcmp(expected, digest, sizeof(digest)));
+
+	// read in part
+	ASSERT_HRESULT_SUCCEEDED(hasher->OnStreamBegin(NULL, content.size()));
+	ASSERT_HRESULT_SUCCEEDED(hasher->OnStreamBlock(0, &content[0], 4096));
+	ASSERT_HRESULT_SUCCEEDED(hasher->OnStreamEnd(S_OK));
+	ASSERT_EQ(E_NOT_SET, hasher->GetDigest(digest));
+
+	// a failed read
+	ASSERT_HRESULT_SUCCEEDED(hasher->OnStreamBegin(NULL, 4096));
+	ASSERT_HRESULT_SUCCEEDED(hasher->OnStreamBlock(0, &content[0], 4096));
+	ASSERT_HRESULT_SUCCEEDED(hasher->OnStreamEnd(E_FAIL));
+	ASSERT_EQ(E_NOT_SET, hasher->GetDigest(digest));
+
+	hasher->Release();
+}
@@ -0,0 +1,284 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <TinyAvCore.h>
+#include <shlwapi.h>
+#include <map>
+#include "../TinyAvCore/FileSystem/FileFsEnumContext.h"
+#include "../TinyAvCore/FileSystem/WatchFsEnum.h"
+#include "../TinyAvCore/FileSystem/FileFs.h"
+#include "TestTree.h"
+
+#define WATCH_TEST_TIMEOUT	(30 * 1000)
+#define OVERFLOW_FILE_COUNT	(2000)
+#define WATCH_FILE_SIZE		(6)	// bytes appended by each write
+
+// Counts the files reported by name. The watch reports them on its own thread.
+class CWatchEnumObserver
+	: public CRefCount
+	, public IFsEnumObserver
+{
+private:
+	CRITICAL_SECTION m_lock;
+	std::map<StringW, UINT> m_found;
+	StringW m_gateName;
+	HANDLE m_hEntered;	// set when the gate file is reported the first time
+	HANDLE m_hRelease;	// the first report of the gate file waits for it
+public:
+	CWatchEnumObserver()
+	{
+		InitializeCriticalSection(&m_lock);
+		m_hEntered = CreateEvent(NULL, TRUE, FALSE, NULL);
+		m_hRelease = CreateEvent(NULL, TRUE, TRUE, NULL);
+	}
+	virtual ~CWatchEnumObserver()
+	{
+		CloseHandle(m_hEntered);
+		CloseHandle(m_hRelease);
+		DeleteCriticalSection(&m_lock);
+	}
+	virtual HRESULT WINAPI QueryInterface(__in REFIID riid, __in void **ppvObject)
+	{
+		if (ppvObject == NULL) return E_INVALIDARG;
+		if (IsEqualIID(riid, IID_IUnknown) ||
+			IsEqualIID(riid, __uuidof(IFsEnumObserver))
+			)
+		{
+			*ppvObject = static_cast<IFsEnumObserver*>(this);
+			AddRef();
+			return S_OK;
+		}
+		else
+		{
+			*ppvObject = NULL;
+		}
+		return E_NOINTERFACE;
+	}
+	DECLARE_REF_COUNT();
+
+	// Hold the watch thread in the first report of a file
+	void SetGate(__in LPCWSTR lpFileName)
+	{
+		m_gateName = lpFileName;
+		ResetEvent(m_hRelease);
+	}
+
+	BOOL WaitForGate(void)
+	{
+		return WaitForSingleObject(m_hEntered, WATCH_TEST_TIMEOUT) == WAIT_OBJECT_0;
+	}
+
+	void OpenGate(void)
+	{
+		SetEvent(m_hRelease);
+	}
+
+	UINT GetCount(__in LPCWSTR lpFileName)
+	{
+		EnterCriticalSection(&m_lock);
+		std::map<StringW, UINT>::const_iterator it = m_found.find(lpFileName);
+		UINT count = (it == m_found.end()) ? 0 : it->second;
+		LeaveCriticalSection(&m_lock);
+		return count;
+	}
+
+	virtual HRESULT WINAPI OnFileFound(__in IVirtualFs *file, __in IFsEnumContext *context, __in const int currentDepth) override
+	{
+		UNREFERENCED_PARAMETER(context);
+		UNREFERENCED_PARAMETER(currentDepth);
+		BSTR lpFullPath = NULL;
+		if (FAILED(file->GetFullPath(&lpFullPath))) return S_OK;
+		StringW name = PathFindFileNameW(lpFullPath);
+		SysFreeString(lpFullPath);
+
+		EnterCriticalSection(&m_lock);
+		UINT count = ++m_found[name];
+		LeaveCriticalSection(&m_lock);
+
+		if (count == 1 && !m_gateName.empty() && 0 == _wcsicmp(name.c_str(), m_gateName.c_str()))
+		{
+			SetEvent(m_hEntered);
+			WaitForSingleObject(m_hRelease, WATCH_TEST_TIMEOUT);
+		}
+		return S_OK;
+	}
+
+	virtual void WINAPI OnError(__in DWORD dwErrorCode, __in_opt LPCWSTR lpMessage = NULL) override
+	{
+		UNREFERENCED_PARAMETER(dwErrorCode);
+		UNREFERENCED_PARAMETER(lpMessage);
+	}
+};
+
+typedef struct WATCH_TEST_THREAD
+{
+	IFsEnum *			enumObj;
+	IFsEnumContext *	enumContext;
+}WATCH_TEST_THREAD;
+
+static DWORD WINAPI WatchThread(__in LPVOID lpParam)
+{
+	WATCH_TEST_THREAD * param = (WATCH_TEST_THREAD*)lpParam;
+	return (DWORD)param->enumObj->Enum(param->enumContext);
+}
+
+// The watch starts some time after its thread: touch a file until it is seen
+static BOOL WaitForWatch(__in LPCWSTR lpDirectory, __in CWatchEnumObserver * testObj)
+{
+	ULONGLONG deadline = GetTickCount64() + WATCH_TEST_TIMEOUT;
+	while (testObj->GetCount(L"ready.txt") == 0)
+	{
+		if (GetTickCount64() > deadline) return FALSE;
+		WriteTestFile(lpDirectory, L"ready.txt", OPEN_ALWAYS, WATCH_FILE_SIZE);
+		Sleep(WATCH_SETTLE_TIME);
+	}
+	return TRUE;
+}
+
+static BOOL WaitForFiles(__in CWatchEnumObserver * testObj, __in const std::vector<StringW> & names)
+{
+	ULONGLONG deadline = GetTickCount64() + WATCH_TEST_TIMEOUT;
+	for (size_t i = 0; i < names.size(); )
+	{
+		if (testObj->GetCount(names[i].c_str()))
+		{
+			i++;
+			continue;
+		}
+		if (GetTickCount64() > deadline) return FALSE;
+		Sleep(WATCH_POLL_TIME);
+	}
+	return TRUE;
+}
+
+TEST(WatchFsEnum, Changes)
+{
+	WCHAR szDirectory[MAX_PATH] = {};
+	MakeTestDirectory(L"wfs", szDirectory);
+	ASSERT_TRUE(WriteTestFile(szDirectory, L"modified.txt", CREATE_ALWAYS, WATCH_FILE_SIZE));
+	ASSERT_TRUE(WriteTestFile(szDirectory, L"renamed.tmp", CREATE_ALWAYS, WATCH_FILE_SIZE));
+
+	IFsEnum * enumObj = static_cast<IFsEnum*>(new CWatchFsEnum);
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	CWatchEnumObserver * testObj = new CWatchEnumObserver();
+	IVirtualFs * container = static_cast<IVirtualFs*>(new CFileFs);
+	WATCH_TEST_THREAD param = { enumObj, enumContext };
+	HANDLE hThread = NULL;
+	std::vector<StringW> names;
+	WCHAR szOldName[MAX_PATH] = {}, szNewName[MAX_PATH] = {};
+
+	if (!enumObj || !enumContext || !testObj || !container)
+		goto EXIT;
+
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetMaxDepth(-1));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchPattern(L"*.*"));
+	ASSERT_HRESULT_SUCCEEDED(container->Create(szDirectory, 0));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchContainer(container));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetFlags(IFsEnumContext::DetectOnly | IFsEnumContext::WatchChanges));
+	ASSERT_HRESULT_SUCCEEDED(enumObj->AddObserver(testObj));
+
+	hThread = CreateThread(NULL, 0, &WatchThread, &param, 0, NULL);
+	ASSERT_NE((HANDLE)NULL, hThread);
+	EXPECT_TRUE(WaitForWatch(szDirectory, testObj));
+
+	// the files found before the watch are not reported
+	EXPECT_EQ(0, testObj->GetCount(L"modified.txt"));
+	EXPECT_EQ(0, testObj->GetCount(L"renamed.tmp"));
+
+	// several events for each file
+	EXPECT_TRUE(WriteTestFile(szDirectory, L"created.txt", CREATE_NEW, WATCH_FILE_SIZE));
+	EXPECT_TRUE(WriteTestFile(szDirectory, L"created.txt", OPEN_EXISTING, WATCH_FILE_SIZE));
+	EXPECT_TRUE(WriteTestFile(szDirectory, L"modified.txt", OPEN_EXISTING, WATCH_FILE_SIZE));
+	wcscpy_s(szOldName, szDirectory);
+	PathAppendW(szOldName, L"renamed.tmp");
+	wcscpy_s(szNewName, szDirectory);
+	PathAppendW(szNewName, L"renamed.txt");
+	EXPECT_TRUE(MoveFileW(szOldName, szNewName));
+
+	names.push_back(L"created.txt");
+	names.push_back(L"modified.txt");
+	names.push_back(L"renamed.txt");
+	EXPECT_TRUE(WaitForFiles(testObj, names));
+	// reports that come late are counted too
+	Sleep(WATCH_SETTLE_TIME * 4);
+
+	ASSERT_HRESULT_SUCCEEDED(enumObj->Stop());
+	EXPECT_EQ(WAIT_OBJECT_0, WaitForSingleObject(hThread, WATCH_TEST_TIMEOUT));
+
+	EXPECT_EQ(1, testObj->GetCount(L"created.txt"));
+	EXPECT_EQ(1, testObj->GetCount(L"modified.txt"));
+	EXPECT_EQ(1, testObj->GetCount(L"renamed.txt"));
+	EXPECT_EQ(0, testObj->GetCount(L"renamed.tmp"));
+	ASSERT_HRESULT_SUCCEEDED(enumObj->RemoveObserver(testObj));
+
+EXIT:
+	if (hThread) CloseHandle(hThread);
+	if (testObj) testObj->Release();
+	if (container) container->Release();
+	if (enumContext) enumContext->Release();
+	if (enumObj) enumObj->Release();
+	RemoveTestDirectory(szDirectory);
+}
+
+TEST(WatchFsEnum, Overflow)
+{
+	WCHAR szDirectory[MAX_PATH] = {};
+	MakeTestDirectory(L"wfs", szDirectory);
+
+	IFsEnum * enumObj = static_cast<IFsEnum*>(new CWatchFsEnum);
+	IFsEnumContext * enumContext = static_cast<IFsEnumContext*>(new CFileFsEnumContext);
+	CWatchEnumObserver * testObj = new CWatchEnumObserver();
+	IVirtualFs * container = static_cast<IVirtualFs*>(new CFileFs);
+	WATCH_TEST_THREAD param = { enumObj, enumContext };
+	HANDLE hThread = NULL;
+	std::vector<StringW> names;
+	WCHAR szName[MAX_PATH] = {};
+
+	if (!enumObj || !enumContext || !testObj || !container)
+		goto EXIT;
+
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetMaxDepth(-1));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchPattern(L"*.*"));
+	ASSERT_HRESULT_SUCCEEDED(container->Create(szDirectory, 0));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetSearchContainer(container));
+	ASSERT_HRESULT_SUCCEEDED(enumContext->SetFlags(IFsEnumContext::DetectOnly | IFsEnumContext::WatchChanges));
+	ASSERT_HRESULT_SUCCEEDED(enumObj->AddObserver(testObj));
+
+	// The watch thread is held in the report of the first file while far
+	// more changes than WATCH_BUFFER_SIZE holds are made: they are lost, and
+	// the next read of the changes comes back empty.
+	testObj->SetGate(L"ready.txt");
+	hThread = CreateThread(NULL, 0, &WatchThread, &param, 0, NULL);
+	ASSERT_NE((HANDLE)NULL, hThread);
+	EXPECT_TRUE(WaitForWatch(szDirectory, testObj));
+	EXPECT_TRUE(testObj->WaitForGate());
+
+	for (int i = 0; i < OVERFLOW_FILE_COUNT; i++)
+	{
+		swprintf_s(szName, L"overflow_%04d_padding_the_name_to_fill_the_notification_buffer_sooner.txt", i);
+		names.push_back(szName);
+		EXPECT_TRUE(WriteTestFile(szDirectory, szName, CREATE_NEW, WATCH_FILE_SIZE));
+	}
+	testObj->OpenGate();
+
+	// the full walk that replaces the lost changes reports every file once
+	EXPECT_TRUE(WaitForFiles(testObj, names));
+	Sleep(WATCH_SETTLE_TIME * 4);
+
+	ASSERT_HRESULT_SUCCEEDED(enumObj->Stop());
+	EXPECT_EQ(WAIT_OBJECT_0, WaitForSingleObject(hThread, WATCH_TEST_TIMEOUT));
+
+	for (size_t i = 0; i < names.size(); i++)
+		EXPECT_EQ(1, testObj->GetCount(names[i].c_str())) << names[i].c_str();
+	// only a full walk reports a file that did not change again
+	EXPECT_LE(2, testObj->GetCount(L"ready.txt"));
+	ASSERT_HRESULT_SUCCEEDED(enumObj->RemoveObserver(testObj));
+
+EXIT:
+	if (testObj) testObj->OpenGate();
+	if (hThread) CloseHandle(hThread);
+	if (testObj) testObj->Release();
+	if (container) container->Release();
+	if (enumContext) enumContext->Release();
+	if (enumObj) enumObj->Release();
+	RemoveTestDirectory(szDirectory);
+}